@@ -0,0 +1,1534 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string.h>
+#include <float.h>
+#include "sphere.h"
+#include "hitable_list.h"
+#include "bvh.h"
+#include "material.h"
+#include "sphere_pack.h"
+#include "packet.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "image_io.h"
+#include "closed_scene.h"
+#include "scene_file.h"
+#include "mesh_file.h"
+#include "denoise.h"
+
+/*
+ * Benchmarks for the hot paths of the raytracer
+ *
+ * Usage: ./Benchmark.out [suite ...] [--json FILE]
+ *   micro   - ns per call of sphere::hit (hit and miss), hitable_list::hit, each material's
+ *             scatter, camera::get_ray and random_in_unit_sphere
+ *   frame   - rays/sec rendering the material and cover scenes
+ *   bvh     - rays/sec of hitable_list vs bvh as the sphere count grows
+ *   packets - primary rays/sec on random_scene(), one ray at a time vs 4x4 / 8x8 packets
+ *   roulette - recursive vs iterative (Russian roulette) integrator: time, rays and mean pixel value
+ *   dispatch - random_scene() rendered through virtual hitables/materials vs a closed_scene
+ *   scenefile - startup of a 1M sphere scene: parsing text and building the bvh vs mapping the binary file
+ *   mesh     - loading a 1M triangle mesh from OBJ and binary PLY, memory per triangle and rays/sec
+ *   instances - instance_scene() (10k instances of a 100k sphere cluster): build time, memory, primary rays/sec
+ *   arena    - building, tracing and freeing a 1M sphere scene allocated with new vs from a scene_arena
+ *   images   - time to write a 4K frame as ascii ppm, binary ppm, png and pfm
+ *   adaptive - error against a 1024 spp reference for fixed vs adaptive samples per pixel
+ *   sampler  - error of the random vs sobol sampler from 1 to 256 spp against a 4096 spp reference
+ *   denoise  - error of raw vs denoised frames from 4 to 64 spp, time of the auxiliary buffers and the filter
+ *   warp     - disk, ball and diffuse bounce directions: ns per point of the rejection loops vs the closed
+ *              forms of sampling.h (one at a time and in batches), and the error of estimates made with each
+ *   deferred - lists and bvhs of spheres filling in a hit_record for every closer sphere (as hit() used
+ *              to) vs nearest() and one fill_record, on the cover scene and sparse and dense sphere clouds
+ *   occlusion - occluded() (first blocker) vs hit() on ambient rays of the cover scene through a list, bvh,
+ *              sphere_pack and closed_scene, and the ambient occlusion preview frame vs the path traced one
+ *   precision - this build's vec3 (RT_DOUBLE, RT_VEC4): ns per sphere test and vector normalise, camera
+ *              rays/s and frame time of the material and cover scenes, and the error of the frames against
+ *              the same frames (same samples) from a double build, see precision_report.sh
+ *   all      - every suite above
+ *
+ * With no suite micro and frame are run. Tables go to stdout, with --json every suite also
+ * records its main numbers, which are written to FILE as one JSON document so results can be
+ * compared between builds.
+ */
+
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(bench_clock::time_point start){
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+//Machine readable results
+
+struct bench_result {
+	std::string suite;
+	std::string name;
+	double value;
+	std::string unit;
+};
+
+std::vector<bench_result> bench_results;
+std::string bench_suite; //suite being run, results are recorded under it
+
+void record(const std::string& name, double value, const std::string& unit){
+	bench_result r = {bench_suite, name, value, unit};
+	bench_results.push_back(r);
+}
+
+std::string json_string(const std::string& s){
+	std::string out = "\"";
+	for(size_t k = 0; k < s.size(); k++){
+		if(s[k] == '"' || s[k] == '\\') out += '\\';
+		out += s[k];
+	}
+	return out + "\"";
+}
+
+bool write_results_json(const std::string& path){
+	std::ostringstream os;
+	os << "{\n  \"compiler\": " << json_string(__VERSION__) << ",\n"
+	   << "  \"simd\": " << json_string(sphere_pack::kernel_name(sphere_pack::default_kernel())) << ",\n"
+	   << "  \"vec3\": " << json_string(vec3_layout_name()) << ",\n"
+	   << "  \"threads\": " << thread_pool::default_thread_count() << ",\n"
+	   << "  \"results\": [";
+	os << std::setprecision(6);
+	for(size_t k = 0; k < bench_results.size(); k++){
+		const bench_result& r = bench_results[k];
+		os << (k ? ",\n" : "\n") << "    {\"suite\": " << json_string(r.suite) << ", \"name\": " << json_string(r.name)
+		   << ", \"value\": " << r.value << ", \"unit\": " << json_string(r.unit) << "}";
+	}
+	os << "\n  ]\n}\n";
+	std::string out = os.str();
+	return write_file(path, out);
+}
+
+//Random point inside a cube of the given half size, centered on the origin
+vec3 random_in_cube(float half){
+	return vec3(half*(2*drand48()-1), half*(2*drand48()-1), half*(2*drand48()-1));
+}
+
+//Random rays starting inside the cube heading in uniformly random directions
+std::vector<ray> make_rays(int n, float half){
+	std::vector<ray> rays;
+	for(int k = 0; k < n; k++){
+		vec3 d;
+		do{
+			d = random_in_cube(1.0);
+		}while(d.squared_length() > 1.0 || d.squared_length() < 1e-4);
+		rays.push_back(ray(random_in_cube(half), unit_vector(d)));
+	}
+	return rays;
+}
+
+//Traces the rays round robin until at least min_seconds have passed, returns rays/sec
+double trace_rate(hitable* world, const std::vector<ray>& rays, double min_seconds, int& hits){
+	hit_record rec;
+	long long traced = 0;
+	hits = 0;
+	bench_clock::time_point start = bench_clock::now();
+	double elapsed = 0;
+	do{
+		//Check the clock every few rays so slow worlds don't overshoot too far
+		for(int k = 0; k < 16; k++){
+			const ray& r = rays[traced % rays.size()];
+			if(world->hit(r, 0.001, FLT_MAX, rec))
+				hits++;
+			traced++;
+		}
+		elapsed = seconds_since(start);
+	}while(elapsed < min_seconds);
+	return traced / elapsed;
+}
+
+//Microbenchmarks
+
+volatile float bench_sink; //results are summed into here so the calls can't be optimised away
+
+//Calls op(k) with k cycling through 0..1023 until min_seconds have passed, returns ns per call
+template <typename Op>
+double ns_per_call(Op op, double min_seconds = 0.25){
+	long long calls = 0;
+	bench_clock::time_point start = bench_clock::now();
+	double elapsed;
+	do{
+		for(int k = 0; k < 1024; k++)
+			op(k);
+		calls += 1024;
+		elapsed = seconds_since(start);
+	}while(elapsed < min_seconds);
+	return 1e9*elapsed/calls;
+}
+
+void print_micro(const std::string& name, double ns){
+	std::cout << std::setw(36) << name << std::setw(12) << std::fixed << std::setprecision(2) << ns << " ns\n";
+	record(name, ns, "ns/call");
+}
+
+void bench_micro(){
+	srand48(0);
+	lambertian diffuse(vec3(0.5, 0.5, 0.5));
+	metal shiny(vec3(0.8, 0.6, 0.2), 0.3);
+	dielectric glass(1.5);
+	sampler rng(0, 0, 0);
+	rng.start_sample(0);
+
+	//1024 rays from the origin towards the sphere at (0,0,-1), and 1024 whose lines pass it by
+	std::vector<ray> hit_rays, miss_rays;
+	for(int k = 0; k < 1024; k++){
+		hit_rays.push_back(ray(vec3(0,0,0), vec3(0.6*drand48() - 0.3, 0.6*drand48() - 0.3, -1)));
+		miss_rays.push_back(ray(vec3(0,0,0), vec3(1.0 + drand48(), 0.6*drand48() - 0.3, -1)));
+	}
+
+	//Called through hitable* as the renderer does
+	sphere ball(vec3(0,0,-1), 0.5, &diffuse);
+	hitable* s = &ball;
+	hit_record rec;
+	print_micro("sphere::hit (hit)", ns_per_call([&](int k){ bench_sink += s->hit(hit_rays[k], 0.001, FLT_MAX, rec); }));
+	print_micro("sphere::hit (miss)", ns_per_call([&](int k){ bench_sink += s->hit(miss_rays[k], 0.001, FLT_MAX, rec); }));
+
+	//Lists of spheres scattered in front of the camera, random rays through them
+	for(int n = 1; n <= 256; n *= 4){
+		scene_arena arena;
+		hitable** list = arena.make_array<hitable*>(n);
+		for(int k = 0; k < n; k++)
+			list[k] = arena.make<sphere>(vec3(4*drand48() - 2, 4*drand48() - 2, -2 - 4*drand48()), 0.3, &diffuse);
+		hitable_list objects(list, n);
+		hitable* world = &objects;
+		print_micro("hitable_list::hit (" + std::to_string(n) + ")",
+		            ns_per_call([&](int k){ bench_sink += world->hit(hit_rays[k], 0.001, FLT_MAX, rec); }));
+	}
+
+	//One hit on the front of the sphere, scattered with rays arriving from the origin
+	hit_record front;
+	front.t = 0.5;
+	front.p = vec3(0,0,-0.5);
+	front.normal = vec3(0,0,1);
+	material* materials[3] = {&diffuse, &shiny, &glass};
+	const char* names[3] = {"lambertian::scatter", "metal::scatter", "dielectric::scatter"};
+	for(int m = 0; m < 3; m++){
+		material* mat = materials[m];
+		print_micro(names[m], ns_per_call([&](int k){
+			vec3 attenuation;
+			ray scattered;
+			bench_sink += mat->scatter(hit_rays[k], front, attenuation, scattered, rng);
+			bench_sink += scattered.direction().x();
+		}));
+	}
+
+	camera cam = random_scene_camera(2.0f);
+	std::vector<float> u(1024), v(1024);
+	for(int k = 0; k < 1024; k++){
+		u[k] = drand48();
+		v[k] = drand48();
+	}
+	print_micro("camera::get_ray", ns_per_call([&](int k){ bench_sink += cam.get_ray(u[k], v[k], rng).direction().x(); }));
+	print_micro("random_in_unit_sphere", ns_per_call([&](int k){ bench_sink += random_in_unit_sphere(rng).x(); }));
+}
+
+//Whole frames of the two scenes main renders, default options apart from the samples
+void bench_frame(){
+	std::cout << std::setw(12) << "scene"
+	          << std::setw(10) << "seconds"
+	          << std::setw(14) << "rays/s" << "\n";
+
+	const char* scene_names[2] = {"materials", "random"};
+	for(int s = 0; s < 2; s++){
+		srand48(0);
+		scene_arena arena;
+		hitable_list* objects = (hitable_list*)(s == 0 ? material_scene(arena) : random_scene(arena));
+		bvh* world = arena.make<bvh>(objects->list, objects->list_size);
+		render_options opt;
+		opt.ns = 16;
+		camera cam = (s == 0 ? material_scene_view() : random_scene_view()).make(float(opt.nx)/float(opt.ny));
+		integrator_fns integrator = {color, color_hit};
+
+		framebuffer fb;
+		render_stats::reset();
+		bench_clock::time_point start = bench_clock::now();
+		render_frame(fb, cam, world, opt, integrator);
+		double elapsed = seconds_since(start);
+		double rate = render_stats::total().rays / elapsed;
+
+		std::cout << std::setw(12) << scene_names[s]
+		          << std::setw(10) << std::fixed << std::setprecision(2) << elapsed
+		          << std::setw(14) << std::setprecision(0) << rate << "\n";
+		record(std::string(scene_names[s]) + " rays/s", rate, "rays/s");
+		record(std::string(scene_names[s]) + " frame", elapsed, "s");
+	}
+}
+
+//Spheres of radius 0.25 at a constant density of one per unit cube, the
+//cloud grows with the count so the number of spheres along a ray grows as n^(1/3)
+void bench_bvh(){
+	std::cout << std::setw(10) << "spheres"
+	          << std::setw(16) << "list rays/s"
+	          << std::setw(16) << "bvh rays/s"
+	          << std::setw(12) << "speedup"
+	          << std::setw(14) << "build ms" << "\n";
+
+	material* mat = new lambertian(vec3(0.5, 0.5, 0.5));
+	for(int n = 10; n <= 1000000; n *= 10){
+		srand48(n);
+		float half = 0.5f*cbrt(float(n));
+		std::vector<hitable*> spheres(n);
+		for(int k = 0; k < n; k++)
+			spheres[k] = new sphere(random_in_cube(half), 0.25, mat);
+		std::vector<ray> rays = make_rays(4096, half);
+
+		hitable_list list(&spheres[0], n);
+		bench_clock::time_point start = bench_clock::now();
+		bvh tree(&spheres[0], n);
+		double build_ms = 1000.0*seconds_since(start);
+
+		int list_hits, bvh_hits;
+		double list_rate = trace_rate(&list, rays, 0.5, list_hits);
+		double bvh_rate = trace_rate(&tree, rays, 0.5, bvh_hits);
+
+		std::cout << std::setw(10) << n
+		          << std::setw(16) << std::fixed << std::setprecision(0) << list_rate
+		          << std::setw(16) << bvh_rate
+		          << std::setw(11) << std::setprecision(1) << bvh_rate / list_rate << "x"
+		          << std::setw(14) << std::setprecision(2) << build_ms << "\n";
+		record("list rays/s (" + std::to_string(n) + ")", list_rate, "rays/s");
+		record("bvh rays/s (" + std::to_string(n) + ")", bvh_rate, "rays/s");
+		record("bvh build (" + std::to_string(n) + ")", build_ms, "ms");
+
+		for(int k = 0; k < n; k++)
+			delete spheres[k];
+	}
+}
+
+//Camera rays for every pixel of an nx * ny image, one sample per pixel,
+//ordered in size x size blocks so consecutive rays form a packet
+std::vector<ray> block_camera_rays(const camera& cam, int nx, int ny, int size){
+	std::vector<ray> rays;
+	for(int by = 0; by < ny; by += size)
+		for(int bx = 0; bx < nx; bx += size)
+			for(int y = by; y < by + size; y++)
+				for(int x = bx; x < bx + size; x++){
+					sampler rng(x, y, 0);
+					rng.start_sample(0);
+					float u = float(x + rng.next_1d()) / float(nx);
+					float v = float(y + rng.next_1d()) / float(ny);
+					rays.push_back(cam.get_ray(u, v, rng));
+				}
+	return rays;
+}
+
+void bench_packets(){
+	int nx = 800, ny = 400; //multiple of 8 so every block is full
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	sphere_pack* pack = arena.make<sphere_pack>();
+	pack->add_list(objects->list, objects->list_size);
+	pack->build_bvh();
+	camera cam = random_scene_camera(float(nx)/float(ny));
+
+	std::cout << "random_scene(), " << nx << "x" << ny << " primary rays, kernel " << sphere_pack::kernel_name(pack->kernel) << "\n";
+	std::cout << std::setw(12) << "mode" << std::setw(16) << "rays/s" << std::setw(12) << "speedup" << "\n";
+
+	double single_rate = 0;
+	int sizes[3] = {1, 4, 8};
+	for(int k = 0; k < 3; k++){
+		int size = sizes[k];
+		std::vector<ray> rays = block_camera_rays(cam, nx, ny, size);
+		ray_packet packet;
+		long long traced = 0, hits = 0;
+		bench_clock::time_point start = bench_clock::now();
+		double elapsed;
+		do{
+			if(size == 1){
+				for(size_t r = 0; r < rays.size(); r++){
+					real tmax = FLT_MAX;
+					int index;
+					hits += pack->nearest(rays[r], 0.001, tmax, index);
+				}
+			}
+			else{
+				int n = size*size;
+				for(size_t r = 0; r < rays.size(); r += n){
+					packet.load(&rays[r], n);
+					trace_packet(*pack, packet, 0.001);
+					for(int l = 0; l < n; l++)
+						hits += packet.index[l] >= 0;
+				}
+			}
+			traced += rays.size();
+			elapsed = seconds_since(start);
+		}while(elapsed < 1.0);
+
+		double rate = traced / elapsed;
+		if(size == 1)
+			single_rate = rate;
+		std::string mode = size == 1 ? "single" : std::to_string(size) + "x" + std::to_string(size);
+		std::cout << std::setw(12) << mode
+		          << std::setw(16) << std::fixed << std::setprecision(0) << rate
+		          << std::setw(11) << std::setprecision(2) << rate / single_rate << "x\n";
+		record(mode + " rays/s", rate, "rays/s");
+	}
+}
+
+//Mean of all pixel values after gamma, on the same scale as the ppm output
+double mean_pixel(const framebuffer& fb){
+	double sum = 0;
+	for(size_t k = 0; k < fb.pixels.size(); k++)
+		for(int c = 0; c < 3; c++)
+			sum += int(255.99*sqrt(fb.pixels[k][c]));
+	return sum / (3.0*fb.pixels.size());
+}
+
+void bench_roulette(){
+	std::cout << std::setw(8) << "scene"
+	          << std::setw(12) << "integrator"
+	          << std::setw(10) << "seconds"
+	          << std::setw(12) << "rays"
+	          << std::setw(10) << "avg len"
+	          << std::setw(12) << "rays saved"
+	          << std::setw(10) << "mean" << "\n";
+
+	const char* scene_names[2] = {"random", "glass"};
+	for(int s = 0; s < 2; s++){
+		srand48(0);
+		scene_arena arena;
+		hitable_list* objects = (hitable_list*)(s == 0 ? random_scene(arena) : glass_scene(arena));
+		bvh world(objects->list, objects->list_size);
+		render_options opt;
+		opt.threads = 1;
+		camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+
+		long long fixed_rays = 0;
+		for(int k = 0; k < 2; k++){
+			integrator_fns integrator = {color, color_hit};
+			if(k == 1)
+				integrator = {color_iterative, color_iterative_hit};
+			framebuffer fb;
+			render_stats::reset();
+			bench_clock::time_point start = bench_clock::now();
+			render_frame(fb, cam, &world, opt, integrator);
+			double elapsed = seconds_since(start);
+			render_counters stats = render_stats::total();
+			if(k == 0)
+				fixed_rays = stats.rays;
+
+			std::cout << std::setw(8) << scene_names[s]
+			          << std::setw(12) << (k == 0 ? "recursive" : "iterative")
+			          << std::setw(10) << std::fixed << std::setprecision(2) << elapsed
+			          << std::setw(12) << stats.rays
+			          << std::setw(10) << std::setprecision(3) << stats.average_length()
+			          << std::setw(11) << std::setprecision(1) << 100.0*(fixed_rays - stats.rays)/fixed_rays << "%"
+			          << std::setw(10) << std::setprecision(2) << mean_pixel(fb) << "\n";
+			std::string name = std::string(scene_names[s]) + " " + (k == 0 ? "recursive" : "iterative");
+			record(name + " time", elapsed, "s");
+			record(name + " rays", double(stats.rays), "rays");
+		}
+	}
+}
+
+//Root mean square difference of two frames after gamma, in 0-255 output units
+double rmse_pixels(const framebuffer& a, const framebuffer& b){
+	double sum = 0;
+	for(size_t k = 0; k < a.pixels.size(); k++)
+		for(int c = 0; c < 3; c++){
+			double d = 255.0*(sqrt(a.pixels[k][c]) - sqrt(b.pixels[k][c]));
+			sum += d*d;
+		}
+	return sqrt(sum / (3.0*a.pixels.size()));
+}
+
+void bench_adaptive(){
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	bvh world(objects->list, objects->list_size);
+	render_options opt;
+	opt.threads = 1;
+	camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+	integrator_fns integrator = {color, color_hit};
+
+	framebuffer reference;
+	opt.ns = 1024;
+	opt.seed = 1; //independent of the samples being measured
+	render_frame(reference, cam, &world, opt, integrator);
+	opt.seed = 0;
+
+	std::cout << "random_scene(), " << opt.nx << "x" << opt.ny << ", error against 1024 spp\n";
+	std::cout << std::setw(20) << "mode"
+	          << std::setw(12) << "avg spp"
+	          << std::setw(10) << "seconds"
+	          << std::setw(10) << "rmse" << "\n";
+
+	for(int k = 0; k < 8; k++){
+		framebuffer fb;
+		std::string mode;
+		if(k < 4){
+			opt.ns = 16 << k;
+			opt.adaptive_threshold = 0;
+			mode = "fixed " + std::to_string(opt.ns);
+		}
+		else{
+			opt.ns = 512;
+			opt.adaptive_threshold = 0.01f / float(1 << (k - 4));
+			std::ostringstream name;
+			name << "adaptive " << opt.adaptive_threshold;
+			mode = name.str();
+		}
+		bench_clock::time_point start = bench_clock::now();
+		render_frame(fb, cam, &world, opt, integrator);
+		double elapsed = seconds_since(start);
+
+		std::cout << std::setw(20) << mode
+		          << std::setw(12) << std::fixed << std::setprecision(1) << double(fb.total_samples()) / fb.samples.size()
+		          << std::setw(10) << std::setprecision(2) << elapsed
+		          << std::setw(10) << rmse_pixels(fb, reference) << "\n";
+		record(mode + " rmse", rmse_pixels(fb, reference), "rmse");
+		record(mode + " spp", double(fb.total_samples()) / fb.samples.size(), "spp");
+	}
+}
+
+void bench_sampler(){
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	bvh world(objects->list, objects->list_size);
+	render_options opt;
+	opt.nx = 100;
+	opt.ny = 50;
+	camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+	integrator_fns integrator = {color, color_hit};
+
+	//The reference has to be far less noisy than sobol at 256 spp, or its own error is measured
+	framebuffer reference;
+	opt.ns = 4096;
+	opt.seed = 1;
+	opt.sampling = SAMPLER_SOBOL;
+	render_frame(reference, cam, &world, opt, integrator);
+	opt.seed = 0;
+	opt.threads = 1;
+
+	std::cout << "random_scene(), " << opt.nx << "x" << opt.ny << ", error against 4096 spp\n";
+	std::cout << std::setw(8) << "spp"
+	          << std::setw(12) << "random"
+	          << std::setw(12) << "sobol"
+	          << std::setw(10) << "ratio" << "\n";
+
+	const int steps = 9;
+	double error[2][steps];
+	for(int k = 0; k < steps; k++){
+		opt.ns = 1 << k;
+		for(int m = 0; m < 2; m++){
+			framebuffer fb;
+			opt.sampling = m == 0 ? SAMPLER_RANDOM : SAMPLER_SOBOL;
+			render_frame(fb, cam, &world, opt, integrator);
+			error[m][k] = rmse_pixels(fb, reference);
+			record(std::string(m == 0 ? "random " : "sobol ") + std::to_string(opt.ns) + " spp rmse", error[m][k], "rmse");
+		}
+		std::cout << std::setw(8) << opt.ns
+		          << std::setw(12) << std::fixed << std::setprecision(3) << error[0][k]
+		          << std::setw(12) << error[1][k]
+		          << std::setw(10) << std::setprecision(2) << error[0][k] / error[1][k] << "\n";
+	}
+
+	//Samples sobol needs for the error random has at 256 spp, interpolated on the log-log curve
+	double target = error[0][steps - 1];
+	double spp = 1 << (steps - 1);
+	for(int k = 1; k < steps; k++)
+		if(error[1][k] <= target){
+			double f = log(error[1][k-1] / target) / log(error[1][k-1] / error[1][k]);
+			spp = double(1 << (k - 1)) * pow(2.0, f);
+			break;
+		}
+	std::cout << "sobol reaches the error of random at " << (1 << (steps - 1)) << " spp with "
+	          << std::setprecision(0) << spp << " spp (" << std::setprecision(1) << (1 << (steps - 1)) / spp << "x fewer)\n";
+	record("sobol spp for random 256 spp error", spp, "spp");
+}
+
+void bench_denoise(){
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	bvh world(objects->list, objects->list_size);
+	render_options opt;
+	camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+	integrator_fns integrator = {color, color_hit};
+
+	framebuffer reference;
+	opt.ns = 4096;
+	opt.seed = 1;
+	render_frame(reference, cam, &world, opt, integrator);
+	opt.seed = 0;
+
+	std::cout << "random_scene(), " << opt.nx << "x" << opt.ny << ", " << thread_pool::default_thread_count()
+	          << " threads, error against 4096 spp, filter kernel "
+	          << denoise_kernel_name(default_denoise_kernel()) << "\n";
+	std::cout << std::setw(8) << "spp"
+	          << std::setw(12) << "raw"
+	          << std::setw(12) << "denoised"
+	          << std::setw(12) << "render ms"
+	          << std::setw(10) << "aov ms"
+	          << std::setw(12) << "filter ms" << "\n";
+
+	const int steps = 7; //4 to 256 spp
+	double raw[steps];
+	for(int k = 0; k < steps; k++){
+		opt.ns = 4 << k;
+		framebuffer fb;
+		bench_clock::time_point start = bench_clock::now();
+		render_frame(fb, cam, &world, opt, integrator);
+		double render_ms = 1000.0*seconds_since(start);
+		raw[k] = rmse_pixels(fb, reference);
+		record("raw " + std::to_string(opt.ns) + " spp rmse", raw[k], "rmse");
+		std::cout << std::setw(8) << opt.ns
+		          << std::setw(12) << std::fixed << std::setprecision(3) << raw[k];
+		if(opt.ns > 64){
+			std::cout << "\n";
+			continue;
+		}
+
+		aov_buffers aov;
+		start = bench_clock::now();
+		render_aovs(aov, cam, &world, opt);
+		double aov_ms = 1000.0*seconds_since(start);
+		//Best of a few runs, the filter takes a few milliseconds
+		double filter_ms = 1e30;
+		framebuffer denoised;
+		for(int run = 0; run < 5; run++){
+			denoised = fb;
+			start = bench_clock::now();
+			denoise_frame(denoised, aov, opt.threads);
+			filter_ms = std::min(filter_ms, 1000.0*seconds_since(start));
+		}
+		double error = rmse_pixels(denoised, reference);
+		record("denoised " + std::to_string(opt.ns) + " spp rmse", error, "rmse");
+		record("denoise " + std::to_string(opt.nx) + "x" + std::to_string(opt.ny) + " filter", filter_ms, "ms");
+		std::cout << std::setw(12) << error
+		          << std::setw(12) << std::setprecision(1) << render_ms
+		          << std::setw(10) << aov_ms
+		          << std::setw(12) << std::setprecision(2) << filter_ms << "\n";
+	}
+
+	//The filter on its own at 1080p, on a frame of noise with flat auxiliary buffers
+	framebuffer big(1920, 1080);
+	aov_buffers aov;
+	aov.width = big.width;
+	aov.height = big.height;
+	aov.albedo.assign(big.pixels.size(), vec3(0.5f, 0.5f, 0.5f));
+	aov.normal.assign(big.pixels.size(), vec3(0, 0, 1));
+	aov.depth.assign(big.pixels.size(), 10.0f);
+	for(size_t k = 0; k < big.pixels.size(); k++)
+		big.pixels[k] = vec3(float(drand48()), float(drand48()), float(drand48()));
+	bench_clock::time_point start = bench_clock::now();
+	denoise_frame(big, aov, 0);
+	double threaded = seconds_since(start);
+	start = bench_clock::now();
+	denoise_frame(big, aov, 1);
+	double serial = seconds_since(start);
+	std::cout << "filter 1920x1080: " << std::setprecision(1) << 1000.0*threaded << " ms, "
+	          << 1000.0*serial << " ms on one thread\n";
+	record("denoise 1920x1080 filter", 1000.0*threaded, "ms");
+	record("denoise 1920x1080 filter serial", 1000.0*serial, "ms");
+}
+
+//The rejection samplers the renderer used before sampling.h, to compare against
+vec3 rejection_in_unit_disk(sampler& rng){
+	vec3 p;
+	do {
+		p = 2.0 * vec3(rng.next_1d(), rng.next_1d(), 0) - vec3(1,1,0);
+	}while(dot(p,p) >= 1.0);
+	return p;
+}
+
+vec3 rejection_in_unit_sphere(sampler& rng){
+	vec3 p;
+	do{
+		p = 2.0*vec3(rng.next_1d(), rng.next_1d(), rng.next_1d()) - vec3(1,1,1);
+	}while (p.squared_length() >= 1.0);
+	return p;
+}
+
+//Mean and standard deviation of pixel estimates of samples_per_pixel samples each, over 4096 pixels.
+//estimate(rng) draws one sample from the sampler, positioned at the start of the sample
+template <typename Estimate>
+void estimate_error(sampler_type sampling, int samples_per_pixel, Estimate estimate, double& mean, double& deviation){
+	const int pixels = 4096;
+	double sum = 0, sum2 = 0;
+	for(int p = 0; p < pixels; p++){
+		sampler rng(p, 0, 0, 0, sampling);
+		double pixel = 0;
+		for(int s = 0; s < samples_per_pixel; s++){
+			rng.start_sample(s);
+			pixel += estimate(rng);
+		}
+		pixel /= samples_per_pixel;
+		sum += pixel;
+		sum2 += pixel*pixel;
+	}
+	mean = sum / pixels;
+	deviation = sqrt(std::max(sum2 / pixels - mean*mean, 0.0));
+}
+
+//Prints the error of the old and new routine with both samplers, around the exact value
+template <typename Old, typename New>
+void print_warp_error(const std::string& name, double exact, Old old_estimate, New new_estimate){
+	std::cout << name << ", exact " << std::fixed << std::setprecision(4) << exact << "\n";
+	std::cout << std::setw(26) << "" << std::setw(10) << "spp" << std::setw(12) << "mean" << std::setw(12) << "std dev" << std::setw(12) << "rmse" << "\n";
+	const char* samplers[2] = {"random", "sobol"};
+	for(int m = 0; m < 2; m++)
+		for(int spp = 4; spp <= 64; spp *= 4)
+			for(int routine = 0; routine < 2; routine++){
+				double mean, deviation;
+				if(routine == 0)
+					estimate_error(m == 0 ? SAMPLER_RANDOM : SAMPLER_SOBOL, spp, old_estimate, mean, deviation);
+				else
+					estimate_error(m == 0 ? SAMPLER_RANDOM : SAMPLER_SOBOL, spp, new_estimate, mean, deviation);
+				double rmse = sqrt(deviation*deviation + (mean - exact)*(mean - exact));
+				std::string label = std::string(routine == 0 ? "rejection, " : "closed form, ") + samplers[m];
+				std::cout << std::setw(26) << label << std::setw(10) << spp << std::setw(12) << mean
+				          << std::setw(12) << deviation << std::setw(12) << rmse << "\n";
+				record(name + ", " + label + " " + std::to_string(spp) + " spp rmse", rmse, "rmse");
+			}
+}
+
+void bench_warp(){
+	sampler rng(0, 0, 0);
+	rng.start_sample(0);
+	vec3 n = unit_vector(vec3(0.3, 0.8, 0.5));
+
+	//Per call, drawing the numbers from the sampler as the renderer does
+	std::cout << "ns per point, numbers drawn from the random sampler\n";
+	print_micro("disk, rejection", ns_per_call([&](int k){ bench_sink += rejection_in_unit_disk(rng).x(); }));
+	print_micro("disk, concentric", ns_per_call([&](int k){ bench_sink += random_in_unit_disk(rng).x(); }));
+	print_micro("ball, rejection", ns_per_call([&](int k){ bench_sink += rejection_in_unit_sphere(rng).x(); }));
+	print_micro("ball, closed form", ns_per_call([&](int k){ bench_sink += random_in_unit_sphere(rng).x(); }));
+	print_micro("diffuse bounce, n + rejection ball", ns_per_call([&](int k){ bench_sink += (n + rejection_in_unit_sphere(rng)).x(); }));
+	print_micro("diffuse bounce, cosine hemisphere", ns_per_call([&](int k){
+		float u1 = rng.next_1d(), u2 = rng.next_1d();
+		bench_sink += local_to_world(cosine_hemisphere(u1, u2), n).x();
+	}));
+
+	//Batches of 1024 points from arrays of numbers
+	const int count = 1024;
+	std::vector<float> u1(count), u2(count), x(count), y(count), z(count);
+	for(int k = 0; k < count; k++){
+		u1[k] = rng.next_1d();
+		u2[k] = rng.next_1d();
+	}
+	std::cout << "ns per point, batches of " << count << "\n";
+	warp_kernel kernels[3] = {warp_kernel_scalar, NULL, NULL};
+	int kernel_count = 1;
+#ifdef RT_X86_SIMD
+	if(__builtin_cpu_supports("sse4.1")) kernels[kernel_count++] = warp_kernel_sse;
+	if(__builtin_cpu_supports("avx")) kernels[kernel_count++] = warp_kernel_avx;
+#endif
+	for(int k = 0; k < kernel_count; k++){
+		warp_kernel kernel = kernels[k];
+		double ns = ns_per_call([&](int call){ if(call == 0){ kernel(&u1[0], &u2[0], &x[0], &y[0], &z[0], count); bench_sink += z[0]; } }) / count * 1024;
+		print_micro(std::string("hemisphere batch, ") + warp_kernel_name(kernel), ns);
+	}
+
+	//Variance - a lens seeing an out of focus edge: the part of the disk on one side of a line
+	double d = 0.2 / sqrt(1.09);
+	double edge = (acos(d) - d*sqrt(1 - d*d)) / M_PI;
+	std::cout << "\n";
+	print_warp_error("lens, fraction beyond an edge", edge,
+		[](sampler& s){ s.next_1d(); s.next_1d(); vec3 p = rejection_in_unit_disk(s); return p.x() + 0.3*p.y() > 0.2 ? 1.0 : 0.0; },
+		[](sampler& s){ s.next_1d(); s.next_1d(); vec3 p = random_in_unit_disk(s); return p.x() + 0.3*p.y() > 0.2 ? 1.0 : 0.0; });
+
+	//A diffuse bounce under a bright sky with a dimmer horizon, the exact value (cosine weighted)
+	//from 4M independent samples
+	auto sky = [](const vec3& w){ return w.y() > 0.5 ? 1.0 : 0.2; };
+	double exact = 0;
+	pcg32 reference_rng;
+	const int reference_samples = 1 << 22;
+	for(int k = 0; k < reference_samples; k++){
+		float a = reference_rng.next_float(), b = reference_rng.next_float();
+		exact += sky(local_to_world(cosine_hemisphere(a, b), n));
+	}
+	exact /= reference_samples;
+	std::cout << "\n";
+	print_warp_error("diffuse bounce, sky above y = 0.5", exact,
+		[&](sampler& s){ s.start_bounce(0); return sky(unit_vector(n + rejection_in_unit_sphere(s))); },
+		[&](sampler& s){ s.start_bounce(0); float a = s.next_1d(), b = s.next_1d(); return sky(local_to_world(cosine_hemisphere(a, b), n)); });
+}
+
+//Reads back a frame written by encode_pfm, false if the file is missing or not one
+bool read_pfm(const std::string& path, framebuffer& fb){
+	FILE* f = fopen(path.c_str(), "rb");
+	if(!f)
+		return false;
+	int w = 0, h = 0;
+	float scale = 0;
+	bool ok = fscanf(f, "PF %d %d %f", &w, &h, &scale) == 3 && fgetc(f) == '\n' && w > 0 && h > 0 && scale < 0;
+	if(ok){
+		fb = framebuffer(w, h);
+		std::vector<float> row(3*size_t(w));
+		for(int j = 0; ok && j < h; j++){
+			ok = fread(&row[0], sizeof(float), row.size(), f) == row.size();
+			for(int i = 0; ok && i < w; i++)
+				fb.at(i, j) = vec3(row[3*i], row[3*i+1], row[3*i+2]);
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+//The same measurements in every build, precision_report.sh runs them in the float, float4,
+//double and double4 builds. Frames are left in /tmp/bench_precision-<vec3>-<scene>.pfm, a
+//build that isn't the double one compares its frames with the double build's if they are
+//there. The samples are the same in every build (sampler.h only uses float), so the
+//difference is only the rounding of the geometry and shading - next to it the table shows
+//the difference between two seeds, the noise of a frame at that many samples
+void bench_precision(){
+	std::string layout = vec3_layout_name();
+	std::cout << "vec3 = " << layout << ", " << sizeof(vec3) << " bytes aligned to " << alignof(vec3)
+	          << ", " << thread_pool::default_thread_count() << " threads\n";
+
+	srand48(0);
+	std::vector<ray> rays = make_rays(1024, 2.0);
+	sphere ball(vec3(0,0,0), 1.0, NULL);
+	hit_record rec;
+	print_micro("sphere::hit", ns_per_call([&](int k){ bench_sink += ball.hit(rays[k], 0.001, FLT_MAX, rec); }));
+	print_micro("unit_vector", ns_per_call([&](int k){ bench_sink += unit_vector(rays[k].origin()).x(); }));
+
+	std::cout << std::setw(12) << "scene"
+	          << std::setw(16) << "camera rays/s"
+	          << std::setw(10) << "frame s"
+	          << std::setw(14) << "rays/s"
+	          << std::setw(12) << "vs double"
+	          << std::setw(10) << "noise" << "\n";
+
+	const char* scene_names[2] = {"materials", "random"};
+	for(int s = 0; s < 2; s++){
+		srand48(0);
+		scene_arena arena;
+		hitable_list* objects = (hitable_list*)(s == 0 ? material_scene(arena) : random_scene(arena));
+		bvh* world = arena.make<bvh>(objects->list, objects->list_size);
+		render_options opt;
+		opt.ns = 16;
+		camera cam = (s == 0 ? material_scene_view() : random_scene_view()).make(float(opt.nx)/float(opt.ny));
+		integrator_fns integrator = {color, color_hit};
+
+		int hits;
+		double camera_rate = trace_rate(world, block_camera_rays(cam, opt.nx, opt.ny, 1), 0.5, hits);
+
+		framebuffer fb;
+		render_stats::reset();
+		bench_clock::time_point start = bench_clock::now();
+		render_frame(fb, cam, world, opt, integrator);
+		double elapsed = seconds_since(start);
+		double rate = render_stats::total().rays / elapsed;
+
+		framebuffer other_seed;
+		opt.seed = 1;
+		render_frame(other_seed, cam, world, opt, integrator);
+		double noise = rmse_pixels(fb, other_seed);
+
+		std::string prefix = std::string("/tmp/bench_precision-");
+		write_file(prefix + layout + "-" + scene_names[s] + ".pfm", encode_pfm(fb));
+		framebuffer reference;
+		double error = -1;
+		if(layout != "double" && read_pfm(prefix + "double-" + scene_names[s] + ".pfm", reference) &&
+		   reference.width == fb.width && reference.height == fb.height)
+			error = rmse_pixels(fb, reference);
+
+		std::cout << std::setw(12) << scene_names[s]
+		          << std::setw(16) << std::fixed << std::setprecision(0) << camera_rate
+		          << std::setw(10) << std::setprecision(2) << elapsed
+		          << std::setw(14) << std::setprecision(0) << rate
+		          << std::setw(12) << std::setprecision(3);
+		if(error >= 0)
+			std::cout << error;
+		else
+			std::cout << "-";
+		std::cout << std::setw(10) << noise << "\n";
+		record(std::string(scene_names[s]) + " camera rays/s", camera_rate, "rays/s");
+		record(std::string(scene_names[s]) + " frame", elapsed, "s");
+		record(std::string(scene_names[s]) + " rays/s", rate, "rays/s");
+		record(std::string(scene_names[s]) + " noise rmse", noise, "rmse");
+		if(error >= 0)
+			record(std::string(scene_names[s]) + " rmse vs double", error, "rmse");
+	}
+}
+
+//sphere::hit, hitable_list::hit and bvh::hit as they were before the hit test was split into
+//nearest and fill_record (hitable.h): every sphere closer than the hit so far fills in the whole
+//record, which the list or bvh copies. eager_sphere keeps the virtual call sphere::hit was
+//reached through and both count render_stats as the list and bvh do
+class eager_sphere: public sphere {
+  public:
+	eager_sphere(const sphere& s) : sphere(s) {}
+	virtual bool eager_hit(const ray& r, real tmin, real tmax, hit_record& rec) const {
+		vec3 oc = r.origin() - center;
+		real a = dot(r.direction(), r.direction());
+		real half_b = dot(oc, r.direction());
+		real c = dot(oc, oc) - radius*radius;
+		real discriminant = half_b*half_b - a*c;
+		if(discriminant > 0){
+			real root = std::sqrt(discriminant);
+			real temp = (-half_b - root)/a;
+			if(!(temp < tmax && temp > tmin))
+				temp = (-half_b + root)/a;
+			if(temp < tmax && temp > tmin){
+				rec.t = temp;
+				rec.p = r.point_at_parameter(temp);
+				rec.normal = (rec.p - center) / radius;
+				rec.mat_ptr = mat_ptr;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+//list has to hold eager_spheres, fills counts the records filled in
+bool eager_list_hit(hitable* const* list, int n, const ray& r, real tmin, real tmax, hit_record& rec, long long& fills){
+	hit_record temp_rec;
+	bool hit_anything = false;
+	real closest_so_far = tmax;
+	RT_STAT(int successes = 0);
+	for(int i = 0; i < n; i++){
+		if(static_cast<const eager_sphere*>(list[i])->eager_hit(r, tmin, closest_so_far, temp_rec)){
+			RT_STAT(successes++);
+			hit_anything = true;
+			closest_so_far = temp_rec.t;
+			rec = temp_rec;
+			fills++;
+		}
+	}
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.hit_tests += n;
+	        stats.hit_successes += successes;)
+	return hit_anything;
+}
+
+bool eager_bvh_hit(const bvh& tree, const ray& r, real tmin, real tmax, hit_record& rec, long long& fills){
+	hit_record temp_rec;
+	RT_STAT(int tests = 0, successes = 0);
+	auto leaf = [&](int first, int count, real& closest_so_far){
+		bool hit_leaf = false;
+		RT_STAT(tests += count);
+		for(int i = first; i < first + count; i++){
+			if(static_cast<const eager_sphere*>(tree.prims[i])->eager_hit(r, tmin, closest_so_far, temp_rec)){
+				RT_STAT(successes++);
+				hit_leaf = true;
+				closest_so_far = temp_rec.t;
+				rec = temp_rec;
+				fills++;
+			}
+		}
+		return hit_leaf;
+	};
+	bool hit_anything = bvh_traverse(&tree.nodes[0], r, tmin, tmax, leaf);
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.hit_tests += tests;
+	        stats.hit_successes += successes;)
+	return hit_anything;
+}
+
+//Traces the rays round robin with trace(ray) until at least min_seconds have passed, returns rays/sec
+template <typename Trace>
+double trace_rate_with(const std::vector<ray>& rays, double min_seconds, Trace trace){
+	long long traced = 0;
+	bench_clock::time_point start = bench_clock::now();
+	double elapsed = 0;
+	do{
+		for(int k = 0; k < 16; k++, traced++)
+			trace(rays[traced % rays.size()]);
+		elapsed = seconds_since(start);
+	}while(elapsed < min_seconds);
+	return traced / elapsed;
+}
+
+//Eager records (every closer sphere fills one in) against nearest() + one fill_record, on the
+//cover scene's camera rays and on clouds of spheres at one per unit cube as in bvh, with radius
+//0.25 (rays meet few spheres) and 1 (spheres overlap, a ray passes many on its way to the nearest).
+//A bvh visits leaves front to back so few spheres beat an earlier one, a list tests them in
+//whatever order they were added
+void bench_deferred(){
+	std::cout << std::setw(24) << "scene"
+	          << std::setw(14) << "records/hit"
+	          << std::setw(16) << "eager rays/s"
+	          << std::setw(16) << "nearest rays/s"
+	          << std::setw(10) << "speedup" << "\n";
+
+	material* mat = new lambertian(vec3(0.5, 0.5, 0.5));
+	for(int c = 0; c < 8; c++){
+		srand48(c);
+		scene_arena arena;
+		std::vector<hitable*> spheres;
+		std::vector<ray> rays;
+		std::string name;
+		if(c <= 1){
+			hitable_list* objects = (hitable_list*)random_scene(arena);
+			for(int k = 0; k < objects->list_size; k++)
+				spheres.push_back(arena.make<eager_sphere>(*static_cast<sphere*>(objects->list[k])));
+			render_options opt;
+			rays = block_camera_rays(random_scene_camera(float(opt.nx)/float(opt.ny)), opt.nx, opt.ny, 1);
+			name = c == 0 ? "random_scene() list" : "random_scene() bvh";
+		}
+		else{
+			int n = c <= 4 ? int(pow(10.0, c + 2)) : int(pow(10.0, c - 1));
+			float radius = c <= 4 ? 0.25f : 1.0f;
+			float half = 0.5f*cbrt(float(n));
+			for(int k = 0; k < n; k++)
+				spheres.push_back(arena.make<eager_sphere>(sphere(random_in_cube(half), radius, mat)));
+			rays = make_rays(4096, half);
+			std::ostringstream os;
+			os << "bvh " << n << " r=" << radius;
+			name = os.str();
+		}
+		int n = int(spheres.size());
+		hitable_list list(&spheres[0], n);
+		bvh tree(&spheres[0], n);
+		const hitable* world = c == 0 ? (const hitable*)&list : (const hitable*)&tree;
+		auto eager = [&](const ray& r, hit_record& rec, long long& fills){
+			return c == 0 ? eager_list_hit(&spheres[0], n, r, 0.001, FLT_MAX, rec, fills) : eager_bvh_hit(tree, r, 0.001, FLT_MAX, rec, fills);
+		};
+
+		hit_record rec;
+		long long fills = 0, hits = 0;
+		for(size_t k = 0; k < rays.size(); k++)
+			hits += eager(rays[k], rec, fills);
+		double eager_rate = trace_rate_with(rays, 0.5, [&](const ray& r){ long long f; bench_sink += eager(r, rec, f); });
+		double nearest_rate = trace_rate_with(rays, 0.5, [&](const ray& r){ bench_sink += world->hit(r, 0.001, FLT_MAX, rec); });
+
+		std::cout << std::setw(24) << name
+		          << std::setw(14) << std::fixed << std::setprecision(2) << (hits ? double(fills) / hits : 0.0)
+		          << std::setw(16) << std::setprecision(0) << eager_rate
+		          << std::setw(16) << nearest_rate
+		          << std::setw(9) << std::setprecision(2) << nearest_rate / eager_rate << "x\n";
+		record(name + " records per hit", hits ? double(fills) / hits : 0.0, "records");
+		record(name + " eager rays/s", eager_rate, "rays/s");
+		record(name + " nearest rays/s", nearest_rate, "rays/s");
+	}
+	delete mat;
+}
+
+//Ambient rays of the cover scene, cosine distributed around the normal where the camera rays
+//of a frame hit, as color_ao_hit() sends them
+std::vector<ray> ambient_rays(hitable* world, int nx, int ny){
+	std::vector<ray> camera_rays = block_camera_rays(random_scene_camera(float(nx)/float(ny)), nx, ny, 1);
+	std::vector<ray> rays;
+	hit_record rec;
+	for(size_t k = 0; k < camera_rays.size(); k++){
+		const ray& r = camera_rays[k];
+		if(!world->hit(r, 0.001, FLT_MAX, rec))
+			continue;
+		vec3 n = dot(rec.normal, r.direction()) < 0 ? rec.normal : -rec.normal;
+		rays.push_back(ray(rec.p, local_to_world(cosine_hemisphere(float(drand48()), float(drand48())), n)));
+	}
+	return rays;
+}
+
+//Yes/no visibility through occluded(), which stops at the first blocker, against finding the
+//nearest hit with hit() and throwing it away, on the ambient rays of the cover scene with no
+//limit and limited to ao_config.distance. Then whole frames of the ambient occlusion preview
+//against the path traced frame
+void bench_occlusion(){
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	bvh* tree = arena.make<bvh>(objects->list, objects->list_size);
+	sphere_pack* pack = arena.make<sphere_pack>();
+	pack->add_list(objects->list, objects->list_size);
+	pack->build_bvh();
+	closed_scene* closed = arena.make<closed_scene>();
+	closed->build(objects->list, objects->list_size);
+	render_options opt;
+	std::vector<ray> rays = ambient_rays(tree, opt.nx, opt.ny);
+
+	std::cout << rays.size() << " ambient rays of random_scene()\n";
+	std::cout << std::setw(20) << "world"
+	          << std::setw(10) << "tmax"
+	          << std::setw(10) << "blocked"
+	          << std::setw(16) << "hit() rays/s"
+	          << std::setw(18) << "occluded() rays/s"
+	          << std::setw(10) << "speedup" << "\n";
+
+	const char* names[4] = {"hitable_list", "bvh", "sphere_pack bvh", "closed_scene"};
+	hitable* worlds[4] = {objects, tree, pack, closed};
+	for(int w = 0; w < 4; w++){
+		for(int limited = 0; limited < 2; limited++){
+			real tmax = limited ? ao_config.distance : FLT_MAX;
+			hitable* world = worlds[w];
+			int blocked = 0;
+			for(size_t k = 0; k < rays.size(); k++)
+				blocked += world->occluded(rays[k], 0.001, tmax);
+			hit_record rec;
+			double hit_rate = trace_rate_with(rays, 0.5, [&](const ray& r){ bench_sink += world->hit(r, 0.001, tmax, rec); });
+			double occluded_rate = trace_rate_with(rays, 0.5, [&](const ray& r){ bench_sink += world->occluded(r, 0.001, tmax); });
+
+			std::string tmax_name = limited ? std::to_string(int(ao_config.distance)) : "none";
+			std::cout << std::setw(20) << names[w]
+			          << std::setw(10) << tmax_name
+			          << std::setw(9) << std::fixed << std::setprecision(1) << 100.0 * blocked / rays.size() << "%"
+			          << std::setw(16) << std::setprecision(0) << hit_rate
+			          << std::setw(18) << occluded_rate
+			          << std::setw(9) << std::setprecision(2) << occluded_rate / hit_rate << "x\n";
+			std::string name = std::string(names[w]) + " tmax " + tmax_name;
+			record(name + " hit() rays/s", hit_rate, "rays/s");
+			record(name + " occluded() rays/s", occluded_rate, "rays/s");
+		}
+	}
+
+	opt.ns = 16;
+	camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+	std::cout << "\nrandom_scene(), bvh, " << opt.nx << "x" << opt.ny << ", " << opt.ns << " spp\n";
+	std::cout << std::setw(34) << "integrator"
+	          << std::setw(10) << "seconds"
+	          << std::setw(14) << "rays/s" << "\n";
+	const char* modes[3] = {"recursive (color)", "ao (color_ao), 1 ambient ray", "ao (color_ao), 4 ambient rays"};
+	integrator_fns integrators[3] = {{color, color_hit}, {color_ao, color_ao_hit}, {color_ao, color_ao_hit}};
+	int ambient_rays[3] = {0, 1, 4};
+	ao_settings saved = ao_config;
+	for(int k = 0; k < 3; k++){
+		ao_config.samples = ambient_rays[k];
+		framebuffer fb;
+		render_stats::reset();
+		bench_clock::time_point start = bench_clock::now();
+		render_frame(fb, cam, tree, opt, integrators[k]);
+		double elapsed = seconds_since(start);
+		double rate = render_stats::total().rays / elapsed;
+		std::cout << std::setw(34) << modes[k]
+		          << std::setw(10) << std::fixed << std::setprecision(2) << elapsed
+		          << std::setw(14) << std::setprecision(0) << rate << "\n";
+		record(std::string(modes[k]) + " frame", elapsed, "s");
+		record(std::string(modes[k]) + " rays/s", rate, "rays/s");
+	}
+	ao_config = saved;
+}
+
+void bench_images(){
+	framebuffer fb(3840, 2160);
+	srand48(0);
+	for(size_t k = 0; k < fb.pixels.size(); k++)
+		fb.pixels[k] = vec3(drand48(), drand48(), drand48());
+	std::string path = "/tmp/bench_image";
+
+	std::cout << "3840x2160 frame\n";
+	std::cout << std::setw(8) << "format" << std::setw(12) << "ms" << std::setw(12) << "MB" << "\n";
+	const char* formats[4] = {"p3", "ppm", "png", "pfm"};
+	for(int k = 0; k < 4; k++){
+		bench_clock::time_point start = bench_clock::now();
+		std::string data = encode_image(fb, formats[k]);
+		write_file(path, data);
+		double ms = 1000.0*seconds_since(start);
+		std::cout << std::setw(8) << formats[k]
+		          << std::setw(12) << std::fixed << std::setprecision(1) << ms
+		          << std::setw(12) << data.size() / 1e6 << "\n";
+		record(formats[k], ms, "ms");
+	}
+	remove(path.c_str());
+}
+
+//color_static() on a plain hitable world, for comparing with the closed scene
+vec3 color_virtual(const ray& r, hitable *world, int depth, sampler& rng){
+	return color_static(virtual_scene(world), r, rng);
+}
+
+void bench_dispatch(){
+	srand48(0);
+	scene_arena arena;
+	hitable_list* objects = (hitable_list*)random_scene(arena);
+	bvh* tree = arena.make<bvh>(objects->list, objects->list_size);
+	closed_scene* closed = arena.make<closed_scene>();
+	closed->build(objects->list, objects->list_size);
+
+	render_options opt;
+	opt.threads = 1;
+	opt.ns = 50;
+	camera cam = random_scene_camera(float(opt.nx)/float(opt.ny));
+
+	std::cout << "random_scene(), " << opt.nx << "x" << opt.ny << ", " << opt.ns << " spp, 1 thread\n";
+	std::cout << std::setw(34) << "mode"
+	          << std::setw(10) << "seconds"
+	          << std::setw(14) << "rays/s"
+	          << std::setw(10) << "speedup"
+	          << std::setw(10) << "mean" << "\n";
+
+	const char* modes[3] = {"bvh, color() (virtual)", "bvh, color_static<virtual_scene>", "color_static<closed_scene>"};
+	double base = 0;
+	for(int k = 0; k < 3; k++){
+		integrator_fns integrator = {color, color_hit};
+		hitable* world = tree;
+		if(k == 1)
+			integrator.radiance = color_virtual;
+		else if(k == 2){
+			integrator.radiance = color_closed;
+			world = closed;
+		}
+		//Best of three, single threaded renders are easily disturbed
+		framebuffer fb;
+		double elapsed = 0;
+		for(int run = 0; run < 3; run++){
+			render_stats::reset();
+			bench_clock::time_point start = bench_clock::now();
+			render_frame(fb, cam, world, opt, integrator);
+			double t = seconds_since(start);
+			if(run == 0 || t < elapsed)
+				elapsed = t;
+		}
+		if(k == 0)
+			base = elapsed;
+
+		std::cout << std::setw(34) << modes[k]
+		          << std::setw(10) << std::fixed << std::setprecision(2) << elapsed
+		          << std::setw(14) << std::setprecision(0) << render_stats::total().rays / elapsed
+		          << std::setw(9) << std::setprecision(2) << base / elapsed << "x"
+		          << std::setw(10) << mean_pixel(fb) << "\n";
+		record(modes[k], elapsed, "s");
+	}
+}
+
+void bench_scenefile(){
+	const int n = 1000000;
+	float half = 0.5f*cbrt(float(n));
+	std::string text_path = "/tmp/bench_scene.txt", binary_path = "/tmp/bench_scene.rtb";
+	camera_params view = {vec3(0,0,2*half), vec3(0,0,0), vec3(0,1,0), 40, 0, 2*half};
+
+	//1M spheres sharing 1000 materials
+	{
+		srand48(n);
+		scene_arena arena;
+		std::vector<material*> materials(1000);
+		for(size_t k = 0; k < materials.size(); k++){
+			vec3 albedo(drand48(), drand48(), drand48());
+			if(k % 10 == 0)
+				materials[k] = arena.make<dielectric>(1.5);
+			else if(k % 3 == 0)
+				materials[k] = arena.make<metal>(albedo, 0.5*drand48());
+			else
+				materials[k] = arena.make<lambertian>(albedo);
+		}
+		hitable** list = arena.make_array<hitable*>(n);
+		for(int k = 0; k < n; k++)
+			list[k] = arena.make<sphere>(random_in_cube(half), 0.25, materials[lrand48() % materials.size()]);
+		hitable_list objects(list, n);
+		std::string error;
+		FILE* f = fopen(text_path.c_str(), "wb");
+		write_scene_text(f, &objects, view, error);
+		fclose(f);
+		f = fopen(binary_path.c_str(), "wb");
+		write_scene_binary(f, &objects, view, error);
+		fclose(f);
+	}
+
+	srand48(1);
+	std::vector<ray> rays = make_rays(4096, half);
+	std::cout << "1M spheres, 1000 materials, time until the scene is ready and to trace the first 4096 rays\n";
+	std::cout << std::setw(8) << "format"
+	          << std::setw(10) << "MB"
+	          << std::setw(12) << "load ms"
+	          << std::setw(12) << "bvh ms"
+	          << std::setw(14) << "4096 rays ms" << "\n";
+
+	for(int binary = 0; binary < 2; binary++){
+		scene_arena arena;
+		std::string error;
+		camera_params loaded;
+		hitable* world;
+		double load_ms, bvh_ms = 0;
+		bench_clock::time_point start = bench_clock::now();
+		if(binary){
+			mapped_scene* scene = arena.make<mapped_scene>();
+			scene->open(binary_path, arena, error);
+			world = scene;
+			load_ms = 1000.0*seconds_since(start);
+		}
+		else{
+			hitable_list* objects = read_scene_text(text_path, arena, loaded, error);
+			load_ms = 1000.0*seconds_since(start);
+			start = bench_clock::now();
+			world = arena.make<bvh>(objects->list, objects->list_size);
+			bvh_ms = 1000.0*seconds_since(start);
+		}
+		if(!error.empty()){
+			std::cerr << error << "\n";
+			return;
+		}
+
+		start = bench_clock::now();
+		hit_record rec;
+		int hits = 0;
+		for(size_t k = 0; k < rays.size(); k++)
+			hits += world->hit(rays[k], 0.001, FLT_MAX, rec);
+		double trace_ms = 1000.0*seconds_since(start);
+
+		struct stat st;
+		stat((binary ? binary_path : text_path).c_str(), &st);
+		std::cout << std::setw(8) << (binary ? "rtb" : "text")
+		          << std::setw(10) << std::fixed << std::setprecision(1) << st.st_size / 1e6
+		          << std::setw(12) << load_ms
+		          << std::setw(12) << bvh_ms
+		          << std::setw(14) << trace_ms << "\n";
+		std::string format = binary ? "rtb" : "text";
+		record(format + " load", load_ms + bvh_ms, "ms");
+		record(format + " first rays", trace_ms, "ms");
+	}
+	remove(text_path.c_str());
+	remove(binary_path.c_str());
+}
+
+//A sphere of about 1M triangles (a latitude/longitude grid) written as OBJ and as binary PLY
+void bench_mesh(){
+	const int rows = 512, columns = 1024;
+	float radius = 40;
+	std::string obj_path = "/tmp/bench_mesh.obj", ply_path = "/tmp/bench_mesh.ply";
+	{
+		std::vector<float> xyz;
+		for(int i = 0; i <= rows; i++)
+			for(int j = 0; j < columns; j++){
+				float theta = float(M_PI)*i/rows, phi = 2*float(M_PI)*j/columns;
+				xyz.push_back(radius*sinf(theta)*cosf(phi));
+				xyz.push_back(radius*cosf(theta));
+				xyz.push_back(radius*sinf(theta)*sinf(phi));
+			}
+		int vertices = int(xyz.size()/3);
+		FILE* obj = fopen(obj_path.c_str(), "wb");
+		FILE* ply = fopen(ply_path.c_str(), "wb");
+		fprintf(ply, "ply\nformat binary_little_endian 1.0\nelement vertex %d\nproperty float x\nproperty float y\nproperty float z\n"
+		             "element face %d\nproperty list uchar int vertex_indices\nend_header\n", vertices, rows*columns);
+		for(int k = 0; k < vertices; k++)
+			fprintf(obj, "v %.9g %.9g %.9g\n", xyz[3*k], xyz[3*k+1], xyz[3*k+2]);
+		fwrite(&xyz[0], sizeof(float), xyz.size(), ply);
+		for(int i = 0; i < rows; i++)
+			for(int j = 0; j < columns; j++){
+				int32_t quad[4] = {i*columns + j, (i+1)*columns + j, (i+1)*columns + (j+1) % columns, i*columns + (j+1) % columns};
+				fprintf(obj, "f %d %d %d %d\n", quad[0]+1, quad[1]+1, quad[2]+1, quad[3]+1);
+				unsigned char corners = 4;
+				fwrite(&corners, 1, 1, ply);
+				fwrite(quad, sizeof(int32_t), 4, ply);
+			}
+		fclose(obj);
+		fclose(ply);
+	}
+
+	srand48(1);
+	std::vector<ray> rays = make_rays(4096, radius);
+	std::cout << rows*columns*2 << " triangles, time to read the file and build the bvh, bytes per triangle of the mesh\n";
+	std::cout << std::setw(8) << "format"
+	          << std::setw(10) << "MB"
+	          << std::setw(12) << "read ms"
+	          << std::setw(12) << "bvh ms"
+	          << std::setw(12) << "bytes/tri"
+	          << std::setw(14) << "rays/s" << "\n";
+
+	for(int ply = 0; ply < 2; ply++){
+		const std::string& path = ply ? ply_path : obj_path;
+		std::vector<vec3> vertices;
+		std::vector<uint32_t> triangles;
+		std::string error;
+		bench_clock::time_point start = bench_clock::now();
+		if(!read_mesh_file(path, vertices, triangles, error)){
+			std::cerr << error << "\n";
+			return;
+		}
+		double read_ms = 1000.0*seconds_since(start);
+		start = bench_clock::now();
+		triangle_mesh mesh(vertices, triangles, NULL);
+		double bvh_ms = 1000.0*seconds_since(start);
+		double bytes = mesh.positions.size()*sizeof(vec3) + mesh.indices.size()*sizeof(uint32_t) + mesh.nodes.size()*sizeof(bvh_node_data);
+
+		int hits;
+		double rate = trace_rate(&mesh, rays, 1.0, hits);
+
+		struct stat st;
+		stat(path.c_str(), &st);
+		std::cout << std::setw(8) << (ply ? "ply" : "obj")
+		          << std::setw(10) << std::fixed << std::setprecision(1) << st.st_size / 1e6
+		          << std::setw(12) << read_ms
+		          << std::setw(12) << bvh_ms
+		          << std::setw(12) << bytes / mesh.triangle_count()
+		          << std::setw(14) << std::setprecision(0) << rate << "\n";
+		std::string format = ply ? "ply" : "obj";
+		record(format + " read", read_ms, "ms");
+		record(format + " bvh", bvh_ms, "ms");
+		record(format + " rays/s", rate, "rays/s");
+	}
+	remove(obj_path.c_str());
+	remove(ply_path.c_str());
+}
+
+//The two level bvh of instance_scene(): what it takes to build, how much memory the scene
+//holds (the 10k instances stand for 1 billion spheres) and how fast rays get through it
+void bench_instances(){
+	srand48(0);
+	scene_arena arena;
+	bench_clock::time_point start = bench_clock::now();
+	hitable_list* objects = (hitable_list*)instance_scene(arena);
+	bvh* world = arena.make<bvh>(objects->list, objects->list_size);
+	double build_ms = 1000.0*seconds_since(start);
+	const bvh* shared = static_cast<const bvh*>(static_cast<const instance*>(objects->list[1])->object);
+	double mb = arena.bytes_used() / 1e6;
+	const bvh* trees[2] = {world, shared};
+	for(int k = 0; k < 2; k++)
+		mb += (trees[k]->nodes.size()*sizeof(bvh_node_data) + trees[k]->prims.size()*sizeof(hitable*)) / 1e6;
+
+	//Primary rays, one thread, and a whole frame at 1 spp on every thread
+	render_options opt;
+	opt.nx = 640;
+	opt.ny = 360;
+	opt.ns = 1;
+	camera cam = instance_scene_view().make(float(opt.nx)/float(opt.ny));
+	std::vector<ray> rays = block_camera_rays(cam, opt.nx, opt.ny, 1);
+	int hits;
+	double rate = trace_rate(world, rays, 1.0, hits);
+	integrator_fns integrator = {color, color_hit};
+	framebuffer fb;
+	start = bench_clock::now();
+	render_frame(fb, cam, world, opt, integrator);
+	double frame_ms = 1000.0*seconds_since(start);
+
+	std::cout << objects->list_size - 1 << " instances of 100000 spheres\n";
+	std::cout << std::setw(12) << "build ms"
+	          << std::setw(10) << "MB"
+	          << std::setw(18) << "primary rays/s"
+	          << std::setw(22) << "640x360 1 spp ms" << "\n";
+	std::cout << std::setw(12) << std::fixed << std::setprecision(1) << build_ms
+	          << std::setw(10) << mb
+	          << std::setw(18) << std::setprecision(0) << rate
+	          << std::setw(22) << std::setprecision(1) << frame_ms << "\n";
+	record("build", build_ms, "ms");
+	record("memory", mb, "MB");
+	record("primary rays/s", rate, "rays/s");
+	record("frame 640x360 1 spp", frame_ms, "ms");
+}
+
+//Spheres of radius 0.25 at one per unit cube, each with its own material. With a heap,
+//every object is followed by a short lived allocation of random size, like a render
+//worker that has been loading scenes for a while, so the objects end up spread out
+void bench_arena(){
+	const int n = 1000000;
+	float half = 0.5f*cbrt(float(n));
+	srand48(1);
+	std::vector<ray> rays = make_rays(4096, half);
+
+	std::cout << "1M spheres, " << n << " materials\n";
+	std::cout << std::setw(8) << "alloc"
+	          << std::setw(12) << "create ms"
+	          << std::setw(12) << "bvh ms"
+	          << std::setw(14) << "rays/s"
+	          << std::setw(12) << "free ms" << "\n";
+
+	for(int use_arena = 0; use_arena < 2; use_arena++){
+		srand48(n);
+		scene_arena arena;
+		std::vector<hitable*> spheres(n);
+		std::vector<material*> materials(n);
+		std::vector<char*> clutter;
+		bench_clock::time_point start = bench_clock::now();
+		for(int k = 0; k < n; k++){
+			vec3 center = random_in_cube(half);
+			vec3 albedo(drand48(), drand48(), drand48());
+			if(use_arena){
+				materials[k] = arena.make<lambertian>(albedo);
+				spheres[k] = arena.make<sphere>(center, 0.25, materials[k]);
+			}
+			else{
+				materials[k] = new lambertian(albedo);
+				clutter.push_back(new char[16 + lrand48() % 256]);
+				spheres[k] = new sphere(center, 0.25, materials[k]);
+				clutter.push_back(new char[16 + lrand48() % 256]);
+			}
+		}
+		double create_ms = 1000.0*seconds_since(start);
+		for(size_t k = 0; k < clutter.size(); k++)
+			delete[] clutter[k];
+
+		start = bench_clock::now();
+		bvh* tree = use_arena ? arena.make<bvh>(&spheres[0], n) : new bvh(&spheres[0], n);
+		double build_ms = 1000.0*seconds_since(start);
+
+		int hits;
+		double rate = trace_rate(tree, rays, 1.0, hits);
+
+		start = bench_clock::now();
+		if(use_arena)
+			arena.release();
+		else{
+			delete tree;
+			for(int k = 0; k < n; k++){
+				delete spheres[k];
+				delete materials[k];
+			}
+		}
+		double free_ms = 1000.0*seconds_since(start);
+
+		std::cout << std::setw(8) << (use_arena ? "arena" : "new")
+		          << std::setw(12) << std::fixed << std::setprecision(1) << create_ms
+		          << std::setw(12) << build_ms
+		          << std::setw(14) << std::setprecision(0) << rate
+		          << std::setw(12) << std::setprecision(1) << free_ms << "\n";
+		std::string alloc = use_arena ? "arena" : "new";
+		record(alloc + " create", create_ms, "ms");
+		record(alloc + " rays/s", rate, "rays/s");
+		record(alloc + " free", free_ms, "ms");
+	}
+}
+
+struct bench_suite_entry {
+	const char* name;
+	void (*run)();
+};
+
+const bench_suite_entry bench_suites[] = {
+	{"micro", bench_micro},
+	{"frame", bench_frame},
+	{"bvh", bench_bvh},
+	{"packets", bench_packets},
+	{"roulette", bench_roulette},
+	{"dispatch", bench_dispatch},
+	{"scenefile", bench_scenefile},
+	{"mesh", bench_mesh},
+	{"instances", bench_instances},
+	{"arena", bench_arena},
+	{"images", bench_images},
+	{"adaptive", bench_adaptive},
+	{"sampler", bench_sampler},
+	{"denoise", bench_denoise},
+	{"warp", bench_warp},
+	{"precision", bench_precision},
+	{"deferred", bench_deferred},
+	{"occlusion", bench_occlusion},
+};
+const int BENCH_SUITE_COUNT = sizeof(bench_suites) / sizeof(bench_suites[0]);
+
+int main(int argc, char** argv){
+	std::vector<std::string> suites;
+	std::string json;
+	for(int k = 1; k < argc; k++){
+		if(!strcmp(argv[k], "--json") && k + 1 < argc)
+			json = argv[++k];
+		else if(!strcmp(argv[k], "all"))
+			for(int s = 0; s < BENCH_SUITE_COUNT; s++)
+				suites.push_back(bench_suites[s].name);
+		else
+			suites.push_back(argv[k]);
+	}
+	if(suites.empty()){
+		suites.push_back("micro");
+		suites.push_back("frame");
+	}
+
+	for(size_t k = 0; k < suites.size(); k++){
+		int s = 0;
+		while(s < BENCH_SUITE_COUNT && suites[k] != bench_suites[s].name)
+			s++;
+		if(s == BENCH_SUITE_COUNT){
+			std::cerr << "Unknown benchmark suite: " << suites[k] << "\n";
+			return 1;
+		}
+		if(suites.size() > 1)
+			std::cout << "== " << suites[k] << "\n";
+		bench_suite = suites[k];
+		bench_suites[s].run();
+	}
+
+	if(!json.empty() && !write_results_json(json)){
+		std::cerr << "Could not write " << json << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <fstream>
 #include <math.h>
 #include "sphere.h"
 #include "hitable_list.h"
@@ -6,6 +7,19 @@
 #include <float.h>
 #include "material.h"
 #include <stdlib.h>
+#include "integrator.h"
+#include "scenes.h"
+#include <string.h>
+#include <string>
+#include "renderer.h"
+#include "bvh.h"
+#include "sphere_pack.h"
+#include "image_io.h"
+#include "closed_scene.h"
+#include "scene_file.h"
+#include "distributed.h"
+#include "progressive.h"
+#include "denoise.h"
 
 
 
@@ -16,146 +30,390 @@
 */
 
 
-/* Chapter 7 - Diffuse Materials
-* Now that objects and multiple rays per pixel are implemented we can start simulating materials
-* Beginning with diffuse (matte) materials, we will treat shapes and materials
-* as individual items which can be mixed and matched e.g. we assign a material to a sphere
-* another option is to have the material  be dependent on the shape (useful if geometry is linked to material)
-*
-* Diffuse objects that don't emit light take on the colour of their surroundings
-* and then modulate the surrounding colour with their own intrinsic colour
-*
-* Light that reflects off a diffuse surface has its direction randomised
-* Rays may also be absorbed rather than reflected, the darker the surface the more likely absorption
-*
-* We need to implement an algorithm that randomises direction, one way is as follows
-* 1. Pick a random point s, from within a a sphere tangent to the ray hitpoint, p
-* 2. Send a ray from the hitpoint, p to the random point s,
-* 
-* The sphere has a radius of N, with the center (p+N)
-* 
-* We need a way to pick a random point in a unit radius sphere centered at the origin
-* to do this we'll use a rejection method, picking a random point in the unit cube (x,y,z range -1 to 1)
-* we reject the point and try again if it lies outside the unitsphere
-*
-*/
-
-
-/*        , - ~ ~ ~ - ,
-*    , '                ' ,
-*  ,                        ,
-* ,                          ,
-*,            (p+N)           ,
-*,             X     s        '
-*,             |    /         ,
-* , (radius N) |   /          ,
-*  ,           |  /          ,
-*    ,         | /        , '
-*      ' - , _ |/ _ , - '
-* -------------p---------------
-*             (hitpoint)
-*/
-
-
-//Color function returns the colour of the background as a basic gradient
-//It blends white/blue depending on the up/down value of the rays y coordinate
-//t = 0 -> white / t = 1 -> blue
-//Known as linear interpolation (lerp), always take the form of (1-t)*start_value + t*end_value
-//Where t can be between 1 and 0
+//Chapter 2 (The Next Week) - Bounding Volume Hierarchies
+//Replace the linear list with a tree of bounding boxes (bvh.h) or
+//packed SIMD sphere arrays (sphere_pack.h), allocated from the scene's arena
+hitable *build_accel(hitable_list *objects, const std::string& accel, scene_arena& arena){
+    if(accel == "list")
+        return objects;
+    if(accel == "bvh")
+        return arena.make<bvh>(objects->list, objects->list_size);
+    if(accel == "pack" || accel == "pack-bvh"){
+        sphere_pack *pack = arena.make<sphere_pack>();
+        if(!pack->add_list(objects->list, objects->list_size)){
+            std::cerr << "--accel " << accel << " needs a scene made only of spheres\n";
+            exit(1);
+        }
+        if(accel == "pack-bvh")
+            pack->build_bvh();
+        return pack;
+    }
+    if(accel == "closed"){
+        closed_scene *scene = arena.make<closed_scene>();
+        if(!scene->build(objects->list, objects->list_size)){
+            std::cerr << "--accel closed needs a scene made only of spheres\n";
+            exit(1);
+        }
+        return scene;
+    }
+    std::cerr << "Unknown acceleration structure: " << accel << "\n";
+    exit(1);
+}
 
+//Everything that can be set from the command line
+struct app_options {
+	app_options() : accel("bvh"), scene("random"), integrator("recursive"), sampler("random"), denoise(false), path_stats(false), output("-"), serve(false), worker_port(0) {}
+	render_options render;
+	std::string accel; //how the world is searched for hits: list, bvh, pack, pack-bvh or closed
+	std::string scene; //random (cover scene), glass, materials or a scene file (.rtb = binary)
+	std::string write_scene; //save the scene to this file (.rtb = binary) instead of rendering
+	std::string integrator; //recursive, iterative, wavefront, closed or ao
+	std::string sampler; //random or sobol
+	bool denoise; //filter the frame with its auxiliary buffers (denoise.h) before writing it
+	std::string aovs; //write the auxiliary buffers to AOVS-albedo.pfm, -normal.pfm and -depth.pfm, empty -> none
+	bool path_stats; //print how the paths ended once the frame is done
+	std::string stats; //file to write the render statistics to as JSON, empty -> none
+	std::string spp_map; //file to write the samples per pixel heatmap to, empty -> none
+	std::string output; //image file, "-" -> stdout
+	std::string format; //ppm (binary), png, pfm or p3 (ascii ppm), empty -> from the output file name
+	bool serve; //coordinate workers (distributed.h) instead of rendering
+	coordinator_options coordinator;
+	std::string worker_host; //render tiles for the coordinator at worker_host:worker_port
+	int worker_port;
+	progressive_options progressive; //render in passes with checkpoints (progressive.h)
+	std::string resume; //checkpoint to continue from, empty -> start afresh
+};
 
-//Chapter 7 - Updated to simulate diffuse materials
-vec3 color(const ray& r, hitable *world, int depth){
+//Reads the options from the command line
+//  --width N, --height N  image size in pixels (default 200x100)
+//  --threads N    worker threads (default: one per hardware thread, 1 = serial)
+//  --tile N       tile edge length in pixels
+//  --seed N       seed for the per-pixel random numbers
+//  --frame N      frame index, also feeds the random numbers
+//  --integrator NAME  recursive (color() in integrator.h, default),
+//                     iterative (color_iterative(), Russian roulette),
+//                     wavefront (material sorted path queues, wavefront.h) or
+//                     closed (color_static() without virtual calls, needs --accel closed) or
+//                     ao (ambient occlusion preview, grey shapes without materials)
+//  --ao-samples N  ambient rays per camera ray with --integrator ao (default 1)
+//  --ao-distance D  blockers further than D don't darken --integrator ao (default 10)
+//  --sampler NAME  random (independent numbers, default) or sobol (scrambled Sobol points, sampler.h)
+//  --denoise      filter the noise out of the finished frame, guided by its albedo, normals and depth
+//  --aovs PREFIX  write the albedo, normal and depth buffers to PREFIX-albedo.pfm, -normal.pfm, -depth.pfm
+//  --max-depth N  bounces before a path is cut off (default 50)
+//  --rr-depth N   bounces before Russian roulette starts (default 3, iterative only)
+//  --path-stats   print path counts and average path length to stderr
+//  --stats FILE   write the render statistics (render_stats.h) to FILE as JSON
+//  -o FILE        write the image to FILE instead of stdout, the format follows the extension
+//  --format NAME  ppm (binary P6), png, pfm (linear floats) or p3 (ascii ppm, default on stdout)
+//  --spp N        samples per pixel (default 100), the most any pixel takes with --adaptive
+//  --adaptive T   adaptive sampling, stop a pixel once its error after gamma is below T (e.g. 0.01)
+//  --min-spp N    samples every pixel takes before --adaptive may stop it (default 16)
+//  --spp-map FILE write the samples taken per pixel as a heatmap ppm
+//  --packet N     trace primary rays in NxN packets (N = 4 or 8, 1 = off, needs --accel pack-bvh,
+//                 not with --integrator wavefront)
+//  --scene NAME   random (cover scene, default), glass (cover scene in glass), materials,
+//                 instances (10k instances of a 100k sphere cluster)
+//                 or a scene file: text (scene_file.h, spheres and OBJ/PLY meshes) or binary .rtb,
+//                 which brings its own bvh
+//  --write-scene FILE  save the scene as text, or binary with its bvh if FILE ends in .rtb, and exit
+//  --checkpoint FILE  render in passes and save the accumulated samples to FILE as it goes
+//  --checkpoint-interval S  seconds between checkpoints (default 60), the finished frame is always saved
+//  --pass-spp N   samples per pixel in each pass of a checkpointed render (default 16)
+//  --resume FILE  carry on from a checkpoint (saving back to it unless --checkpoint says otherwise),
+//                 with the next sample of every pixel, up to --spp
+//  --serve PORT   coordinate: hand out the tiles to worker processes connecting on PORT (0 -> any)
+//  --local-workers N  start N workers on this machine for --serve (implies --serve 0), with --threads
+//                     threads each (default: the cores shared out between them)
+//  --job-timeout S    seconds before --serve hands a tile that hasn't come back to another worker (default 300)
+//  --worker HOST:PORT render tiles for the coordinator at HOST:PORT, with --threads threads
+//  --accel NAME   list     - test every object (plain hitable_list)
+//                 bvh      - bounding volume hierarchy over the objects (default)
+//                 pack     - spheres packed into SIMD friendly arrays, all tested
+//                 pack-bvh - packed spheres with a bvh whose leaves are runs of the arrays
+//                 closed   - closed_scene, objects stored by type and dispatched with a switch
+void parse_args(int argc, char** argv, app_options& app){
+	render_options& opt = app.render;
+	for (int k = 1; k < argc; k++) {
+		bool has_value = (k + 1 < argc);
+		if (!strcmp(argv[k], "--threads") && has_value) opt.threads = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--width") && has_value) opt.nx = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--height") && has_value) opt.ny = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--tile") && has_value) opt.tile_size = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--seed") && has_value) opt.seed = (unsigned int)strtoul(argv[++k], NULL, 10);
+		else if (!strcmp(argv[k], "--frame") && has_value) opt.frame = (unsigned int)strtoul(argv[++k], NULL, 10);
+		else if (!strcmp(argv[k], "--accel") && has_value) app.accel = argv[++k];
+		else if (!strcmp(argv[k], "--scene") && has_value) app.scene = argv[++k];
+		else if (!strcmp(argv[k], "--write-scene") && has_value) app.write_scene = argv[++k];
+		else if (!strcmp(argv[k], "--packet") && has_value) opt.packet_size = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--integrator") && has_value) app.integrator = argv[++k];
+		else if (!strcmp(argv[k], "--sampler") && has_value) app.sampler = argv[++k];
+		else if (!strcmp(argv[k], "--denoise")) app.denoise = true;
+		else if (!strcmp(argv[k], "--aovs") && has_value) app.aovs = argv[++k];
+		else if (!strcmp(argv[k], "--ao-samples") && has_value) ao_config.samples = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--ao-distance") && has_value) ao_config.distance = real(atof(argv[++k]));
+		else if (!strcmp(argv[k], "--max-depth") && has_value) path_config.max_depth = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--rr-depth") && has_value) path_config.roulette_depth = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--path-stats")) app.path_stats = true;
+		else if (!strcmp(argv[k], "--stats") && has_value) app.stats = argv[++k];
+		else if (!strcmp(argv[k], "--spp") && has_value) opt.ns = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--adaptive") && has_value) opt.adaptive_threshold = float(atof(argv[++k]));
+		else if (!strcmp(argv[k], "--min-spp") && has_value) opt.min_spp = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--spp-map") && has_value) app.spp_map = argv[++k];
+		else if ((!strcmp(argv[k], "-o") || !strcmp(argv[k], "--output")) && has_value) app.output = argv[++k];
+		else if (!strcmp(argv[k], "--format") && has_value) app.format = argv[++k];
+		else if (!strcmp(argv[k], "--checkpoint") && has_value) app.progressive.checkpoint = argv[++k];
+		else if (!strcmp(argv[k], "--checkpoint-interval") && has_value) app.progressive.checkpoint_interval = atof(argv[++k]);
+		else if (!strcmp(argv[k], "--pass-spp") && has_value) app.progressive.pass_spp = atoi(argv[++k]);
+		else if (!strcmp(argv[k], "--resume") && has_value) app.resume = argv[++k];
+		else if (!strcmp(argv[k], "--serve") && has_value) { app.serve = true; app.coordinator.port = atoi(argv[++k]); }
+		else if (!strcmp(argv[k], "--local-workers") && has_value) { app.serve = true; app.coordinator.local_workers = atoi(argv[++k]); }
+		else if (!strcmp(argv[k], "--job-timeout") && has_value) app.coordinator.job_timeout = atof(argv[++k]);
+		else if (!strcmp(argv[k], "--worker") && has_value) {
+			std::string address = argv[++k];
+			size_t colon = address.find_last_of(':');
+			if (colon == std::string::npos) {
+				std::cerr << "--worker needs HOST:PORT\n";
+				exit(1);
+			}
+			app.worker_host = address.substr(0, colon);
+			app.worker_port = atoi(address.c_str() + colon + 1);
+		}
+		else {
+			std::cerr << "Unknown or incomplete option: " << argv[k] << "\n";
+			exit(1);
+		}
+	}
+	if (app.integrator == "wavefront")
+		opt.wavefront = true;
+	else if (app.integrator == "closed" && app.accel != "closed") {
+		std::cerr << "--integrator closed needs --accel closed\n";
+		exit(1);
+	}
+	else if (app.integrator != "recursive" && app.integrator != "iterative" && app.integrator != "closed" && app.integrator != "ao") {
+		std::cerr << "Unknown integrator: " << app.integrator << "\n";
+		exit(1);
+	}
+	if (ao_config.samples < 1 || !(ao_config.distance > 0)) {
+		std::cerr << "--ao-samples and --ao-distance must be positive\n";
+		exit(1);
+	}
+	if (app.sampler == "sobol")
+		opt.sampling = SAMPLER_SOBOL;
+	else if (app.sampler != "random") {
+		std::cerr << "Unknown sampler: " << app.sampler << "\n";
+		exit(1);
+	}
+	if (opt.packet_size == 1)
+		opt.packet_size = 0; //a 1x1 packet is one ray at a time
+	if (opt.packet_size != 0 && opt.packet_size != 4 && opt.packet_size != 8) {
+		std::cerr << "--packet must be 4 or 8 (1 for one ray at a time)\n";
+		exit(1);
+	}
+	if (opt.packet_size > 0 && (app.accel != "pack-bvh" || image_format(app.scene) == "rtb")) {
+		std::cerr << "--packet needs --accel pack-bvh (and a scene other than .rtb, which brings its own bvh)\n";
+		exit(1);
+	}
+	if (opt.packet_size > 0 && opt.wavefront) {
+		std::cerr << "--packet can't be combined with --integrator wavefront, which traces its own camera rays\n";
+		exit(1);
+	}
+	if (app.format.empty())
+		app.format = app.output == "-" ? "p3" : image_format(app.output);
+	if (app.format != "ppm" && app.format != "png" && app.format != "pfm" && app.format != "p3") {
+		std::cerr << "Unknown image format: " << app.format << "\n";
+		exit(1);
+	}
+	if (opt.nx < 1 || opt.ny < 1) {
+		std::cerr << "--width and --height must be at least 1\n";
+		exit(1);
+	}
+	if (opt.ns < 1) {
+		std::cerr << "--spp must be at least 1\n";
+		exit(1);
+	}
+	if (app.serve && (!app.write_scene.empty() || app.path_stats || !app.stats.empty())) {
+		std::cerr << "--serve only hands out tiles, --write-scene, --path-stats and --stats work without it\n";
+		exit(1);
+	}
+	if (app.progressive.checkpoint.empty())
+		app.progressive.checkpoint = app.resume;
+	if (!app.progressive.checkpoint.empty() && (app.serve || opt.adaptive_threshold > 0)) {
+		std::cerr << "--checkpoint and --resume can't be combined with --serve or --adaptive\n";
+		exit(1);
+	}
+	if (opt.adaptive_threshold > 0) {
+		if (opt.packet_size > 0 || opt.wavefront) {
+			std::cerr << "--adaptive works one ray at a time, it can't be combined with --packet or --integrator wavefront\n";
+			exit(1);
+		}
+		if (opt.min_spp < 2 || opt.min_spp > opt.ns) {
+			std::cerr << "--min-spp must be between 2 and --spp\n";
+			exit(1);
+		}
+	}
+}
 
-  hit_record rec; //Holds details of whatever object ray has hit
-  
-  //Is there a collision?
-  if(world->hit(r, 0.001, FLT_MAX, rec)){ //If ray hits, hit record will be updated
-	ray scattered; //Resulting ray from material interaction
-	
-	//Attenuation is a value less than 1, unless perfect reflective surface
-	//Reflects the loss of ray intensity as it is (repeatedly) reflected and scattered
-	vec3 attenuation;
-	//Material interactions for 50 iterations and if ray scatters and is not absorbed
-	//Actual results of scatter function depend on type of material
-	if(depth < 50 && rec.mat_ptr->scatter(r, rec,attenuation, scattered)){
-		return attenuation*color(scattered, world, depth+1); //Multiply current attenuation value with results from next iteration using the new scattered ray
-	}
-	else{
-		return vec3(0,0,0);
-	}
-  }
-  else{
-    //No - determine background colour
-    vec3 unit_direction = unit_vector(r.direction()); //Convert the direction of the ray into a unit vector (magnitude of 1)
-    float t = 0.5*(unit_direction.y() + 1.0); //Calculate some value for t depending on rays y value
-    return (1.0-t)*vec3(1.0,1.0,1.0) + t*vec3(0.5,0.7,1.0); //Create a vector using t (color)
-  }
+//Loads the scene named by app.scene into the arena together with its camera view, NULL with
+//error set if it can't. binary_scene is set for .rtb files, which come with their own bvh,
+//the other scenes are returned as the plain list of objects
+hitable *load_scene(const app_options& app, scene_arena& arena, camera_params& view, bool& binary_scene, std::string& error){
+    binary_scene = image_format(app.scene) == "rtb";
+    if(app.scene == "materials"){
+        view = material_scene_view();
+        return material_scene(arena);
+    }
+    if(app.scene == "random"){
+        view = random_scene_view();
+        return random_scene(arena);
+    }
+    if(app.scene == "glass"){
+        view = random_scene_view();
+        return glass_scene(arena);
+    }
+    if(app.scene == "instances"){
+        view = instance_scene_view();
+        return instance_scene(arena);
+    }
+    if(binary_scene){
+        //Already has its bvh, used as it is
+        if(!app.write_scene.empty() || app.integrator == "closed"){
+            error = "--write-scene and --integrator closed need a built in or text scene";
+            return NULL;
+        }
+        mapped_scene *scene = arena.make<mapped_scene>();
+        if(!scene->open(app.scene, arena, error))
+            return NULL;
+        view = scene->view;
+        return scene;
+    }
+    return read_scene_text(app.scene, arena, view, error);
 }
 
+//The options the samples of a frame depend on, a checkpoint only resumes the same frame
+std::string frame_key(const app_options& app){
+	const render_options& opt = app.render;
+	return app.scene + " " + app.accel + " " + app.integrator + " " + std::to_string(opt.nx) + "x" + std::to_string(opt.ny) +
+	       " seed " + std::to_string(opt.seed) + " frame " + std::to_string(opt.frame) + " packet " + std::to_string(opt.packet_size) +
+	       " depth " + std::to_string(path_config.max_depth) + " rr " + std::to_string(path_config.roulette_depth) +
+	       (app.sampler == "random" ? "" : " sampler " + app.sampler) + //checkpoints from before --sampler keep resuming
+	       (app.integrator != "ao" ? "" : " ao " + std::to_string(ao_config.samples) + " " + std::to_string(ao_config.distance));
+}
 
+integrator_fns select_integrator(const app_options& app){
+	integrator_fns integrator = {color, color_hit};
+	if(app.integrator == "iterative")
+		integrator = {color_iterative, color_iterative_hit};
+	else if(app.integrator == "closed")
+		integrator = {color_closed, color_hit};
+	else if(app.integrator == "ao")
+		integrator = {color_ao, color_ao_hit};
+	return integrator;
+}
 
-//Chatper 12 - cover scene
-hitable *random_scene() {
-    int n = 500;
-    hitable **list = new hitable*[n+1];
-    list[0] =  new sphere(vec3(0,-1000,0), 1000, new lambertian(vec3(0.5, 0.5, 0.5)));
-    int i = 1;
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            float choose_mat = drand48();
-            vec3 center(a+0.9*drand48(),0.2,b+0.9*drand48()); 
-            if ((center-vec3(4,0.2,0)).length() > 0.9) { 
-                if (choose_mat < 0.8) {  // diffuse
-                    list[i++] = new sphere(center, 0.2, new lambertian(vec3(drand48()*drand48(), drand48()*drand48(), drand48()*drand48())));
-                }
-                else if (choose_mat < 0.95) { // metal
-                    list[i++] = new sphere(center, 0.2,
-                            new metal(vec3(0.5*(1 + drand48()), 0.5*(1 + drand48()), 0.5*(1 + drand48())),  0.5*drand48()));
-                }
-                else {  // glass
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
-                }
-            }
-        }
-    }
+//The options that describe the frame, for the workers: everything but what only concerns
+//the coordinator (its output files, threads and the distribution itself)
+std::vector<std::string> frame_args(int argc, char** argv){
+	static const char* const coordinator_only[] = {"--serve", "--local-workers", "--job-timeout", "--threads",
+	                                               "-o", "--output", "--format", "--spp-map", NULL};
+	std::vector<std::string> args;
+	for (int k = 1; k < argc; k++) {
+		bool skip = false;
+		for (int c = 0; coordinator_only[c]; c++)
+			if (!strcmp(argv[k], coordinator_only[c]))
+				skip = true;
+		if (skip)
+			k++; //and its value
+		else
+			args.push_back(argv[k]);
+	}
+	return args;
+}
 
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+//Worker side of distributed rendering: the frame comes from the coordinator's options
+int run_worker_mode(const app_options& app){
+	scene_arena arena;
+	dist_setup_fn setup = [&arena](const std::vector<std::string>& args, dist_frame& frame, std::string& error){
+		std::vector<char*> argv(1, const_cast<char*>("Raytracer"));
+		for (size_t k = 0; k < args.size(); k++)
+			argv.push_back(const_cast<char*>(args[k].c_str()));
+		app_options frame_app;
+		parse_args(int(argv.size()), &argv[0], frame_app);
 
-    return new hitable_list(list,i);
+		camera_params view;
+		bool binary_scene;
+		hitable *world = load_scene(frame_app, arena, view, binary_scene, error);
+		if (!world)
+			return false;
+		if (!binary_scene)
+			world = build_accel((hitable_list*)world, frame_app.accel, arena);
+		frame.opt = frame_app.render;
+		frame.cam = view.make(float(frame.opt.nx)/float(frame.opt.ny));
+		frame.world = world;
+		frame.integrator = select_integrator(frame_app);
+		return true;
+	};
+	std::string error;
+	if (!run_worker(app.worker_host, app.worker_port, app.render.threads, setup, error)) {
+		std::cerr << "worker: " << error << "\n";
+		return 1;
+	}
+	return 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
   //Start  by generating ppm files
 
+  app_options app;
+  parse_args(argc, argv, app);
+  render_options& opt = app.render;
+
   //Image dimensions
-	int nx = 200; //width
-	int ny = 100; //height
+	int nx = opt.nx; //width
+	int ny = opt.ny; //height
 
 	//This produces the following:
 	//P3 <-- This means colours are in ASCII
 	//200 100 <-- 200 columns x 100 rows 
 	//255 <-- Max possible values of 255 for a colour
-	std::cout << "P3\n" << nx << " " << ny << "\n255\n";
+	//(written by framebuffer::write_ppm once the frame is finished, image_io.h has the binary formats)
 	
 	
-	hitable *list[5];
-    float R = cos(M_PI/4);
-    list[0] = new sphere(vec3(0,0,-1), 0.5, new lambertian(vec3(0.1, 0.2, 0.5)));
-    list[1] = new sphere(vec3(0,-100.5,-1), 100, new lambertian(vec3(0.8, 0.8, 0.0)));
-    list[2] = new sphere(vec3(1,0,-1), 0.5, new metal(vec3(0.8, 0.6, 0.2), 0.0));
-    list[3] = new sphere(vec3(-1,0,-1), 0.5, new dielectric(1.5));
-    list[4] = new sphere(vec3(-1,0,-1), -0.45, new dielectric(1.5));
-    hitable *world = new hitable_list(list,5);
-    world = random_scene();
-
-    vec3 lookfrom(13,2,3);
-    vec3 lookat(0,0,0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.1;
+	if(!app.worker_host.empty())
+		return run_worker_mode(app);
+
+	//Everything the scene is made of lives in the arena and goes away with it
+	scene_arena arena;
+	hitable *world = NULL;
+    camera_params view;
+    std::string error;
+    bool binary_scene = false;
+    bool post_process = app.denoise || !app.aovs.empty(); //needs the scene for the auxiliary buffers
+    if(!app.serve || post_process){
+        world = load_scene(app, arena, view, binary_scene, error);
+        if(!world){
+            std::cerr << error << "\n";
+            return 1;
+        }
+    }
+    camera cam = view.make(float(nx)/float(ny));
+
+    if(!app.write_scene.empty()){
+        FILE* f = fopen(app.write_scene.c_str(), "wb");
+        bool ok = f && (image_format(app.write_scene) == "rtb" ? write_scene_binary(f, (hitable_list*)world, view, error)
+                                                                : write_scene_text(f, (hitable_list*)world, view, error));
+        if(f && fclose(f) != 0)
+            ok = false;
+        if(!ok){
+            std::cerr << "Could not write " << app.write_scene << (error.empty() ? "" : ": " + error) << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if(!binary_scene && (!app.serve || post_process))
+        world = build_accel((hitable_list*)world, app.accel, arena);
 
   //Chapter 6 - Anti-aliasing
   /*
@@ -167,42 +425,79 @@ int main()
   * of the samples, the colours of these rays is then averaged
   */
 
-    camera cam(lookfrom, lookat, vec3(0,1,0), 20, float(nx)/float(ny), aperture, dist_to_focus);
-
 	    
   
-  int ns = 100; //no. of samples to take per pixel
-  
-	//Loop through each column / row and write an RGB triplet
-	//Top to bottom - left to right
-	for (int j = ny-1; j >= 0; j--)	{
-		for (int i = 0; i < nx; i++) {
-
-      //"empty" colour vector each pixel
-      vec3 col(0,0,0);
-      
-      //Sum up ray colours for each random sample at each pixel
-      for (int s = 0; s < ns; s++){
-      
-              float u = float(i + drand48()) / float(nx);
-              float v = float(j + drand48())/ float(ny);
-              ray r = cam.get_ray(u, v);
-              
-              col += color(r, world, 0);
-      }
-      
-      //Divide colour by total no. samples for an average
-      col /= ns;
-      col = vec3(sqrt(col.r()), sqrt(col.g()), sqrt(col.b()));
-      
-      //Convert to integer
-      int ir = int(255.99 * col.r());
-      int ig = int(255.99 * col.g());
-      int ib = int(255.99 * col.b());
-
-		//Output in format R G B
-		std::cout << ir << " " << ig << " " << ib << "\n";
+	//Render the frame tile by tile across the thread pool, then write it out in one go
+	framebuffer fb;
+	if(app.serve){
+		//Or let worker processes render the tiles
+		if(!run_coordinator(app.coordinator, frame_args(argc, argv), opt, fb, error)){
+			std::cerr << error << "\n";
+			return 1;
+		}
+	}
+	else if(!app.progressive.checkpoint.empty()){
+		//Or in passes, saving the samples taken so far
+		accumulation_buffer accum(nx, ny, fnv1a64(frame_key(app)));
+		if(!app.resume.empty()){
+			if(!accum.load(app.resume, error)){
+				std::cerr << error << "\n";
+				return 1;
+			}
+			if(accum.width != nx || accum.height != ny || accum.key != fnv1a64(frame_key(app))){
+				std::cerr << app.resume << " is a checkpoint of a different frame (size, scene, seed or integrator)\n";
+				return 1;
+			}
+		}
+		if(!render_progressive(fb, cam, world, opt, select_integrator(app), accum, app.progressive, error)){
+			std::cerr << error << "\n";
+			return 1;
+		}
+	}
+	else
+		render_frame(fb, cam, world, opt, select_integrator(app));
+	render_counters frame_stats = render_stats::total(); //without the rays of the auxiliary buffers
 
+	//Then the post process on the finished frame
+	if(post_process){
+		aov_buffers aov;
+		render_aovs(aov, cam, world, opt);
+		if(!app.aovs.empty() && !write_aovs(app.aovs, aov)){
+			std::cerr << "Could not write the auxiliary buffers " << app.aovs << "-*.pfm\n";
+			return 1;
 		}
+		if(app.denoise)
+			denoise_frame(fb, aov, opt.threads);
+	}
+	if(!write_file(app.output, encode_image(fb, app.format))){
+		std::cerr << "Could not write " << app.output << "\n";
+		return 1;
+	}
+
+	if(!app.spp_map.empty()){
+		std::ofstream map(app.spp_map.c_str(), std::ios::binary);
+		fb.write_samples_heatmap(map, opt.ns);
+	}
+	if(opt.adaptive_threshold > 0){
+		long long samples = fb.total_samples(), fixed = (long long)nx*ny*opt.ns;
+		std::cerr << "adaptive sampling: " << samples << " samples, " << double(samples)/(nx*ny)
+		          << " per pixel, " << 100.0*samples/fixed << "% of " << opt.ns << " spp\n";
+	}
+
+	if(app.path_stats){
+		const render_counters& stats = frame_stats;
+		std::cerr << "paths " << stats.paths << ", rays " << stats.rays
+		          << ", average length " << stats.average_length() << "\n"
+		          << "  escaped " << stats.escaped << ", absorbed " << stats.absorbed
+		          << ", depth limited " << stats.depth_limited
+		          << ", roulette " << stats.roulette_killed << "\n"
+		          << "  node visits " << stats.node_visits << ", hit tests " << stats.hit_tests
+		          << ", hits " << stats.hit_successes << "\n";
+	}
+	if(!app.stats.empty() && !write_file(app.stats, stats_json(frame_stats))){
+		std::cerr << "Could not write " << app.stats << "\n";
+		return 1;
 	}
+	if(!RT_STATS && (app.path_stats || !app.stats.empty()))
+		std::cerr << "built with RT_STATS=0, the statistics are all zero\n";
 }
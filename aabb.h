@@ -0,0 +1,98 @@
+#include "ray.h"
+#include <float.h>
+#pragma once
+
+//Axis-aligned bounding boxes
+
+/*
+ * An axis-aligned bounding box (aabb) is the region between two corner points,
+ * min and max. It can be seen as three "slabs", one per axis, each being the region
+ * between two parallel planes e.g. min.x() <= x <= max.x()
+ *
+ * A ray enters and leaves each slab at a value of t:
+ *
+ * t0 = (min.x() - A.x()) / B.x()
+ * t1 = (max.x() - A.x()) / B.x()
+ *
+ * The ray is inside the box where it is inside all three slabs at once, so it
+ * hits the box if the overlap of the three [t0,t1] intervals is not empty.
+ *
+ *            |       |
+ *      ------+-------+------ max.y
+ *            |  \    |
+ *            |   \   |
+ *      ------+----\--+------ min.y
+ *            |     \ |
+ *          min.x   max.x
+ *
+ * Dividing by B.x() is done once per ray by passing in 1/B (inv_dir), a zero
+ * component gives +/-inf which the comparisons handle as expected.
+ */
+
+class aabb {
+
+  public:
+	//Default box is empty (min > max) so it can be grown with surrounding_box
+	aabb() : _min(FLT_MAX, FLT_MAX, FLT_MAX), _max(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+	aabb(const vec3& a, const vec3& b) : _min(a), _max(b) {}
+
+	vec3 min() const { return _min; }
+	vec3 max() const { return _max; }
+
+	vec3 centroid() const { return 0.5f*(_min + _max); }
+
+	//Surface area, used by the SAH to estimate how likely a ray is to hit the box
+	float area() const {
+		vec3 d = _max - _min;
+		if(d.x() < 0 || d.y() < 0 || d.z() < 0)
+			return 0;
+		return 2.0f*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+	}
+
+	//Index of the longest axis (0 = x, 1 = y, 2 = z)
+	int longest_axis() const {
+		vec3 d = _max - _min;
+		if(d.x() > d.y() && d.x() > d.z())
+			return 0;
+		return d.y() > d.z() ? 1 : 2;
+	}
+
+	void grow(const vec3& p){
+		for(int a = 0; a < 3; a++){
+			if(p[a] < _min[a]) _min[a] = p[a];
+			if(p[a] > _max[a]) _max[a] = p[a];
+		}
+	}
+
+	void grow(const aabb& b){
+		grow(b._min);
+		grow(b._max);
+	}
+
+	//Slab test, on a hit tmin/tmax are narrowed to the part of the ray inside the box
+	inline bool hit(const ray& r, const vec3& inv_dir, real& tmin, real& tmax) const {
+		vec3 o = r.origin();
+		for(int a = 0; a < 3; a++){
+			real t0 = (_min[a] - o[a]) * inv_dir[a];
+			real t1 = (_max[a] - o[a]) * inv_dir[a];
+			if(inv_dir[a] < 0.0f){
+				real tmp = t0; t0 = t1; t1 = tmp;
+			}
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+			if(tmax < tmin)
+				return false;
+		}
+		return true;
+	}
+
+	vec3 _min;
+	vec3 _max;
+};
+
+//Smallest box containing both boxes
+inline aabb surrounding_box(const aabb& a, const aabb& b){
+	aabb box = a;
+	box.grow(b);
+	return box;
+}
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#pragma once
+
+//Allocator handing out memory aligned to Alignment bytes (a cache line by default)
+//so SIMD loads from the start of std::vector storage never straddle cache lines
+
+template <typename T, size_t Alignment = 64>
+class aligned_allocator {
+
+  public:
+	typedef T value_type;
+
+	template <typename U> struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+	aligned_allocator() {}
+	template <typename U> aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+	T* allocate(size_t n){
+		//aligned_alloc needs the size to be a multiple of the alignment
+		size_t bytes = ((n*sizeof(T) + Alignment - 1) / Alignment) * Alignment;
+		void* p = aligned_alloc(Alignment, bytes ? bytes : Alignment);
+		if(!p)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t) { free(p); }
+
+	template <typename U> bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
+	template <typename U> bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, aligned_allocator<T> >;
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#pragma once
+
+//Scene arena
+
+/*
+ * Everything a scene is made of (spheres, materials, the object lists and the acceleration
+ * structures on top) is created once when the scene is built and lives until the scene is
+ * thrown away. Allocating each of them with new scatters them over the heap and leaves
+ * the freeing to whoever remembers.
+ *
+ * The arena hands out memory by bumping a pointer through large cache line aligned blocks,
+ * so objects built one after the other (a sphere and its material, the spheres of a list)
+ * sit next to each other in memory. Nothing is freed on its own: release() (or the
+ * destructor) runs the destructors of the objects that need one, newest first, and frees
+ * the blocks in one go.
+ *
+ *   block 0                              block 1
+ *   [sphere|lambertian|sphere|metal|...] [sphere|dielectric|list ...|bvh|....free....]
+ *                                                                        ^ next
+ */
+
+class scene_arena {
+
+  public:
+	static const size_t BLOCK_ALIGNMENT = 64; //cache line
+
+	explicit scene_arena(size_t block_size = 1 << 16) : block_size(block_size), next(NULL), end(NULL), used(0) {}
+	~scene_arena() { release(); }
+
+	//Memory of the given size and alignment (a power of two no larger than a cache line)
+	void* allocate(size_t bytes, size_t alignment){
+		char* p = align_up(next, alignment);
+		if(!next || p + bytes > end){
+			//Requests bigger than a block get a block of their own
+			size_t size = bytes > block_size ? bytes : block_size;
+			size = (size + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+			char* block = static_cast<char*>(aligned_alloc(BLOCK_ALIGNMENT, size));
+			if(!block)
+				throw std::bad_alloc();
+			blocks.push_back(block);
+			p = block;
+			end = block + size;
+		}
+		next = p + bytes;
+		used += bytes;
+		return p;
+	}
+
+	//Constructs a T in the arena, its destructor is run by release()
+	template <typename T, typename... Args>
+	T* make(Args&&... args){
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if(!std::is_trivially_destructible<T>::value)
+			destructors.push_back(std::make_pair(static_cast<void*>(object), &destroy<T>));
+		return object;
+	}
+
+	//Array of n value initialised Ts (e.g. null pointers), cache line aligned
+	template <typename T>
+	T* make_array(size_t n){
+		static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+		T* array = static_cast<T*>(allocate(n*sizeof(T), BLOCK_ALIGNMENT));
+		for(size_t k = 0; k < n; k++)
+			new (&array[k]) T();
+		return array;
+	}
+
+	//Destroys every object and frees every block, the arena can be used again afterwards
+	void release(){
+		for(size_t k = destructors.size(); k-- > 0; )
+			destructors[k].second(destructors[k].first);
+		destructors.clear();
+		for(size_t k = 0; k < blocks.size(); k++)
+			free(blocks[k]);
+		blocks.clear();
+		next = end = NULL;
+		used = 0;
+	}
+
+	//Bytes handed out since the last release, alignment padding not included
+	size_t bytes_used() const { return used; }
+	size_t block_count() const { return blocks.size(); }
+
+  private:
+	scene_arena(const scene_arena&);
+	scene_arena& operator=(const scene_arena&);
+
+	static char* align_up(char* p, size_t alignment){
+		return reinterpret_cast<char*>((reinterpret_cast<size_t>(p) + alignment - 1) & ~(alignment - 1));
+	}
+
+	template <typename T>
+	static void destroy(void* object) { static_cast<T*>(object)->~T(); }
+
+	size_t block_size;
+	char* next;
+	char* end;
+	size_t used;
+	std::vector<char*> blocks;
+	std::vector<std::pair<void*, void (*)(void*)> > destructors;
+};
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Builds every configuration of CMakePresets.json and times the same render with each,
+# printing a markdown table of the speedups over the plain release build.
+#
+#   ./build_report.sh                  all configurations
+#   ./build_report.sh release native   only these
+#
+# RUNS (default 5) renders per configuration, the fastest counts. RENDER_ARGS is the render,
+# by default the cover scene with a different seed and size than the PGO training run so the
+# profile isn't judged on exactly the frame it was trained on.
+set -e
+cd "$(dirname "$0")"
+
+presets=("$@")
+if [ ${#presets[@]} -eq 0 ]; then
+	presets=(release native lto pgo native-lto-pgo)
+fi
+runs=${RUNS:-5}
+render_args=${RENDER_ARGS:-"--scene random --seed 7 --width 400 --height 200 --spp 32"}
+
+for p in "${presets[@]}"; do
+	echo "building $p" >&2
+	cmake --preset "$p" > /dev/null
+	cmake --build --preset "$p" -j"$(nproc)" > /dev/null
+done
+
+now_ms() { echo $(( $(date +%s%N) / 1000000 )); }
+
+report="build/report.md"
+{
+	echo "Render: \`Raytracer $render_args\`, fastest of $runs, $(nproc) threads, $(c++ --version | head -n 1)"
+	echo
+	echo "| configuration | seconds | speedup |"
+	echo "|---|---|---|"
+} > "$report"
+
+# Configurations take turns, so a machine getting faster or slower during the report
+# affects all of them alike
+declare -A best
+for ((k = 0; k < runs; k++)); do
+	for p in "${presets[@]}"; do
+		start=$(now_ms)
+		"build/$p/Raytracer" $render_args -o /dev/null --format ppm
+		ms=$(( $(now_ms) - start ))
+		if [ -z "${best[$p]}" ] || [ "$ms" -lt "${best[$p]}" ]; then best[$p]=$ms; fi
+	done
+done
+
+base=${best[${presets[0]}]}
+for p in "${presets[@]}"; do
+	awk -v p="$p" -v ms="${best[$p]}" -v base="$base" \
+		'BEGIN { printf "| %s | %.3f | %.2fx |\n", p, ms / 1000, base / ms }' >> "$report"
+done
+cat "$report"
@@ -0,0 +1,397 @@
+#include "hitable.h"
+#include "aabb.h"
+#include "render_stats.h"
+#include <vector>
+#include <algorithm>
+#include <future>
+#include <thread>
+#pragma once
+
+//Bounding Volume Hierarchy (BVH)
+
+/*
+ * hitable_list tests every object for every ray, which costs O(n) per ray.
+ * A BVH groups objects into a tree of bounding boxes, if a ray misses a box it
+ * cannot hit anything inside it, so the whole subtree is skipped - roughly O(log n) per ray.
+ *
+ *                 [ root box ]
+ *                /            \
+ *         [ box A ]          [ box B ]
+ *         /      \           /      \
+ *      (s1 s2)  (s3)     (s4 s5)   (s6 s7)
+ *
+ * Building - Surface Area Heuristic (SAH)
+ * The chance of a random ray hitting a box is roughly proportional to its surface area,
+ * so the expected cost of splitting a set of objects into L and R is
+ *
+ *   cost = C_trav + (area(L) * count(L) + area(R) * count(R)) / area(parent)
+ *
+ * Trying every possible split is expensive, so object centroids are dropped into a
+ * fixed number of bins along each axis and only the bin boundaries are evaluated ("binned SAH").
+ * Large subtrees are built on separate threads as the two halves are independent.
+ *
+ * Layout - the tree is flattened depth first into an array, the first child of a node
+ * is always the next node so only the second child's index is stored.
+ *
+ * Traversal - iterative with a small stack. The child on the near side of the split axis
+ * (judged by the sign of the ray direction) is visited first, so close hits are found early
+ * and shrink tmax, letting the far child's box be rejected more often.
+ *
+ * Objects without a bounding box (bounding_box() returns false) can't be placed in the tree,
+ * they are kept in a list of their own that every ray tests as well as the tree, and the bvh then
+ * has no box either.
+ */
+
+struct bvh_node_data {
+	aabb box;
+	int offset; //leaf: index of the first primitive, interior: index of the second child
+	int count;  //number of primitives in a leaf, 0 for interior nodes
+	int axis;   //split axis of an interior node
+};
+
+//Upper bound on tree depth, keeps the traversal stack a fixed size
+const int BVH_MAX_DEPTH = 64;
+
+//Builds a flattened bvh over a set of boxes
+//order receives the primitive indices in leaf order, leaves refer to ranges of it
+class bvh_builder {
+
+  public:
+	bvh_builder(const std::vector<aabb>& b, int leaf_size) : boxes(b), max_leaf_size(leaf_size < 1 ? 1 : leaf_size) {
+		centroids.resize(boxes.size());
+		for(size_t k = 0; k < boxes.size(); k++)
+			centroids[k] = boxes[k].centroid();
+		int threads = int(std::thread::hardware_concurrency());
+		//Spawn threads for the top few levels, a few more subtrees than cores helps balance
+		parallel_depth = 2;
+		while(threads > 1){
+			parallel_depth++;
+			threads >>= 1;
+		}
+	}
+
+	void build(std::vector<bvh_node_data>& nodes, std::vector<int>& order){
+		order.resize(boxes.size());
+		for(size_t k = 0; k < order.size(); k++)
+			order[k] = int(k);
+		nodes.clear();
+		if(boxes.empty())
+			return;
+		build_node* root = build_range(order, 0, int(order.size()), 0);
+		flatten(root, nodes);
+		destroy(root);
+	}
+
+  private:
+	static const int BINS = 16;
+
+	struct build_node {
+		aabb box;
+		int first, count, axis;
+		build_node* child[2];
+	};
+
+	build_node* make_leaf(const aabb& box, int begin, int end){
+		build_node* n = new build_node;
+		n->box = box;
+		n->first = begin;
+		n->count = end - begin;
+		n->axis = 0;
+		n->child[0] = n->child[1] = NULL;
+		return n;
+	}
+
+	build_node* build_range(std::vector<int>& order, int begin, int end, int depth){
+		aabb box, centroid_box;
+		for(int k = begin; k < end; k++){
+			box.grow(boxes[order[k]]);
+			centroid_box.grow(centroids[order[k]]);
+		}
+		int count = end - begin;
+		if(count <= 1 || depth >= BVH_MAX_DEPTH - 1)
+			return make_leaf(box, begin, end);
+
+		//Evaluate the SAH at every bin boundary of every axis
+		float best_cost = FLT_MAX;
+		int best_axis = -1, best_split = 0;
+		vec3 cmin = centroid_box.min();
+		vec3 extent = centroid_box.max() - cmin;
+		for(int axis = 0; axis < 3; axis++){
+			if(extent[axis] <= 0)
+				continue;
+			aabb bin_box[BINS];
+			int bin_count[BINS] = {0};
+			float scale = BINS / extent[axis];
+			for(int k = begin; k < end; k++){
+				int b = bin_of(centroids[order[k]][axis], cmin[axis], scale);
+				bin_count[b]++;
+				bin_box[b].grow(boxes[order[k]]);
+			}
+			//Sweep from the right to get the area/count of every right hand side
+			float right_area[BINS];
+			int right_count[BINS];
+			aabb acc;
+			int n = 0;
+			for(int b = BINS-1; b > 0; b--){
+				acc.grow(bin_box[b]);
+				n += bin_count[b];
+				right_area[b] = acc.area();
+				right_count[b] = n;
+			}
+			acc = aabb();
+			n = 0;
+			for(int b = 0; b < BINS-1; b++){
+				acc.grow(bin_box[b]);
+				n += bin_count[b];
+				if(n == 0 || right_count[b+1] == 0)
+					continue;
+				float cost = acc.area()*n + right_area[b+1]*right_count[b+1];
+				if(cost < best_cost){
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+
+		//Compare against leaving all primitives in one leaf (cost = count, traversal cost = 1)
+		float parent_area = box.area();
+		float split_cost = 1.0f + (parent_area > 0 ? best_cost / parent_area : FLT_MAX);
+		if(best_axis < 0 || split_cost >= float(count)){
+			if(count <= max_leaf_size)
+				return make_leaf(box, begin, end);
+		}
+
+		int mid;
+		int axis;
+		if(best_axis >= 0){
+			axis = best_axis;
+			float scale = BINS / extent[axis];
+			float lo = cmin[axis];
+			const std::vector<vec3>& c = centroids;
+			int split = best_split;
+			int* m = std::partition(&order[0] + begin, &order[0] + end, [&](int p){ return bin_of(c[p][axis], lo, scale) <= split; });
+			mid = int(m - &order[0]);
+		}
+		else{
+			//All centroids coincide, any split is as good as another
+			axis = box.longest_axis();
+			mid = (begin + end) / 2;
+		}
+
+		build_node* n = new build_node;
+		n->box = box;
+		n->first = 0;
+		n->count = 0;
+		n->axis = axis;
+		if(depth < parallel_depth && count > 4096){
+			std::future<build_node*> left = std::async(std::launch::async, [&]{ return build_range(order, begin, mid, depth+1); });
+			n->child[1] = build_range(order, mid, end, depth+1);
+			n->child[0] = left.get();
+		}
+		else{
+			n->child[0] = build_range(order, begin, mid, depth+1);
+			n->child[1] = build_range(order, mid, end, depth+1);
+		}
+		return n;
+	}
+
+	static inline int bin_of(float c, float lo, float scale){
+		int b = int((c - lo) * scale);
+		return b < 0 ? 0 : (b >= BINS ? BINS-1 : b);
+	}
+
+	//Depth first, first child stored directly after its parent
+	void flatten(const build_node* n, std::vector<bvh_node_data>& nodes){
+		int index = int(nodes.size());
+		nodes.push_back(bvh_node_data());
+		nodes[index].box = n->box;
+		nodes[index].axis = n->axis;
+		if(n->child[0] == NULL){
+			nodes[index].offset = n->first;
+			nodes[index].count = n->count;
+			return;
+		}
+		flatten(n->child[0], nodes);
+		nodes[index].offset = int(nodes.size());
+		nodes[index].count = 0;
+		flatten(n->child[1], nodes);
+	}
+
+	void destroy(build_node* n){
+		if(n->child[0]){
+			destroy(n->child[0]);
+			destroy(n->child[1]);
+		}
+		delete n;
+	}
+
+	const std::vector<aabb>& boxes;
+	std::vector<vec3> centroids;
+	int max_leaf_size;
+	int parallel_depth;
+};
+
+
+//Walks a flattened bvh front to back, calling leaf(first, count, tmax) for every leaf
+//the ray reaches. leaf returns true if it found a closer hit and lowered tmax.
+//With AnyHit the walk stops at the first leaf that returns true (occlusion queries)
+template <bool AnyHit = false, typename LeafFn>
+inline bool bvh_traverse(const bvh_node_data* nodes, const ray& r, real tmin, real& tmax, LeafFn& leaf){
+
+	vec3 d = r.direction();
+	vec3 inv_dir(1.0f/d.x(), 1.0f/d.y(), 1.0f/d.z());
+	int dir_neg[3] = {d.x() < 0, d.y() < 0, d.z() < 0};
+
+	int stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	int index = 0;
+	bool hit_anything = false;
+	RT_STAT(int visits = 0);
+	for(;;){
+		const bvh_node_data& n = nodes[index];
+		RT_STAT(visits++);
+		real t0 = tmin, t1 = tmax;
+		if(n.box.hit(r, inv_dir, t0, t1)){
+			if(n.count > 0){
+				if(leaf(n.offset, n.count, tmax)){
+					hit_anything = true;
+					if(AnyHit)
+						break;
+				}
+			}
+			else if(dir_neg[n.axis]){
+				//Second child lies on the near side
+				stack[sp++] = index + 1;
+				index = n.offset;
+				continue;
+			}
+			else{
+				stack[sp++] = n.offset;
+				index = index + 1;
+				continue;
+			}
+		}
+		if(sp == 0)
+			break;
+		index = stack[--sp];
+	}
+	RT_STAT(render_stats::local().node_visits += visits);
+	return hit_anything;
+}
+
+
+//BVH over arbitrary hitables, can be used anywhere a hitable world is used
+class bvh: public hitable {
+
+  public:
+    bvh() {}
+    bvh(hitable **l, int n, int max_leaf_size = 4) { build(l, n, max_leaf_size); }
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    std::vector<hitable*> prims; //primitives in leaf order
+    std::vector<bvh_node_data> nodes;
+    std::vector<hitable*> unbounded; //objects without a box, tested by every ray
+
+  private:
+    void build(hitable **l, int n, int max_leaf_size);
+
+};
+
+
+void bvh::build(hitable **l, int n, int max_leaf_size){
+
+  std::vector<aabb> boxes;
+  std::vector<hitable*> bounded;
+  for (int i = 0; i < n; i++) {
+    aabb box;
+    if (l[i]->bounding_box(box)) {
+      boxes.push_back(box);
+      bounded.push_back(l[i]);
+    }
+    else
+      unbounded.push_back(l[i]);
+  }
+
+  std::vector<int> order;
+  bvh_builder(boxes, max_leaf_size).build(nodes, order);
+
+  prims.resize(bounded.size());
+  for (size_t i = 0; i < bounded.size(); i++)
+    prims[i] = bounded[order[i]];
+
+}
+
+
+bool bvh::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
+
+  bool hit_anything = false;
+  for (size_t i = 0; i < unbounded.size(); i++)
+    if (unbounded[i]->nearest(r, tmin, tmax, id))
+      hit_anything = true;
+  if(nodes.empty())
+    return hit_anything;
+
+  hitable* const* p = &prims[0];
+  RT_STAT(int tests = 0, successes = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    bool hit_leaf = false;
+    RT_STAT(tests += count);
+    for (int i = first; i < first + count; i++) {
+      if(p[i]->nearest(r, tmin, closest_so_far, id)){
+        RT_STAT(successes++);
+        hit_leaf = true;
+      }
+    }
+    return hit_leaf;
+  };
+
+  if (bvh_traverse(&nodes[0], r, tmin, tmax, leaf))
+    hit_anything = true;
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += successes;)
+  return hit_anything;
+
+}
+
+
+//Stops at the first primitive in the way, whichever leaf it is in
+bool bvh::occluded(const ray& r, real tmin, real tmax) const {
+
+  for (size_t i = 0; i < unbounded.size(); i++)
+    if (unbounded[i]->occluded(r, tmin, tmax))
+      return true;
+  if(nodes.empty())
+    return false;
+
+  hitable* const* p = &prims[0];
+  RT_STAT(int tests = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    for (int i = first; i < first + count; i++) {
+      RT_STAT(tests++);
+      if(p[i]->occluded(r, tmin, closest_so_far))
+        return true;
+    }
+    return false;
+  };
+
+  bool blocked = bvh_traverse<true>(&nodes[0], r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += blocked;)
+  return blocked;
+
+}
+
+
+bool bvh::bounding_box(aabb& box) const {
+
+  if(nodes.empty() || !unbounded.empty())
+    return false;
+  box = nodes[0].box;
+  return true;
+
+}
@@ -1,4 +1,6 @@
 #include "ray.h"
+#include "sampler.h"
+#include "sampling.h"
 #pragma once
 
 //Chapter 6 - We'll abstract out a camera class to encapsulate the simple axis-aligned camera from main.
@@ -128,22 +130,23 @@
    * loookfrom rather than from a point.
    */
 
-vec3 random_in_unit_disk(){
-	vec3 p;
-	do {
-		p = 2.0 * vec3(drand48(), drand48(), 0) - vec3(1,1,0);
-	}while(dot(p,p) >= 1.0);
-	return p;	
+//The point on the lens comes from the concentric disk map (sampling.h), which needs exactly two
+//numbers where a rejection loop would take an unknown count
+vec3 random_in_unit_disk(sampler& rng){
+	float u1 = rng.next_1d(), u2 = rng.next_1d(), x, y;
+	concentric_disk(u1, u2, x, y);
+	return vec3(x, y, 0);
 }
 
 class camera{
 
   public:
-	camera(vec3 lookfrom, vec3 lookat, vec3 vup, float vfov, float aspect, float aperture, float focus_dist) { // vfov is top to bottom in degrees
+	camera() {}
+	camera(vec3 lookfrom, vec3 lookat, vec3 vup, real vfov, real aspect, real aperture, real focus_dist) { // vfov is top to bottom in degrees
 			lens_radius = aperture / 2;
-            float theta = vfov*M_PI/180;
-            float half_height = tan(theta/2);
-            float half_width = aspect * half_height;
+            real theta = vfov*real(M_PI)/180;
+            real half_height = std::tan(theta/2);
+            real half_width = aspect * half_height;
             origin = lookfrom;
             w = unit_vector(lookfrom - lookat);
             u = unit_vector(cross(vup, w));
@@ -154,17 +157,50 @@ class camera{
         }
     
 
-        ray get_ray(float s, float t) {
-			vec3 rd = lens_radius*random_in_unit_disk();
-			vec3 offset = u *rd.x() * v * rd.y();
-            return ray(origin, lower_left_corner + s*horizontal + t*vertical - origin - offset); 
+        ray get_ray(float s, float t, sampler& rng) const {
+			vec3 rd = random_in_unit_disk(rng);
+			return lens_ray(s, t, rd.x(), rd.y());
         }
 
+		//The rays of a packet at once: (s[k], t[k]) on the film and (lens_u[k], lens_v[k]), the
+		//numbers get_ray draws for the lens, warped onto it together (concentric_disk_batch)
+		void get_rays(const float* s, const float* t, const float* lens_u, const float* lens_v, int count, ray* rays) const {
+			const int batch = 64;
+			float x[batch], y[batch];
+			for (int k0 = 0; k0 < count; k0 += batch) {
+				int n = count - k0 < batch ? count - k0 : batch;
+				concentric_disk_batch(lens_u + k0, lens_v + k0, x, y, n);
+				for (int k = 0; k < n; k++)
+					rays[k0+k] = lens_ray(s[k0+k], t[k0+k], x[k], y[k]);
+			}
+		}
+
+		//From the point (x, y) of the unit disk scaled to the lens, through the focus plane at (s, t)
+		inline ray lens_ray(float s, float t, float x, float y) const {
+			vec3 offset = u*(lens_radius*x) + v*(lens_radius*y);
+			return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset);
+		}
+
     vec3 origin;
-    float lens_radius;
+    real lens_radius;
     vec3 lower_left_corner;
     vec3 horizontal;
     vec3 vertical;
     vec3 u,v,w;
 };
 
+
+//Everything the camera constructor takes except the aspect ratio, which comes from the
+//image size - lets a scene carry its camera (see scene_file.h)
+struct camera_params {
+	vec3 lookfrom;
+	vec3 lookat;
+	vec3 vup;
+	real vfov;       //degrees, top to bottom
+	real aperture;
+	real focus_dist;
+
+	camera make(real aspect) const {
+		return camera(lookfrom, lookat, vup, vfov, aspect, aperture, focus_dist);
+	}
+};
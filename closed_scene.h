@@ -0,0 +1,333 @@
+#include "hitable.h"
+#include "sphere.h"
+#include "material.h"
+#include "bvh.h"
+#include "sampler.h"
+#include "integrator.h"
+#include <vector>
+#include <unordered_map>
+#include <float.h>
+#pragma once
+
+//Closed scene
+
+/*
+ * A hitable world can hold any hitable and any material, at the price of a virtual call
+ * for every object tested and every bounce. Scenes built today only use a handful of types,
+ * so closed_scene fixes the set: every primitive and material is stored by value in an
+ * array for its type and referred to by a (type tag, index) pair.
+ *
+ *   prims:       [{SPHERE,0} {SPHERE,1} ...]        spheres:     [s0 s1 ...]
+ *   prim_mat:    [{LAMB,0} {METAL,0} {LAMB,1} ...]  lambertians: [l0 l1 ...]
+ *                                                   metals:      [m0 ...]
+ *                                                   dielectrics: [d0 ...]
+ *
+ * Dispatch is a switch on the tag. Primitives are plain structs with inline tests that
+ * only find the distance, the hit_record is filled in once for the nearest hit. Materials
+ * are called qualified (lambertians[i].lambertian::scatter(...)) so no vtable is involved.
+ * Together with color_static() (integrator.h) the whole bounce - traversal, sphere test,
+ * scatter - is one loop without an indirect call. Materials outside the set still work
+ * through their virtual scatter (MATERIAL_OTHER), new primitive types need a tag, a struct
+ * and a case here.
+ *
+ * A bvh over the primitives is built as part of the scene. closed_scene is a hitable too,
+ * so it can also be used with the other integrators.
+ */
+
+enum primitive_type { PRIMITIVE_SPHERE, PRIMITIVE_TYPES };
+
+//Reference to an object in one of the per type arrays
+struct closed_ref {
+	int type;
+	int index;
+};
+
+//Sphere without the vtable and material pointer, same quadratic as sphere::hit
+struct closed_sphere {
+	vec3 center;
+	real radius;
+
+	//Lowers tmax to the nearest root within (tmin,tmax), if there is one
+	inline bool hit(const ray& r, real tmin, real& tmax) const {
+		vec3 oc = r.origin() - center;
+		real a = dot(r.direction(), r.direction());
+		real half_b = dot(oc, r.direction());
+		real c = dot(oc, oc) - radius*radius;
+		real discriminant = half_b*half_b - a*c;
+		if(discriminant > 0){
+			real root = std::sqrt(discriminant);
+			real temp = (-half_b - root)/a;
+			if(temp < tmax && temp > tmin){
+				tmax = temp;
+				return true;
+			}
+			temp = (-half_b + root)/a;
+			if(temp < tmax && temp > tmin){
+				tmax = temp;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//Whether either root is within (tmin,tmax), as sphere::occluded
+	inline bool occluded(const ray& r, real tmin, real tmax) const {
+		vec3 oc = r.origin() - center;
+		real a = dot(r.direction(), r.direction());
+		real half_b = dot(oc, r.direction());
+		real c = dot(oc, oc) - radius*radius;
+		real discriminant = half_b*half_b - a*c;
+		if(discriminant <= 0)
+			return false;
+		real root = std::sqrt(discriminant);
+		real lo = a*tmin, hi = a*tmax;
+		real near_root = -half_b - root, far_root = -half_b + root;
+		return (near_root > lo && near_root < hi) || (far_root > lo && far_root < hi);
+	}
+
+	inline void fill_record(const ray& r, real t, hit_record& rec) const {
+		rec.t = t;
+		rec.p = r.point_at_parameter(t);
+		rec.normal = (rec.p - center) / radius;
+	}
+};
+
+class closed_scene: public hitable {
+
+  public:
+    typedef closed_ref material_ref;
+
+    closed_scene() {}
+
+    //Copies the objects of a list and builds a bvh over them, returns false (building nothing)
+    //if the list holds a hitable that isn't one of the known primitives
+    bool build(hitable **l, int n, int max_leaf_size = 4);
+
+    inline bool intersect(const ray& r, real tmin, real tmax, hit_record& rec, closed_ref& m) const;
+    inline bool scatter(closed_ref m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const;
+
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    std::vector<closed_ref> prims;    //primitives in leaf order
+    std::vector<closed_ref> prim_mat; //material of each primitive
+    std::vector<material*> prim_mat_ptr; //the original material, for hit_record::mat_ptr
+    std::vector<closed_sphere> spheres;
+    std::vector<lambertian> lambertians;
+    std::vector<metal> metals;
+    std::vector<dielectric> dielectrics;
+    std::vector<const material*> others;
+    std::vector<bvh_node_data> nodes;
+
+  private:
+    //Index into prims of the nearest primitive hit within (tmin,tmax), which lowers tmax, -1 for none
+    inline int nearest_prim(const ray& r, real tmin, real& tmax) const;
+    inline void fill_prim(const ray& r, real t, int i, hit_record& rec) const;
+
+    closed_ref add_material(const material* m);
+    std::unordered_map<const material*, closed_ref> material_refs;
+
+};
+
+
+closed_ref closed_scene::add_material(const material* m){
+
+  std::unordered_map<const material*, closed_ref>::iterator found = material_refs.find(m);
+  if (found != material_refs.end())
+    return found->second;
+
+  closed_ref ref;
+  ref.type = m->type();
+  switch (ref.type) {
+    case MATERIAL_LAMBERTIAN:
+      ref.index = int(lambertians.size());
+      lambertians.push_back(*static_cast<const lambertian*>(m));
+      break;
+    case MATERIAL_METAL:
+      ref.index = int(metals.size());
+      metals.push_back(*static_cast<const metal*>(m));
+      break;
+    case MATERIAL_DIELECTRIC:
+      ref.index = int(dielectrics.size());
+      dielectrics.push_back(*static_cast<const dielectric*>(m));
+      break;
+    default:
+      ref.type = MATERIAL_OTHER;
+      ref.index = int(others.size());
+      others.push_back(m);
+  }
+  material_refs[m] = ref;
+  return ref;
+
+}
+
+
+bool closed_scene::build(hitable **l, int n, int max_leaf_size){
+
+  for (int i = 0; i < n; i++)
+    if (!dynamic_cast<sphere*>(l[i]))
+      return false;
+
+  std::vector<aabb> boxes(n);
+  for (int i = 0; i < n; i++)
+    l[i]->bounding_box(boxes[i]);
+  std::vector<int> order;
+  bvh_builder(boxes, max_leaf_size).build(nodes, order);
+
+  //Primitives are stored in leaf order so a leaf is a run of the arrays
+  for (int i = 0; i < n; i++) {
+    const sphere* s = static_cast<const sphere*>(l[order[i]]);
+    closed_ref ref = {PRIMITIVE_SPHERE, int(spheres.size())};
+    closed_sphere cs = {s->center, s->radius};
+    spheres.push_back(cs);
+    prims.push_back(ref);
+    prim_mat.push_back(add_material(s->mat_ptr));
+    prim_mat_ptr.push_back(s->mat_ptr);
+  }
+  material_refs.clear();
+  return true;
+
+}
+
+
+inline int closed_scene::nearest_prim(const ray& r, real tmin, real& tmax) const {
+
+  if (nodes.empty())
+    return -1;
+
+  const closed_ref* p = &prims[0];
+  int closest = -1;
+  RT_STAT(int tests = 0, successes = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    bool hit_leaf = false;
+    RT_STAT(tests += count);
+    for (int i = first; i < first + count; i++) {
+      bool hit_prim = false;
+      switch (p[i].type) {
+        case PRIMITIVE_SPHERE:
+          hit_prim = spheres[p[i].index].hit(r, tmin, closest_so_far);
+          break;
+      }
+      if (hit_prim) {
+        RT_STAT(successes++);
+        hit_leaf = true;
+        closest = i;
+      }
+    }
+    return hit_leaf;
+  };
+
+  bool hit_anything = bvh_traverse(&nodes[0], r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += successes;)
+  return hit_anything ? closest : -1;
+
+}
+
+
+inline void closed_scene::fill_prim(const ray& r, real t, int i, hit_record& rec) const {
+
+  switch (prims[i].type) {
+    case PRIMITIVE_SPHERE:
+      spheres[prims[i].index].fill_record(r, t, rec);
+      break;
+  }
+  rec.mat_ptr = prim_mat_ptr[i];
+
+}
+
+
+inline bool closed_scene::intersect(const ray& r, real tmin, real tmax, hit_record& rec, closed_ref& m) const {
+
+  int i = nearest_prim(r, tmin, tmax);
+  if (i < 0)
+    return false;
+  fill_prim(r, tmax, i, rec);
+  m = prim_mat[i];
+  return true;
+
+}
+
+
+inline bool closed_scene::scatter(closed_ref m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const {
+
+  switch (m.type) {
+    case MATERIAL_LAMBERTIAN:
+      return lambertians[m.index].lambertian::scatter(r_in, rec, attenuation, scattered, rng);
+    case MATERIAL_METAL:
+      return metals[m.index].metal::scatter(r_in, rec, attenuation, scattered, rng);
+    case MATERIAL_DIELECTRIC:
+      return dielectrics[m.index].dielectric::scatter(r_in, rec, attenuation, scattered, rng);
+    default:
+      return others[m.index]->scatter(r_in, rec, attenuation, scattered, rng);
+  }
+
+}
+
+
+bool closed_scene::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
+
+  int i = nearest_prim(r, tmin, tmax);
+  if (i < 0)
+    return false;
+  id.prim = this;
+  id.index = i;
+  id.depth = 0;
+  return true;
+
+}
+
+
+void closed_scene::fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const {
+
+  fill_prim(r, t, id.index, rec);
+
+}
+
+
+bool closed_scene::occluded(const ray& r, real tmin, real tmax) const {
+
+  if (nodes.empty())
+    return false;
+
+  const closed_ref* p = &prims[0];
+  RT_STAT(int tests = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    for (int i = first; i < first + count; i++) {
+      RT_STAT(tests++);
+      switch (p[i].type) {
+        case PRIMITIVE_SPHERE:
+          if (spheres[p[i].index].occluded(r, tmin, closest_so_far))
+            return true;
+          break;
+      }
+    }
+    return false;
+  };
+
+  bool blocked = bvh_traverse<true>(&nodes[0], r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += blocked;)
+  return blocked;
+
+}
+
+
+bool closed_scene::bounding_box(aabb& box) const {
+
+  if (nodes.empty())
+    return false;
+  box = nodes[0].box;
+  return true;
+
+}
+
+
+//Radiance function for the renderer (see integrator_fns), world must be a closed_scene
+vec3 color_closed(const ray& r, hitable *world, int depth, sampler& rng){
+  return color_static(*static_cast<const closed_scene*>(world), r, rng);
+}
@@ -0,0 +1,579 @@
+#include "renderer.h"
+#include "image_io.h"
+#include "thread_pool.h"
+#include "sphere_pack.h"
+#include <vector>
+#include <algorithm>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#pragma once
+
+//Denoiser
+
+/*
+ * A frame of a few samples per pixel is mostly right and mostly noise: every pixel is the
+ * average of a handful of random paths. Neighbouring pixels that see the same surface should
+ * have about the same colour, so averaging them removes the noise - as long as the average
+ * stops at the edges of objects and doesn't blur them away. Where the edges are comes from
+ * auxiliary buffers (AOVs) of what the camera rays hit first, which are nearly noise free:
+ *
+ *   albedo  - the colour of the surface (material::surface_albedo), black for the sky
+ *   normal  - hit_record::normal, averaged over the pixel (shorter where a pixel covers an edge)
+ *   depth   - distance to the hit along the ray, 0 for the sky
+ *
+ * A mirror or glass surface (material::specular) has no texture of its own to keep, what it
+ * shows is the scene it reflects, so the camera rays follow it (up to AOV_SPECULAR_BOUNCES
+ * times) and the buffers hold what they meet there, the albedo tinted by the mirror's colour.
+ *
+ * render_aovs() traces the camera rays of the first AOV_SAMPLES samples of every pixel again
+ * after the frame is done, the same rays the render started its paths with, so the buffers
+ * line up with the image for every integrator, a checkpointed or a distributed render.
+ *
+ * Edge avoiding a-trous wavelet filter (Dammertz et al. 2010, with the variance guided colour
+ * weight of SVGF, Schied et al. 2017)
+ *
+ * A 5x5 blur applied 5 times, spreading its taps further apart every time (holes, "trous"),
+ * reaches over 125x125 pixels for 5*25 taps per pixel:
+ *
+ *   pass 0   x x x x x      pass 1  x . x . x . x . x      ...  step 2^pass
+ *
+ * Every tap q of pixel p is weighted by the B3 spline h = (1/16, 1/4, 3/8, 1/4, 1/16) times
+ *
+ *   w_normal = exp(-32 (1 - n_p . n_q))                  a surface facing another way
+ *   w_depth  = exp(-|z_p - z_q| / (slope_p * |p - q|))   further away than p's surface slopes
+ *   w_albedo = exp(-|a_p - a_q|^2 / 0.1^2)               a different material
+ *   w_colour = exp(-|l_p - l_q| / (2 * sigma_p))         a luminance difference larger than the noise
+ *
+ * all four in a single exp of the sum of the exponents. sigma_p is the standard deviation of
+ * p's noise: estimated from its 7x7 neighbourhood (weighted by the first three weights) before
+ * the first pass and carried through the passes the way filtering changes it (sum of w^2 var /
+ * (sum of w)^2), so the colour weight lets less through as the image gets smoother. The sky has
+ * no normal and is left as it is.
+ *
+ * The filter works on planes of floats (one per channel, structure of arrays) and every tap is a
+ * loop along a row with no branches, run by SSE4.1 or AVX2 kernels picked at runtime like
+ * sphere_pack's (RT_SIMD=scalar|sse|avx2 forces one); exp is a short polynomial. Rows are split
+ * between the threads of a thread_pool, every pass waits for the last.
+ */
+
+const int AOV_SAMPLES = 16;          //camera rays per pixel for the auxiliary buffers
+const int AOV_SPECULAR_BOUNCES = 4;  //mirrors and glass the buffers look through
+const int DENOISE_PASSES = 5;        //steps 1, 2, 4, 8, 16
+const float DENOISE_NORMAL = 32.0f;  //how sharply the weights fall off with the angle between normals
+const float DENOISE_ALBEDO = 100.0f; //and with the albedo difference, 1/0.1^2
+const float DENOISE_COLOUR = 2.0f;   //luminance differences up to about this many standard deviations are noise
+
+//Per pixel averages of the first hits, in framebuffer order (top row first)
+struct aov_buffers {
+	aov_buffers() : width(0), height(0) {}
+
+	int width;
+	int height;
+	std::vector<vec3> albedo;
+	std::vector<vec3> normal;
+	std::vector<float> depth;
+};
+
+//Renders the auxiliary buffers from the camera rays of samples [0, min(AOV_SAMPLES, ns))
+void render_aovs(aov_buffers& aov, const camera& cam, hitable *world, const render_options& opt){
+	aov.width = opt.nx;
+	aov.height = opt.ny;
+	size_t n = size_t(opt.nx)*size_t(opt.ny);
+	aov.albedo.assign(n, vec3(0,0,0));
+	aov.normal.assign(n, vec3(0,0,0));
+	aov.depth.assign(n, 0.0f);
+	int samples = std::min(AOV_SAMPLES, opt.ns);
+
+	auto render = [&aov, &cam, world, &opt, samples](const tile& t){
+		for (int j = t.y0; j < t.y1; j++) {
+			for (int i = t.x0; i < t.x1; i++) {
+				sampler rng(i, j, opt.frame, opt.seed, opt.sampling);
+				vec3 albedo(0,0,0), normal(0,0,0);
+				float depth = 0;
+				int hits = 0;
+				for (int s = 0; s < samples; s++) {
+					rng.start_sample(s);
+					float u = float(i + rng.next_1d()) / float(opt.nx);
+					float v = float(j + rng.next_1d()) / float(opt.ny);
+					ray r = cam.get_ray(u, v, rng);
+					hit_record rec;
+					vec3 throughput(1,1,1);
+					float distance = 0;
+					for (int bounce = 0; bounce <= AOV_SPECULAR_BOUNCES && world->hit(r, 0.001, FLT_MAX, rec); bounce++) {
+						distance += rec.t * r.direction().length();
+						vec3 attenuation;
+						ray scattered;
+						rng.start_bounce(bounce);
+						if (bounce < AOV_SPECULAR_BOUNCES && rec.mat_ptr->specular() && rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng)) {
+							throughput *= attenuation;
+							r = scattered;
+							continue;
+						}
+						albedo += throughput * rec.mat_ptr->surface_albedo(rec);
+						normal += rec.normal;
+						depth += distance;
+						hits++;
+						break;
+					}
+				}
+				size_t k = size_t(aov.height-1-j)*aov.width + i;
+				aov.albedo[k] = albedo / float(samples);
+				aov.normal[k] = normal / float(samples);
+				aov.depth[k] = hits ? depth / float(hits) : 0.0f;
+			}
+		}
+	};
+
+	std::vector<tile> tiles = make_tiles(opt.nx, opt.ny, opt.tile_size);
+	if(opt.threads == 1){
+		for(size_t k = 0; k < tiles.size(); k++)
+			render(tiles[k]);
+		return;
+	}
+	thread_pool pool(opt.threads);
+	for(size_t k = 0; k < tiles.size(); k++){
+		const tile t = tiles[k];
+		pool.submit([t, &render]{ render(t); });
+	}
+	pool.wait();
+}
+
+//Writes the buffers as prefix-albedo.pfm, prefix-normal.pfm and prefix-depth.pfm (depth in all three channels)
+bool write_aovs(const std::string& prefix, const aov_buffers& aov){
+	framebuffer fb(aov.width, aov.height);
+	fb.pixels = aov.albedo;
+	if(!write_file(prefix + "-albedo.pfm", encode_pfm(fb)))
+		return false;
+	fb.pixels = aov.normal;
+	if(!write_file(prefix + "-normal.pfm", encode_pfm(fb)))
+		return false;
+	for(size_t k = 0; k < fb.pixels.size(); k++)
+		fb.pixels[k] = vec3(aov.depth[k], aov.depth[k], aov.depth[k]);
+	return write_file(prefix + "-depth.pfm", encode_pfm(fb));
+}
+
+//One tap offset of the filter for a run of pixels of a row: pixel p = x, its tap q = x + offset
+struct denoise_taps {
+	const float* np[3];  //normals of p
+	const float* nq[3];  //and of q
+	const float* ap[3];  //albedo
+	const float* aq[3];
+	const float* cp[3];  //colour
+	const float* cq[3];
+	const float* zp;     //depth
+	const float* zq;
+	const float* slope;  //of p
+	const float* vq;     //variance of q
+	const float* sigma;  //1 / (DENOISE_COLOUR * standard deviation) of p's noise, 0 leaves the colour out
+	float h;             //B3 spline weight of the offset
+	float inv_distance;  //1 / |p - q| in pixels
+	float* sum[5];       //of w*r, w*g, w*b, w and w*w*var, per pixel of the row
+};
+
+//Adds the taps of pixels [x0,x1) of the row to t.sum
+typedef void (*denoise_kernel)(const denoise_taps& t, int x0, int x1);
+
+//e^x for -20 <= x <= 0 to about 1e-4 relative (e^-20 below that)
+inline float exp_negative(float x){
+	x = x > -20.0f ? x : -20.0f;
+	float t = x * 1.44269504f; //log2(e)
+	float i = floorf(t);
+	float f = t - i;
+	float p = 1.0f + f*(0.69606564f + f*(0.22449434f + f*0.07944024f)); //2^f on [0,1)
+	int32_t bits = (int32_t(i) + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+//Plain C++ version, also the reference for the SIMD kernels
+void denoise_kernel_scalar(const denoise_taps& t, int x0, int x1){
+	for (int x = x0; x < x1; x++) {
+		float d = t.np[0][x]*t.nq[0][x] + t.np[1][x]*t.nq[1][x] + t.np[2][x]*t.nq[2][x];
+		float ar = t.ap[0][x] - t.aq[0][x], ag = t.ap[1][x] - t.aq[1][x], ab = t.ap[2][x] - t.aq[2][x];
+		float lp = 0.2126f*t.cp[0][x] + 0.7152f*t.cp[1][x] + 0.0722f*t.cp[2][x];
+		float lq = 0.2126f*t.cq[0][x] + 0.7152f*t.cq[1][x] + 0.0722f*t.cq[2][x];
+		float e = DENOISE_NORMAL*(1.0f - d)
+		        + fabsf(t.zp[x] - t.zq[x]) * t.inv_distance / t.slope[x]
+		        + (ar*ar + ag*ag + ab*ab) * DENOISE_ALBEDO
+		        + fabsf(lp - lq) * t.sigma[x];
+		float w = t.h * exp_negative(-e);
+		t.sum[0][x] += w*t.cq[0][x];
+		t.sum[1][x] += w*t.cq[1][x];
+		t.sum[2][x] += w*t.cq[2][x];
+		t.sum[3][x] += w;
+		t.sum[4][x] += w*w*t.vq[x];
+	}
+}
+
+#ifdef RT_X86_SIMD
+
+//The kernels below are denoise_kernel_scalar a vector of pixels at a time, the pixels left over
+//at the end of the row go through the scalar kernel
+
+__attribute__((target("sse4.1")))
+inline __m128 exp_negative_sse(__m128 x){
+	__m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-20.0f)), _mm_set1_ps(1.44269504f));
+	__m128 i = _mm_floor_ps(t);
+	__m128 f = _mm_sub_ps(t, i);
+	__m128 p = _mm_add_ps(_mm_set1_ps(0.22449434f), _mm_mul_ps(f, _mm_set1_ps(0.07944024f)));
+	p = _mm_add_ps(_mm_set1_ps(0.69606564f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+	__m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(i), _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+__attribute__((target("sse4.1")))
+void denoise_kernel_sse(const denoise_taps& t, int x0, int x1){
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 lr = _mm_set1_ps(0.2126f), lg = _mm_set1_ps(0.7152f), lb = _mm_set1_ps(0.0722f);
+	const __m128 one = _mm_set1_ps(1.0f), normal = _mm_set1_ps(DENOISE_NORMAL), albedo = _mm_set1_ps(DENOISE_ALBEDO);
+	const __m128 h = _mm_set1_ps(t.h), inv_distance = _mm_set1_ps(t.inv_distance);
+	int x = x0;
+	for (; x + 4 <= x1; x += 4) {
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t.np[0]+x), _mm_loadu_ps(t.nq[0]+x)),
+		                                 _mm_mul_ps(_mm_loadu_ps(t.np[1]+x), _mm_loadu_ps(t.nq[1]+x))),
+		                      _mm_mul_ps(_mm_loadu_ps(t.np[2]+x), _mm_loadu_ps(t.nq[2]+x)));
+		__m128 ar = _mm_sub_ps(_mm_loadu_ps(t.ap[0]+x), _mm_loadu_ps(t.aq[0]+x));
+		__m128 ag = _mm_sub_ps(_mm_loadu_ps(t.ap[1]+x), _mm_loadu_ps(t.aq[1]+x));
+		__m128 ab = _mm_sub_ps(_mm_loadu_ps(t.ap[2]+x), _mm_loadu_ps(t.aq[2]+x));
+		__m128 qr = _mm_loadu_ps(t.cq[0]+x), qg = _mm_loadu_ps(t.cq[1]+x), qb = _mm_loadu_ps(t.cq[2]+x);
+		__m128 lp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lr, _mm_loadu_ps(t.cp[0]+x)), _mm_mul_ps(lg, _mm_loadu_ps(t.cp[1]+x))), _mm_mul_ps(lb, _mm_loadu_ps(t.cp[2]+x)));
+		__m128 lq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lr, qr), _mm_mul_ps(lg, qg)), _mm_mul_ps(lb, qb));
+		__m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(t.zp+x), _mm_loadu_ps(t.zq+x)));
+		__m128 dl = _mm_andnot_ps(sign, _mm_sub_ps(lp, lq));
+		__m128 e = _mm_mul_ps(normal, _mm_sub_ps(one, d));
+		e = _mm_add_ps(e, _mm_div_ps(_mm_mul_ps(dz, inv_distance), _mm_loadu_ps(t.slope+x)));
+		e = _mm_add_ps(e, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ar, ar), _mm_mul_ps(ag, ag)), _mm_mul_ps(ab, ab)), albedo));
+		e = _mm_add_ps(e, _mm_mul_ps(dl, _mm_loadu_ps(t.sigma+x)));
+		__m128 w = _mm_mul_ps(h, exp_negative_sse(_mm_sub_ps(_mm_setzero_ps(), e)));
+		_mm_storeu_ps(t.sum[0]+x, _mm_add_ps(_mm_loadu_ps(t.sum[0]+x), _mm_mul_ps(w, qr)));
+		_mm_storeu_ps(t.sum[1]+x, _mm_add_ps(_mm_loadu_ps(t.sum[1]+x), _mm_mul_ps(w, qg)));
+		_mm_storeu_ps(t.sum[2]+x, _mm_add_ps(_mm_loadu_ps(t.sum[2]+x), _mm_mul_ps(w, qb)));
+		_mm_storeu_ps(t.sum[3]+x, _mm_add_ps(_mm_loadu_ps(t.sum[3]+x), w));
+		_mm_storeu_ps(t.sum[4]+x, _mm_add_ps(_mm_loadu_ps(t.sum[4]+x), _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(t.vq+x))));
+	}
+	denoise_kernel_scalar(t, x, x1);
+}
+
+__attribute__((target("avx2,fma")))
+inline __m256 exp_negative_avx2(__m256 x){
+	__m256 t = _mm256_mul_ps(_mm256_max_ps(x, _mm256_set1_ps(-20.0f)), _mm256_set1_ps(1.44269504f));
+	__m256 i = _mm256_floor_ps(t);
+	__m256 f = _mm256_sub_ps(t, i);
+	__m256 p = _mm256_fmadd_ps(f, _mm256_set1_ps(0.07944024f), _mm256_set1_ps(0.22449434f));
+	p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(0.69606564f));
+	p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(1.0f));
+	__m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2,fma")))
+void denoise_kernel_avx2(const denoise_taps& t, int x0, int x1){
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 lr = _mm256_set1_ps(0.2126f), lg = _mm256_set1_ps(0.7152f), lb = _mm256_set1_ps(0.0722f);
+	const __m256 one = _mm256_set1_ps(1.0f), normal = _mm256_set1_ps(DENOISE_NORMAL), albedo = _mm256_set1_ps(DENOISE_ALBEDO);
+	const __m256 h = _mm256_set1_ps(t.h), inv_distance = _mm256_set1_ps(t.inv_distance);
+	int x = x0;
+	for (; x + 8 <= x1; x += 8) {
+		__m256 d = _mm256_mul_ps(_mm256_loadu_ps(t.np[0]+x), _mm256_loadu_ps(t.nq[0]+x));
+		d = _mm256_fmadd_ps(_mm256_loadu_ps(t.np[1]+x), _mm256_loadu_ps(t.nq[1]+x), d);
+		d = _mm256_fmadd_ps(_mm256_loadu_ps(t.np[2]+x), _mm256_loadu_ps(t.nq[2]+x), d);
+		__m256 ar = _mm256_sub_ps(_mm256_loadu_ps(t.ap[0]+x), _mm256_loadu_ps(t.aq[0]+x));
+		__m256 ag = _mm256_sub_ps(_mm256_loadu_ps(t.ap[1]+x), _mm256_loadu_ps(t.aq[1]+x));
+		__m256 ab = _mm256_sub_ps(_mm256_loadu_ps(t.ap[2]+x), _mm256_loadu_ps(t.aq[2]+x));
+		__m256 qr = _mm256_loadu_ps(t.cq[0]+x), qg = _mm256_loadu_ps(t.cq[1]+x), qb = _mm256_loadu_ps(t.cq[2]+x);
+		__m256 lp = _mm256_fmadd_ps(lb, _mm256_loadu_ps(t.cp[2]+x), _mm256_fmadd_ps(lg, _mm256_loadu_ps(t.cp[1]+x), _mm256_mul_ps(lr, _mm256_loadu_ps(t.cp[0]+x))));
+		__m256 lq = _mm256_fmadd_ps(lb, qb, _mm256_fmadd_ps(lg, qg, _mm256_mul_ps(lr, qr)));
+		__m256 dz = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(t.zp+x), _mm256_loadu_ps(t.zq+x)));
+		__m256 dl = _mm256_andnot_ps(sign, _mm256_sub_ps(lp, lq));
+		__m256 a2 = _mm256_fmadd_ps(ab, ab, _mm256_fmadd_ps(ag, ag, _mm256_mul_ps(ar, ar)));
+		__m256 e = _mm256_mul_ps(normal, _mm256_sub_ps(one, d));
+		e = _mm256_add_ps(e, _mm256_div_ps(_mm256_mul_ps(dz, inv_distance), _mm256_loadu_ps(t.slope+x)));
+		e = _mm256_fmadd_ps(a2, albedo, e);
+		e = _mm256_fmadd_ps(dl, _mm256_loadu_ps(t.sigma+x), e);
+		__m256 w = _mm256_mul_ps(h, exp_negative_avx2(_mm256_sub_ps(_mm256_setzero_ps(), e)));
+		_mm256_storeu_ps(t.sum[0]+x, _mm256_fmadd_ps(w, qr, _mm256_loadu_ps(t.sum[0]+x)));
+		_mm256_storeu_ps(t.sum[1]+x, _mm256_fmadd_ps(w, qg, _mm256_loadu_ps(t.sum[1]+x)));
+		_mm256_storeu_ps(t.sum[2]+x, _mm256_fmadd_ps(w, qb, _mm256_loadu_ps(t.sum[2]+x)));
+		_mm256_storeu_ps(t.sum[3]+x, _mm256_add_ps(_mm256_loadu_ps(t.sum[3]+x), w));
+		_mm256_storeu_ps(t.sum[4]+x, _mm256_fmadd_ps(_mm256_mul_ps(w, w), _mm256_loadu_ps(t.vq+x), _mm256_loadu_ps(t.sum[4]+x)));
+	}
+	denoise_kernel_scalar(t, x, x1);
+}
+
+#endif
+
+
+//Widest kernel this CPU supports, RT_SIMD in the environment overrides the choice (as for sphere_pack,
+//avx512 gets the avx2 kernel: the rows are short and the filter is bound by memory)
+denoise_kernel default_denoise_kernel(){
+	const char* forced = getenv("RT_SIMD");
+#ifdef RT_X86_SIMD
+	__builtin_cpu_init();
+	bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	bool has_sse = __builtin_cpu_supports("sse4.1");
+	if (forced) {
+		if ((!strcmp(forced, "avx2") || !strcmp(forced, "avx512")) && has_avx2) return denoise_kernel_avx2;
+		if (!strcmp(forced, "sse") && has_sse) return denoise_kernel_sse;
+		if (!strcmp(forced, "scalar")) return denoise_kernel_scalar;
+	}
+	if (has_avx2) return denoise_kernel_avx2;
+	if (has_sse) return denoise_kernel_sse;
+#endif
+	(void)forced;
+	return denoise_kernel_scalar;
+}
+
+const char* denoise_kernel_name(denoise_kernel k){
+#ifdef RT_X86_SIMD
+	if (k == denoise_kernel_avx2) return "avx2";
+	if (k == denoise_kernel_sse) return "sse";
+#endif
+	(void)k;
+	return "scalar";
+}
+
+class atrous_denoiser {
+
+  public:
+	atrous_denoiser(const framebuffer& fb, const aov_buffers& aov);
+
+	//Filters the colours and writes them back into fb
+	void run(framebuffer& fb, int threads);
+
+	denoise_kernel kernel;
+
+  private:
+	typedef std::vector<float> plane;
+
+	void estimate_variance(int y, std::vector<float>* scratch);
+	void filter_row(int y, int step, int src, std::vector<float>* scratch);
+	void add_taps(const denoise_taps& t, int y, int qy, int dx, const plane* c, const plane& v);
+	template <typename Row> void for_rows(thread_pool* pool, Row row);
+
+	int width, height;
+	plane col[2][3];   //ping-pong colour planes
+	plane var[2];      //variance of each pixel's luminance
+	plane normal[3];
+	plane depth;
+	plane slope;       //how fast the depth changes from one pixel to the next
+	plane albedo[3];
+};
+
+
+atrous_denoiser::atrous_denoiser(const framebuffer& fb, const aov_buffers& aov) : kernel(default_denoise_kernel()), width(fb.width), height(fb.height) {
+
+	size_t n = size_t(width)*size_t(height);
+	for (int c = 0; c < 3; c++) {
+		col[0][c].resize(n);
+		col[1][c].resize(n);
+		normal[c].resize(n);
+		albedo[c].resize(n);
+		for (size_t k = 0; k < n; k++) {
+			col[0][c][k] = fb.pixels[k][c];
+			normal[c][k] = aov.normal[k][c];
+			albedo[c][k] = aov.albedo[k][c];
+		}
+	}
+	var[0].resize(n);
+	var[1].resize(n);
+	depth = aov.depth;
+
+	//Smaller of the forward and backward difference, so a silhouette next to p doesn't count
+	slope.resize(n);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) {
+			size_t k = size_t(y)*width + x;
+			float z = depth[k], dx = FLT_MAX, dy = FLT_MAX;
+			if (x > 0) dx = fabsf(z - depth[k-1]);
+			if (x < width-1) dx = std::min(dx, fabsf(z - depth[k+1]));
+			if (y > 0) dy = fabsf(z - depth[k-width]);
+			if (y < height-1) dy = std::min(dy, fabsf(z - depth[k+width]));
+			float s = std::max(dx == FLT_MAX ? 0.0f : dx, dy == FLT_MAX ? 0.0f : dy);
+			slope[k] = s + 1e-3f*z + 1e-6f;
+		}
+
+}
+
+
+//Runs row(y, scratch) for every row, split between the pool's threads
+template <typename Row>
+void atrous_denoiser::for_rows(thread_pool* pool, Row row){
+	const int band = 8;
+	if (!pool) {
+		std::vector<float> scratch[6];
+		for (int y = 0; y < height; y++)
+			row(y, scratch);
+		return;
+	}
+	for (int y0 = 0; y0 < height; y0 += band) {
+		int y1 = std::min(y0 + band, height);
+		pool->submit([y0, y1, &row]{
+			std::vector<float> scratch[6];
+			for (int y = y0; y < y1; y++)
+				row(y, scratch);
+		});
+	}
+	pool->wait();
+}
+
+
+//Runs the kernel over the pixels of row y whose tap, dx pixels along in row qy, is inside the
+//image. Every pointer starts at the first of those pixels, x0, so none points outside its plane
+//when the tap is further out than the image is wide
+void atrous_denoiser::add_taps(const denoise_taps& t, int y, int qy, int dx, const plane* c, const plane& v){
+	int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+	if (x0 >= x1)
+		return;
+	size_t p = size_t(y)*width + x0, q = size_t(qy)*width + x0 + dx;
+	denoise_taps s = t;
+	for (int k = 0; k < 3; k++) {
+		s.np[k] = &normal[k][p];
+		s.nq[k] = &normal[k][q];
+		s.ap[k] = &albedo[k][p];
+		s.aq[k] = &albedo[k][q];
+		s.cp[k] = &c[k][p];
+		s.cq[k] = &c[k][q];
+	}
+	s.zp = &depth[p];
+	s.zq = &depth[q];
+	s.slope = &slope[p];
+	s.vq = &v[q];
+	s.sigma = t.sigma + x0;
+	for (int k = 0; k < 5; k++)
+		s.sum[k] = t.sum[k] + x0;
+	kernel(s, 0, x1 - x0);
+}
+
+
+//Luminance variance of the 7x7 neighbourhood of every pixel of row y, over the pixels of the
+//same surface: the kernel without the colour weight, run on planes of l, l^2 (col[1] for now)
+void atrous_denoiser::estimate_variance(int y, std::vector<float>* scratch){
+
+	const int r = 3;
+	size_t p = size_t(y)*width;
+	for (int k = 0; k < 6; k++)
+		scratch[k].assign(width, 0.0f);
+	denoise_taps t;
+	t.sigma = &scratch[5][0];
+	t.h = 1.0f;
+	for (int k = 0; k < 5; k++)
+		t.sum[k] = &scratch[k][0];
+	for (int dy = -r; dy <= r; dy++) {
+		int qy = y + dy;
+		if (qy < 0 || qy >= height)
+			continue;
+		for (int dx = -r; dx <= r; dx++) {
+			if (dx == 0 && dy == 0)
+				continue;
+			t.inv_distance = 1.0f / float(abs(dx) + abs(dy));
+			add_taps(t, y, qy, dx, col[1], var[1]);
+		}
+	}
+	//The pixel itself counts with weight 1 whatever its normal
+	for (int x = 0; x < width; x++) {
+		float sum_w = t.sum[3][x] + 1.0f;
+		float mean = (t.sum[0][x] + col[1][0][p+x]) / sum_w;
+		float mean2 = (t.sum[1][x] + col[1][1][p+x]) / sum_w;
+		var[0][p+x] = std::max(mean2 - mean*mean, 0.0f);
+	}
+
+}
+
+
+//One pass of the filter over row y, reading buffer src and writing the other one
+void atrous_denoiser::filter_row(int y, int step, int src, std::vector<float>* scratch){
+
+	static const float h[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+	const plane* c = col[src];
+	const plane& v = var[src];
+	size_t p = size_t(y)*width;
+	for (int k = 0; k < 6; k++)
+		scratch[k].assign(width, 0.0f);
+	denoise_taps t;
+	for (int k = 0; k < 5; k++)
+		t.sum[k] = &scratch[k][0];
+
+	//Scale of the colour weight from p's variance blurred over 3x3
+	float* sigma = &scratch[5][0];
+	for (int x = 0; x < width; x++) {
+		float sum = 0, weights = 0;
+		for (int dy = -1; dy <= 1; dy++)
+			for (int dx = -1; dx <= 1; dx++) {
+				int qx = x + dx, qy = y + dy;
+				if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+					continue;
+				float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+				sum += w * v[size_t(qy)*width + qx];
+				weights += w;
+			}
+		sigma[x] = 1.0f / (DENOISE_COLOUR * sqrtf(sum / weights) + 1e-4f);
+	}
+	t.sigma = sigma;
+
+	for (int ty = -2; ty <= 2; ty++) {
+		int qy = y + ty*step;
+		if (qy < 0 || qy >= height)
+			continue;
+		for (int tx = -2; tx <= 2; tx++) {
+			if (tx == 0 && ty == 0)
+				continue;
+			t.h = h[tx+2] * h[ty+2];
+			t.inv_distance = 1.0f / float((abs(tx) + abs(ty)) * step);
+			add_taps(t, y, qy, tx*step, c, v);
+		}
+	}
+
+	//The pixel itself, whatever its normal
+	const float hp = h[2] * h[2];
+	plane* out = col[1 - src];
+	plane& out_var = var[1 - src];
+	for (int x = 0; x < width; x++) {
+		float inv = 1.0f / (t.sum[3][x] + hp);
+		out[0][p+x] = (t.sum[0][x] + hp*c[0][p+x]) * inv;
+		out[1][p+x] = (t.sum[1][x] + hp*c[1][p+x]) * inv;
+		out[2][p+x] = (t.sum[2][x] + hp*c[2][p+x]) * inv;
+		out_var[p+x] = (t.sum[4][x] + hp*hp*v[p+x]) * inv * inv;
+	}
+
+}
+
+
+void atrous_denoiser::run(framebuffer& fb, int threads){
+
+	thread_pool* pool = threads == 1 ? NULL : new thread_pool(threads);
+
+	//Planes of l, l^2 and 0 for the variance estimate
+	size_t n = col[0][0].size();
+	for (size_t k = 0; k < n; k++) {
+		float l = 0.2126f*col[0][0][k] + 0.7152f*col[0][1][k] + 0.0722f*col[0][2][k];
+		col[1][0][k] = l;
+		col[1][1][k] = l*l;
+		col[1][2][k] = 0.0f;
+		var[1][k] = 0.0f;
+	}
+	for_rows(pool, [this](int y, std::vector<float>* scratch){ estimate_variance(y, scratch); });
+
+	int src = 0;
+	for (int pass = 0; pass < DENOISE_PASSES; pass++) {
+		int step = 1 << pass;
+		for_rows(pool, [this, step, src](int y, std::vector<float>* scratch){ filter_row(y, step, src, scratch); });
+		src = 1 - src;
+	}
+	delete pool;
+
+	for (size_t k = 0; k < fb.pixels.size(); k++)
+		fb.pixels[k] = vec3(col[src][0][k], col[src][1][k], col[src][2][k]);
+
+}
+
+
+//Denoises fb with the auxiliary buffers of the same frame
+void denoise_frame(framebuffer& fb, const aov_buffers& aov, int threads){
+	atrous_denoiser denoiser(fb, aov);
+	denoiser.run(fb, threads);
+}
@@ -0,0 +1,539 @@
+#include "renderer.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#pragma once
+
+//Distributed rendering
+
+/*
+ * A coordinator cuts the frame into the same tiles as render_frame() and hands them out over
+ * TCP to worker processes, on this machine or others. A worker builds the scene itself (from
+ * the options the coordinator sends, so every process has the same world and camera), renders
+ * each tile it is given with render_tile() and sends the finished pixels back as they are in
+ * its framebuffer (vec3, so float or double and 3 or 4 lanes depending on the build, vec3.h).
+ *
+ *   worker                              coordinator
+ *     HELLO (version, slots,   ---->
+ *            sizeof(vec3))
+ *                              <----    SETUP (the frame's command line options)
+ *                              <----    JOB (tile) ... up to slots at a time
+ *     RESULT (tile, pixels)    ---->
+ *                              <----    JOB ...
+ *                              <----    DONE
+ *
+ * A tile's pixels only depend on (seed, frame, pixel, sample) (see sampler.h), so the tile a
+ * worker sends back is bit for bit the tile the coordinator would have rendered itself: the
+ * frame is copied together, not averaged, and equals a single process render exactly.
+ *
+ * Workers that go away (connection closed or reset, a message that doesn't arrive within
+ * the socket timeout) have their tiles put back in the queue for the others. Tiles that have
+ * been out for longer than job_timeout are handed out again as well, for nodes that hang
+ * without closing the connection; whichever copy comes back first is used.
+ *
+ * Messages are a type and a payload length (uint32 each) followed by the payload, integers and
+ * floats in the byte order of the machines, which are expected to be alike (x86-64). The
+ * coordinator listens on every interface, so it never trusts a length: each message has a
+ * largest size it can have (a RESULT the pixels of the largest tile) and a peer sending a
+ * longer one is dropped before anything is allocated for it. A worker
+ * whose vec3 has another size than the coordinator's (a double or RT_VEC4 build talking to a
+ * float one) is turned away at HELLO.
+ *
+ * New connections wait in a list of their own, polled with the workers, until their HELLO
+ * arrives, so a client that connects and says nothing (a port scan, a hung node) never holds
+ * up the results of the others. One that hasn't sent it within DIST_HANDSHAKE_TIMEOUT is closed.
+ */
+
+static const uint32_t DIST_PROTOCOL_VERSION = 2;
+
+enum dist_message_type { DIST_HELLO = 1, DIST_SETUP, DIST_JOB, DIST_RESULT, DIST_DONE };
+
+//Seconds a coordinator waits for the rest of a message once it has started arriving
+static const int DIST_SOCKET_TIMEOUT = 30;
+//Seconds a new connection has to send its HELLO in
+static const int DIST_HANDSHAKE_TIMEOUT = 5;
+
+//Longest payloads of the messages other than RESULT (dist_result_size)
+static const uint32_t DIST_MAX_HELLO = 64;
+static const uint32_t DIST_MAX_SETUP = 1 << 20; //the frame's options
+static const uint32_t DIST_MAX_JOB = 64;
+
+//Everything a worker needs to render tiles of the frame, filled in by a dist_setup_fn
+struct dist_frame {
+	render_options opt;
+	camera cam;
+	hitable *world;
+	integrator_fns integrator;
+};
+
+//Builds the frame described by the coordinator's options (args), false with error set if it can't
+typedef std::function<bool(const std::vector<std::string>& args, dist_frame& frame, std::string& error)> dist_setup_fn;
+
+struct coordinator_options {
+	coordinator_options() : port(0), local_workers(0), job_timeout(300) {}
+	int port;          //port to listen on, 0 -> any free port
+	int local_workers; //worker processes to start on this machine
+	double job_timeout; //seconds before a tile that hasn't come back is handed out again, 0 -> never
+};
+
+
+//Sends all of data, false if the connection failed
+bool dist_send_all(int fd, const void* data, size_t n){
+	const char* p = static_cast<const char*>(data);
+	while(n > 0){
+		ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return false;
+		p += sent;
+		n -= size_t(sent);
+	}
+	return true;
+}
+
+//Receives exactly n bytes, false if the connection closed, failed or timed out first
+bool dist_recv_all(int fd, void* data, size_t n){
+	char* p = static_cast<char*>(data);
+	while(n > 0){
+		ssize_t got = recv(fd, p, n, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			return false;
+		p += got;
+		n -= size_t(got);
+	}
+	return true;
+}
+
+bool dist_send_message(int fd, uint32_t type, const std::string& payload){
+	uint32_t header[2] = {type, uint32_t(payload.size())};
+	std::string message(reinterpret_cast<const char*>(header), sizeof(header));
+	message += payload;
+	return dist_send_all(fd, message.data(), message.size());
+}
+
+//Receives a message, false if the connection failed or the payload is longer than max_length
+bool dist_recv_message(int fd, uint32_t& type, std::string& payload, uint32_t max_length){
+	uint32_t header[2];
+	if(!dist_recv_all(fd, header, sizeof(header)) || header[1] > max_length)
+		return false;
+	type = header[0];
+	payload.resize(header[1]);
+	return header[1] == 0 || dist_recv_all(fd, &payload[0], header[1]);
+}
+
+template <typename T>
+void dist_put(std::string& out, const T& value){
+	out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+//Reads a T at pos and moves pos past it, false if the payload is too short
+template <typename T>
+bool dist_get(const std::string& in, size_t& pos, T& value){
+	if(in.size() < pos + sizeof(T))
+		return false;
+	memcpy(&value, &in[pos], sizeof(T));
+	pos += sizeof(T);
+	return true;
+}
+
+//Options as one payload, each followed by a 0
+std::string dist_pack_args(const std::vector<std::string>& args){
+	std::string out;
+	for(size_t k = 0; k < args.size(); k++){
+		out += args[k];
+		out += '\0';
+	}
+	return out;
+}
+
+std::vector<std::string> dist_unpack_args(const std::string& payload){
+	std::vector<std::string> args;
+	size_t start = 0;
+	for(size_t k = 0; k < payload.size(); k++)
+		if(payload[k] == '\0'){
+			args.push_back(payload.substr(start, k - start));
+			start = k + 1;
+		}
+	return args;
+}
+
+
+//Longest RESULT payload for tiles of the given size: job id, tile, pixels and sample counts
+uint32_t dist_result_size(int tile_size){
+	size_t edge = size_t(std::max(tile_size, 1));
+	return uint32_t(sizeof(uint32_t) + sizeof(tile) + edge*edge*(sizeof(vec3) + sizeof(int32_t)));
+}
+
+
+/* Worker */
+
+//Connects to host:port, renders tiles until the coordinator is done, false with error set on failure
+bool run_worker(const std::string& host, int port, int threads, const dist_setup_fn& setup, std::string& error){
+
+	addrinfo hints, *addresses = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int status = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+	if(status != 0){
+		error = host + ": " + gai_strerror(status);
+		return false;
+	}
+	int fd = -1;
+	for(addrinfo* a = addresses; a && fd < 0; a = a->ai_next){
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0){
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if(fd < 0){
+		error = "could not connect to " + host + ":" + std::to_string(port);
+		return false;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	thread_pool pool(threads);
+	std::string hello;
+	dist_put(hello, DIST_PROTOCOL_VERSION);
+	dist_put(hello, uint32_t(pool.size()));
+	dist_put(hello, uint32_t(sizeof(vec3)));
+	uint32_t type;
+	std::string payload;
+	if(!dist_send_message(fd, DIST_HELLO, hello) || !dist_recv_message(fd, type, payload, DIST_MAX_SETUP) || type != DIST_SETUP){
+		error = "no frame from the coordinator";
+		close(fd);
+		return false;
+	}
+	dist_frame frame;
+	if(!setup(dist_unpack_args(payload), frame, error)){
+		close(fd);
+		return false;
+	}
+
+	//Tiles render on the pool, each thread sends its own results back
+	framebuffer fb(frame.opt.nx, frame.opt.ny);
+	std::mutex send_mutex;
+	bool connected = true;
+	while(dist_recv_message(fd, type, payload, DIST_MAX_JOB) && type == DIST_JOB){
+		size_t pos = 0;
+		uint32_t id;
+		tile t;
+		if(!dist_get(payload, pos, id) || !dist_get(payload, pos, t) ||
+		   t.x0 < 0 || t.y0 < 0 || t.x1 > fb.width || t.y1 > fb.height || t.x0 >= t.x1 || t.y0 >= t.y1){
+			error = "bad job from the coordinator";
+			break;
+		}
+		pool.submit([id, t, &fb, &frame, fd, &send_mutex, &connected]{
+			render_tile(t, fb, frame.cam, frame.world, frame.opt, frame.integrator);
+			std::string result;
+			dist_put(result, id);
+			dist_put(result, t);
+			for(int j = t.y0; j < t.y1; j++)
+				result.append(reinterpret_cast<const char*>(&fb.at(t.x0, j)), size_t(t.x1 - t.x0)*sizeof(vec3));
+			for(int j = t.y0; j < t.y1; j++)
+				for(int i = t.x0; i < t.x1; i++)
+					dist_put(result, int32_t(fb.samples_at(i, j)));
+			std::lock_guard<std::mutex> lock(send_mutex);
+			if(connected && !dist_send_message(fd, DIST_RESULT, result))
+				connected = false;
+		});
+	}
+	pool.wait();
+	close(fd);
+	//The coordinator closing the connection instead of sending DONE isn't this worker's failure,
+	//the coordinator either finished or went away and nobody is left to render for
+	return error.empty();
+
+}
+
+
+/* Coordinator */
+
+struct dist_job {
+	tile t;
+	bool done;
+	int copies;       //workers rendering it right now
+	std::chrono::steady_clock::time_point issued;
+};
+
+struct dist_worker {
+	int fd;
+	int slots;
+	std::vector<uint32_t> jobs; //handed out and not back yet
+};
+
+//A connection that hasn't sent its HELLO yet
+struct dist_pending {
+	int fd;
+	std::chrono::steady_clock::time_point accepted;
+};
+
+//Starts n workers on this machine, running this program with --worker, returns their pids.
+//threads 0 shares the cores out between the workers rather than giving each all of them
+std::vector<pid_t> spawn_local_workers(int n, int port, int threads){
+	std::vector<pid_t> pids;
+	if(threads <= 0 && n > 0)
+		threads = std::max(1, int(std::thread::hardware_concurrency()) / n);
+	std::string address = "127.0.0.1:" + std::to_string(port);
+	std::string thread_count = std::to_string(threads);
+	for(int k = 0; k < n; k++){
+		pid_t pid = fork();
+		if(pid == 0){
+			const char* args[] = {"Raytracer", "--worker", address.c_str(), "--threads", thread_count.c_str(), NULL};
+			execv("/proc/self/exe", const_cast<char* const*>(args));
+			_exit(127);
+		}
+		if(pid > 0)
+			pids.push_back(pid);
+	}
+	return pids;
+}
+
+//Renders the frame described by frame_args (passed to the workers' setup) and opt (tile layout)
+//on the workers that connect, false with error set if it can't finish
+bool run_coordinator(const coordinator_options& co, const std::vector<std::string>& frame_args, const render_options& opt,
+                     framebuffer& fb, std::string& error){
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(uint16_t(co.port));
+	socklen_t length = sizeof(address);
+	if(listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0 ||
+	   getsockname(listener, (sockaddr*)&address, &length) != 0){
+		error = "could not listen on port " + std::to_string(co.port) + ": " + strerror(errno);
+		if(listener >= 0) close(listener);
+		return false;
+	}
+	int port = ntohs(address.sin_port);
+	std::cerr << "coordinator listening on port " << port << "\n";
+
+	fb = framebuffer(opt.nx, opt.ny);
+	std::vector<tile> tiles = make_tiles(opt.nx, opt.ny, opt.tile_size);
+	std::vector<dist_job> jobs(tiles.size());
+	std::deque<uint32_t> queue; //jobs waiting for a worker, possibly done meanwhile
+	for(size_t k = 0; k < tiles.size(); k++){
+		jobs[k].t = tiles[k];
+		jobs[k].done = false;
+		jobs[k].copies = 0;
+		queue.push_back(uint32_t(k));
+	}
+	size_t remaining = jobs.size();
+	uint32_t max_result = dist_result_size(opt.tile_size);
+	std::string setup = dist_pack_args(frame_args);
+	std::vector<dist_worker> workers;
+	std::vector<dist_pending> pending;
+	int reissued = 0, lost_workers = 0, connected_workers = 0;
+
+	std::vector<pid_t> children = spawn_local_workers(co.local_workers, port, opt.threads);
+	size_t children_running = children.size();
+
+	//A worker gone: its tiles go to the front of the queue
+	auto drop_worker = [&](size_t w){
+		for(size_t k = 0; k < workers[w].jobs.size(); k++){
+			dist_job& job = jobs[workers[w].jobs[k]];
+			job.copies--;
+			if(!job.done && job.copies == 0){
+				queue.push_front(workers[w].jobs[k]);
+				reissued++;
+			}
+		}
+		close(workers[w].fd);
+		workers.erase(workers.begin() + w);
+		lost_workers++;
+	};
+
+	while(remaining > 0){
+		//Hand out tiles to every free slot
+		for(size_t w = 0; w < workers.size(); w++){
+			while(int(workers[w].jobs.size()) < workers[w].slots && !queue.empty()){
+				uint32_t id = queue.front();
+				queue.pop_front();
+				if(jobs[id].done)
+					continue;
+				std::vector<uint32_t>& out = workers[w].jobs;
+				if(std::find(out.begin(), out.end(), id) != out.end()){
+					//Timed out on this worker, wait for another one to be free
+					queue.push_back(id);
+					break;
+				}
+				std::string payload;
+				dist_put(payload, id);
+				dist_put(payload, jobs[id].t);
+				jobs[id].copies++;
+				jobs[id].issued = std::chrono::steady_clock::now();
+				workers[w].jobs.push_back(id);
+				if(!dist_send_message(workers[w].fd, DIST_JOB, payload))
+					break; //noticed as a failed read below
+			}
+		}
+
+		//The listener, then the workers, then the connections waiting to say HELLO
+		std::vector<pollfd> fds(1 + workers.size() + pending.size());
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for(size_t w = 0; w < workers.size(); w++){
+			fds[1 + w].fd = workers[w].fd;
+			fds[1 + w].events = POLLIN;
+		}
+		for(size_t k = 0; k < pending.size(); k++){
+			fds[1 + workers.size() + k].fd = pending[k].fd;
+			fds[1 + workers.size() + k].events = POLLIN;
+		}
+		size_t polled_workers = workers.size();
+		if(poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR){
+			error = std::string("poll: ") + strerror(errno);
+			break;
+		}
+
+		//Results, or workers gone (a closed connection is readable too). Back to front so
+		//dropping a worker doesn't move the ones still to be looked at
+		for(size_t w = workers.size(); w-- > 0; ){
+			if(!(fds[1 + w].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			uint32_t type;
+			std::string payload;
+			size_t pos = 0;
+			uint32_t id;
+			tile t;
+			if(!dist_recv_message(workers[w].fd, type, payload, max_result) || type != DIST_RESULT ||
+			   !dist_get(payload, pos, id) || !dist_get(payload, pos, t) || id >= jobs.size() ||
+			   memcmp(&t, &jobs[id].t, sizeof(tile)) != 0 ||
+			   payload.size() != pos + size_t(t.x1 - t.x0)*(t.y1 - t.y0)*(sizeof(vec3) + sizeof(int32_t))){
+				drop_worker(w);
+				continue;
+			}
+			std::vector<uint32_t>& out = workers[w].jobs;
+			std::vector<uint32_t>::iterator found = std::find(out.begin(), out.end(), id);
+			if(found != out.end()){
+				out.erase(found);
+				jobs[id].copies--;
+			}
+			if(jobs[id].done)
+				continue; //a reissued tile that came back twice
+			size_t row_bytes = size_t(t.x1 - t.x0)*sizeof(vec3);
+			for(int j = t.y0; j < t.y1; j++, pos += row_bytes)
+				memcpy(&fb.at(t.x0, j), &payload[pos], row_bytes);
+			for(int j = t.y0; j < t.y1; j++)
+				for(int i = t.x0; i < t.x1; i++){
+					int32_t s = 0;
+					dist_get(payload, pos, s);
+					fb.samples_at(i, j) = s;
+				}
+			jobs[id].done = true;
+			remaining--;
+		}
+
+		//Handshakes of the connections that have sent something, or that have had long enough to.
+		//The HELLO is tiny, so once its first bytes are in the rest follows at once
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for(size_t k = pending.size(); k-- > 0; ){
+			int fd = pending[k].fd;
+			bool readable = fds[1 + polled_workers + k].revents & (POLLIN | POLLERR | POLLHUP);
+			if(!readable && std::chrono::duration<double>(now - pending[k].accepted).count() < DIST_HANDSHAKE_TIMEOUT)
+				continue;
+			pending.erase(pending.begin() + k);
+			uint32_t type, version = 0, slots = 0, pixel_size = 0;
+			std::string payload;
+			size_t pos = 0;
+			if(readable && dist_recv_message(fd, type, payload, DIST_MAX_HELLO) && type == DIST_HELLO && dist_get(payload, pos, version) &&
+			   dist_get(payload, pos, slots) && dist_get(payload, pos, pixel_size) &&
+			   version == DIST_PROTOCOL_VERSION && slots > 0 && pixel_size == sizeof(vec3) &&
+			   dist_send_message(fd, DIST_SETUP, setup)){
+				timeval timeout = {DIST_SOCKET_TIMEOUT, 0};
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				dist_worker worker;
+				worker.fd = fd;
+				worker.slots = int(slots);
+				workers.push_back(worker);
+				connected_workers++;
+			}
+			else
+				close(fd);
+		}
+
+		//New connections, they wait in pending until their HELLO arrives
+		if(fds[0].revents & POLLIN){
+			int fd = accept(listener, NULL, NULL);
+			if(fd >= 0){
+				timeval timeout = {DIST_HANDSHAKE_TIMEOUT, 0};
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				timeout.tv_sec = DIST_SOCKET_TIMEOUT;
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				dist_pending connection;
+				connection.fd = fd;
+				connection.accepted = now;
+				pending.push_back(connection);
+			}
+		}
+
+		//Tiles out for too long go back in the queue, the worker keeps its copy in case it's only slow
+		if(co.job_timeout > 0){
+			for(size_t w = 0; w < workers.size(); w++)
+				for(size_t k = 0; k < workers[w].jobs.size(); k++){
+					dist_job& job = jobs[workers[w].jobs[k]];
+					if(!job.done && std::chrono::duration<double>(now - job.issued).count() > co.job_timeout){
+						job.issued = now;
+						queue.push_back(workers[w].jobs[k]);
+						reissued++;
+					}
+				}
+		}
+
+		//Local workers that all failed before finishing would leave the frame waiting forever
+		for(size_t k = 0; k < children.size(); k++)
+			if(children[k] > 0 && waitpid(children[k], NULL, WNOHANG) == children[k]){
+				children[k] = 0;
+				children_running--;
+			}
+		if(co.local_workers > 0 && children_running == 0 && workers.empty()){
+			error = "every local worker exited before the frame was done";
+			break;
+		}
+	}
+
+	for(size_t w = 0; w < workers.size(); w++){
+		dist_send_message(workers[w].fd, DIST_DONE, std::string());
+		close(workers[w].fd);
+	}
+	for(size_t k = 0; k < pending.size(); k++)
+		close(pending[k].fd);
+	close(listener);
+	for(size_t k = 0; k < children.size(); k++)
+		if(children[k] > 0)
+			waitpid(children[k], NULL, 0);
+
+	std::cerr << "distributed: " << jobs.size() << " tiles on " << connected_workers << " workers, "
+	          << lost_workers << " workers lost, " << reissued << " tiles reissued\n";
+	return remaining == 0;
+
+}
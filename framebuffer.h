@@ -0,0 +1,83 @@
+#include "vec3.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <math.h>
+#pragma once
+
+//Framebuffer
+
+/*
+ * Holds the averaged (linear) colour of every pixel of a frame. Render threads write
+ * disjoint pixels into it and the image is only written out once the frame is complete.
+ *
+ * Pixels are stored top row first so the buffer can be written out in order,
+ * pixel (i,j) uses the same convention as main: i = column, j = row counted from the bottom.
+ *
+ * Next to the colour every pixel records how many samples were averaged into it,
+ * which only varies with adaptive sampling and can be written out as a heatmap.
+ */
+
+class framebuffer {
+
+  public:
+	framebuffer() : width(0), height(0) {}
+	framebuffer(int w, int h) : width(w), height(h), pixels(size_t(w)*size_t(h), vec3(0,0,0)), samples(size_t(w)*size_t(h), 0) {}
+
+	//Index of pixel (i,j) in pixels and samples
+	size_t index(int i, int j) const { return size_t(height-1-j)*width + i; }
+
+	vec3& at(int i, int j) { return pixels[index(i, j)]; }
+	const vec3& at(int i, int j) const { return pixels[index(i, j)]; }
+
+	int& samples_at(int i, int j) { return samples[index(i, j)]; }
+
+	//Samples taken over the whole frame
+	long long total_samples() const {
+		long long total = 0;
+		for(size_t k = 0; k < samples.size(); k++)
+			total += samples[k];
+		return total;
+	}
+
+	//Writes the frame as an ASCII (P3) ppm, gamma corrected with gamma 2
+	//The text is built up in memory and handed to the stream in one go
+	void write_ppm(std::ostream& os) const {
+		std::string out = "P3\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+		out.reserve(out.size() + pixels.size()*12);
+		for(size_t k = 0; k < pixels.size(); k++){
+			vec3 col = vec3(sqrt(pixels[k].r()), sqrt(pixels[k].g()), sqrt(pixels[k].b()));
+			int ir = int(255.99 * col.r());
+			int ig = int(255.99 * col.g());
+			int ib = int(255.99 * col.b());
+			out += std::to_string(ir); out += ' ';
+			out += std::to_string(ig); out += ' ';
+			out += std::to_string(ib); out += '\n';
+		}
+		os.write(out.data(), out.size());
+	}
+
+	//Writes the samples per pixel as an ASCII ppm, black (none) through blue and red to
+	//yellow (max_samples)
+	void write_samples_heatmap(std::ostream& os, int max_samples) const {
+		static const float ramp[4][3] = {{0,0,0}, {0,0,1}, {1,0,0}, {1,1,0}};
+		std::string out = "P3\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+		out.reserve(out.size() + samples.size()*12);
+		for(size_t k = 0; k < samples.size(); k++){
+			float t = max_samples > 0 ? 3.0f*float(samples[k])/float(max_samples) : 0.0f;
+			if(t > 3.0f) t = 3.0f;
+			int seg = t >= 3.0f ? 2 : int(t);
+			float f = t - seg;
+			for(int c = 0; c < 3; c++){
+				out += std::to_string(int(255.99f*((1-f)*ramp[seg][c] + f*ramp[seg+1][c])));
+				out += c < 2 ? ' ' : '\n';
+			}
+		}
+		os.write(out.data(), out.size());
+	}
+
+	int width;
+	int height;
+	std::vector<vec3> pixels;
+	std::vector<int> samples; //samples averaged into each pixel
+};
@@ -1,12 +1,16 @@
 #include "ray.h"
+#include "aabb.h"
+#include <stdio.h>
+#include <stdlib.h>
 #pragma once
 
 
 class material;
+class hitable;
 
 //Chp 5
 
-/* 
+/*
 * hitable is an abstract class used to model an object or "thing" a ray can collide with or hit
 * most ray tracers use a valid interval for t, so a hit is only allowed if tmin < t < tmax
 * initially this interval is any positive t
@@ -14,19 +18,94 @@ class material;
 
 //Bundle up details of the hit in a hit_record structure
 struct hit_record {
-  float t;
+  real t;
   vec3 p;
   vec3 normal;
   material *mat_ptr;
 };
 
+/*
+ * Finding the nearest hit is split in two:
+ *
+ *   nearest()      only the distance: every primitive the ray meets lowers tmax if it is
+ *                  closer and says which primitive that was in a hit_id
+ *   fill_record()  the point, normal and material, computed once for the hit that was
+ *                  nearest in the end
+ *
+ * A candidate that a closer one beats later on costs nothing for its surface, and no
+ * hit_record is copied around while searching. That matters most for a hitable_list, which
+ * tests objects in whatever order they were added; a bvh visits leaves front to back so
+ * the first hit is mostly the nearest (Benchmark deferred). hit() does both steps for
+ * callers that want the record.
+ *
+ * A hit_id is the primitive (a sphere, a mesh, a pack of spheres, ...) with the part of it
+ * that was hit (triangle, sphere of the pack) and the instances the ray went through to get
+ * there, innermost first: each instance adds itself on the way out of nearest(). Lists and
+ * bvhs of hitables are never in it, they only pass the search on to their children.
+ *
+ * occluded() is a third query, for rays that only need to know whether something is in the
+ * way: it stops at the first hit it finds and has no hit_id or record at all.
+ */
+
+//Deepest nesting of instances in instances (see scene_file.h)
+const int MAX_INSTANCE_DEPTH = 8;
+
+struct hit_id {
+  const hitable* prim; //fills in the record
+  int index;           //part of prim that was hit, for primitives made of several
+  int depth;           //number of instances around prim
+  const hitable* instances[MAX_INSTANCE_DEPTH];
+};
+
 class hitable {
 
   public:
-  
-    //declaration of hit function
+
+    virtual ~hitable() {}
+
+    //Nearest hit within (tmin,tmax): lowers tmax to its distance and describes it in id, false
+    //(changing neither) if there is none
     //Note: =0 denotes a pure virtual function this must be implemented derived class
-    //pure virtual -> abstract / virtual -> polymorphic 
-    virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const = 0;
+    //pure virtual -> abstract / virtual -> polymorphic
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const = 0;
+
+    //Fills in rec for a hit nearest() found on this primitive at distance t along r, where r
+    //is in the space of the primitive (inside the instances around it). Every primitive and
+    //instance overrides it; lists and bvhs never put themselves in a hit_id, so reaching this
+    //one means a nearest() named the wrong hitable and rec would be left as garbage
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const {
+      fprintf(stderr, "fill_record: a hit_id names a hitable that doesn't fill in records\n");
+      abort();
+    }
+
+    //Nearest hit within (tmin,tmax) with its hit_record
+    inline bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
+
+    //Whether anything is in the way within (tmin,tmax), for shadow and ambient occlusion rays.
+    //Any hit answers that, so the search can stop at the first one and never needs the
+    //nearest. Falls back to nearest() for primitives that don't have a cheaper test
+    virtual bool occluded(const ray& r, real tmin, real tmax) const {
+      hit_id id;
+      return nearest(r, tmin, tmax, id);
+    }
+
+    //Box enclosing the whole object, used to build acceleration structures (bvh.h)
+    virtual bool bounding_box(aabb& box) const = 0;
 
 };
+
+
+//Fills in rec for the hit id at distance t along the (world space) ray r, starting with the
+//outermost instance around the primitive
+inline void fill_hit(const ray& r, real t, const hit_id& id, hit_record& rec) {
+  const hitable* outer = id.depth > 0 ? id.instances[id.depth - 1] : id.prim;
+  outer->fill_record(r, t, id, rec);
+}
+
+inline bool hitable::hit(const ray& r, real tmin, real tmax, hit_record& rec) const {
+  hit_id id;
+  if (!nearest(r, tmin, tmax, id))
+    return false;
+  fill_hit(r, tmax, id, rec);
+  return true;
+}
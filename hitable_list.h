@@ -1,4 +1,5 @@
 #include "hitable.h"
+#include "render_stats.h"
 #pragma once
 
 
@@ -13,7 +14,9 @@ class hitable_list: public hitable {
   public:
     hitable_list() {}
     hitable_list(hitable **l, int n) {list = l; list_size = n;} //** declares a point to a pointer (array)
-    virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
     hitable **list;
     int list_size;
 
@@ -21,20 +24,53 @@ class hitable_list: public hitable {
 
 
 //Iterates through list of objects and check if provided ray has hit any of them
-bool hitable_list::hit(const ray& r, float tmin, float tmax, hit_record& rec) const {
+//every object that is hit lowers tmax, so the last one to report a hit is the nearest
+bool hitable_list::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
 
-  hit_record temp_rec;
   bool hit_anything = false;
-  double closest_so_far = tmax;
+  RT_STAT(int successes = 0);
   for (int i = 0; i < list_size; i++) {
-    if(list[i]->hit(r, tmin, closest_so_far, temp_rec)){
+    if(list[i]->nearest(r, tmin, tmax, id)){
+      RT_STAT(successes++);
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
     }
   }
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += list_size;
+          stats.hit_successes += successes;)
   
   return hit_anything;
 
 
-}
\ No newline at end of file
+}
+
+
+//Any object will do, so the search ends at the first one in the way
+bool hitable_list::occluded(const ray& r, real tmin, real tmax) const {
+
+  int i = 0;
+  while (i < list_size && !list[i]->occluded(r, tmin, tmax))
+    i++;
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += i < list_size ? i + 1 : list_size;
+          stats.hit_successes += i < list_size;)
+
+  return i < list_size;
+
+}
+
+
+//Box surrounding every object in the list
+bool hitable_list::bounding_box(aabb& box) const {
+
+  box = aabb();
+  for (int i = 0; i < list_size; i++) {
+    aabb temp_box;
+    if(!list[i]->bounding_box(temp_box))
+      return false; //an unbounded object makes the whole list unbounded
+    box.grow(temp_box);
+  }
+
+  return list_size > 0;
+
+}
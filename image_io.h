@@ -0,0 +1,193 @@
+#include "framebuffer.h"
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#pragma once
+
+//Image writers
+
+/*
+ * Every writer encodes the whole framebuffer into one block of memory first and hands it
+ * to the file (or stdout) with a single write, so the cost is one pass over the pixels
+ * plus one system call instead of a formatted stream insertion per value.
+ *
+ *   ppm - binary P6, 8 bits per channel, gamma 2 (P3 is still there as framebuffer::write_ppm)
+ *   png - 8 bit RGB, gamma 2, the image data stored uncompressed ("stored" deflate blocks)
+ *         which costs some size but no compressor
+ *   pfm - the linear float colours as they are in the framebuffer (no gamma, no clamp),
+ *         for tone mapping or comparing renders later
+ */
+
+//Linear colour value to an 8 bit output value, gamma 2 as in write_ppm
+inline unsigned char gamma_byte(float linear){
+	int v = int(255.99f * sqrtf(linear > 0 ? linear : 0));
+	return (unsigned char)(v > 255 ? 255 : v);
+}
+
+//Binary (P6) ppm
+std::string encode_ppm(const framebuffer& fb){
+	std::string header = "P6\n" + std::to_string(fb.width) + " " + std::to_string(fb.height) + "\n255\n";
+	std::string out(header.size() + fb.pixels.size()*3, '\0');
+	memcpy(&out[0], header.data(), header.size());
+	unsigned char* p = (unsigned char*)&out[header.size()];
+	for(size_t k = 0; k < fb.pixels.size(); k++){
+		*p++ = gamma_byte(fb.pixels[k].r());
+		*p++ = gamma_byte(fb.pixels[k].g());
+		*p++ = gamma_byte(fb.pixels[k].b());
+	}
+	return out;
+}
+
+//Portable float map, little endian, rows bottom to top as the format wants
+std::string encode_pfm(const framebuffer& fb){
+	std::string header = "PF\n" + std::to_string(fb.width) + " " + std::to_string(fb.height) + "\n-1.0\n";
+	size_t row_bytes = size_t(fb.width)*3*sizeof(float);
+	std::string out(header.size() + row_bytes*fb.height, '\0');
+	memcpy(&out[0], header.data(), header.size());
+	char* p = &out[header.size()];
+	for(int j = 0; j < fb.height; j++){
+		//In the default build vec3 is three packed floats, so a row of the framebuffer is already
+		//a row of the file (on the little endian machines this is built for). Double and 4 lane
+		//builds (vec3.h) convert the pixels one at a time
+		if(sizeof(vec3) == 3*sizeof(float)){
+			memcpy(p, &fb.at(0, j), row_bytes);
+			p += row_bytes;
+			continue;
+		}
+		for(int i = 0; i < fb.width; i++){
+			const vec3& c = fb.at(i, j);
+			float rgb[3] = {float(c.r()), float(c.g()), float(c.b())};
+			memcpy(p, rgb, sizeof(rgb));
+			p += sizeof(rgb);
+		}
+	}
+	return out;
+}
+
+//CRC-32 as used by png chunks
+inline uint32_t png_crc(const unsigned char* data, size_t n, uint32_t crc = 0){
+	static uint32_t table[256];
+	static bool table_ready = false;
+	if(!table_ready){
+		for(uint32_t k = 0; k < 256; k++){
+			uint32_t c = k;
+			for(int b = 0; b < 8; b++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[k] = c;
+		}
+		table_ready = true;
+	}
+	crc = ~crc;
+	for(size_t k = 0; k < n; k++)
+		crc = table[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+inline void put_be32(std::string& out, uint32_t v){
+	out += char(v >> 24); out += char(v >> 16); out += char(v >> 8); out += char(v);
+}
+
+//Appends a chunk: length, type, data, crc of type and data
+void png_chunk(std::string& out, const char* type, const std::string& data){
+	put_be32(out, uint32_t(data.size()));
+	size_t start = out.size();
+	out.append(type, 4);
+	out += data;
+	put_be32(out, png_crc((const unsigned char*)&out[start], out.size() - start));
+}
+
+//8 bit RGB png
+std::string encode_png(const framebuffer& fb){
+	//Raw scanlines, each starting with filter type 0 (none)
+	size_t row_bytes = size_t(fb.width)*3 + 1;
+	std::string raw(row_bytes*fb.height, '\0');
+	for(int y = 0; y < fb.height; y++){
+		unsigned char* p = (unsigned char*)&raw[y*row_bytes + 1];
+		const vec3* row = &fb.pixels[size_t(y)*fb.width];
+		for(int x = 0; x < fb.width; x++){
+			*p++ = gamma_byte(row[x].r());
+			*p++ = gamma_byte(row[x].g());
+			*p++ = gamma_byte(row[x].b());
+		}
+	}
+
+	//zlib stream of stored deflate blocks (at most 65535 bytes each) and the adler-32 of the data
+	std::string z;
+	z.reserve(raw.size() + raw.size()/65535*5 + 16);
+	z += char(0x78); z += char(0x01);
+	size_t pos = 0;
+	do{
+		size_t n = std::min(raw.size() - pos, size_t(65535));
+		z += char(pos + n == raw.size() ? 1 : 0); //final block flag, type 00 (stored)
+		z += char(n & 0xff); z += char(n >> 8);
+		z += char(~n & 0xff); z += char((~n >> 8) & 0xff);
+		z.append(raw, pos, n);
+		pos += n;
+	}while(pos < raw.size());
+	//Adler-32, taking the modulo only every 5552 bytes (the most that can't overflow b)
+	uint32_t a = 1, b = 0;
+	for(size_t k = 0; k < raw.size(); ){
+		size_t end = std::min(raw.size(), k + 5552);
+		for(; k < end; k++){
+			a += (unsigned char)raw[k];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	put_be32(z, (b << 16) | a);
+
+	std::string out("\x89PNG\r\n\x1a\n", 8);
+	std::string ihdr;
+	put_be32(ihdr, fb.width);
+	put_be32(ihdr, fb.height);
+	ihdr += char(8); //bit depth
+	ihdr += char(2); //colour type RGB
+	ihdr += char(0); ihdr += char(0); ihdr += char(0); //compression, filter, no interlace
+	png_chunk(out, "IHDR", ihdr);
+	png_chunk(out, "IDAT", z);
+	png_chunk(out, "IEND", std::string());
+	return out;
+}
+
+//Encodes the frame in the given format (ppm, png, pfm or p3), empty if the format is unknown
+std::string encode_image(const framebuffer& fb, const std::string& format){
+	if(format == "ppm") return encode_ppm(fb);
+	if(format == "png") return encode_png(fb);
+	if(format == "pfm") return encode_pfm(fb);
+	if(format == "p3"){
+		std::ostringstream os;
+		fb.write_ppm(os);
+		return os.str();
+	}
+	return std::string();
+}
+
+//Format from the extension of a file name, ppm if there is none
+std::string image_format(const std::string& path){
+	size_t dot = path.find_last_of('.');
+	if(dot == std::string::npos || path.find('/', dot) != std::string::npos)
+		return "ppm";
+	std::string ext = path.substr(dot + 1);
+	for(size_t k = 0; k < ext.size(); k++)
+		ext[k] = char(tolower(ext[k]));
+	return ext;
+}
+
+//Writes an encoded image with one fwrite, to stdout for "-", returns false on failure
+bool write_file(const std::string& path, const std::string& data){
+	FILE* f = path == "-" ? stdout : fopen(path.c_str(), "wb");
+	if(!f)
+		return false;
+	bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+	if(f == stdout)
+		ok = fflush(f) == 0 && ok;
+	else
+		ok = fclose(f) == 0 && ok;
+	return ok;
+}
@@ -0,0 +1,230 @@
+#include "hitable.h"
+#include "aabb.h"
+#include <math.h>
+#include <assert.h>
+#pragma once
+
+//Instances
+
+/*
+ * An instance places a shared object (a bvh over a cluster of spheres, a mesh, ...) in the
+ * scene with an affine transform, without copying it. Placing the object a thousand times
+ * costs a thousand instances of about 150 bytes, the object itself is stored once.
+ *
+ * Instead of moving the object into the world, the ray is moved into the object:
+ *
+ *   world                                   object space
+ *
+ *     A + t*B  ---- world_to_object --->    A' + t*B'     A' = M^-1 (A - T),  B' = M^-1 B
+ *
+ * The transform is affine, so a point at t on the world ray is the point at the same t on
+ * the object space ray (B' is not normalised, every hit test allows for that). The hit t is
+ * therefore the world t as it is, the hit point is taken on the world ray and the normal goes
+ * through the transpose of M^-1 (normals are perpendicular to the surface, a non uniform
+ * scale would tilt them if they were moved like points) and is normalised again.
+ *
+ * Two levels - the instances are the primitives of the scene's bvh, built over their world
+ * boxes (the object's box with its 8 corners transformed), and every object has its own bvh
+ * in object space. A ray walks the top bvh down to the instances whose boxes it meets, is
+ * transformed once per instance and walks the object's bvh from there.
+ *
+ *             [ scene bvh ]                     top level, over instance boxes
+ *             /           \
+ *      (inst 1  inst 2)   (inst 3)
+ *          \      |       /
+ *           [ object bvh ]                      bottom level, shared
+ *            /          \
+ *       (s1 s2 s3)   (s4 s5)
+ *
+ * Instances can refer to objects made of instances in turn.
+ */
+
+//p' = M p + T, stored as the rows of the 3x4 matrix [M | T]
+struct affine_transform {
+
+	static affine_transform identity(){
+		affine_transform a;
+		for(int r = 0; r < 3; r++)
+			for(int c = 0; c < 4; c++)
+				a.m[r][c] = r == c ? 1.0f : 0.0f;
+		return a;
+	}
+
+	static affine_transform translation(const vec3& t){
+		affine_transform a = identity();
+		for(int r = 0; r < 3; r++)
+			a.m[r][3] = t[r];
+		return a;
+	}
+
+	static affine_transform scaling(const vec3& s){
+		affine_transform a = identity();
+		for(int r = 0; r < 3; r++)
+			a.m[r][r] = s[r];
+		return a;
+	}
+
+	//Counter clockwise looking down the axis towards the origin (Rodrigues' formula)
+	static affine_transform rotation(const vec3& axis, real degrees){
+		vec3 u = unit_vector(axis);
+		real radians = degrees * real(M_PI) / 180;
+		real c = std::cos(radians), s = std::sin(radians), k = 1 - c;
+		affine_transform a = identity();
+		a.m[0][0] = c + u.x()*u.x()*k;         a.m[0][1] = u.x()*u.y()*k - u.z()*s;   a.m[0][2] = u.x()*u.z()*k + u.y()*s;
+		a.m[1][0] = u.y()*u.x()*k + u.z()*s;   a.m[1][1] = c + u.y()*u.y()*k;         a.m[1][2] = u.y()*u.z()*k - u.x()*s;
+		a.m[2][0] = u.z()*u.x()*k - u.y()*s;   a.m[2][1] = u.z()*u.y()*k + u.x()*s;   a.m[2][2] = c + u.z()*u.z()*k;
+		return a;
+	}
+
+	//This transform followed by next
+	affine_transform then(const affine_transform& next) const {
+		affine_transform a;
+		for(int r = 0; r < 3; r++)
+			for(int c = 0; c < 4; c++){
+				real v = c == 3 ? next.m[r][3] : 0;
+				for(int k = 0; k < 3; k++)
+					v += next.m[r][k] * m[k][c];
+				a.m[r][c] = v;
+			}
+		return a;
+	}
+
+	vec3 point(const vec3& p) const {
+		return vec3(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+		            m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+		            m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const {
+		return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+		            m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+		            m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+	}
+
+	//M^T v, normals are moved out of object space with the transpose of world_to_object
+	vec3 transposed_vector(const vec3& v) const {
+		return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+		            m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+		            m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+	}
+
+	//False if M is singular (e.g. a scale of 0), computed in double
+	bool inverse(affine_transform& inv) const {
+		double a[3][3];
+		for(int r = 0; r < 3; r++)
+			for(int c = 0; c < 3; c++)
+				a[r][c] = m[r][c];
+		double cof[3][3];
+		for(int r = 0; r < 3; r++)
+			for(int c = 0; c < 3; c++){
+				int r1 = (r+1)%3, r2 = (r+2)%3, c1 = (c+1)%3, c2 = (c+2)%3;
+				cof[r][c] = a[r1][c1]*a[r2][c2] - a[r1][c2]*a[r2][c1];
+			}
+		double det = a[0][0]*cof[0][0] + a[0][1]*cof[0][1] + a[0][2]*cof[0][2];
+		if(det == 0 || !isfinite(det))
+			return false;
+		for(int r = 0; r < 3; r++){
+			for(int c = 0; c < 3; c++)
+				inv.m[r][c] = real(cof[c][r] / det);
+		}
+		//-M^-1 T
+		for(int r = 0; r < 3; r++){
+			double t = 0;
+			for(int c = 0; c < 3; c++)
+				t -= (cof[c][r] / det) * m[c][3];
+			inv.m[r][3] = real(t);
+		}
+		return true;
+	}
+
+	//Box around the transformed corners of b
+	aabb box(const aabb& b) const {
+		aabb out;
+		for(int corner = 0; corner < 8; corner++){
+			vec3 p((corner & 1) ? b.max().x() : b.min().x(),
+			       (corner & 2) ? b.max().y() : b.min().y(),
+			       (corner & 4) ? b.max().z() : b.min().z());
+			out.grow(point(p));
+		}
+		return out;
+	}
+
+	real m[3][4];
+};
+
+
+class instance: public hitable {
+
+  public:
+    //object_to_world must be invertible (affine_transform::inverse), the scene file reader
+    //checks that; a singular one built in code leaves the object untransformed
+    instance(const hitable* o, const affine_transform& object_to_world) : object(o), to_world(object_to_world),
+                                                                          to_object(affine_transform::identity()) {
+      bool invertible = to_world.inverse(to_object);
+      assert(invertible && "instance: object_to_world is singular");
+      (void)invertible;
+      aabb object_box;
+      has_box = object->bounding_box(object_box);
+      if (has_box)
+        world_box = to_world.box(object_box);
+    }
+
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    const hitable* object;
+    affine_transform to_world;
+    affine_transform to_object;
+    aabb world_box;
+    bool has_box;
+
+};
+
+
+bool instance::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
+
+  ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+  if (!object->nearest(local, tmin, tmax, id))
+    return false;
+  //The object's primitive has just set id, this instance goes around it. The scene file reader
+  //refuses deeper nesting, scenes built in code have to keep to it as well
+  assert(id.depth < MAX_INSTANCE_DEPTH && "instances nested deeper than MAX_INSTANCE_DEPTH");
+  id.instances[id.depth++] = this;
+  return true;
+
+}
+
+
+//Passes the ray in the object's space on to the next instance in (or the primitive), and
+//moves the point and normal it gets back out to this instance's space
+void instance::fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const {
+
+  int level = id.depth - 1;
+  while (id.instances[level] != this)
+    level--;
+  ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+  const hitable* inner = level > 0 ? id.instances[level - 1] : id.prim;
+  inner->fill_record(local, t, id, rec);
+  rec.p = r.point_at_parameter(t);
+  rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+
+}
+
+
+//t means the same in both spaces, so the interval carries over as it is
+bool instance::occluded(const ray& r, real tmin, real tmax) const {
+
+  ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+  return object->occluded(local, tmin, tmax);
+
+}
+
+
+bool instance::bounding_box(aabb& box) const {
+
+  box = world_box;
+  return has_box;
+
+}
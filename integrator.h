@@ -0,0 +1,316 @@
+#include "hitable.h"
+#include "material.h"
+#include "sampler.h"
+#include "sampling.h"
+#include "render_stats.h"
+#include <float.h>
+#pragma once
+
+//Integrator - works out the colour seen along a ray
+
+//Settings shared by the integrators
+struct path_settings {
+	int max_depth;     //bounces before a path is cut off
+	int roulette_depth; //bounces before Russian roulette starts (iterative integrator only)
+};
+
+path_settings path_config = {50, 3};
+
+/* Chapter 7 - Diffuse Materials
+* Now that objects and multiple rays per pixel are implemented we can start simulating materials
+* Beginning with diffuse (matte) materials, we will treat shapes and materials
+* as individual items which can be mixed and matched e.g. we assign a material to a sphere
+* another option is to have the material  be dependent on the shape (useful if geometry is linked to material)
+*
+* Diffuse objects that don't emit light take on the colour of their surroundings
+* and then modulate the surrounding colour with their own intrinsic colour
+*
+* Light that reflects off a diffuse surface has its direction randomised
+* Rays may also be absorbed rather than reflected, the darker the surface the more likely absorption
+*
+* We need to implement an algorithm that randomises direction, one way is as follows
+* 1. Pick a random point s, from within a a sphere tangent to the ray hitpoint, p
+* 2. Send a ray from the hitpoint, p to the random point s,
+* 
+* The sphere has a radius of N, with the center (p+N)
+* 
+* We need a way to pick a random point in a unit radius sphere centered at the origin
+* to do this we'll use a rejection method, picking a random point in the unit cube (x,y,z range -1 to 1)
+* we reject the point and try again if it lies outside the unitsphere
+*
+*/
+
+
+/*        , - ~ ~ ~ - ,
+*    , '                ' ,
+*  ,                        ,
+* ,                          ,
+*,            (p+N)           ,
+*,             X     s        '
+*,             |    /         ,
+* , (radius N) |   /          ,
+*  ,           |  /          ,
+*    ,         | /        , '
+*      ' - , _ |/ _ , - '
+* -------------p---------------
+*             (hitpoint)
+*/
+
+
+//Color function returns the colour of the background as a basic gradient
+//It blends white/blue depending on the up/down value of the rays y coordinate
+//t = 0 -> white / t = 1 -> blue
+//Known as linear interpolation (lerp), always take the form of (1-t)*start_value + t*end_value
+//Where t can be between 1 and 0
+vec3 background(const ray& r){
+    vec3 unit_direction = unit_vector(r.direction()); //Convert the direction of the ray into a unit vector (magnitude of 1)
+    real t = real(0.5)*(unit_direction.y() + 1); //Calculate some value for t depending on rays y value
+    return (1-t)*vec3(1.0,1.0,1.0) + t*vec3(0.5,0.7,1.0); //Create a vector using t (color)
+}
+
+
+vec3 color(const ray& r, hitable *world, int depth, sampler& rng);
+
+//Colour of a ray whose hit (rec) is already known, lets the first hit come from
+//somewhere else e.g. a ray packet
+vec3 color_hit(const ray& r, const hit_record& rec, hitable *world, int depth, sampler& rng){
+
+	ray scattered; //Resulting ray from material interaction
+	
+	//Attenuation is a value less than 1, unless perfect reflective surface
+	//Reflects the loss of ray intensity as it is (repeatedly) reflected and scattered
+	vec3 attenuation;
+	//Material interactions for 50 (max_depth) iterations and if ray scatters and is not absorbed
+	//Actual results of scatter function depend on type of material
+	rng.start_bounce(depth);
+	if(depth < path_config.max_depth && rec.mat_ptr->scatter(r, rec,attenuation, scattered, rng)){
+		return attenuation*color(scattered, world, depth+1, rng); //Multiply current attenuation value with results from next iteration using the new scattered ray
+	}
+	else{
+		RT_STAT(render_counters& stats = render_stats::local();
+		        if(depth < path_config.max_depth) stats.absorbed++; else stats.depth_limited++;)
+		return vec3(0,0,0);
+	}
+}
+
+
+//Chapter 7 - Updated to simulate diffuse materials
+vec3 color(const ray& r, hitable *world, int depth, sampler& rng){
+
+  hit_record rec; //Holds details of whatever object ray has hit
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.count_ray(depth);
+          if(depth == 0) stats.paths++;)
+  
+  //Is there a collision?
+  if(world->hit(r, 0.001, FLT_MAX, rec)){ //If ray hits, hit record will be updated
+	return color_hit(r, rec, world, depth, rng);
+  }
+  else{
+    //No - determine background colour
+    RT_STAT(stats.escaped++);
+    return background(r);
+  }
+}
+
+
+/* Iterative integrator with Russian roulette
+ *
+ * The recursion above can be unrolled into a loop by carrying the product of the
+ * attenuations so far (the throughput) along with the ray:
+ *
+ *   colour = a0 * (a1 * (a2 * ... * background))  =  (a0 * a1 * a2 * ...) * background
+ *
+ * so there is no stack frame per bounce.
+ *
+ * Once the throughput is small a path can barely change the pixel, yet tracing it further
+ * costs as much as any other bounce. Russian roulette stops such paths at random: after
+ * roulette_depth bounces a path survives with probability p (here the largest throughput
+ * component, at most 0.95 so even undimmed glass paths end eventually) and the survivors
+ * are scaled by 1/p. On average this gives the same result as tracing every path out
+ * (p * (x / p) + (1 - p) * 0 = x) - it is unbiased, it only trades a little noise for
+ * a lot fewer rays.
+ */
+
+//Iterative version of color_hit, continues a path whose first hit is known
+vec3 color_iterative_hit(const ray& r_in, const hit_record& rec_in, hitable *world, int depth, sampler& rng){
+
+	RT_STAT(render_counters& stats = render_stats::local());
+	ray r = r_in;
+	hit_record rec = rec_in;
+	vec3 throughput(1,1,1);
+	for(;;){
+		ray scattered;
+		vec3 attenuation;
+		if(depth >= path_config.max_depth){
+			RT_STAT(stats.depth_limited++);
+			return vec3(0,0,0);
+		}
+		rng.start_bounce(depth);
+		if(!rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng)){
+			RT_STAT(stats.absorbed++);
+			return vec3(0,0,0);
+		}
+		throughput *= attenuation;
+		depth++;
+
+		if(depth >= path_config.roulette_depth){
+			float p = fmaxf(throughput.r(), fmaxf(throughput.g(), throughput.b()));
+			if(p > 0.95f)
+				p = 0.95f;
+			if(rng.next_1d() >= p){
+				RT_STAT(stats.roulette_killed++);
+				return vec3(0,0,0);
+			}
+			throughput /= p;
+		}
+
+		r = scattered;
+		RT_STAT(stats.count_ray(depth));
+		if(!world->hit(r, 0.001, FLT_MAX, rec)){
+			RT_STAT(stats.escaped++);
+			return throughput * background(r);
+		}
+	}
+}
+
+//Iterative version of color
+vec3 color_iterative(const ray& r, hitable *world, int depth, sampler& rng){
+
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.count_ray(depth);
+	        if(depth == 0) stats.paths++;)
+
+	hit_record rec;
+	if(world->hit(r, 0.001, FLT_MAX, rec))
+		return color_iterative_hit(r, rec, world, depth, rng);
+	RT_STAT(stats.escaped++);
+	return background(r);
+}
+
+
+/* Ambient occlusion preview
+ *
+ * A quick look at the shapes of a scene without any of its materials: every camera ray that
+ * hits something sends ao_config.samples rays out over the hemisphere around the normal and
+ * the pixel gets the fraction of them that got away, from black (in a crevice) to white (open to the
+ * sky). The rays are cosine distributed (sampling.h), so the fraction is the cosine weighted
+ * visibility (1/pi) * integral of V(w) cos(theta) dw without any weights.
+ *
+ * Only whether an ambient ray is blocked matters, so they go through hitable::occluded(),
+ * which stops at the first object in the way, and blockers further away than ao_distance
+ * don't count (a closed room would be black everywhere otherwise). Rays that miss the scene
+ * show the background as usual. One ambient ray per camera ray is the default, the samples
+ * per pixel already average over many of them.
+ */
+
+//Settings of the ambient occlusion integrator
+struct ao_settings {
+	int samples; //ambient rays per camera ray
+	real distance; //blockers further away than this don't count
+};
+
+ao_settings ao_config = {1, 10};
+
+//Ambient occlusion at a hit that is already known, grey from 0 (every ray blocked) to 1
+vec3 color_ao_hit(const ray& r, const hit_record& rec, hitable *world, int depth, sampler& rng){
+
+	RT_STAT(render_counters& stats = render_stats::local());
+	vec3 n = dot(rec.normal, r.direction()) < 0 ? rec.normal : -rec.normal;
+	int open = 0;
+	for(int k = 0; k < ao_config.samples; k++){
+		rng.start_bounce(depth + k);
+		float u1 = rng.next_1d();
+		float u2 = rng.next_1d();
+		ray ambient(rec.p, local_to_world(cosine_hemisphere(u1, u2), n));
+		RT_STAT(stats.count_ray(depth + 1));
+		if(!world->occluded(ambient, 0.001, ao_config.distance))
+			open++;
+	}
+	real v = real(open) / real(ao_config.samples);
+	return vec3(v, v, v);
+}
+
+vec3 color_ao(const ray& r, hitable *world, int depth, sampler& rng){
+
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.count_ray(depth);
+	        if(depth == 0) stats.paths++;)
+
+	hit_record rec;
+	if(world->hit(r, 0.001, FLT_MAX, rec))
+		return color_ao_hit(r, rec, world, depth, rng);
+	RT_STAT(stats.escaped++);
+	return background(r);
+}
+
+
+/* Statically dispatched integrator
+ *
+ * color() reaches the scene through virtual calls every bounce, hitable::nearest and
+ * fill_record (hitable::hit) and material::scatter, so the compiler can't inline any of
+ * them into the bounce loop.
+ * color_static() is written against a Scene type instead, which provides
+ *
+ *   typedef ... material_ref;   //whatever identifies the material of a hit
+ *   bool intersect(const ray& r, real tmin, real tmax, hit_record& rec, material_ref& m) const;
+ *   bool scatter(material_ref m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const;
+ *
+ * With a closed scene (closed_scene.h, a tag and a switch over the known types) the whole
+ * bounce is one inlined loop. virtual_scene below puts the usual hitable world behind the
+ * same interface, so the same loop also runs on any scene.
+ *
+ * The loop traces the same paths as color() (same depth limit, same random numbers) but
+ * multiplies the attenuations front to back, so the result only differs by rounding.
+ */
+
+//Any hitable world seen through the Scene interface, one virtual call each
+struct virtual_scene {
+	typedef const material* material_ref;
+
+	explicit virtual_scene(const hitable* w) : world(w) {}
+
+	bool intersect(const ray& r, real tmin, real tmax, hit_record& rec, material_ref& m) const {
+		if(!world->hit(r, tmin, tmax, rec))
+			return false;
+		m = rec.mat_ptr;
+		return true;
+	}
+
+	bool scatter(material_ref m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const {
+		return m->scatter(r_in, rec, attenuation, scattered, rng);
+	}
+
+	const hitable* world;
+};
+
+template <typename Scene>
+vec3 color_static(const Scene& scene, const ray& r_in, sampler& rng){
+
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.paths++;)
+	ray r = r_in;
+	vec3 throughput(1,1,1);
+	hit_record rec;
+	typename Scene::material_ref m;
+	for(int depth = 0; ; depth++){
+		RT_STAT(stats.count_ray(depth));
+		if(!scene.intersect(r, 0.001, FLT_MAX, rec, m)){
+			RT_STAT(stats.escaped++);
+			return throughput * background(r);
+		}
+		ray scattered;
+		vec3 attenuation;
+		if(depth >= path_config.max_depth){
+			RT_STAT(stats.depth_limited++);
+			return vec3(0,0,0);
+		}
+		rng.start_bounce(depth);
+		if(!scene.scatter(m, r, rec, attenuation, scattered, rng)){
+			RT_STAT(stats.absorbed++);
+			return vec3(0,0,0);
+		}
+		throughput *= attenuation;
+		r = scattered;
+	}
+}
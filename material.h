@@ -1,6 +1,9 @@
 #include "ray.h"
 #include "hitable.h"
 #include <stdlib.h>
+#include "sampler.h"
+#include "sampling.h"
+#include "render_stats.h"
 #pragma once
 
 struct hit_record;
@@ -34,12 +37,10 @@ struct hit_record;
  */
 
 //This function returns our random point (s) that falls within the unit sphere
-	vec3 random_in_unit_sphere() {
-	vec3 p;
-	do{
-		p = 2.0*vec3(drand48(), drand48(), drand48()) - vec3(1,1,1);
-	}while (p.squared_length() >= 1.0);
-	return p;
+//(closed form, see sampling.h - a rejection loop would draw an unknown count of numbers)
+inline vec3 random_in_unit_sphere(sampler& rng) {
+	float u1 = rng.next_1d(), u2 = rng.next_1d();
+	return uniform_ball(u1, u2, rng.next_1d());
 }
  
 
@@ -71,9 +72,21 @@ inline vec3 reflect(const vec3& v, const vec3& n){
 	return v - 2*dot(v,n)*n;
 }
 
+//Tag for each concrete material, lets hits be grouped by material type (see wavefront.h)
+enum material_type { MATERIAL_LAMBERTIAN, MATERIAL_METAL, MATERIAL_DIELECTRIC, MATERIAL_OTHER, MATERIAL_TYPES };
+static_assert(MATERIAL_TYPES == STAT_MATERIAL_TYPES, "render_stats.h keeps one counter per material_type");
+
 class material{
 	public:
-		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
+		virtual ~material() {}
+		//rng supplies the random numbers for this bounce (see sampler.h)
+		//Implementations count their calls into render_stats (scatter_calls of their type)
+		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const = 0;
+		virtual material_type type() const { return MATERIAL_OTHER; }
+		//For the denoiser's auxiliary buffers (denoise.h): the colour of the surface, and whether it
+		//scatters every ray the same way (mirror, glass), so the buffers should show what it reflects
+		virtual vec3 surface_albedo(const hit_record& rec) const { return vec3(1,1,1); }
+		virtual bool specular() const { return false; }
 };
 
 /* Chapter 8
@@ -93,9 +106,19 @@ class material{
 	 
 	 public:
 		lambertian(const vec3& a) : albedo(a) {}
-		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const{
-			vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-			scattered = ray(rec.p, target-rec.p);
+		virtual material_type type() const { return MATERIAL_LAMBERTIAN; }
+		virtual vec3 surface_albedo(const hit_record& rec) const { return albedo; }
+		//Directions with density cos(theta)/pi around the normal, Lambert's law (the book's
+		//normal + random_in_unit_sphere() leans further towards the normal)
+		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const{
+			float u1 = rng.next_1d(), u2 = rng.next_1d();
+			return scatter_local(rec, cosine_hemisphere(u1, u2), attenuation, scattered);
+		}
+		//The rest of scatter once the cosine weighted direction around the normal is drawn
+		//(wavefront.h draws the directions of a whole queue at once)
+		inline bool scatter_local(const hit_record& rec, const vec3& local, vec3& attenuation, ray& scattered) const{
+			RT_STAT(render_stats::local().scatter_calls[MATERIAL_LAMBERTIAN]++);
+			scattered = ray(rec.p, local_to_world(local, rec.normal));
 			attenuation = albedo;
 			return true;
 		}
@@ -218,17 +241,17 @@ class material{
 
 //Refract takes in incident vector, normal vector, refraction index ratio
 //Updates the refracted vector and returns true / false if refraction occurs
-bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted){
+bool refract(const vec3& v, const vec3& n, real ni_over_nt, vec3& refracted){
 	
 	vec3 uv = unit_vector(v); //Unit vector - direction of incident vector
-	float dt = dot(uv, n);  //Multiply unit vector by normal
+	real dt = dot(uv, n);  //Multiply unit vector by normal
 	
 	//If the discriminant is >0 there is a collision
 	//1 - (N1/N2)^2 * (1 - dt^2)
-	float discriminant = 1.0 - ni_over_nt * ni_over_nt * (1-dt*dt);
+	real discriminant = 1 - ni_over_nt * ni_over_nt * (1-dt*dt);
 	if (discriminant > 0){
 		//Update the outgoing refracted ray
-		refracted = ni_over_nt*(uv - n * dt) - n * sqrt(discriminant);
+		refracted = ni_over_nt*(uv - n * dt) - n * std::sqrt(discriminant);
 		return true; //True, refraction has occurred
 	}
 	else
@@ -236,26 +259,31 @@ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted){
 }
 
 //Reflectivity varies with angle, a simple approximate developed by Christopher Schlick can be used
-float schlick(float cosine, float ref_idx){
-	float r0 = (1 - ref_idx) / (1 + ref_idx);
+//(1-cosine)^5 is multiplied out, pow would go through double
+real schlick(real cosine, real ref_idx){
+	real r0 = (1 - ref_idx) / (1 + ref_idx);
 	r0 = r0+r0;
-	return r0 + (1-r0)*pow((1-cosine),5);	
+	real m = 1 - cosine, m2 = m*m;
+	return r0 + (1-r0)*m2*m2*m;
 }
 
 class dielectric : public material{
 	public:
 	
 		dielectric(float ri) : ref_idx(ri) {} //ri - refractive index of material
+		virtual material_type type() const { return MATERIAL_DIELECTRIC; }
+		virtual bool specular() const { return true; }
 	
-		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const {
 	
+			RT_STAT(render_stats::local().scatter_calls[MATERIAL_DIELECTRIC]++);
 			vec3 outward_normal;  
 			vec3 reflected = reflect(r_in.direction(), rec.normal); //Determine direction if ray were reflected
-			float ni_over_nt;
+			real ni_over_nt;
 			attenuation = vec3(1.0,1.0,1.0);
 			vec3 refracted;
-			float reflect_prob;
-			float cosine;
+			real reflect_prob;
+			real cosine;
 			
 			//Determine which way normal is pointing
 			if(dot(r_in.direction(), rec.normal) > 0){
@@ -265,7 +293,7 @@ class dielectric : public material{
 			}
 			else{
 				outward_normal = rec.normal;
-				ni_over_nt = 1.0 / ref_idx;
+				ni_over_nt = 1 / ref_idx;
 				cosine = -dot(r_in.direction(), rec.normal) / r_in.direction().length();
 			}
 			
@@ -275,12 +303,13 @@ class dielectric : public material{
 			}
 			//If reflection occurs reflection probability is 1.0
 			else{
+				RT_STAT(render_stats::local().total_internal_reflections++);
 				//scattered = ray(rec.p, reflected);
-				reflect_prob = 1.0;
+				reflect_prob = 1;
 			}
 			
 			//Determine if refraction or reflection has occurred
-			if(drand48() < reflect_prob){
+			if(rng.next_1d() < reflect_prob){
 				scattered = ray(rec.p, reflected);
 			}
 			else{
@@ -331,11 +360,18 @@ class dielectric : public material{
 class metal : public material {
 	public:
 		metal(const vec3& a, float f) : albedo(a) {if (f < 1) fuzz = f; else fuzz = 1;}
-		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const{			
+		virtual material_type type() const { return MATERIAL_METAL; }
+		virtual vec3 surface_albedo(const hit_record& rec) const { return albedo; }
+		virtual bool specular() const { return fuzz == 0; }
+		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng) const{			
 			vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal); //direction of reflected ray
-			scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere()); //Create a scattered ray using origin of r_in and reflected direction multiplied by fuzz value
+			scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(rng)); //Create a scattered ray using origin of r_in and reflected direction multiplied by fuzz value
 			attenuation = albedo;
-			return (dot(scattered.direction(), rec.normal) > 0);
+			bool above = dot(scattered.direction(), rec.normal) > 0; //below the surface the ray is absorbed
+			RT_STAT(render_counters& stats = render_stats::local();
+			        stats.scatter_calls[MATERIAL_METAL]++;
+			        if(!above) stats.scatter_absorbed[MATERIAL_METAL]++;)
+			return above;
 			
 		}
 		
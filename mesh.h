@@ -0,0 +1,262 @@
+#include "hitable.h"
+#include "bvh.h"
+#include "material.h"
+#include "render_stats.h"
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <math.h>
+#pragma once
+
+//Triangle meshes
+
+/*
+ * A mesh stores its vertices once and its triangles as indices into them, the way OBJ and
+ * PLY files hold them:
+ *
+ *   vertices   [ v0 | v1 | v2 | v3 | ... ]          3 floats per vertex
+ *   triangles  [ 0 1 2 | 2 1 3 | ... ]              3 uint32 per triangle, in bvh leaf order
+ *
+ * A closed mesh has about twice as many triangles as vertices, so that is 18 bytes per
+ * triangle plus the bvh, against a hitable per triangle (vtable, material and three vertex
+ * copies, then a bvh over those objects) at well over 60. The mesh is one hitable with its
+ * own bvh over the triangles, the scene's bvh only sees its box.
+ *
+ * Ray/triangle test - watertight (Woop, Benthin, Wald 2013)
+ * The usual test (Moller-Trumbore) computes the barycentric coordinates of each triangle
+ * on its own, and rounding can leave a ray through the shared edge of two triangles missing
+ * both: dark specks along the edges of a mesh. The watertight test moves the ray to the
+ * origin and shears space so the ray points along +z,
+ *
+ *   kz = axis where |d| is largest, kx, ky the other two
+ *   x' = x - (d[kx]/d[kz])*z,   y' = y - (d[ky]/d[kz])*z
+ *
+ * after which the hit test is 2D: is the origin inside the triangle (x', y')? The three
+ * edge functions
+ *
+ *   U = Cx*By - Cy*Bx,   V = Ax*Cy - Ay*Cx,   W = Bx*Ay - By*Ax
+ *
+ * are computed from the same (sheared) vertex values by both triangles sharing an edge, so
+ * the edge function of that edge has exactly opposite signs in the two triangles: a ray is
+ * always inside at least one of them. The ray hits if U, V and W have the same sign, and the
+ * distance follows from interpolating the sheared z with them. Edge functions that round to
+ * exactly zero are computed again in double, as the paper does.
+ *
+ * The shear only depends on the ray, so it is set up once per ray (triangle_ray), and the test
+ * itself is the same straight line arithmetic for every triangle with a single branch on
+ * the result, which suits the compiler's vectoriser and a SIMD version alike.
+ *
+ * The normal is the geometric normal cross(b-a, c-a), which points out of a closed mesh
+ * whose triangles are counter clockwise seen from outside (the OBJ and PLY convention), the
+ * way a sphere's normal points out of it. Only the closest triangle gets a normal.
+ *
+ * A mesh needn't be closed though (a quad, a leaf, a mesh with holes), and lambertian and
+ * metal scatter on the side the normal is on: seen from behind, a metal triangle would
+ * reflect into itself and come out black. So the normal is turned towards the ray for every
+ * material except a dielectric, which needs the outward normal to tell a ray entering the
+ * mesh from one leaving it (material.h).
+ */
+
+//The ray in the sheared space of the watertight test
+struct triangle_ray {
+
+	triangle_ray(const ray& r) : origin(r.origin()) {
+		vec3 d = r.direction();
+		kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2) : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+		kx = kz == 2 ? 0 : kz + 1;
+		ky = kx == 2 ? 0 : kx + 1;
+		//Keep the winding of the triangles when looking down -z
+		if(d[kz] < 0){
+			int k = kx; kx = ky; ky = k;
+		}
+		sx = d[kx] / d[kz];
+		sy = d[ky] / d[kz];
+		sz = 1 / d[kz];
+	}
+
+	vec3 origin;
+	int kx, ky, kz;
+	real sx, sy, sz;
+};
+
+//Watertight ray/triangle test, true with t set if the ray hits (a, b, c) with tmin < t < tmax
+inline bool hit_triangle(const triangle_ray& tr, const vec3& a, const vec3& b, const vec3& c, real tmin, real tmax, real& t){
+
+	vec3 A = a - tr.origin, B = b - tr.origin, C = c - tr.origin;
+	real ax = A[tr.kx] - tr.sx*A[tr.kz], ay = A[tr.ky] - tr.sy*A[tr.kz];
+	real bx = B[tr.kx] - tr.sx*B[tr.kz], by = B[tr.ky] - tr.sy*B[tr.kz];
+	real cx = C[tr.kx] - tr.sx*C[tr.kz], cy = C[tr.ky] - tr.sy*C[tr.kz];
+
+	real u = cx*by - cy*bx;
+	real v = ax*cy - ay*cx;
+	real w = bx*ay - by*ax;
+	if(u == 0 || v == 0 || w == 0){
+		u = real(double(cx)*double(by) - double(cy)*double(bx));
+		v = real(double(ax)*double(cy) - double(ay)*double(cx));
+		w = real(double(bx)*double(ay) - double(by)*double(ax));
+	}
+	if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		return false;
+	real det = u + v + w;
+	if(det == 0)
+		return false; //ray in the plane of the triangle or a degenerate triangle
+
+	real T = u*(tr.sz*A[tr.kz]) + v*(tr.sz*B[tr.kz]) + w*(tr.sz*C[tr.kz]);
+	t = T / det;
+	return t > tmin && t < tmax;
+
+}
+
+
+class triangle_mesh: public hitable {
+
+  public:
+    triangle_mesh() : mat_ptr(NULL) {}
+    //Takes the contents of vertices and triangles (3 indices per triangle) and builds the bvh
+    triangle_mesh(std::vector<vec3>& vertices, std::vector<uint32_t>& triangles, material* m, int max_leaf_size = 4) : mat_ptr(m) {
+      build(vertices, triangles, max_leaf_size);
+    }
+
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    std::vector<vec3> positions;
+    std::vector<uint32_t> indices; //3 per triangle, in leaf order
+    std::vector<bvh_node_data> nodes;
+    material* mat_ptr;
+    std::string source; //file the mesh was read from, for writing the scene back out
+
+  private:
+    void build(std::vector<vec3>& vertices, std::vector<uint32_t>& triangles, int max_leaf_size);
+
+};
+
+
+void triangle_mesh::build(std::vector<vec3>& vertices, std::vector<uint32_t>& triangles, int max_leaf_size){
+
+  positions.swap(vertices);
+  size_t n = triangles.size() / 3;
+  std::vector<aabb> boxes(n);
+  for (size_t i = 0; i < n; i++) {
+    const uint32_t* tri = &triangles[3*i];
+    aabb box;
+    box.grow(positions[tri[0]]);
+    box.grow(positions[tri[1]]);
+    box.grow(positions[tri[2]]);
+    boxes[i] = box;
+  }
+
+  std::vector<int> order;
+  bvh_builder(boxes, max_leaf_size).build(nodes, order);
+
+  //Triangles in leaf order, so a leaf reads consecutive indices
+  indices.resize(3*n);
+  for (size_t i = 0; i < n; i++) {
+    const uint32_t* tri = &triangles[3*size_t(order[i])];
+    indices[3*i] = tri[0];
+    indices[3*i+1] = tri[1];
+    indices[3*i+2] = tri[2];
+  }
+  std::vector<uint32_t>().swap(triangles);
+
+}
+
+
+bool triangle_mesh::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
+
+  if (nodes.empty())
+    return false;
+
+  triangle_ray tr(r);
+  const vec3* v = &positions[0];
+  const uint32_t* tri = &indices[0];
+  int closest = -1;
+  RT_STAT(int tests = 0, successes = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    bool hit_leaf = false;
+    RT_STAT(tests += count);
+    for (int i = first; i < first + count; i++) {
+      const uint32_t* k = tri + 3*size_t(i);
+      real t;
+      if (hit_triangle(tr, v[k[0]], v[k[1]], v[k[2]], tmin, closest_so_far, t)) {
+        RT_STAT(successes++);
+        hit_leaf = true;
+        closest_so_far = t;
+        closest = i;
+      }
+    }
+    return hit_leaf;
+  };
+
+  bool hit_anything = bvh_traverse(&nodes[0], r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += successes;)
+  if (!hit_anything)
+    return false;
+  id.prim = this;
+  id.index = closest;
+  id.depth = 0;
+  return true;
+
+}
+
+
+//Geometric normal of the triangle that was hit, facing the ray unless the mesh is a dielectric
+void triangle_mesh::fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const {
+
+  const vec3* v = &positions[0];
+  const uint32_t* k = &indices[3*size_t(id.index)];
+  vec3 n = unit_vector(cross(v[k[1]] - v[k[0]], v[k[2]] - v[k[0]]));
+  if ((!mat_ptr || mat_ptr->type() != MATERIAL_DIELECTRIC) && dot(r.direction(), n) > 0)
+    n = -n;
+  rec.t = t;
+  rec.p = r.point_at_parameter(t);
+  rec.normal = n;
+  rec.mat_ptr = mat_ptr;
+
+}
+
+
+//Stops at the first triangle in the way
+bool triangle_mesh::occluded(const ray& r, real tmin, real tmax) const {
+
+  if (nodes.empty())
+    return false;
+
+  triangle_ray tr(r);
+  const vec3* v = &positions[0];
+  const uint32_t* tri = &indices[0];
+  RT_STAT(int tests = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    for (int i = first; i < first + count; i++) {
+      const uint32_t* k = tri + 3*size_t(i);
+      real t;
+      RT_STAT(tests++);
+      if (hit_triangle(tr, v[k[0]], v[k[1]], v[k[2]], tmin, closest_so_far, t))
+        return true;
+    }
+    return false;
+  };
+
+  bool blocked = bvh_traverse<true>(&nodes[0], r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += blocked;)
+  return blocked;
+
+}
+
+
+bool triangle_mesh::bounding_box(aabb& box) const {
+
+  if (nodes.empty())
+    return false;
+  box = nodes[0].box;
+  return true;
+
+}
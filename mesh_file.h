@@ -0,0 +1,505 @@
+#include "mesh.h"
+#include "arena.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#pragma once
+
+//Mesh files
+
+/*
+ * read_mesh_file() reads the vertex positions and faces of an OBJ or PLY file (ascii, binary
+ * little or big endian) into the buffers of a triangle_mesh, everything else in the file
+ * (normals, texture coordinates, colours, groups, materials) is skipped.
+ *
+ * The file is memory mapped and parsed where it lies in the mapping, no line or token is
+ * copied out of it, so the only memory a mesh needs on top of the page cache is the final
+ * vertex and index buffers. Those are sized before they are filled, an OBJ is scanned once
+ * for its vertex and face counts (a PLY header holds them), so they don't grow by doubling
+ * and copying either. The pages are read ahead and can be dropped as soon as they have
+ * been parsed (MADV_SEQUENTIAL), so a file larger than memory streams through.
+ *
+ *   OBJ    v x y z           vertex (an optional w and colours are ignored)
+ *          f 1 2 3 4         face, 1 based, negative indices count back from the last
+ *                            vertex, i/t/n forms use the vertex index only
+ *   PLY    element vertex N with float or double x y z properties,
+ *          element face N with a list property vertex_indices (or vertex_index)
+ *
+ * Polygons are split into a fan of triangles.
+ */
+
+//A read only mapping of a whole file
+class mapped_file {
+
+  public:
+    mapped_file() : data(NULL), size(0) {}
+    ~mapped_file() { if (data) munmap(data, size); }
+
+    bool open(const std::string& path, std::string& error){
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        error = "can't open " + path;
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        error = path + " is empty";
+        return false;
+      }
+      size = size_t(st.st_size);
+      data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (data == MAP_FAILED) {
+        data = NULL;
+        error = "can't map " + path;
+        return false;
+      }
+      madvise(data, size, MADV_SEQUENTIAL);
+      return true;
+    }
+
+    const char* begin() const { return static_cast<const char*>(data); }
+    const char* end() const { return static_cast<const char*>(data) + size; }
+
+  private:
+    mapped_file(const mapped_file&);
+    mapped_file& operator=(const mapped_file&);
+
+    void* data;
+    size_t size;
+
+};
+
+
+//Number parsing on [p, end), the mapping isn't NUL terminated so the strto* functions can't
+//be used on it. p is left after the number
+
+inline void skip_blanks(const char*& p, const char* end){
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+}
+
+inline bool parse_int(const char*& p, const char* end, long long& v){
+  skip_blanks(p, end);
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+  const char* start = p;
+  v = 0;
+  while (p < end && *p >= '0' && *p <= '9' && p - start < 18)
+    v = 10*v + (*p++ - '0');
+  if (p == start || (p < end && *p >= '0' && *p <= '9'))
+    return false;
+  if (negative) v = -v;
+  return true;
+}
+
+//Up to 19 significant digits are used
+inline bool parse_double(const char*& p, const char* end, double& v){
+  static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  skip_blanks(p, end);
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+    if (digits < 19) { mantissa = 10*mantissa + (*p - '0'); if (mantissa) digits++; }
+    else exponent++;
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+      if (digits < 19) { mantissa = 10*mantissa + (*p - '0'); if (mantissa) digits++; exponent--; }
+    }
+  }
+  if (!any)
+    return false;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    long long e;
+    if (!parse_int(p, end, e))
+      return false;
+    exponent += int(e < -1000 ? -1000 : (e > 1000 ? 1000 : e));
+  }
+  double value = double(mantissa);
+  if (exponent < 0)
+    value = -exponent <= 22 ? value / powers[-exponent] : value * pow(10.0, exponent);
+  else if (exponent > 0)
+    value = exponent <= 22 ? value * powers[exponent] : value * pow(10.0, exponent);
+  v = negative ? -value : value;
+  return true;
+}
+
+inline bool parse_float(const char*& p, const char* end, float& v){
+  double d;
+  if (!parse_double(p, end, d))
+    return false;
+  v = float(d);
+  return true;
+}
+
+//True if the next character ends a token
+inline bool at_token_end(const char* p, const char* end){
+  return p == end || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n';
+}
+
+inline const char* line_end(const char* p, const char* end){
+  const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+  return eol ? eol : end;
+}
+
+
+//OBJ
+
+//Adds the triangles of the polygon fan (first, previous, index) as each index comes in
+struct fan_builder {
+  fan_builder(std::vector<uint32_t>& t) : triangles(t), count(0) {}
+
+  void add(uint32_t index){
+    if (count >= 2) {
+      triangles.push_back(first);
+      triangles.push_back(previous);
+      triangles.push_back(index);
+    }
+    if (count == 0) first = index;
+    previous = index;
+    count++;
+  }
+
+  std::vector<uint32_t>& triangles;
+  uint32_t first, previous;
+  int count;
+};
+
+bool read_obj(const char* begin, const char* end, const std::string& path, std::vector<vec3>& vertices,
+              std::vector<uint32_t>& triangles, std::string& error){
+
+  //Count vertices and triangles first so the buffers are allocated once
+  size_t vertex_count = 0, triangle_count = 0;
+  for (const char* p = begin; p < end; ) {
+    const char* eol = line_end(p, end);
+    skip_blanks(p, eol);
+    if (eol - p > 1 && p[1] <= ' ') {
+      if (p[0] == 'v')
+        vertex_count++;
+      else if (p[0] == 'f') {
+        int corners = 0;
+        for (p++; p < eol; ) {
+          skip_blanks(p, eol);
+          if (p == eol) break;
+          corners++;
+          while (p < eol && !at_token_end(p, eol)) p++;
+        }
+        if (corners > 2)
+          triangle_count += corners - 2;
+      }
+    }
+    p = eol + 1;
+  }
+  vertices.clear();
+  triangles.clear();
+  vertices.reserve(vertex_count);
+  triangles.reserve(3*triangle_count);
+
+  size_t line_number = 0;
+  for (const char* p = begin; p < end; ) {
+    const char* eol = line_end(p, end);
+    line_number++;
+    skip_blanks(p, eol);
+    bool ok = true;
+    if (eol - p > 1 && p[0] == 'v' && p[1] <= ' ') {
+      float x, y, z;
+      p++;
+      ok = parse_float(p, eol, x) && parse_float(p, eol, y) && parse_float(p, eol, z);
+      if (ok)
+        vertices.push_back(vec3(x, y, z));
+    }
+    else if (eol - p > 1 && p[0] == 'f' && p[1] <= ' ') {
+      fan_builder fan(triangles);
+      p++;
+      for (;;) {
+        skip_blanks(p, eol);
+        if (p == eol)
+          break;
+        long long index;
+        if (!parse_int(p, eol, index) || index == 0) {
+          ok = false;
+          break;
+        }
+        //Relative indices refer to the vertices read so far
+        index = index < 0 ? (long long)vertices.size() + index : index - 1;
+        if (index < 0 || index > 0xffffffffLL) {
+          ok = false;
+          break;
+        }
+        fan.add(uint32_t(index));
+        while (p < eol && !at_token_end(p, eol)) p++; //texture and normal indices
+      }
+      ok = ok && fan.count >= 3;
+    }
+    if (!ok) {
+      error = path + ":" + std::to_string(line_number) + ": can't read this line";
+      return false;
+    }
+    p = eol + 1;
+  }
+  return true;
+
+}
+
+
+//PLY
+
+enum ply_type { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_NONE };
+
+inline ply_type ply_type_named(const std::string& name){
+  static const char* const names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                                         {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+  for (int k = 0; k < PLY_NONE; k++)
+    if (name == names[k][0] || name == names[k][1])
+      return ply_type(k);
+  return PLY_NONE;
+}
+
+inline int ply_type_size(ply_type type){
+  static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+  return sizes[type];
+}
+
+struct ply_property {
+  std::string name;
+  ply_type type;
+  ply_type count_type; //PLY_NONE unless the property is a list
+};
+
+struct ply_element {
+  std::string name;
+  size_t count;
+  std::vector<ply_property> properties;
+};
+
+//Reads values of a ply body one at a time, ascii or binary
+struct ply_reader {
+  const char* p;
+  const char* end;
+  bool ascii;
+  bool swap; //big endian file
+
+  bool value(ply_type type, double& v){
+    if (ascii) {
+      if (!parse_double(p, end, v) || !at_token_end(p, end))
+        return false;
+      //Skip to the next token, across line ends
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+      return true;
+    }
+    int size = ply_type_size(type);
+    if (end - p < size)
+      return false;
+    unsigned char b[8];
+    memcpy(b, p, size);
+    p += size;
+    if (swap)
+      for (int k = 0; k < size/2; k++) { unsigned char t = b[k]; b[k] = b[size-1-k]; b[size-1-k] = t; }
+    switch (type) {
+      case PLY_INT8: { int8_t x; memcpy(&x, b, 1); v = x; break; }
+      case PLY_UINT8: v = b[0]; break;
+      case PLY_INT16: { int16_t x; memcpy(&x, b, 2); v = x; break; }
+      case PLY_UINT16: { uint16_t x; memcpy(&x, b, 2); v = x; break; }
+      case PLY_INT32: { int32_t x; memcpy(&x, b, 4); v = x; break; }
+      case PLY_UINT32: { uint32_t x; memcpy(&x, b, 4); v = x; break; }
+      case PLY_FLOAT32: { float x; memcpy(&x, b, 4); v = x; break; }
+      default: { double x; memcpy(&x, b, 8); v = x; break; }
+    }
+    return true;
+  }
+};
+
+bool read_ply(const char* begin, const char* end, const std::string& path, std::vector<vec3>& vertices,
+              std::vector<uint32_t>& triangles, std::string& error){
+
+  //Header, one statement per line up to end_header
+  std::vector<ply_element> elements;
+  std::string format;
+  const char* p = begin;
+  bool header_done = false;
+  while (p < end && !header_done) {
+    const char* line = p;
+    const char* eol = line_end(p, end);
+    std::vector<std::string> words;
+    for (const char* q = p; ; ) {
+      skip_blanks(q, eol);
+      if (q == eol) break;
+      const char* start = q;
+      while (q < eol && !at_token_end(q, eol)) q++;
+      words.push_back(std::string(start, q));
+    }
+    p = eol + 1;
+    if (words.empty() || words[0] == "ply" || words[0] == "comment" || words[0] == "obj_info")
+      continue;
+    bool ok = true;
+    if (words[0] == "end_header")
+      header_done = true;
+    else if (words[0] == "format" && words.size() == 3)
+      format = words[1];
+    else if (words[0] == "element" && words.size() == 3) {
+      ply_element e;
+      e.name = words[1];
+      e.count = strtoull(words[2].c_str(), NULL, 10);
+      elements.push_back(e);
+    }
+    else if (words[0] == "property" && !elements.empty()) {
+      ply_property prop;
+      if (words.size() == 5 && words[1] == "list") {
+        prop.count_type = ply_type_named(words[2]);
+        prop.type = ply_type_named(words[3]);
+        prop.name = words[4];
+        ok = prop.count_type != PLY_NONE && prop.type != PLY_NONE;
+      }
+      else if (words.size() == 3) {
+        prop.count_type = PLY_NONE;
+        prop.type = ply_type_named(words[1]);
+        prop.name = words[2];
+        ok = prop.type != PLY_NONE;
+      }
+      else
+        ok = false;
+      elements.back().properties.push_back(prop);
+    }
+    else
+      ok = false;
+    if (!ok) {
+      error = path + ": can't read the header line \"" + std::string(line, eol) + "\"";
+      return false;
+    }
+  }
+  if (!header_done || (format != "ascii" && format != "binary_little_endian" && format != "binary_big_endian")) {
+    error = path + " is not a ply file";
+    return false;
+  }
+
+  const uint16_t one = 1;
+  bool little_endian_host = *reinterpret_cast<const unsigned char*>(&one) == 1;
+  ply_reader in = {p, end, format == "ascii", format != "ascii" && (format == "binary_big_endian") == little_endian_host};
+  if (in.ascii)
+    while (in.p < end && (*in.p == ' ' || *in.p == '\t' || *in.p == '\r' || *in.p == '\n')) in.p++;
+
+  vertices.clear();
+  triangles.clear();
+  for (size_t e = 0; e < elements.size(); e++) {
+    const ply_element& element = elements[e];
+    //Where x, y, z and the face indices are among the properties
+    int position[3] = {-1, -1, -1}, face_list = -1;
+    //Every value takes at least a byte, so a damaged count can't reserve more than the file holds
+    size_t fits = std::min(element.count, size_t(end - in.p) / std::max<size_t>(1, element.properties.size()));
+    for (size_t k = 0; k < element.properties.size(); k++) {
+      const ply_property& prop = element.properties[k];
+      if (element.name == "vertex" && prop.count_type == PLY_NONE && prop.name.size() == 1 && prop.name[0] >= 'x' && prop.name[0] <= 'z')
+        position[prop.name[0] - 'x'] = int(k);
+      if (element.name == "face" && prop.count_type != PLY_NONE && (prop.name == "vertex_indices" || prop.name == "vertex_index"))
+        face_list = int(k);
+    }
+    if (element.name == "vertex") {
+      if (position[0] < 0 || position[1] < 0 || position[2] < 0) {
+        error = path + " has vertices without x, y and z";
+        return false;
+      }
+      vertices.reserve(fits);
+    }
+    if (element.name == "face") {
+      if (face_list < 0) {
+        error = path + " has faces without vertex_indices";
+        return false;
+      }
+      triangles.reserve(3*fits);
+    }
+
+    for (size_t i = 0; i < element.count; i++) {
+      double xyz[3] = {0, 0, 0};
+      fan_builder fan(triangles);
+      for (size_t k = 0; k < element.properties.size(); k++) {
+        const ply_property& prop = element.properties[k];
+        double v;
+        if (!in.value(prop.count_type == PLY_NONE ? prop.type : prop.count_type, v))
+          goto truncated;
+        if (prop.count_type == PLY_NONE) {
+          for (int a = 0; a < 3; a++)
+            if (position[a] == int(k)) xyz[a] = v;
+          continue;
+        }
+        size_t n = size_t(v);
+        for (size_t j = 0; j < n; j++) {
+          double index;
+          if (!in.value(prop.type, index))
+            goto truncated;
+          if (int(k) == face_list) {
+            if (index < 0 || index > double(0xffffffffu)) {
+              error = path + " has a face index out of range";
+              return false;
+            }
+            fan.add(uint32_t(index));
+          }
+        }
+      }
+      if (element.name == "vertex")
+        vertices.push_back(vec3(float(xyz[0]), float(xyz[1]), float(xyz[2])));
+    }
+  }
+  return true;
+
+truncated:
+  error = path + " is truncated or has a malformed value";
+  return false;
+
+}
+
+
+//Reads an OBJ or PLY file (told apart by the "ply" that starts a PLY file), false with error
+//set if it can't be read or refers to vertices it doesn't have
+bool read_mesh_file(const std::string& path, std::vector<vec3>& vertices, std::vector<uint32_t>& triangles, std::string& error){
+
+  mapped_file file;
+  if (!file.open(path, error))
+    return false;
+  bool ply = file.end() - file.begin() >= 4 && memcmp(file.begin(), "ply", 3) == 0 && (file.begin()[3] == '\n' || file.begin()[3] == '\r');
+  if (!(ply ? read_ply(file.begin(), file.end(), path, vertices, triangles, error)
+            : read_obj(file.begin(), file.end(), path, vertices, triangles, error)))
+    return false;
+
+  for (size_t k = 0; k < triangles.size(); k++) {
+    if (triangles[k] >= vertices.size()) {
+      error = path + " has a face using vertex " + std::to_string(triangles[k] + 1) + " of " + std::to_string(vertices.size());
+      return false;
+    }
+  }
+  if (triangles.empty()) {
+    error = path + " has no faces";
+    return false;
+  }
+  return true;
+
+}
+
+
+//Reads a mesh file into a triangle_mesh created in the arena, NULL with error set if it can't
+triangle_mesh* load_mesh(const std::string& path, material* m, scene_arena& arena, std::string& error){
+
+  std::vector<vec3> vertices;
+  std::vector<uint32_t> triangles;
+  if (!read_mesh_file(path, vertices, triangles, error))
+    return NULL;
+  triangle_mesh* mesh = arena.make<triangle_mesh>(vertices, triangles, m);
+  char* absolute = realpath(path.c_str(), NULL);
+  mesh->source = absolute ? absolute : path;
+  free(absolute);
+  return mesh;
+
+}
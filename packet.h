@@ -0,0 +1,289 @@
+#include "sphere_pack.h"
+#include "bvh.h"
+#include <float.h>
+#pragma once
+
+//Ray packets
+
+/*
+ * Camera rays through neighbouring pixels start at (nearly) the same point and point in
+ * nearly the same direction, so they visit almost the same bvh nodes. A packet traces
+ * a block of them (4x4 or 8x8 pixels) through the tree together:
+ *
+ *  - every node is fetched once for the whole packet instead of once per ray
+ *  - the per-ray box tests run over structure-of-arrays lanes in a plain loop
+ *    that the compiler turns into SIMD instructions
+ *  - if every ray direction has the same sign on each axis the packet is bounded by a
+ *    frustum (intervals of origins and inverse directions), and a box the frustum misses
+ *    is rejected without looking at any individual ray
+ *
+ * Leaves turn the loops around compared to sphere_pack's kernels: one sphere at a time
+ * is tested against 8 (AVX2) or 16 (AVX-512) rays at once. Rays only stay coherent up to their first hit,
+ * after that (diffuse bounces) they are traced one at a time again.
+ */
+
+const int MAX_PACKET_RAYS = 64;
+
+struct ray_packet {
+
+	//Loads rays into the packet and resets the hits
+	void load(const ray* rays, int count){
+		n = count;
+		coherent = true;
+		for(int l = 0; l < n; l++){
+			vec3 o = rays[l].origin(), d = rays[l].direction();
+			ox[l] = o.x(); oy[l] = o.y(); oz[l] = o.z();
+			dx[l] = d.x(); dy[l] = d.y(); dz[l] = d.z();
+			ix[l] = 1.0f/d.x(); iy[l] = 1.0f/d.y(); iz[l] = 1.0f/d.z();
+			dd[l] = dot(d, d);
+			tmax[l] = FLT_MAX;
+			index[l] = -1;
+			if(l > 0 && (d_zero(l) || (d.x() < 0) != (dx[0] < 0) || (d.y() < 0) != (dy[0] < 0) || (d.z() < 0) != (dz[0] < 0)))
+				coherent = false;
+		}
+		if(d_zero(0))
+			coherent = false;
+		//Pad to a whole group of 16 lanes with rays that can never hit anything
+		for(int l = n; l < ((n + 15) & ~15); l++){
+			ox[l] = oy[l] = oz[l] = 0;
+			dx[l] = dy[l] = dz[l] = ix[l] = iy[l] = iz[l] = dd[l] = 1;
+			tmax[l] = -FLT_MAX;
+			index[l] = -1;
+		}
+		if(coherent)
+			build_frustum();
+	}
+
+	bool d_zero(int l) const { return dx[l] == 0 || dy[l] == 0 || dz[l] == 0; }
+
+	//Bounds of the origins and inverse directions on every axis
+	void build_frustum(){
+		const float* o[3] = {ox, oy, oz};
+		const float* inv[3] = {ix, iy, iz};
+		for(int a = 0; a < 3; a++){
+			o_lo[a] = o_hi[a] = o[a][0];
+			inv_lo[a] = inv_hi[a] = inv[a][0];
+			for(int l = 1; l < n; l++){
+				o_lo[a] = fminf(o_lo[a], o[a][l]);
+				o_hi[a] = fmaxf(o_hi[a], o[a][l]);
+				inv_lo[a] = fminf(inv_lo[a], inv[a][l]);
+				inv_hi[a] = fmaxf(inv_hi[a], inv[a][l]);
+			}
+		}
+	}
+
+	//True if no ray of the packet can enter the box before far
+	//Interval arithmetic: t = (plane - o) * inv over all o and inv in their ranges
+	bool frustum_misses(const aabb& box, float tmin, float far) const {
+		float tnear = tmin, tfar = far;
+		vec3 lo = box.min(), hi = box.max();
+		for(int a = 0; a < 3; a++){
+			bool neg = inv_lo[a] < 0;
+			float near_plane = neg ? hi[a] : lo[a];
+			float far_plane = neg ? lo[a] : hi[a];
+			float n0 = (near_plane - o_hi[a]), n1 = (near_plane - o_lo[a]);
+			float f0 = (far_plane - o_hi[a]), f1 = (far_plane - o_lo[a]);
+			float near_lo = fminf(fminf(n0*inv_lo[a], n0*inv_hi[a]), fminf(n1*inv_lo[a], n1*inv_hi[a]));
+			float far_hi = fmaxf(fmaxf(f0*inv_lo[a], f0*inv_hi[a]), fmaxf(f1*inv_lo[a], f1*inv_hi[a]));
+			tnear = fmaxf(tnear, near_lo);
+			tfar = fminf(tfar, far_hi);
+		}
+		return tnear > tfar;
+	}
+
+	//Slab test of every ray against the box, hit[l] is set for rays that enter it
+	//Runs over whole groups of 16 lanes, branch free, so the compiler turns each group
+	//into a few SIMD instructions (lanes past n have tmax = -inf and never hit)
+	bool box_test(const aabb& box, float tmin, int* hit) const {
+		vec3 lo = box.min(), hi = box.max();
+		int any = 0;
+		for(int g = 0; g < n; g += 16){
+			for(int l = g; l < g + 16; l++){
+				float t0x = (lo.x() - ox[l]) * ix[l], t1x = (hi.x() - ox[l]) * ix[l];
+				float t0y = (lo.y() - oy[l]) * iy[l], t1y = (hi.y() - oy[l]) * iy[l];
+				float t0z = (lo.z() - oz[l]) * iz[l], t1z = (hi.z() - oz[l]) * iz[l];
+				float tn = min_max(t0x, t1x, t0y, t1y, t0z, t1z, tmin);
+				float tf = max_min(t0x, t1x, t0y, t1y, t0z, t1z, tmax[l]);
+				hit[l] = tn <= tf;
+				any |= hit[l];
+			}
+		}
+		return any != 0;
+	}
+
+	//Largest of the slab entry points and t, and smallest of the slab exit points and t
+	static inline float min_max(float a0, float a1, float b0, float b1, float c0, float c1, float t){
+		float a = a0 < a1 ? a0 : a1, b = b0 < b1 ? b0 : b1, c = c0 < c1 ? c0 : c1;
+		float m = a > b ? a : b;
+		m = m > c ? m : c;
+		return m > t ? m : t;
+	}
+	static inline float max_min(float a0, float a1, float b0, float b1, float c0, float c1, float t){
+		float a = a0 > a1 ? a0 : a1, b = b0 > b1 ? b0 : b1, c = c0 > c1 ? c0 : c1;
+		float m = a < b ? a : b;
+		m = m < c ? m : c;
+		return m < t ? m : t;
+	}
+
+	float max_tmax() const {
+		float m = tmax[0];
+		for(int l = 1; l < n; l++)
+			m = tmax[l] > m ? tmax[l] : m;
+		return m;
+	}
+
+	ray get_ray(int l) const { return ray(vec3(ox[l], oy[l], oz[l]), vec3(dx[l], dy[l], dz[l])); }
+
+	int n;
+	bool coherent;
+	alignas(64) float ox[MAX_PACKET_RAYS], oy[MAX_PACKET_RAYS], oz[MAX_PACKET_RAYS];
+	alignas(64) float dx[MAX_PACKET_RAYS], dy[MAX_PACKET_RAYS], dz[MAX_PACKET_RAYS];
+	alignas(64) float ix[MAX_PACKET_RAYS], iy[MAX_PACKET_RAYS], iz[MAX_PACKET_RAYS];
+	alignas(64) float dd[MAX_PACKET_RAYS];   //dot(d,d), the "a" of the sphere quadratic
+	alignas(64) float tmax[MAX_PACKET_RAYS]; //nearest hit so far of every ray
+	alignas(64) int index[MAX_PACKET_RAYS];  //sphere hit by every ray, -1 for a miss
+	float o_lo[3], o_hi[3], inv_lo[3], inv_hi[3];
+};
+
+
+//Tests the rays flagged in active against spheres [first, first + count) of the pack
+//Same quadratic as sphere::hit, one sphere against a group of lanes at a time
+typedef void (*packet_sphere_kernel)(const sphere_pack& s, int first, int count, ray_packet& p, float tmin, const int* active);
+
+void packet_spheres_scalar(const sphere_pack& s, int first, int count, ray_packet& p, float tmin, const int* active){
+	for(int l = 0; l < p.n; l++){
+		if(active[l])
+			sphere_kernel_scalar(s, first, first + count, p.get_ray(l), tmin, p.tmax[l], p.index[l]);
+	}
+}
+
+#ifdef RT_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+void packet_spheres_avx2(const sphere_pack& s, int first, int count, ray_packet& p, float tmin, const int* active){
+	__m256 vtmin = _mm256_set1_ps(tmin), zero = _mm256_setzero_ps();
+	for(int g = 0; g < p.n; g += 8){
+		__m256 ox = _mm256_load_ps(p.ox + g), oy = _mm256_load_ps(p.oy + g), oz = _mm256_load_ps(p.oz + g);
+		__m256 dx = _mm256_load_ps(p.dx + g), dy = _mm256_load_ps(p.dy + g), dz = _mm256_load_ps(p.dz + g);
+		__m256 a = _mm256_load_ps(p.dd + g);
+		__m256 best_t = _mm256_load_ps(p.tmax + g);
+		__m256i best_i = _mm256_loadu_si256((const __m256i*)(p.index + g));
+		__m256 act = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(active + g)), _mm256_setzero_si256()));
+		if(_mm256_movemask_ps(act) == 0)
+			continue;
+		for(int k = first; k < first + count; k++){
+			__m256 ocx = _mm256_sub_ps(ox, _mm256_set1_ps(s.cx[k]));
+			__m256 ocy = _mm256_sub_ps(oy, _mm256_set1_ps(s.cy[k]));
+			__m256 ocz = _mm256_sub_ps(oz, _mm256_set1_ps(s.cz[k]));
+			__m256 half_b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+			__m256 c = _mm256_sub_ps(_mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))), _mm256_set1_ps(s.r[k]*s.r[k]));
+			__m256 disc = _mm256_fmsub_ps(half_b, half_b, _mm256_mul_ps(a, c));
+			__m256 valid = _mm256_and_ps(act, _mm256_cmp_ps(disc, zero, _CMP_GT_OQ));
+			if(_mm256_movemask_ps(valid) == 0)
+				continue;
+			__m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+			__m256 nb = _mm256_sub_ps(zero, half_b);
+			__m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, root), a);
+			__m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, root), a);
+			__m256 in0 = _mm256_and_ps(_mm256_cmp_ps(t0, vtmin, _CMP_GT_OQ), _mm256_cmp_ps(t0, best_t, _CMP_LT_OQ));
+			__m256 in1 = _mm256_and_ps(_mm256_cmp_ps(t1, vtmin, _CMP_GT_OQ), _mm256_cmp_ps(t1, best_t, _CMP_LT_OQ));
+			__m256 take = _mm256_and_ps(valid, _mm256_or_ps(in0, in1));
+			best_t = _mm256_blendv_ps(best_t, _mm256_blendv_ps(t1, t0, in0), take);
+			best_i = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_i), _mm256_castsi256_ps(_mm256_set1_epi32(k)), take));
+		}
+		_mm256_store_ps(p.tmax + g, best_t);
+		_mm256_storeu_si256((__m256i*)(p.index + g), best_i);
+	}
+}
+
+__attribute__((target("avx512f")))
+void packet_spheres_avx512(const sphere_pack& s, int first, int count, ray_packet& p, float tmin, const int* active){
+	__m512 vtmin = _mm512_set1_ps(tmin), zero = _mm512_setzero_ps();
+	for(int g = 0; g < p.n; g += 16){
+		__mmask16 act = _mm512_cmpgt_epi32_mask(_mm512_loadu_si512(active + g), _mm512_setzero_si512());
+		if(act == 0)
+			continue;
+		__m512 ox = _mm512_load_ps(p.ox + g), oy = _mm512_load_ps(p.oy + g), oz = _mm512_load_ps(p.oz + g);
+		__m512 dx = _mm512_load_ps(p.dx + g), dy = _mm512_load_ps(p.dy + g), dz = _mm512_load_ps(p.dz + g);
+		__m512 a = _mm512_load_ps(p.dd + g);
+		__m512 best_t = _mm512_load_ps(p.tmax + g);
+		__m512i best_i = _mm512_loadu_si512(p.index + g);
+		for(int k = first; k < first + count; k++){
+			__m512 ocx = _mm512_sub_ps(ox, _mm512_set1_ps(s.cx[k]));
+			__m512 ocy = _mm512_sub_ps(oy, _mm512_set1_ps(s.cy[k]));
+			__m512 ocz = _mm512_sub_ps(oz, _mm512_set1_ps(s.cz[k]));
+			__m512 half_b = _mm512_fmadd_ps(ocz, dz, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocx, dx)));
+			__m512 c = _mm512_sub_ps(_mm512_fmadd_ps(ocz, ocz, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocx, ocx))), _mm512_set1_ps(s.r[k]*s.r[k]));
+			__m512 disc = _mm512_fmsub_ps(half_b, half_b, _mm512_mul_ps(a, c));
+			__mmask16 valid = act & _mm512_cmp_ps_mask(disc, zero, _CMP_GT_OQ);
+			if(valid == 0)
+				continue;
+			__m512 root = _mm512_maskz_sqrt_ps(valid, disc);
+			__m512 nb = _mm512_sub_ps(zero, half_b);
+			__m512 t0 = _mm512_div_ps(_mm512_sub_ps(nb, root), a);
+			__m512 t1 = _mm512_div_ps(_mm512_add_ps(nb, root), a);
+			__mmask16 in0 = _mm512_cmp_ps_mask(t0, vtmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t0, best_t, _CMP_LT_OQ);
+			__mmask16 in1 = _mm512_cmp_ps_mask(t1, vtmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t1, best_t, _CMP_LT_OQ);
+			__mmask16 take = valid & (in0 | in1);
+			best_t = _mm512_mask_blend_ps(take, best_t, _mm512_mask_blend_ps(in0, t1, t0));
+			best_i = _mm512_mask_blend_epi32(take, best_i, _mm512_set1_epi32(k));
+		}
+		_mm512_store_ps(p.tmax + g, best_t);
+		_mm512_storeu_si512(p.index + g, best_i);
+	}
+}
+
+#endif
+
+//Matches the packet kernel to the sphere kernel the pack uses (and so to RT_SIMD)
+packet_sphere_kernel select_packet_kernel(const sphere_pack& s){
+#ifdef RT_X86_SIMD
+	if(s.kernel == sphere_kernel_avx512) return packet_spheres_avx512;
+	if(s.kernel == sphere_kernel_avx2) return packet_spheres_avx2;
+#endif
+	(void)s;
+	return packet_spheres_scalar;
+}
+
+//Finds the nearest hit of every ray of the packet in a sphere_pack that has a bvh
+void trace_packet(const sphere_pack& s, ray_packet& p, float tmin){
+
+	if(s.nodes.empty() || p.n == 0)
+		return;
+
+	const bvh_node_data* nodes = &s.nodes[0];
+	int lane_hit[MAX_PACKET_RAYS];
+	int stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	int index = 0;
+	int dir_neg[3] = {p.dx[0] < 0, p.dy[0] < 0, p.dz[0] < 0};
+	packet_sphere_kernel leaf = select_packet_kernel(s);
+	RT_STAT(long long visits = 0, tests = 0);
+
+	for(;;){
+		const bvh_node_data& node = nodes[index];
+		RT_STAT(visits++);
+		bool visit = !(p.coherent && p.frustum_misses(node.box, tmin, p.max_tmax()));
+		if(visit && p.box_test(node.box, tmin, lane_hit)){
+			if(node.count > 0){
+				leaf(s, node.offset, node.count, p, tmin, lane_hit);
+				RT_STAT(tests += (long long)node.count * p.n);
+			}
+			else{
+				//Near child first, judged by the direction of the first ray of the packet
+				int near_child = dir_neg[node.axis] ? node.offset : index + 1;
+				int far_child = dir_neg[node.axis] ? index + 1 : node.offset;
+				stack[sp++] = far_child;
+				index = near_child;
+				continue;
+			}
+		}
+		if(sp == 0)
+			break;
+		index = stack[--sp];
+	}
+	RT_STAT(render_counters& stats = render_stats::local();
+	        stats.node_visits += visits;
+	        stats.hit_tests += tests;)
+
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Builds the float, vec4, double and double-vec4 configurations of CMakePresets.json and runs the
+# precision benchmark in each, printing a markdown table of throughput and image error.
+#
+#   ./precision_report.sh
+#
+# The double build runs first: the other builds compare their frames with the frames it leaves
+# in /tmp (see bench_precision in Benchmark.cpp). "vs double" is the RMSE of a 16 spp frame
+# against the double frame made from the same samples, "noise" the RMSE between two seeds of it,
+# both after gamma in 0-255 units.
+set -e
+cd "$(dirname "$0")"
+
+presets=(double release vec4 double-vec4)
+for p in "${presets[@]}"; do
+	echo "building $p" >&2
+	cmake --preset "$p" > /dev/null
+	cmake --build --preset "$p" -j"$(nproc)" > /dev/null
+done
+
+report="build/precision.md"
+{
+	echo "\`Benchmark precision\`, $(nproc) threads, $(c++ --version | head -n 1)"
+	echo
+	echo "| configuration | vec3 | scene | camera rays/s | frame s | rays/s | vs double | noise |"
+	echo "|---|---|---|---|---|---|---|---|"
+} > "$report"
+
+for p in "${presets[@]}"; do
+	echo "running $p" >&2
+	# vec3 line, then the micro benchmarks and the table header, then one row per scene
+	"build/$p/Benchmark" precision | awk -v p="$p" '
+		NR == 1 { split($3, v, ","); vec3 = v[1] }
+		NF == 6 && $2 ~ /^[0-9]/ { printf "| %s | %s | %s | %s | %s | %s | %s | %s |\n", p, vec3, $1, $2, $3, $4, $5, $6 }' >> "$report"
+done
+cat "$report"
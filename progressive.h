@@ -0,0 +1,225 @@
+#include "renderer.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#pragma once
+
+//Progressive rendering with checkpoints
+
+/*
+ * render_frame() keeps a pixel's running sum only while the pixel is being rendered, so a
+ * render that is stopped loses every sample taken so far. A progressive render takes the
+ * samples in passes instead (samples [0,16), [16,32), ...) and keeps an accumulation buffer
+ * that holds the sum of the samples and the sample count of every pixel. The image is the sum
+ * divided by the count at any point.
+ *
+ * A pass doesn't start a new sum, it adds its samples on to the sums so far
+ * (render_options::sums), in the same float arithmetic and the same order as a frame rendered
+ * in one go. The passes therefore end with the very sums, and the very image, of a single
+ * render. Only the wavefront integrator, which adds samples in the order their paths end,
+ * differs in the last bits.
+ *
+ * Every so often the accumulation buffer is saved. The file is written under a temporary
+ * name, flushed to disk and then renamed over the old checkpoint, so a crash at any moment
+ * leaves either the previous checkpoint or the new one, never half of one.
+ *
+ * A resumed render carries on with the next sample index. Sample s of a pixel always draws
+ * the same random numbers (sampler.h), so resuming takes exactly the samples the render would
+ * have taken had it not stopped, none of the ones already in the buffer again. The same way
+ * a finished render can be resumed with a higher --spp to add samples to it. The sums are
+ * saved as doubles, which hold the float (or double) sums of the passes exactly.
+ *
+ *   checkpoint file:  header | sums (3 doubles per pixel) | counts (int32 per pixel)
+ *
+ * Pixels are in framebuffer order. The header holds a hash of the options the samples depend
+ * on (scene, size, seed, integrator, ...), a checkpoint only resumes a render of the same frame.
+ */
+
+static const char ACCUMULATION_MAGIC[8] = {'R','T','A','C','C','U','M','\0'};
+static const uint32_t ACCUMULATION_VERSION = 1;
+//Largest width or height load() accepts, so the size of a damaged header can't overflow
+static const int32_t ACCUMULATION_MAX_SIZE = 1 << 20;
+
+struct accumulation_header {
+	char magic[8];
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	uint32_t reserved;
+	uint64_t key; //hash of the frame's options
+};
+
+//FNV-1a, to turn the frame's options into accumulation_header::key
+inline uint64_t fnv1a64(const std::string& text){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t k = 0; k < text.size(); k++){
+		hash ^= (unsigned char)text[k];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+class accumulation_buffer {
+
+  public:
+	accumulation_buffer() : width(0), height(0), key(0) {}
+	accumulation_buffer(int w, int h, uint64_t frame_key) : width(w), height(h), key(frame_key),
+	                    sums(size_t(w)*h*3, 0.0), counts(size_t(w)*h, 0) {}
+
+	//The sums as a pass adds on to them (render_options::sums)
+	std::vector<vec3> running_sums() const {
+		std::vector<vec3> running(counts.size());
+		for(size_t k = 0; k < counts.size(); k++)
+			running[k] = vec3(real(sums[3*k]), real(sums[3*k+1]), real(sums[3*k+2]));
+		return running;
+	}
+
+	//Takes the sums and sample counts a pass left (render_options::sums)
+	void update(const std::vector<vec3>& running, const framebuffer& pass){
+		for(size_t k = 0; k < counts.size(); k++){
+			sums[3*k] = running[k].r();
+			sums[3*k+1] = running[k].g();
+			sums[3*k+2] = running[k].b();
+			counts[k] = pass.samples[k];
+		}
+	}
+
+	//The image so far, divided the way render_tile() divides its sums
+	void resolve(framebuffer& fb) const {
+		fb = framebuffer(width, height);
+		std::vector<vec3> running = running_sums();
+		for(size_t k = 0; k < counts.size(); k++){
+			vec3 col = running[k];
+			col /= float(counts[k] > 0 ? counts[k] : 1);
+			fb.pixels[k] = col;
+			fb.samples[k] = counts[k];
+		}
+	}
+
+	//Samples every pixel has, -1 if the pixels have different counts
+	int samples_taken() const {
+		for(size_t k = 1; k < counts.size(); k++)
+			if(counts[k] != counts[0])
+				return -1;
+		return counts.empty() ? 0 : counts[0];
+	}
+
+	//Writes the buffer to path through a temporary file and a rename
+	bool save(const std::string& path, std::string& error) const {
+		std::string temporary = path + ".tmp";
+		FILE* f = fopen(temporary.c_str(), "wb");
+		if(!f){
+			error = "could not create " + temporary + ": " + strerror(errno);
+			return false;
+		}
+		accumulation_header header = accumulation_header();
+		memcpy(header.magic, ACCUMULATION_MAGIC, sizeof(header.magic));
+		header.version = ACCUMULATION_VERSION;
+		header.width = width;
+		header.height = height;
+		header.key = key;
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		          fwrite(&sums[0], sizeof(double), sums.size(), f) == sums.size() &&
+		          fwrite(&counts[0], sizeof(int32_t), counts.size(), f) == counts.size() &&
+		          fflush(f) == 0 && fsync(fileno(f)) == 0;
+		ok = fclose(f) == 0 && ok;
+		if(!ok || rename(temporary.c_str(), path.c_str()) != 0){
+			error = "could not write " + path + ": " + strerror(errno);
+			remove(temporary.c_str());
+			return false;
+		}
+		//The rename itself is only on disk once the directory is
+		size_t slash = path.find_last_of('/');
+		std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+		int dir = open(directory.c_str(), O_RDONLY);
+		if(dir >= 0){
+			fsync(dir);
+			close(dir);
+		}
+		return true;
+	}
+
+	//Reads a buffer saved by save(), false with error set if the file isn't one
+	bool load(const std::string& path, std::string& error){
+		FILE* f = fopen(path.c_str(), "rb");
+		if(!f){
+			error = "could not open " + path + ": " + strerror(errno);
+			return false;
+		}
+		//The header's size has to agree with the file's before anything is allocated for it
+		accumulation_header header;
+		struct stat st;
+		bool ok = fstat(fileno(f), &st) == 0 && fread(&header, sizeof(header), 1, f) == 1 &&
+		          memcmp(header.magic, ACCUMULATION_MAGIC, sizeof(header.magic)) == 0 &&
+		          header.version == ACCUMULATION_VERSION && header.width > 0 && header.height > 0 &&
+		          header.width <= ACCUMULATION_MAX_SIZE && header.height <= ACCUMULATION_MAX_SIZE &&
+		          uint64_t(st.st_size) == sizeof(header) + uint64_t(header.width)*uint64_t(header.height)*(3*sizeof(double) + sizeof(int32_t));
+		if(ok){
+			*this = accumulation_buffer(header.width, header.height, header.key);
+			ok = fread(&sums[0], sizeof(double), sums.size(), f) == sums.size() &&
+			     fread(&counts[0], sizeof(int32_t), counts.size(), f) == counts.size() &&
+			     fgetc(f) == EOF;
+		}
+		fclose(f);
+		if(!ok)
+			error = path + " is not a checkpoint or is damaged";
+		return ok;
+	}
+
+	int width;
+	int height;
+	uint64_t key;
+	std::vector<double> sums;     //sum of the samples, r g b per pixel
+	std::vector<int32_t> counts;  //samples per pixel
+};
+
+struct progressive_options {
+	progressive_options() : pass_spp(16), checkpoint_interval(60) {}
+	std::string checkpoint;     //file to save to, empty -> none
+	int pass_spp;               //samples per pixel in a pass
+	double checkpoint_interval; //seconds between checkpoints, the last pass is always saved
+};
+
+//Renders passes until every pixel of accum has opt.ns samples, starting after the samples it
+//already has, and leaves the result in fb. False with error set if a checkpoint can't be saved
+bool render_progressive(framebuffer& fb, const camera& cam, hitable *world, const render_options& opt, const integrator_fns& integrator,
+                        accumulation_buffer& accum, const progressive_options& po, std::string& error){
+
+	int taken = accum.samples_taken();
+	if(taken < 0){
+		error = "the pixels of the accumulation buffer have different sample counts";
+		return false;
+	}
+	std::chrono::steady_clock::time_point last_save = std::chrono::steady_clock::now();
+	std::vector<vec3> running = accum.running_sums();
+	render_options pass_opt = opt;
+	pass_opt.sums = &running;
+	framebuffer pass;
+	while(taken < opt.ns){
+		pass_opt.first_sample = taken;
+		pass_opt.ns = std::min(opt.ns, taken + std::max(po.pass_spp, 1));
+		render_frame(pass, cam, world, pass_opt, integrator);
+		accum.update(running, pass);
+		taken = pass_opt.ns;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(!po.checkpoint.empty() && (taken == opt.ns || std::chrono::duration<double>(now - last_save).count() >= po.checkpoint_interval)){
+			if(!accum.save(po.checkpoint, error))
+				return false;
+			last_save = now;
+			std::cerr << "checkpoint: " << taken << " of " << opt.ns << " spp saved to " << po.checkpoint << "\n";
+		}
+	}
+	accum.resolve(fb);
+	return true;
+
+}
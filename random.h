@@ -0,0 +1,53 @@
+#include <stdint.h>
+#pragma once
+
+//Random numbers for rendering
+
+/*
+ * drand48() keeps a single hidden state shared by the whole program, so every thread
+ * contends for it and the sequence each pixel sees depends on thread scheduling.
+ *
+ * PCG32 (O'Neill, pcg-random.org) is a tiny generator: 64 bits of state advanced by a
+ * linear congruential step, with a permutation of the old state as output. It is fast,
+ * statistically strong, and the "inc" value selects one of 2^63 independent streams,
+ * so every pixel can be given its own stream.
+ */
+
+class pcg32 {
+
+  public:
+	pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+	pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+	//initseq picks the stream, initstate the starting point along it
+	void seed(uint64_t initstate, uint64_t initseq){
+		state = 0u;
+		inc = (initseq << 1u) | 1u;
+		next_uint();
+		state += initstate;
+		next_uint();
+	}
+
+	inline uint32_t next_uint(){
+		uint64_t oldstate = state;
+		state = oldstate * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = uint32_t(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = uint32_t(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	//Uniform float in [0,1), the top 24 bits fill the float mantissa exactly
+	inline float next_float(){
+		return float(next_uint() >> 8) * (1.0f / 16777216.0f);
+	}
+
+	uint64_t state;
+	uint64_t inc;
+};
+
+//Mixes a value into a well spread 64-bit hash (splitmix64 finaliser)
+inline uint64_t mix64(uint64_t z){
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
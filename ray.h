@@ -34,7 +34,7 @@ class ray  {
     vec3 direction() const {return B;}
     
     //Determines position along the ray depending on given value t
-    vec3 point_at_parameter(float t) const {return A + t*B;}
+    vec3 point_at_parameter(real t) const {return A + t*B;}
     
   private:
   
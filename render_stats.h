@@ -0,0 +1,222 @@
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+#pragma once
+
+//Render statistics
+
+/*
+ * Counters for where the time of a frame goes: how paths end, how deep they get, how many
+ * bvh nodes and primitives each ray tests, what the materials do and how long every tile
+ * took. They are kept per thread so the render loop never touches shared memory (each thread
+ * registers its block once), and summed when the frame is done. A thread that exits adds its
+ * block to a retired total and frees it, so a pool per frame (or per progressive pass) doesn't
+ * leave a block behind for every thread it ever started.
+ *
+ * Counting is wrapped in RT_STAT(...), so building with -DRT_STATS=0 removes every counter
+ * update from the hot paths (the counters still exist, they just stay zero).
+ *
+ * Loops that run per primitive or per bvh node count into locals and add them to the thread's
+ * block once per ray, the thread_local lookup is paid per ray or per scatter, not per test.
+ */
+
+#ifndef RT_STATS
+#define RT_STATS 1
+#endif
+
+#if RT_STATS
+#define RT_STAT(...) __VA_ARGS__
+#else
+#define RT_STAT(...)
+#endif
+
+//Depths from STAT_MAX_DEPTH-1 on share the last bucket
+static const int STAT_MAX_DEPTH = 64;
+//One slot per material_type (material.h checks the two agree)
+static const int STAT_MATERIAL_TYPES = 4;
+static const char* const stat_material_names[STAT_MATERIAL_TYPES] = {"lambertian", "metal", "dielectric", "other"};
+
+//Wall time of one tile
+struct tile_time {
+	int x0, y0, x1, y1;
+	double seconds;
+};
+
+struct render_counters {
+	render_counters() : paths(0), rays(0), escaped(0), absorbed(0), depth_limited(0), roulette_killed(0),
+	                    node_visits(0), hit_tests(0), hit_successes(0), total_internal_reflections(0) {
+		for(int d = 0; d < STAT_MAX_DEPTH; d++) rays_by_depth[d] = 0;
+		for(int m = 0; m < STAT_MATERIAL_TYPES; m++) scatter_calls[m] = scatter_absorbed[m] = 0;
+	}
+	long long paths;           //camera rays started
+	long long rays;            //rays traced, camera rays included
+	long long escaped;         //paths that left the scene and picked up the background
+	long long absorbed;        //paths whose material absorbed the ray (scatter returned false)
+	long long depth_limited;   //paths stopped by the maximum depth
+	long long roulette_killed; //paths stopped by Russian roulette
+	long long rays_by_depth[STAT_MAX_DEPTH]; //rays traced per bounce, 0 = camera rays
+
+	long long node_visits;     //bvh nodes whose box was tested
+	long long hit_tests;       //primitive hit tests (a sphere_pack leaf counts each sphere)
+	long long hit_successes;   //tests that found a nearer hit (a sphere_pack leaf counts once)
+
+	long long scatter_calls[STAT_MATERIAL_TYPES];    //per material_type
+	long long scatter_absorbed[STAT_MATERIAL_TYPES]; //scatter calls that returned false (metal below the surface)
+	long long total_internal_reflections;            //dielectric scatters that couldn't refract
+
+	std::vector<tile_time> tiles;
+
+	void count_ray(int depth){
+		rays++;
+		rays_by_depth[depth < STAT_MAX_DEPTH ? depth : STAT_MAX_DEPTH - 1]++;
+	}
+
+	void add(const render_counters& c){
+		paths += c.paths; rays += c.rays; escaped += c.escaped; absorbed += c.absorbed;
+		depth_limited += c.depth_limited; roulette_killed += c.roulette_killed;
+		for(int d = 0; d < STAT_MAX_DEPTH; d++) rays_by_depth[d] += c.rays_by_depth[d];
+		node_visits += c.node_visits; hit_tests += c.hit_tests; hit_successes += c.hit_successes;
+		for(int m = 0; m < STAT_MATERIAL_TYPES; m++){
+			scatter_calls[m] += c.scatter_calls[m];
+			scatter_absorbed[m] += c.scatter_absorbed[m];
+		}
+		total_internal_reflections += c.total_internal_reflections;
+		tiles.insert(tiles.end(), c.tiles.begin(), c.tiles.end());
+	}
+
+	//Average number of rays traced per path
+	double average_length() const { return paths ? double(rays) / double(paths) : 0.0; }
+};
+
+class render_stats {
+
+  public:
+	//Counters of the calling thread
+	static render_counters& local(){
+		static thread_local owner block;
+		if(!block.counters){
+			block.counters = new render_counters();
+			std::lock_guard<std::mutex> lock(registry_mutex());
+			registry().push_back(block.counters);
+		}
+		return *block.counters;
+	}
+
+	//Sum over every thread that has counted something, running or exited
+	static render_counters total(){
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		render_counters sum = retired();
+		for(size_t k = 0; k < registry().size(); k++)
+			sum.add(*registry()[k]);
+		return sum;
+	}
+
+	static void reset(){
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		retired() = render_counters();
+		for(size_t k = 0; k < registry().size(); k++)
+			*registry()[k] = render_counters();
+	}
+
+  private:
+	//Hands the thread's block back when the thread exits
+	struct owner {
+		owner() : counters(NULL) {}
+		~owner(){
+			if(!counters)
+				return;
+			std::lock_guard<std::mutex> lock(registry_mutex());
+			retired().add(*counters);
+			registry().erase(std::find(registry().begin(), registry().end(), counters));
+			delete counters;
+		}
+		render_counters* counters;
+	};
+
+	//Blocks of the running threads
+	static std::vector<render_counters*>& registry(){
+		static std::vector<render_counters*> r;
+		return r;
+	}
+	//Counts of the threads that have exited
+	static render_counters& retired(){
+		static render_counters r;
+		return r;
+	}
+	static std::mutex& registry_mutex(){
+		static std::mutex m;
+		return m;
+	}
+};
+
+//Records the wall time of a tile into the thread's counters when it goes out of scope
+class tile_timer {
+
+  public:
+	tile_timer(int x0, int y0, int x1, int y1) : start(std::chrono::steady_clock::now()) {
+		t.x0 = x0; t.y0 = y0; t.x1 = x1; t.y1 = y1;
+	}
+	~tile_timer(){
+		t.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		render_stats::local().tiles.push_back(t);
+	}
+
+  private:
+	tile_time t;
+	std::chrono::steady_clock::time_point start;
+};
+
+//The counters as a JSON object, depth buckets after the deepest non-empty one left out
+std::string stats_json(const render_counters& c){
+	char buf[256];
+	std::string out = "{\n";
+	snprintf(buf, sizeof(buf), "  \"paths\": %lld,\n  \"rays\": %lld,\n  \"average_path_length\": %.4f,\n",
+	         c.paths, c.rays, c.average_length());
+	out += buf;
+	snprintf(buf, sizeof(buf), "  \"escaped\": %lld,\n  \"absorbed\": %lld,\n  \"depth_limited\": %lld,\n  \"roulette_killed\": %lld,\n",
+	         c.escaped, c.absorbed, c.depth_limited, c.roulette_killed);
+	out += buf;
+
+	int deepest = STAT_MAX_DEPTH;
+	while(deepest > 1 && c.rays_by_depth[deepest - 1] == 0)
+		deepest--;
+	out += "  \"rays_by_depth\": [";
+	for(int d = 0; d < deepest; d++){
+		snprintf(buf, sizeof(buf), "%s%lld", d ? ", " : "", c.rays_by_depth[d]);
+		out += buf;
+	}
+	out += "],\n";
+
+	snprintf(buf, sizeof(buf), "  \"node_visits\": %lld,\n  \"hit_tests\": %lld,\n  \"hit_successes\": %lld,\n",
+	         c.node_visits, c.hit_tests, c.hit_successes);
+	out += buf;
+	out += "  \"materials\": {";
+	for(int m = 0; m < STAT_MATERIAL_TYPES; m++){
+		snprintf(buf, sizeof(buf), "%s\n    \"%s\": {\"scatter_calls\": %lld, \"absorbed\": %lld}",
+		         m ? "," : "", stat_material_names[m], c.scatter_calls[m], c.scatter_absorbed[m]);
+		out += buf;
+	}
+	out += "\n  },\n";
+	snprintf(buf, sizeof(buf), "  \"total_internal_reflections\": %lld,\n", c.total_internal_reflections);
+	out += buf;
+
+	double slowest = 0, sum = 0;
+	for(size_t k = 0; k < c.tiles.size(); k++){
+		sum += c.tiles[k].seconds;
+		if(c.tiles[k].seconds > slowest) slowest = c.tiles[k].seconds;
+	}
+	snprintf(buf, sizeof(buf), "  \"tile_seconds_total\": %.6f,\n  \"tile_seconds_max\": %.6f,\n  \"tiles\": [",
+	         sum, slowest);
+	out += buf;
+	for(size_t k = 0; k < c.tiles.size(); k++){
+		const tile_time& t = c.tiles[k];
+		snprintf(buf, sizeof(buf), "%s\n    {\"x0\": %d, \"y0\": %d, \"x1\": %d, \"y1\": %d, \"seconds\": %.6f}",
+		         k ? "," : "", t.x0, t.y0, t.x1, t.y1, t.seconds);
+		out += buf;
+	}
+	out += c.tiles.empty() ? "]\n}\n" : "\n  ]\n}\n";
+	return out;
+}
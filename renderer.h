@@ -0,0 +1,242 @@
+#include "camera.h"
+#include "hitable.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include "sampler.h"
+#include "integrator.h"
+#include "packet.h"
+#include "wavefront.h"
+#include <algorithm>
+#pragma once
+
+//Tile renderer
+
+/*
+ * The image is cut into square tiles (the ones on the right/top edge may be smaller)
+ * and each tile is one task on the work-stealing thread pool. A tile writes only its
+ * own pixels of the shared framebuffer so no locking is needed while rendering.
+ *
+ * Every sample draws its random numbers from a sampler seeded from (seed, frame, i, j, s),
+ * so the image is identical for any number of threads or tile size, and identical to the serial loop.
+ *
+ * With packets enabled (and a sphere_pack world with a bvh) primary rays of a tile are traced
+ * in square blocks (see packet.h), each ray is then finished off on its own by the integrator.
+ * Each lane keeps its own pixel's sampler, so the image only differs from the one ray at a
+ * time path by the rounding of the (differently vectorised) sphere tests.
+ *
+ * Adaptive sampling
+ *
+ * A pixel of open sky has converged after a handful of samples while a pixel looking through
+ * glass is still noisy after hundreds. With adaptive_threshold set, every pixel keeps a running
+ * mean and variance (Welford) of its sample brightness and, every 16 samples from min_spp on,
+ * checks the 95% confidence interval of its mean. It stops when
+ *
+ *   error = 1.96 * sqrt(variance / n) / (2 * sqrt(mean))   (interval half width after the gamma 2 of the output)
+ *   error < threshold * sqrt(n / min_spp)
+ *
+ * or after ns samples. Dividing by the slope of the gamma curve measures the error in output
+ * values, so dark pixels don't soak up samples for noise nobody can see.
+ *
+ * The allowed error grows with the samples already spent: asking every pixel for the same error
+ * gives pixels samples in proportion to their variance, and the noisiest few pixels take most of
+ * the frame. The total squared error of a frame for a given number of samples is smallest with
+ * samples in proportion to the standard deviation instead, which is what the growing limit gives
+ * (sigma / n < threshold / 1.96 / sqrt(min_spp)). The check only every 16 samples stops pixels
+ * stopping on one lucky low variance estimate.
+ *
+ * Sample s of a pixel is the same with or without adaptive sampling, a pixel just stops earlier.
+ */
+
+//Colour along a ray, e.g. color() in integrator.h
+typedef vec3 (*radiance_fn)(const ray& r, hitable *world, int depth, sampler& rng);
+
+//Colour along a ray whose hit is already known, e.g. color_hit() in integrator.h
+typedef vec3 (*shade_fn)(const ray& r, const hit_record& rec, hitable *world, int depth, sampler& rng);
+
+//The integrator used for every sample
+struct integrator_fns {
+	radiance_fn radiance;
+	shade_fn shade;
+};
+
+struct render_options {
+	render_options() : nx(200), ny(100), ns(100), tile_size(16), threads(0), seed(0), frame(0), packet_size(0), wavefront(false), wavefront_pool(1 << 14),
+	                   adaptive_threshold(0), min_spp(16), first_sample(0), sampling(SAMPLER_RANDOM), sums(NULL) {}
+	int nx;          //image width
+	int ny;          //image height
+	int ns;          //samples per pixel (the maximum with adaptive sampling)
+	int tile_size;   //tile edge length in pixels
+	int threads;     //worker threads, 0 -> one per hardware thread
+	unsigned int seed;
+	unsigned int frame; //frame index, gives every frame of a sequence different samples
+	int packet_size;    //edge length of primary ray packets (4 or 8), 0 -> one ray at a time
+	bool wavefront;     //use the wavefront integrator (wavefront.h) instead of integrator_fns
+	int wavefront_pool; //paths in flight per tile with the wavefront integrator
+	float adaptive_threshold; //error a pixel may have after gamma (0-1 scale), 0 -> fixed ns samples
+	int min_spp;        //samples every pixel takes before adaptive sampling may stop it
+	int first_sample;   //samples [first_sample,ns) are taken, so a frame can be rendered in passes (progressive.h)
+	sampler_type sampling; //where the random numbers come from (sampler.h)
+	//Sums of samples [0,first_sample) of every pixel (framebuffer order), NULL -> none. The
+	//samples are added on to them and they are written back, the frame then shows the average
+	//of samples [0,ns). Adding on to the same float sums keeps a frame rendered in passes
+	//identical to one rendered in one go (progressive.h)
+	std::vector<vec3>* sums;
+};
+
+struct tile {
+	int x0, y0, x1, y1; //pixel range [x0,x1) x [y0,y1)
+};
+
+//Renders the tile in blocks of packet_size x packet_size pixels, tracing
+//the primary rays of every sample of a block as one packet
+void render_tile_packets(const tile& t, framebuffer& fb, const camera& cam, const sphere_pack& pack, hitable *world, const render_options& opt, const integrator_fns& integrator){
+	int size = opt.packet_size;
+	sampler rng[MAX_PACKET_RAYS];
+	vec3 col[MAX_PACKET_RAYS];
+	ray rays[MAX_PACKET_RAYS];
+	float film_u[MAX_PACKET_RAYS], film_v[MAX_PACKET_RAYS], lens_u[MAX_PACKET_RAYS], lens_v[MAX_PACKET_RAYS];
+	ray_packet packet;
+	for (int by = t.y0; by < t.y1; by += size) {
+		for (int bx = t.x0; bx < t.x1; bx += size) {
+			int w = std::min(size, t.x1 - bx), h = std::min(size, t.y1 - by);
+			int n = w*h;
+			for (int l = 0; l < n; l++) {
+				rng[l] = sampler(bx + l % w, by + l / w, opt.frame, opt.seed, opt.sampling);
+				col[l] = opt.sums ? (*opt.sums)[fb.index(bx + l % w, by + l / w)] : vec3(0,0,0);
+			}
+			for (int s = opt.first_sample; s < opt.ns; s++){
+				for (int l = 0; l < n; l++) {
+					rng[l].start_sample(s);
+					film_u[l] = float(rng[l].px + rng[l].next_1d()) / float(opt.nx);
+					film_v[l] = float(rng[l].py + rng[l].next_1d()) / float(opt.ny);
+					lens_u[l] = rng[l].next_1d();
+					lens_v[l] = rng[l].next_1d();
+				}
+				cam.get_rays(film_u, film_v, lens_u, lens_v, n, rays);
+				packet.load(rays, n);
+				trace_packet(pack, packet, 0.001);
+				RT_STAT(render_counters& stats = render_stats::local();
+				        stats.paths += n;
+				        stats.rays += n;
+				        stats.rays_by_depth[0] += n;)
+				for (int l = 0; l < n; l++) {
+					if (packet.index[l] >= 0) {
+						hit_record rec;
+						pack.fill_record(rays[l], packet.tmax[l], packet.index[l], rec);
+						col[l] += integrator.shade(rays[l], rec, world, 0, rng[l]);
+					}
+					else{
+						RT_STAT(stats.escaped++);
+						col[l] += background(rays[l]);
+					}
+				}
+			}
+			int taken = opt.sums ? opt.ns : opt.ns - opt.first_sample;
+			for (int l = 0; l < n; l++){
+				size_t k = fb.index(bx + l % w, by + l / w);
+				if (opt.sums)
+					(*opt.sums)[k] = col[l];
+				col[l] /= float(taken); //as render_tile() divides, so every path averages alike
+				fb.pixels[k] = col[l];
+				fb.samples[k] = taken;
+			}
+		}
+	}
+}
+
+//Renders every pixel of a tile into the framebuffer
+void render_tile(const tile& t, framebuffer& fb, const camera& cam, hitable *world, const render_options& opt, const integrator_fns& integrator){
+	RT_STAT(tile_timer timer(t.x0, t.y0, t.x1, t.y1));
+	if(opt.wavefront){
+		render_wavefront(t.x0, t.y0, t.x1, t.y1, fb, cam, world, opt.nx, opt.ny, opt.first_sample, opt.ns, opt.frame, opt.seed, opt.sampling, opt.wavefront_pool, opt.sums);
+		return;
+	}
+	if(opt.packet_size > 0){
+		const sphere_pack* pack = dynamic_cast<const sphere_pack*>(world);
+		if(pack && !pack->nodes.empty()){
+			render_tile_packets(t, fb, cam, *pack, world, opt, integrator);
+			return;
+		}
+	}
+
+	bool adaptive = opt.adaptive_threshold > 0;
+	for (int j = t.y0; j < t.y1; j++) {
+		for (int i = t.x0; i < t.x1; i++) {
+			sampler rng(i, j, opt.frame, opt.seed, opt.sampling);
+
+			//Sum up ray colours for each random sample at each pixel
+			vec3 col = opt.sums ? (*opt.sums)[fb.index(i, j)] : vec3(0,0,0);
+			double mean = 0, m2 = 0; //running mean and sum of squared differences of the brightness
+			int s = opt.first_sample, n = 0;
+			while (s < opt.ns){
+				rng.start_sample(s);
+				float u = float(i + rng.next_1d()) / float(opt.nx);
+				float v = float(j + rng.next_1d()) / float(opt.ny);
+				ray r = cam.get_ray(u, v, rng);
+				vec3 sample = integrator.radiance(r, world, 0, rng);
+				col += sample;
+				s++;
+				n++;
+
+				if (adaptive){
+					double y = (sample.r() + sample.g() + sample.b()) / 3.0;
+					double delta = y - mean;
+					mean += delta / n;
+					m2 += delta * (y - mean);
+					if (n >= opt.min_spp && (n - opt.min_spp) % 16 == 0){
+						double error = 1.96 * sqrt(m2 / (n - 1) / n) / (2.0 * sqrt(mean + 1e-4));
+						if (error < opt.adaptive_threshold * sqrt(double(n) / opt.min_spp))
+							break;
+					}
+				}
+			}
+
+			//Divide colour by total no. samples for an average
+			if (opt.sums){
+				(*opt.sums)[fb.index(i, j)] = col;
+				n = s;
+			}
+			col /= float(n);
+			fb.at(i, j) = col;
+			fb.samples_at(i, j) = n;
+		}
+	}
+}
+
+//Splits the image into tiles, top rows first so the sky-heavy part doesn't end up last
+std::vector<tile> make_tiles(int nx, int ny, int tile_size){
+	std::vector<tile> tiles;
+	if(tile_size < 1)
+		tile_size = 1;
+	for (int y = ny; y > 0; y -= tile_size) {
+		for (int x = 0; x < nx; x += tile_size) {
+			tile t;
+			t.x0 = x;
+			t.x1 = std::min(x + tile_size, nx);
+			t.y0 = std::max(y - tile_size, 0);
+			t.y1 = y;
+			tiles.push_back(t);
+		}
+	}
+	return tiles;
+}
+
+//Renders a whole frame, returns once every tile has been written
+void render_frame(framebuffer& fb, const camera& cam, hitable *world, const render_options& opt, const integrator_fns& integrator){
+	fb = framebuffer(opt.nx, opt.ny);
+	std::vector<tile> tiles = make_tiles(opt.nx, opt.ny, opt.tile_size);
+
+	if(opt.threads == 1){
+		//Serial path, no pool overhead
+		for(size_t k = 0; k < tiles.size(); k++)
+			render_tile(tiles[k], fb, cam, world, opt, integrator);
+		return;
+	}
+
+	thread_pool pool(opt.threads);
+	for(size_t k = 0; k < tiles.size(); k++){
+		const tile t = tiles[k];
+		pool.submit([t, &fb, &cam, world, &opt, &integrator]{ render_tile(t, fb, cam, world, opt, integrator); });
+	}
+	pool.wait();
+}
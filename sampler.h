@@ -0,0 +1,144 @@
+#include "random.h"
+#pragma once
+
+//Sampler
+
+/*
+ * Every random number used while tracing a path (pixel jitter, lens position,
+ * bounce directions, reflect/refract choice) is drawn from a sampler that is passed
+ * down through camera::get_ray and material::scatter.
+ *
+ * The sampler is seeded from (seed, frame, pixel, sample index) alone:
+ *  - the pixel (and the user seed) picks the PCG stream
+ *  - the frame and sample index pick the starting point along it
+ * so a given sample always sees the same numbers, whichever thread traces it and
+ * in whatever order the work was scheduled. Sample s of a pixel can also be
+ * regenerated on its own, e.g. to continue a render later with sample s+1.
+ *
+ * Sampler types (sampler_type, --sampler)
+ *
+ *   random - independent uniform numbers from the PCG stream. The error of the pixel
+ *            average falls like 1/sqrt(samples)
+ *   sobol  - the samples of a pixel are points of a scrambled Sobol sequence, which fill
+ *            the space far more evenly than independent points (no clumps, no gaps), so the
+ *            error falls faster, up to about 1/samples where the pixel is smooth
+ *
+ * Dimensions - for the points of a sequence to be spread evenly, the same number has to be
+ * used for the same thing in every sample: the 1st for the pixel x jitter, the 3rd for the
+ * lens and so on. A path is split into blocks of 4 numbers,
+ *
+ *   block 0            pixel x, pixel y | lens u, lens v
+ *   block 1 + bounce   what the material at that bounce draws (scatter direction, reflect or
+ *                      refract) and Russian roulette after it
+ *
+ * start_sample() opens block 0 and the integrators call start_bounce(depth) before a material
+ * scatters. Numbers a block needs beyond its 4 (a rejection sampler trying again) come from
+ * the PCG stream, which leaves the result unbiased. The random sampler ignores the blocks
+ * and draws exactly the numbers it always has.
+ *
+ * Each half of a block is a 2D point made of the first two Sobol dimensions, which together
+ * are a (0,2)-sequence: the first 2^k points put exactly one point into every cell of every
+ * grid of 2^k cells (16x16, 4x64, ...). Every pair of every block of every pixel gets its own
+ * scrambling, so none of them are correlated and any number of bounces is covered ("padded"
+ * 2D points, with the hash based Owen scrambling of Burley, "Practical Hash-based Owen
+ * Scrambling", JCGT 2020):
+ *
+ *   index' = owen_scramble(sample index, seed)   shuffles the order the points are taken in
+ *   x      = owen_scramble(sobol_0(index'), hash(seed, 0))
+ *   y      = owen_scramble(sobol_1(index'), hash(seed, 1))
+ *
+ * where seed = hash(pixel, user seed, frame, block, pair). Owen scrambling randomises the
+ * points while keeping them stratified, so every power of two prefix of a pixel's samples
+ * is still evenly spread.
+ */
+
+enum sampler_type { SAMPLER_RANDOM, SAMPLER_SOBOL };
+
+const int SAMPLER_BLOCK_SIZE = 4; //numbers per block, two 2D points
+
+inline uint32_t reverse_bits(uint32_t x){
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+//Sobol dimension 1, the direction numbers follow v_k = v_(k-1) ^ (v_(k-1) >> 1).
+//Dimension 0 is the van der Corput sequence, reverse_bits(index)
+inline uint32_t sobol_1(uint32_t index){
+	uint32_t x = 0;
+	for(uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+		if(index & 1)
+			x ^= v;
+	return x;
+}
+
+//Owen scrambling as a hash: flipping a bit only depends on the bits above it
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed){
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+class sampler {
+
+  public:
+	sampler() : px(0), py(0), frame(0), seed(0), type(SAMPLER_RANDOM), index(0), block(0), component(0) {}
+	sampler(int i, int j, unsigned int frame_index, unsigned int user_seed = 0, sampler_type sampling = SAMPLER_RANDOM)
+		: px(i), py(j), frame(frame_index), seed(user_seed), type(sampling), index(0), block(0), component(0) {}
+
+	//Positions the sampler at the start of the given sample of this pixel
+	void start_sample(unsigned int sample_index){
+		uint64_t pixel = (uint64_t(uint32_t(px)) << 32) | uint32_t(py);
+		uint64_t stream = mix64(pixel ^ mix64(uint64_t(seed) * 0x9E3779B97F4A7C15ULL));
+		rng.seed(mix64((uint64_t(frame) << 32) + sample_index + 0x632BE59BD9B4E019ULL), stream);
+		index = sample_index;
+		block = 0;
+		component = 0;
+	}
+
+	//Moves on to the dimensions of the given bounce
+	inline void start_bounce(int depth){
+		block = 1 + depth;
+		component = 0;
+	}
+
+	//Next uniform number in [0,1)
+	inline float next_1d(){
+		if(type == SAMPLER_SOBOL && component < SAMPLER_BLOCK_SIZE){
+			if((component & 1) == 0)
+				sobol_point(component >> 1);
+			return point[component++ & 1];
+		}
+		return rng.next_float();
+	}
+
+	int px, py;
+	unsigned int frame;
+	unsigned int seed;
+	sampler_type type;
+	pcg32 rng;
+
+  private:
+	//The 2D point of the given half of the current block
+	void sobol_point(int pair){
+		uint64_t pixel = (uint64_t(uint32_t(px)) << 32) | uint32_t(py);
+		uint64_t key = mix64(pixel ^ mix64((uint64_t(seed) << 32 | frame) + 0xD1B54A32D192ED03ULL));
+		uint32_t pair_seed = uint32_t(mix64(key + uint64_t(2*block + pair) * 0x9E3779B97F4A7C15ULL));
+		uint32_t shuffled = owen_scramble(index, pair_seed);
+		uint32_t x = owen_scramble(reverse_bits(shuffled), uint32_t(mix64(pair_seed + 1ULL)));
+		uint32_t y = owen_scramble(sobol_1(shuffled), uint32_t(mix64(pair_seed + 2ULL)));
+		point[0] = float(x >> 8) * (1.0f / 16777216.0f);
+		point[1] = float(y >> 8) * (1.0f / 16777216.0f);
+	}
+
+	unsigned int index; //sample index
+	int block;
+	int component;      //next number of the block
+	float point[2];     //of the current pair
+};
@@ -0,0 +1,267 @@
+#include "vec3.h"
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RT_X86_SIMD 1
+#endif
+#pragma once
+
+//Warping uniform numbers onto disks, hemispheres and balls
+
+/*
+ * The obvious way to get a point in the unit disk is to throw darts at the square around it
+ * until one lands inside (rejection sampling). It takes 4/pi tries on average, but how many is
+ * random, so the loop's branch mispredicts, and the numbers a try throws away break the even
+ * spread of a Sobol sampler (sampler.h): the n-th number of a block no longer means the same
+ * thing in every sample. The functions here map two (or three) numbers to the shape directly,
+ * with no loop and no branch:
+ *
+ * Concentric disk (Shirley and Chiu, "A Low Distortion Map Between Disk and Square", 1997) -
+ * the square [-1,1]^2 is cut into 4 triangles along its diagonals and each is mapped to a
+ * quarter of the disk, square rings going to circles:
+ *
+ *    +-------+            .-'''-.
+ *    |\  2  /|          /\   2   /\
+ *    | \   / |         |  \     /  |     a, b = 2 u1 - 1, 2 u2 - 1
+ *    |3 \ / 1|   -->   | 3  \ /  1 |     |a| > |b|:  r = a, phi = pi/4 * b/a
+ *    |  / \  |         |    / \    |     else:       r = b, phi = pi/2 - pi/4 * a/b
+ *    | /   \ |         |  /     \  |
+ *    |/  4  \|          \/   4   \/      (x, y) = r (cos phi, sin phi)
+ *    +-------+            '-...-'
+ *
+ * Areas are kept, so uniform points stay uniform, and the map is continuous, so a stratified
+ * set of points (a Sobol pattern) is still stratified on the disk. The angle of each triangle
+ * is within +-pi/4, where short polynomials give sin and cos to float precision; the two
+ * cases are selected with bit masks (select_float), not branched on.
+ *
+ * Cosine weighted hemisphere (Malley's method) - lifting a uniform disk point straight up onto
+ * the hemisphere, z = sqrt(1 - x^2 - y^2), gives directions with density cos(theta)/pi, the
+ * lambertian reflection itself. local_to_world() turns it around the surface normal with the
+ * branch free basis of Duff et al., "Building an Orthonormal Basis, Revisited" (JCGT 2017).
+ *
+ * Uniform ball - the disk goes onto the sphere with the equal area (Lambert azimuthal) map and
+ * the radius is the cube root of a third number, so the volume is covered evenly.
+ *
+ * The batch versions warp whole arrays (the rays of a packet, a wavefront material queue)
+ * with SSE4.1 or AVX kernels picked at runtime like sphere_pack's (RT_SIMD forces one). They
+ * do the same float operations in the same order as the one point versions, so a path gets the
+ * same direction whichever way it was drawn.
+ */
+
+const float QUARTER_PI = 0.785398163f;
+
+//sin and cos of |phi| <= pi/4 (Taylor series to phi^7 and phi^8, error below 4e-7)
+inline float sin_quarter(float phi){
+	float p2 = phi*phi;
+	return phi*(1.0f + p2*(-1.0f/6.0f + p2*(1.0f/120.0f + p2*(-1.0f/5040.0f))));
+}
+
+inline float cos_quarter(float phi){
+	float p2 = phi*phi;
+	return 1.0f + p2*(-0.5f + p2*(1.0f/24.0f + p2*(-1.0f/720.0f + p2*(1.0f/40320.0f))));
+}
+
+//c ? a : b without a branch, gcc turns a float ?: into a jump, which mispredicts half the time
+//on random numbers
+inline float select_float(bool c, float a, float b){
+	uint32_t mask = 0u - uint32_t(c), ia, ib;
+	memcpy(&ia, &a, sizeof(ia));
+	memcpy(&ib, &b, sizeof(ib));
+	uint32_t bits = (ia & mask) | (ib & ~mask);
+	float out;
+	memcpy(&out, &bits, sizeof(out));
+	return out;
+}
+
+//Uniform point in the unit disk from two numbers in [0,1)
+inline void concentric_disk(float u1, float u2, float& x, float& y){
+	float a = 2.0f*u1 - 1.0f, b = 2.0f*u2 - 1.0f;
+	bool steep = fabsf(a) <= fabsf(b); //triangles 2 and 4
+	float r = select_float(steep, b, a);
+	float ratio = select_float(steep, a, b);
+	//r is only 0 in the centre, where ratio is 0 too, dividing by 1 instead keeps phi at 0
+	float phi = QUARTER_PI*(ratio/(r + select_float(r == 0.0f, 1.0f, 0.0f)));
+	float s = sin_quarter(phi), c = cos_quarter(phi);
+	x = r*select_float(steep, s, c);
+	y = r*select_float(steep, c, s);
+}
+
+//Height of the hemisphere over a disk point
+inline float hemisphere_z(float x, float y){
+	float z2 = 1.0f - x*x - y*y;
+	return sqrtf(select_float(z2 > 0.0f, z2, 0.0f));
+}
+
+//Direction around +z with density cos(theta)/pi
+inline vec3 cosine_hemisphere(float u1, float u2){
+	float x, y;
+	concentric_disk(u1, u2, x, y);
+	return vec3(x, y, hemisphere_z(x, y));
+}
+
+//Cube root of u in [0,1): a guess from dividing the exponent bits by 3, refined by two Newton
+//steps to about 2e-6 relative, cheaper than cbrtf
+inline float cube_root(float u){
+	uint32_t bits;
+	memcpy(&bits, &u, sizeof(bits));
+	bits = bits/3 + 709921077u;
+	float y;
+	memcpy(&y, &bits, sizeof(y));
+	y = (2.0f*y + u/(y*y)) * (1.0f/3.0f);
+	y = (2.0f*y + u/(y*y)) * (1.0f/3.0f);
+	return y;
+}
+
+//Uniform point in the unit ball from three numbers in [0,1)
+inline vec3 uniform_ball(float u1, float u2, float u3){
+	float x, y;
+	concentric_disk(u1, u2, x, y);
+	float r2 = x*x + y*y;
+	float scale = 2.0f*sqrtf(select_float(r2 < 1.0f, 1.0f - r2, 0.0f));
+	float radius = cube_root(u3);
+	return radius*vec3(x*scale, y*scale, 1.0f - 2.0f*r2);
+}
+
+//Local direction (x, y, z) with z along the unit normal n
+inline vec3 local_to_world(const vec3& d, const vec3& n){
+	float sign = copysignf(1.0f, n.z());
+	float a = -1.0f/(sign + n.z());
+	float b = n.x()*n.y()*a;
+	vec3 tangent(1.0f + sign*n.x()*n.x()*a, sign*b, -sign*n.x());
+	vec3 bitangent(b, sign + n.y()*n.y()*a, -n.y());
+	return d.x()*tangent + d.y()*bitangent + d.z()*n;
+}
+
+
+//Warps count pairs (u1[k], u2[k]) to disk points (x[k], y[k]), and to hemisphere heights z[k]
+//unless z is NULL
+typedef void (*warp_kernel)(const float* u1, const float* u2, float* x, float* y, float* z, int count);
+
+void warp_kernel_scalar(const float* u1, const float* u2, float* x, float* y, float* z, int count){
+	for (int k = 0; k < count; k++) {
+		concentric_disk(u1[k], u2[k], x[k], y[k]);
+		if (z)
+			z[k] = hemisphere_z(x[k], y[k]);
+	}
+}
+
+#ifdef RT_X86_SIMD
+
+//The same operations as concentric_disk and cosine_hemisphere, a vector of points at a time,
+//the points left over at the end go through the scalar kernel. No FMA, which would round
+//differently from the scalar code
+
+__attribute__((target("sse4.1")))
+void warp_kernel_sse(const float* u1, const float* u2, float* x, float* y, float* z, int count){
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+	const __m128 sign = _mm_set1_ps(-0.0f), quarter_pi = _mm_set1_ps(QUARTER_PI);
+	int k = 0;
+	for (; k + 4 <= count; k += 4) {
+		__m128 a = _mm_sub_ps(_mm_mul_ps(two, _mm_loadu_ps(u1+k)), one);
+		__m128 b = _mm_sub_ps(_mm_mul_ps(two, _mm_loadu_ps(u2+k)), one);
+		__m128 steep = _mm_cmple_ps(_mm_andnot_ps(sign, a), _mm_andnot_ps(sign, b));
+		__m128 r = _mm_blendv_ps(a, b, steep);
+		__m128 ratio = _mm_blendv_ps(b, a, steep);
+		__m128 phi = _mm_mul_ps(quarter_pi, _mm_div_ps(ratio, _mm_add_ps(r, _mm_and_ps(_mm_cmpeq_ps(r, zero), one))));
+		__m128 p2 = _mm_mul_ps(phi, phi);
+		__m128 s = _mm_add_ps(_mm_set1_ps(1.0f/120.0f), _mm_mul_ps(p2, _mm_set1_ps(-1.0f/5040.0f)));
+		s = _mm_add_ps(_mm_set1_ps(-1.0f/6.0f), _mm_mul_ps(p2, s));
+		s = _mm_mul_ps(phi, _mm_add_ps(one, _mm_mul_ps(p2, s)));
+		__m128 c = _mm_add_ps(_mm_set1_ps(-1.0f/720.0f), _mm_mul_ps(p2, _mm_set1_ps(1.0f/40320.0f)));
+		c = _mm_add_ps(_mm_set1_ps(1.0f/24.0f), _mm_mul_ps(p2, c));
+		c = _mm_add_ps(_mm_set1_ps(-0.5f), _mm_mul_ps(p2, c));
+		c = _mm_add_ps(one, _mm_mul_ps(p2, c));
+		__m128 px = _mm_mul_ps(r, _mm_blendv_ps(c, s, steep));
+		__m128 py = _mm_mul_ps(r, _mm_blendv_ps(s, c, steep));
+		_mm_storeu_ps(x+k, px);
+		_mm_storeu_ps(y+k, py);
+		if (z) {
+			__m128 z2 = _mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(px, px)), _mm_mul_ps(py, py));
+			_mm_storeu_ps(z+k, _mm_sqrt_ps(_mm_max_ps(z2, zero)));
+		}
+	}
+	warp_kernel_scalar(u1+k, u2+k, x+k, y+k, z ? z+k : NULL, count-k);
+}
+
+__attribute__((target("avx")))
+void warp_kernel_avx(const float* u1, const float* u2, float* x, float* y, float* z, int count){
+	const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+	const __m256 sign = _mm256_set1_ps(-0.0f), quarter_pi = _mm256_set1_ps(QUARTER_PI);
+	int k = 0;
+	for (; k + 8 <= count; k += 8) {
+		__m256 a = _mm256_sub_ps(_mm256_mul_ps(two, _mm256_loadu_ps(u1+k)), one);
+		__m256 b = _mm256_sub_ps(_mm256_mul_ps(two, _mm256_loadu_ps(u2+k)), one);
+		__m256 steep = _mm256_cmp_ps(_mm256_andnot_ps(sign, a), _mm256_andnot_ps(sign, b), _CMP_LE_OQ);
+		__m256 r = _mm256_blendv_ps(a, b, steep);
+		__m256 ratio = _mm256_blendv_ps(b, a, steep);
+		__m256 phi = _mm256_mul_ps(quarter_pi, _mm256_div_ps(ratio, _mm256_add_ps(r, _mm256_and_ps(_mm256_cmp_ps(r, zero, _CMP_EQ_OQ), one))));
+		__m256 p2 = _mm256_mul_ps(phi, phi);
+		__m256 s = _mm256_add_ps(_mm256_set1_ps(1.0f/120.0f), _mm256_mul_ps(p2, _mm256_set1_ps(-1.0f/5040.0f)));
+		s = _mm256_add_ps(_mm256_set1_ps(-1.0f/6.0f), _mm256_mul_ps(p2, s));
+		s = _mm256_mul_ps(phi, _mm256_add_ps(one, _mm256_mul_ps(p2, s)));
+		__m256 c = _mm256_add_ps(_mm256_set1_ps(-1.0f/720.0f), _mm256_mul_ps(p2, _mm256_set1_ps(1.0f/40320.0f)));
+		c = _mm256_add_ps(_mm256_set1_ps(1.0f/24.0f), _mm256_mul_ps(p2, c));
+		c = _mm256_add_ps(_mm256_set1_ps(-0.5f), _mm256_mul_ps(p2, c));
+		c = _mm256_add_ps(one, _mm256_mul_ps(p2, c));
+		__m256 px = _mm256_mul_ps(r, _mm256_blendv_ps(c, s, steep));
+		__m256 py = _mm256_mul_ps(r, _mm256_blendv_ps(s, c, steep));
+		_mm256_storeu_ps(x+k, px);
+		_mm256_storeu_ps(y+k, py);
+		if (z) {
+			__m256 z2 = _mm256_sub_ps(_mm256_sub_ps(one, _mm256_mul_ps(px, px)), _mm256_mul_ps(py, py));
+			_mm256_storeu_ps(z+k, _mm256_sqrt_ps(_mm256_max_ps(z2, zero)));
+		}
+	}
+	warp_kernel_scalar(u1+k, u2+k, x+k, y+k, z ? z+k : NULL, count-k);
+}
+
+#endif
+
+
+//Widest kernel this CPU supports, RT_SIMD in the environment overrides the choice (avx2 and
+//avx512 get the AVX kernel)
+warp_kernel default_warp_kernel(){
+	const char* forced = getenv("RT_SIMD");
+#ifdef RT_X86_SIMD
+	__builtin_cpu_init();
+	bool has_avx = __builtin_cpu_supports("avx");
+	bool has_sse = __builtin_cpu_supports("sse4.1");
+	if (forced) {
+		if ((!strcmp(forced, "avx2") || !strcmp(forced, "avx512")) && has_avx) return warp_kernel_avx;
+		if (!strcmp(forced, "sse") && has_sse) return warp_kernel_sse;
+		if (!strcmp(forced, "scalar")) return warp_kernel_scalar;
+	}
+	if (has_avx) return warp_kernel_avx;
+	if (has_sse) return warp_kernel_sse;
+#endif
+	(void)forced;
+	return warp_kernel_scalar;
+}
+
+const char* warp_kernel_name(warp_kernel k){
+#ifdef RT_X86_SIMD
+	if (k == warp_kernel_avx) return "avx";
+	if (k == warp_kernel_sse) return "sse";
+#endif
+	(void)k;
+	return "scalar";
+}
+
+//Picked once, the first time a batch is warped
+inline warp_kernel batch_warp_kernel(){
+	static const warp_kernel kernel = default_warp_kernel();
+	return kernel;
+}
+
+//concentric_disk for count points
+inline void concentric_disk_batch(const float* u1, const float* u2, float* x, float* y, int count){
+	batch_warp_kernel()(u1, u2, x, y, NULL, count);
+}
+
+//cosine_hemisphere for count points, as (x[k], y[k], z[k])
+inline void cosine_hemisphere_batch(const float* u1, const float* u2, float* x, float* y, float* z, int count){
+	batch_warp_kernel()(u1, u2, x, y, z, count);
+}
@@ -0,0 +1,699 @@
+#include "hitable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "camera.h"
+#include "bvh.h"
+#include "arena.h"
+#include "closed_scene.h"
+#include "mesh_file.h"
+#include "instance.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#pragma once
+
+//Scene files
+
+/*
+ * Text format - one statement per line, # starts a comment
+ *
+ *   camera lookfrom 13 2 3 lookat 0 0 0 vup 0 1 0 vfov 20 aperture 0.1 focus 10
+ *   material ground lambertian 0.5 0.5 0.5        (albedo)
+ *   material steel metal 0.7 0.6 0.5 0.0          (albedo, fuzz)
+ *   material glass dielectric 1.5                 (refractive index)
+ *   sphere 0 -1000 0 1000 ground                  (center, radius, material name)
+ *   mesh models/bunny.ply ground                  (OBJ or PLY file, material name)
+ *
+ *   object tree                                   (the lines up to end make up a shared object)
+ *   sphere 0 1 0 0.5 leaves
+ *   end
+ *   instance tree scale 2 rotate 0 1 0 30 translate 5 0 -3
+ *
+ * An object gets a bvh of its own and is only stored once however many instances of it
+ * there are (instance.h). The transforms of an instance are applied to the object in the
+ * order they are written: translate x y z, rotate (axis) x y z (degrees) d, scale s or
+ * scale x y z. Objects can hold instances of objects defined before them, up to
+ * MAX_INSTANCE_DEPTH (hitable.h) instances in instances.
+ * Camera keys can come in any order, missing ones default to lookfrom 0 0 0, lookat 0 0 -1,
+ * vup 0 1 0, vfov 90, aperture 0, focus 1. Materials must be
+ * defined before the objects using them. Mesh paths are relative to the scene file, the
+ * formats are in mesh_file.h. Numbers are written with 9 significant digits so
+ * a saved scene reads back bit for bit.
+ *
+ * Binary format (.rtb) - the scene as it is used while rendering: spheres in bvh leaf order,
+ * the material index of each sphere and the flattened bvh nodes, every section starting on
+ * a 64 byte boundary
+ *
+ *   [header | materials | spheres | sphere materials | bvh nodes]
+ *
+ * mapped_scene mmaps the file and traverses the nodes and spheres where they lie in the
+ * mapping, only the (small) material table is turned into material objects, so a scene of any
+ * size is ready in about the time it takes to map it. The pages are read in by the first rays.
+ * The file stores the sizes of the structs it holds and is refused if they don't match the build.
+ * The section offsets, the material indices and the bvh are checked once when the file is opened,
+ * so a damaged or truncated file is refused instead of being read out of bounds.
+ */
+
+//Text
+
+//Writes the spheres and meshes of a list and the camera as a text scene, false if the list holds
+//anything else or an object with a material other than lambertian, metal or dielectric
+bool write_scene_text(FILE* f, const hitable_list* objects, const camera_params& view, std::string& error){
+
+  std::unordered_map<const material*, int> names;
+  std::string out;
+  char line[256];
+  snprintf(line, sizeof(line), "camera lookfrom %.9g %.9g %.9g lookat %.9g %.9g %.9g vup %.9g %.9g %.9g vfov %.9g aperture %.9g focus %.9g\n",
+           view.lookfrom.x(), view.lookfrom.y(), view.lookfrom.z(), view.lookat.x(), view.lookat.y(), view.lookat.z(),
+           view.vup.x(), view.vup.y(), view.vup.z(), view.vfov, view.aperture, view.focus_dist);
+  out += line;
+
+  for (int i = 0; i < objects->list_size; i++) {
+    const sphere* s = dynamic_cast<const sphere*>(objects->list[i]);
+    const triangle_mesh* mesh = dynamic_cast<const triangle_mesh*>(objects->list[i]);
+    if (!s && (!mesh || mesh->source.empty())) {
+      error = "only spheres and meshes read from a file can be saved";
+      return false;
+    }
+    const material* m = s ? s->mat_ptr : mesh->mat_ptr;
+    if (names.find(m) == names.end()) {
+      int name = int(names.size());
+      names[m] = name;
+      switch (m->type()) {
+        case MATERIAL_LAMBERTIAN: {
+          const lambertian* l = static_cast<const lambertian*>(m);
+          snprintf(line, sizeof(line), "material m%d lambertian %.9g %.9g %.9g\n", name, l->albedo.r(), l->albedo.g(), l->albedo.b());
+          break;
+        }
+        case MATERIAL_METAL: {
+          const metal* mt = static_cast<const metal*>(m);
+          snprintf(line, sizeof(line), "material m%d metal %.9g %.9g %.9g %.9g\n", name, mt->albedo.r(), mt->albedo.g(), mt->albedo.b(), mt->fuzz);
+          break;
+        }
+        case MATERIAL_DIELECTRIC:
+          snprintf(line, sizeof(line), "material m%d dielectric %.9g\n", name, static_cast<const dielectric*>(m)->ref_idx);
+          break;
+        default:
+          error = "only lambertian, metal and dielectric materials can be saved";
+          return false;
+      }
+      out += line;
+    }
+    if (s) {
+      snprintf(line, sizeof(line), "sphere %.9g %.9g %.9g %.9g m%d\n", s->center.x(), s->center.y(), s->center.z(), s->radius, names[m]);
+      out += line;
+    }
+    else
+      out += "mesh " + mesh->source + " m" + std::to_string(names[m]) + "\n";
+  }
+
+  if (fwrite(out.data(), 1, out.size(), f) != out.size()) {
+    error = "write failed";
+    return false;
+  }
+  return true;
+
+}
+
+
+//Tokeniser over one line of a text scene
+struct scene_line {
+  const char* p;
+  const char* end;
+
+  bool word(std::string& w){
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    const char* start = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    w.assign(start, p);
+    return p > start;
+  }
+
+  bool number(real& v){
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p == end)
+      return false;
+    char* e;
+#if RT_DOUBLE
+    v = strtod(p, &e);
+#else
+    v = strtof(p, &e);
+#endif
+    if (e == p || e > end || (e < end && *e != ' ' && *e != '\t' && *e != '\r'))
+      return false;
+    p = e;
+    return true;
+  }
+
+  bool vector(vec3& v){
+    real x, y, z;
+    if (!number(x) || !number(y) || !number(z))
+      return false;
+    v = vec3(x, y, z);
+    return true;
+  }
+};
+
+
+//Reads a text scene into the arena, returns NULL and sets error (with the line number) if it is malformed
+hitable_list* read_scene_text(const std::string& path, scene_arena& arena, camera_params& view, std::string& error){
+
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
+    error = "can't open " + path;
+    return NULL;
+  }
+  std::string text;
+  char buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    text.append(buffer, n);
+  fclose(f);
+
+  camera_params defaults = {vec3(0,0,0), vec3(0,0,-1), vec3(0,1,0), 90, 0, 1};
+  view = defaults;
+  std::unordered_map<std::string, material*> materials;
+  std::vector<hitable*> objects;
+  std::unordered_map<std::string, const hitable*> shared; //objects that can be instanced
+  std::unordered_map<std::string, int> shared_depth;        //and the instances nested in each
+  std::vector<hitable*> block;                              //parts of the object being defined
+  std::string block_name;
+  int block_depth = 0;
+  std::vector<hitable*>* target = &objects;
+  size_t slash = path.find_last_of('/');
+  std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+  size_t pos = 0;
+  int line_number = 0;
+  std::string w;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size();
+    line_number++;
+    const char* start = text.data() + pos;
+    const char* hash = (const char*)memchr(start, '#', eol - pos);
+    scene_line line = {start, hash ? hash : text.data() + eol};
+    pos = eol + 1;
+
+    bool ok = true;
+    if (!line.word(w))
+      continue;
+    if (w == "sphere") {
+      vec3 center;
+      real radius;
+      ok = line.vector(center) && line.number(radius) && line.word(w);
+      if (ok && materials.find(w) == materials.end()) {
+        error = "unknown material " + w;
+        ok = false;
+      }
+      if (ok)
+        target->push_back(arena.make<sphere>(center, radius, materials[w]));
+    }
+    else if (w == "mesh") {
+      std::string file;
+      ok = line.word(file) && line.word(w);
+      if (ok && materials.find(w) == materials.end()) {
+        error = "unknown material " + w;
+        ok = false;
+      }
+      if (ok && file[0] != '/')
+        file = directory + file;
+      triangle_mesh* mesh = ok ? load_mesh(file, materials[w], arena, error) : NULL;
+      ok = mesh != NULL;
+      if (ok)
+        target->push_back(mesh);
+    }
+    else if (w == "object") {
+      ok = target == &objects && line.word(block_name);
+      if (ok && shared.find(block_name) != shared.end()) {
+        error = "object " + block_name + " is already defined";
+        ok = false;
+      }
+      target = &block;
+      block_depth = 0;
+    }
+    else if (w == "end") {
+      ok = target == &block && !block.empty();
+      if (ok) {
+        shared[block_name] = arena.make<bvh>(&block[0], int(block.size()));
+        shared_depth[block_name] = block_depth;
+        block.clear();
+        target = &objects;
+      }
+    }
+    else if (w == "instance") {
+      ok = line.word(w);
+      if (ok && shared.find(w) == shared.end()) {
+        error = "unknown object " + w;
+        ok = false;
+      }
+      int depth = ok ? shared_depth[w] + 1 : 0;
+      if (depth > MAX_INSTANCE_DEPTH) {
+        error = "instances nested more than " + std::to_string(MAX_INSTANCE_DEPTH) + " deep";
+        ok = false;
+      }
+      if (target == &block && depth > block_depth)
+        block_depth = depth;
+      affine_transform to_world = affine_transform::identity(), inverse;
+      std::string op;
+      while (ok && line.word(op)) {
+        vec3 v;
+        real value;
+        if (op == "translate" && line.vector(v))
+          to_world = to_world.then(affine_transform::translation(v));
+        else if (op == "rotate" && line.vector(v) && line.number(value) && v.squared_length() > 0)
+          to_world = to_world.then(affine_transform::rotation(v, value));
+        else if (op == "scale" && line.number(value)) {
+          const char* p = line.p;
+          if (!line.number(v[1]) || !line.number(v[2])) {
+            line.p = p;
+            v = vec3(value, value, value);
+          }
+          else
+            v[0] = value;
+          to_world = to_world.then(affine_transform::scaling(v));
+        }
+        else
+          ok = false;
+      }
+      if (ok && !to_world.inverse(inverse)) {
+        error = "the transform can't be inverted";
+        ok = false;
+      }
+      if (ok)
+        target->push_back(arena.make<instance>(shared[w], to_world));
+    }
+    else if (w == "material") {
+      std::string name, kind;
+      ok = line.word(name) && line.word(kind);
+      vec3 albedo;
+      real value;
+      if (!ok) {}
+      else if (kind == "lambertian" && line.vector(albedo))
+        materials[name] = arena.make<lambertian>(albedo);
+      else if (kind == "metal" && line.vector(albedo) && line.number(value))
+        materials[name] = arena.make<metal>(albedo, value);
+      else if (kind == "dielectric" && line.number(value))
+        materials[name] = arena.make<dielectric>(value);
+      else
+        ok = false;
+    }
+    else if (w == "camera") {
+      while (ok && line.word(w)) {
+        if (w == "lookfrom") ok = line.vector(view.lookfrom);
+        else if (w == "lookat") ok = line.vector(view.lookat);
+        else if (w == "vup") ok = line.vector(view.vup);
+        else if (w == "vfov") ok = line.number(view.vfov);
+        else if (w == "aperture") ok = line.number(view.aperture);
+        else if (w == "focus") ok = line.number(view.focus_dist);
+        else ok = false;
+      }
+    }
+    else
+      ok = false;
+
+    if (ok && line.word(w))
+      ok = false; //trailing junk
+    if (!ok) {
+      if (error.empty())
+        error = "can't read this line";
+      error = path + ":" + std::to_string(line_number) + ": " + error;
+      return NULL;
+    }
+  }
+  if (target == &block) {
+    error = path + ": object " + block_name + " has no end";
+    return NULL;
+  }
+
+  hitable** list = arena.make_array<hitable*>(objects.size());
+  for (size_t i = 0; i < objects.size(); i++)
+    list[i] = objects[i];
+  return arena.make<hitable_list>(list, int(objects.size()));
+
+}
+
+
+//Binary
+
+const char SCENE_FILE_MAGIC[8] = {'R','T','S','C','E','N','E','\0'};
+const uint32_t SCENE_FILE_VERSION = 1;
+
+struct scene_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;   //sizes of the stored structs, the file is only usable by a matching build
+  uint32_t material_size;
+  uint32_t sphere_size;
+  uint32_t node_size;
+  uint32_t reserved;
+  camera_params view;
+  uint64_t material_count, material_offset;
+  uint64_t sphere_count, sphere_offset, sphere_material_offset;
+  uint64_t node_count, node_offset;
+  uint64_t file_size;
+};
+
+struct scene_file_material {
+  int32_t type;   //material_type
+  float albedo[3];
+  float param;    //metal: fuzz, dielectric: refractive index
+};
+
+
+//Writes a list of spheres with a bvh over them as a binary scene
+bool write_scene_binary(FILE* f, const hitable_list* objects, const camera_params& view, std::string& error, int max_leaf_size = 4){
+
+  int n = objects->list_size;
+  std::vector<aabb> boxes(n);
+  for (int i = 0; i < n; i++) {
+    if (!dynamic_cast<const sphere*>(objects->list[i])) {
+      error = "only spheres can be saved";
+      return false;
+    }
+    objects->list[i]->bounding_box(boxes[i]);
+  }
+  std::vector<bvh_node_data> nodes;
+  std::vector<int> order;
+  bvh_builder(boxes, max_leaf_size).build(nodes, order);
+
+  std::unordered_map<const material*, int> material_index;
+  std::vector<scene_file_material> materials;
+  std::vector<closed_sphere> spheres(n);
+  std::vector<int32_t> sphere_material(n);
+  for (int i = 0; i < n; i++) {
+    const sphere* s = static_cast<const sphere*>(objects->list[order[i]]);
+    closed_sphere cs = {s->center, s->radius};
+    spheres[i] = cs;
+    const material* m = s->mat_ptr;
+    std::unordered_map<const material*, int>::iterator found = material_index.find(m);
+    if (found == material_index.end()) {
+      scene_file_material fm;
+      memset(&fm, 0, sizeof(fm));
+      fm.type = m->type();
+      if (fm.type == MATERIAL_LAMBERTIAN || fm.type == MATERIAL_METAL) {
+        const vec3& a = fm.type == MATERIAL_LAMBERTIAN ? static_cast<const lambertian*>(m)->albedo : static_cast<const metal*>(m)->albedo;
+        fm.albedo[0] = a.r(); fm.albedo[1] = a.g(); fm.albedo[2] = a.b();
+        if (fm.type == MATERIAL_METAL)
+          fm.param = static_cast<const metal*>(m)->fuzz;
+      }
+      else if (fm.type == MATERIAL_DIELECTRIC)
+        fm.param = static_cast<const dielectric*>(m)->ref_idx;
+      else {
+        error = "only lambertian, metal and dielectric materials can be saved";
+        return false;
+      }
+      found = material_index.insert(std::make_pair(m, int(materials.size()))).first;
+      materials.push_back(fm);
+    }
+    sphere_material[i] = found->second;
+  }
+
+  //Lay the sections out on 64 byte boundaries
+  scene_file_header header = scene_file_header(); //zeroed, the struct has no padding
+  memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_FILE_VERSION;
+  header.header_size = sizeof(scene_file_header);
+  header.material_size = sizeof(scene_file_material);
+  header.sphere_size = sizeof(closed_sphere);
+  header.node_size = sizeof(bvh_node_data);
+  header.view = view;
+  uint64_t offset = 0;
+  struct { uint64_t* offset; size_t bytes; } sections[5] = {
+    {NULL, sizeof(header)},
+    {&header.material_offset, materials.size()*sizeof(scene_file_material)},
+    {&header.sphere_offset, spheres.size()*sizeof(closed_sphere)},
+    {&header.sphere_material_offset, sphere_material.size()*sizeof(int32_t)},
+    {&header.node_offset, nodes.size()*sizeof(bvh_node_data)}};
+  for (int k = 0; k < 5; k++) {
+    offset = (offset + 63) / 64 * 64;
+    if (sections[k].offset)
+      *sections[k].offset = offset;
+    offset += sections[k].bytes;
+  }
+  header.material_count = materials.size();
+  header.sphere_count = spheres.size();
+  header.node_count = nodes.size();
+  header.file_size = offset;
+
+  std::string out(offset, '\0');
+  memcpy(&out[0], &header, sizeof(header));
+  if (!materials.empty()) memcpy(&out[header.material_offset], &materials[0], materials.size()*sizeof(scene_file_material));
+  if (n > 0) {
+    memcpy(&out[header.sphere_offset], &spheres[0], spheres.size()*sizeof(closed_sphere));
+    memcpy(&out[header.sphere_material_offset], &sphere_material[0], sphere_material.size()*sizeof(int32_t));
+    memcpy(&out[header.node_offset], &nodes[0], nodes.size()*sizeof(bvh_node_data));
+  }
+  if (fwrite(out.data(), 1, out.size(), f) != out.size()) {
+    error = "write failed";
+    return false;
+  }
+  return true;
+
+}
+
+
+//A binary scene used straight from its memory mapping
+class mapped_scene: public hitable {
+
+  public:
+    mapped_scene() : data(NULL), size(0), spheres(NULL), sphere_material(NULL), nodes(NULL), sphere_count(0), node_count(0) {}
+    ~mapped_scene() { if (data) munmap(data, size); }
+
+    //Maps the file and creates its materials in the arena, false with error set if it can't be used
+    bool open(const std::string& path, scene_arena& arena, std::string& error);
+
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    camera_params view;
+
+  private:
+    mapped_scene(const mapped_scene&);
+    mapped_scene& operator=(const mapped_scene&);
+
+    bool check_sections(const scene_file_header& header) const;
+    bool check_contents(uint64_t material_count) const;
+
+    void* data;
+    size_t size;
+    const closed_sphere* spheres;
+    const int32_t* sphere_material;
+    const bvh_node_data* nodes;
+    size_t sphere_count, node_count;
+    std::vector<material*> materials;
+
+};
+
+
+bool mapped_scene::open(const std::string& path, scene_arena& arena, std::string& error){
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "can't open " + path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(scene_file_header)) {
+    close(fd);
+    error = path + " is not a scene file";
+    return false;
+  }
+  size = size_t(st.st_size);
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    data = NULL;
+    error = "can't map " + path;
+    return false;
+  }
+
+  scene_file_header header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != SCENE_FILE_VERSION) {
+    error = path + " is not a scene file of this version";
+    return false;
+  }
+  if (header.header_size != sizeof(scene_file_header) || header.material_size != sizeof(scene_file_material) ||
+      header.sphere_size != sizeof(closed_sphere) || header.node_size != sizeof(bvh_node_data)) {
+    error = path + " was written by an incompatible build";
+    return false;
+  }
+  if (header.file_size > size) {
+    error = path + " is truncated";
+    return false;
+  }
+  if (header.file_size != size || !check_sections(header)) {
+    error = path + " is damaged";
+    return false;
+  }
+
+  const char* base = static_cast<const char*>(data);
+  const scene_file_material* file_materials = reinterpret_cast<const scene_file_material*>(base + header.material_offset);
+  materials.resize(header.material_count);
+  for (size_t k = 0; k < materials.size(); k++) {
+    const scene_file_material& fm = file_materials[k];
+    vec3 albedo(fm.albedo[0], fm.albedo[1], fm.albedo[2]);
+    switch (fm.type) {
+      case MATERIAL_LAMBERTIAN: materials[k] = arena.make<lambertian>(albedo); break;
+      case MATERIAL_METAL: materials[k] = arena.make<metal>(albedo, fm.param); break;
+      case MATERIAL_DIELECTRIC: materials[k] = arena.make<dielectric>(fm.param); break;
+      default:
+        error = path + " has an unknown material";
+        return false;
+    }
+  }
+
+  view = header.view;
+  spheres = reinterpret_cast<const closed_sphere*>(base + header.sphere_offset);
+  sphere_material = reinterpret_cast<const int32_t*>(base + header.sphere_material_offset);
+  nodes = reinterpret_cast<const bvh_node_data*>(base + header.node_offset);
+  sphere_count = header.sphere_count;
+  node_count = header.node_count;
+  if (!check_contents(header.material_count)) {
+    error = path + " is damaged";
+    return false;
+  }
+  return true;
+
+}
+
+
+//Whether count items of T from offset on lie within the mapping, aligned for T (the mapping
+//itself starts on a page boundary)
+template <typename T>
+inline bool section_fits(uint64_t offset, uint64_t count, size_t size){
+  return offset % alignof(T) == 0 && offset <= size && count <= (size - offset) / sizeof(T);
+}
+
+
+//The sections the header points to are all within the file, and the counts fit the int
+//indices of the bvh
+bool mapped_scene::check_sections(const scene_file_header& header) const {
+
+  return header.sphere_count <= uint64_t(INT_MAX) && header.node_count <= uint64_t(INT_MAX) &&
+         section_fits<scene_file_material>(header.material_offset, header.material_count, size) &&
+         section_fits<closed_sphere>(header.sphere_offset, header.sphere_count, size) &&
+         section_fits<int32_t>(header.sphere_material_offset, header.sphere_count, size) &&
+         section_fits<bvh_node_data>(header.node_offset, header.node_count, size);
+
+}
+
+
+//Every material index names a material and every node refers to nodes and spheres that
+//exist. Children always come after their parent in the flattened tree (bvh_builder), which
+//also keeps a damaged file from sending the traversal round in a loop, and no node may be
+//deeper than the traversal stack (BVH_MAX_DEPTH)
+bool mapped_scene::check_contents(uint64_t material_count) const {
+
+  for (size_t i = 0; i < sphere_count; i++)
+    if (sphere_material[i] < 0 || uint64_t(sphere_material[i]) >= material_count)
+      return false;
+
+  std::vector<int> depth(node_count, 0);
+  for (size_t i = 0; i < node_count; i++) {
+    const bvh_node_data& n = nodes[i];
+    if (n.count > 0) {
+      if (n.offset < 0 || int64_t(n.offset) + n.count > int64_t(sphere_count))
+        return false;
+      continue;
+    }
+    if (n.count < 0 || i + 1 >= node_count || n.offset <= int64_t(i) || size_t(n.offset) >= node_count)
+      return false;
+    int child_depth = depth[i] + 1;
+    if (child_depth >= BVH_MAX_DEPTH)
+      return false;
+    depth[i + 1] = std::max(depth[i + 1], child_depth);
+    depth[n.offset] = std::max(depth[n.offset], child_depth);
+  }
+  return true;
+
+}
+
+
+bool mapped_scene::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const {
+
+  if (node_count == 0)
+    return false;
+
+  int closest = -1;
+  RT_STAT(int tests = 0, successes = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    bool hit_leaf = false;
+    RT_STAT(tests += count);
+    for (int i = first; i < first + count; i++) {
+      if (spheres[i].hit(r, tmin, closest_so_far)) {
+        RT_STAT(successes++);
+        hit_leaf = true;
+        closest = i;
+      }
+    }
+    return hit_leaf;
+  };
+
+  bool hit_anything = bvh_traverse(nodes, r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += successes;)
+  if (!hit_anything)
+    return false;
+  id.prim = this;
+  id.index = closest;
+  id.depth = 0;
+  return true;
+
+}
+
+
+void mapped_scene::fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const {
+
+  spheres[id.index].fill_record(r, t, rec);
+  rec.mat_ptr = materials[sphere_material[id.index]];
+
+}
+
+
+bool mapped_scene::occluded(const ray& r, real tmin, real tmax) const {
+
+  if (node_count == 0)
+    return false;
+
+  RT_STAT(int tests = 0);
+  auto leaf = [&](int first, int count, real& closest_so_far){
+    for (int i = first; i < first + count; i++) {
+      RT_STAT(tests++);
+      if (spheres[i].occluded(r, tmin, closest_so_far))
+        return true;
+    }
+    return false;
+  };
+
+  bool blocked = bvh_traverse<true>(nodes, r, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += blocked;)
+  return blocked;
+
+}
+
+
+bool mapped_scene::bounding_box(aabb& box) const {
+
+  if (node_count == 0)
+    return false;
+  box = nodes[0].box;
+  return true;
+
+}
@@ -0,0 +1,150 @@
+#include "sphere.h"
+#include "hitable_list.h"
+#include "material.h"
+#include "camera.h"
+#include "arena.h"
+#include "bvh.h"
+#include "instance.h"
+#include <stdlib.h>
+#pragma once
+
+//Scenes
+
+//Chapter 8/9 - three spheres (diffuse, metal and hollow glass) sitting on a large diffuse sphere
+hitable *material_scene(scene_arena& arena) {
+    hitable **list = arena.make_array<hitable*>(5);
+    list[0] = arena.make<sphere>(vec3(0,0,-1), 0.5, arena.make<lambertian>(vec3(0.1, 0.2, 0.5)));
+    list[1] = arena.make<sphere>(vec3(0,-100.5,-1), 100, arena.make<lambertian>(vec3(0.8, 0.8, 0.0)));
+    list[2] = arena.make<sphere>(vec3(1,0,-1), 0.5, arena.make<metal>(vec3(0.8, 0.6, 0.2), 0.0));
+    list[3] = arena.make<sphere>(vec3(-1,0,-1), 0.5, arena.make<dielectric>(1.5));
+    list[4] = arena.make<sphere>(vec3(-1,0,-1), -0.45, arena.make<dielectric>(1.5));
+    return arena.make<hitable_list>(list,5);
+}
+
+//Chapter 11 - camera looking down at the material scene with a wide aperture
+camera_params material_scene_view() {
+    vec3 lookfrom(3,3,2);
+    vec3 lookat(0,0,-1);
+    float dist_to_focus = (lookfrom-lookat).length();
+    float aperture = 2.0;
+    camera_params view = {lookfrom, lookat, vec3(0,1,0), 20, aperture, dist_to_focus};
+    return view;
+}
+
+camera material_scene_camera(float aspect) {
+    return material_scene_view().make(aspect);
+}
+
+//Chatper 12 - cover scene
+hitable *random_scene(scene_arena& arena) {
+    int n = 500;
+    hitable **list = arena.make_array<hitable*>(n+1);
+    list[0] =  arena.make<sphere>(vec3(0,-1000,0), 1000, arena.make<lambertian>(vec3(0.5, 0.5, 0.5)));
+    int i = 1;
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            float choose_mat = drand48();
+            vec3 center(a+0.9*drand48(),0.2,b+0.9*drand48()); 
+            if ((center-vec3(4,0.2,0)).length() > 0.9) { 
+                if (choose_mat < 0.8) {  // diffuse
+                    list[i++] = arena.make<sphere>(center, 0.2, arena.make<lambertian>(vec3(drand48()*drand48(), drand48()*drand48(), drand48()*drand48())));
+                }
+                else if (choose_mat < 0.95) { // metal
+                    list[i++] = arena.make<sphere>(center, 0.2,
+                            arena.make<metal>(vec3(0.5*(1 + drand48()), 0.5*(1 + drand48()), 0.5*(1 + drand48())),  0.5*drand48()));
+                }
+                else {  // glass
+                    list[i++] = arena.make<sphere>(center, 0.2, arena.make<dielectric>(1.5));
+                }
+            }
+        }
+    }
+
+    list[i++] = arena.make<sphere>(vec3(0, 1, 0), 1.0, arena.make<dielectric>(1.5));
+    list[i++] = arena.make<sphere>(vec3(-4, 1, 0), 1.0, arena.make<lambertian>(vec3(0.4, 0.2, 0.1)));
+    list[i++] = arena.make<sphere>(vec3(4, 1, 0), 1.0, arena.make<metal>(vec3(0.7, 0.6, 0.5), 0.0));
+
+    return arena.make<hitable_list>(list,i);
+}
+
+
+//Cover scene layout with every small sphere made of glass - paths bounce around
+//for a long time, which is where the depth limit and Russian roulette matter most
+//(use random_scene_camera)
+hitable *glass_scene(scene_arena& arena) {
+    int n = 500;
+    hitable **list = arena.make_array<hitable*>(n+1);
+    list[0] =  arena.make<sphere>(vec3(0,-1000,0), 1000, arena.make<lambertian>(vec3(0.5, 0.5, 0.5)));
+    int i = 1;
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            vec3 center(a+0.9*drand48(),0.2,b+0.9*drand48());
+            if ((center-vec3(4,0.2,0)).length() > 0.9)
+                list[i++] = arena.make<sphere>(center, 0.2, arena.make<dielectric>(1.3 + 0.4*drand48()));
+        }
+    }
+
+    list[i++] = arena.make<sphere>(vec3(0, 1, 0), 1.0, arena.make<dielectric>(1.5));
+    list[i++] = arena.make<sphere>(vec3(-4, 1, 0), 1.0, arena.make<dielectric>(1.5));
+    list[i++] = arena.make<sphere>(vec3(-4, 1, 0), -0.9, arena.make<dielectric>(1.5)); //hollow glass ball
+    list[i++] = arena.make<sphere>(vec3(4, 1, 0), 1.0, arena.make<metal>(vec3(0.7, 0.6, 0.5), 0.0));
+
+    return arena.make<hitable_list>(list,i);
+}
+
+
+//A 100 x 100 field of instances of one cluster of 100k small spheres (1 billion spheres
+//seen, 100k stored), each turned and scaled differently, on the cover scene's ground
+hitable *instance_scene(scene_arena& arena) {
+    const int cluster_size = 100000, rows = 100;
+    material* materials[8];
+    for (int k = 0; k < 6; k++)
+        materials[k] = arena.make<lambertian>(vec3(drand48(), drand48(), drand48()));
+    materials[6] = arena.make<metal>(vec3(0.8, 0.8, 0.8), 0.1);
+    materials[7] = arena.make<metal>(vec3(0.9, 0.6, 0.3), 0.3);
+    std::vector<hitable*> cluster(cluster_size);
+    for (int k = 0; k < cluster_size; k++) {
+        vec3 p;
+        do {
+            p = vec3(2*drand48()-1, 2*drand48()-1, 2*drand48()-1);
+        } while (p.squared_length() > 1);
+        cluster[k] = arena.make<sphere>(p, 0.012, materials[lrand48() % 8]);
+    }
+    bvh* shared = arena.make<bvh>(&cluster[0], cluster_size);
+
+    hitable **list = arena.make_array<hitable*>(rows*rows + 1);
+    list[0] = arena.make<sphere>(vec3(0,-1000,0), 1000, arena.make<lambertian>(vec3(0.5, 0.5, 0.5)));
+    int i = 1;
+    for (int a = 0; a < rows; a++) {
+        for (int b = 0; b < rows; b++) {
+            float scale = 0.6 + 0.4*drand48();
+            affine_transform t = affine_transform::scaling(vec3(scale, scale, scale))
+                                 .then(affine_transform::rotation(vec3(drand48()-0.5, 1, drand48()-0.5), 360*drand48()))
+                                 .then(affine_transform::translation(vec3(2.5*(a - rows/2) + drand48(), scale, 2.5*(b - rows/2) + drand48())));
+            list[i++] = arena.make<instance>(shared, t);
+        }
+    }
+    return arena.make<hitable_list>(list, i);
+}
+
+camera_params instance_scene_view() {
+    vec3 lookfrom(-30, 10, 135);
+    vec3 lookat(0, 0, 80);
+    camera_params view = {lookfrom, lookat, vec3(0,1,0), 40, 0, (lookfrom-lookat).length()};
+    return view;
+}
+
+
+//Camera used for the cover scene
+camera_params random_scene_view() {
+    vec3 lookfrom(13,2,3);
+    vec3 lookat(0,0,0);
+    float dist_to_focus = 10.0;
+    float aperture = 0.1;
+    camera_params view = {lookfrom, lookat, vec3(0,1,0), 20, aperture, dist_to_focus};
+    return view;
+}
+
+camera random_scene_camera(float aspect) {
+    return random_scene_view().make(aspect);
+}
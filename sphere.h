@@ -87,40 +87,39 @@ class sphere: public hitable {
   public:
     sphere() {}
     //Note : is initialization list syntax, center / radius are assigned values cen / r
-    sphere(vec3 cen, float r, material* m) : center(cen), radius(r), mat_ptr(m) {}; 
-    //hit function from hitable
-    virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+    sphere(vec3 cen, real r, material* m) : center(cen), radius(r), mat_ptr(m) {}; 
+    //nearest and fill_record from hitable
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
     vec3 center;
-    float radius; 
+    real radius; 
     material* mat_ptr;
 
 };
 
 
-//Spheres implementation of hit
-bool sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const{
+//Spheres implementation of nearest
+//With b = 2*h the roots (-b +/- sqrt(b*b - 4*a*c)) / 2*a simplify to (-h +/- sqrt(h*h - a*c)) / a
+//and the square root is only taken once for both roots
+bool sphere::nearest(const ray& r, real tmin, real& tmax, hit_id& id) const{
 
   vec3 oc = r.origin() - center; //(A - C)
-  float a = dot(r.direction(), r.direction()); //(B*B)
-  float b = 2.0 * dot(oc, r.direction()); //2 * (B*(A-C))
-  float c = dot(oc, oc) - radius*radius; //((A-C)*(A-C)) - R*R
-  float discriminant = b*b - 4*a*c; //quadratic formula discriminant sqrt(b^2 - 4ac)
+  real a = dot(r.direction(), r.direction()); //(B*B)
+  real half_b = dot(oc, r.direction()); //(B*(A-C))
+  real c = dot(oc, oc) - radius*radius; //((A-C)*(A-C)) - R*R
+  real discriminant = half_b*half_b - a*c; //quarter of the quadratic formula discriminant b^2 - 4ac
   
   if(discriminant > 0){
-    float temp = (-b - sqrt(b*b-4*a*c))/(2*a); //first root
-    if (temp < tmax && temp > tmin) { //within t interval, update the record
-      rec.t = temp;
-      rec.p = r.point_at_parameter(rec.t);
-      rec.normal = (rec.p - center) / radius;
-      rec.mat_ptr = mat_ptr;
-      return true;
-    }
-    temp = (-b + sqrt(b*b-4*a*c))/(2*a); //second root
-      if (temp < tmax && temp > tmin) { //within t interval, update the record
-      rec.t = temp;
-      rec.p = r.point_at_parameter(rec.t);
-      rec.normal = (rec.p - center) / radius;
-      rec.mat_ptr = mat_ptr;
+    real root = std::sqrt(discriminant);
+    real temp = (-half_b - root)/a; //first root
+    if (!(temp < tmax && temp > tmin))
+      temp = (-half_b + root)/a; //second root
+    if (temp < tmax && temp > tmin) { //within t interval, only the distance is kept
+      tmax = temp;
+      id.prim = this;
+      id.depth = 0;
       return true;
     }
   }
@@ -128,3 +127,40 @@ bool sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const{
   return false;
 
 }
+
+
+//The point, normal and material of the hit, once nearest has found it
+void sphere::fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const{
+  rec.t = t;
+  rec.p = r.point_at_parameter(t);
+  rec.normal = (rec.p - center) / radius;
+  rec.mat_ptr = mat_ptr;
+}
+
+
+//Either root within (tmin,tmax), compared as -h +/- sqrt(h*h - a*c) against a*tmin and
+//a*tmax (a > 0) so neither root is divided out
+bool sphere::occluded(const ray& r, real tmin, real tmax) const{
+
+  vec3 oc = r.origin() - center;
+  real a = dot(r.direction(), r.direction());
+  real half_b = dot(oc, r.direction());
+  real c = dot(oc, oc) - radius*radius;
+  real discriminant = half_b*half_b - a*c;
+  if(discriminant <= 0)
+    return false;
+
+  real root = std::sqrt(discriminant);
+  real lo = a*tmin, hi = a*tmax;
+  real near_root = -half_b - root, far_root = -half_b + root;
+  return (near_root > lo && near_root < hi) || (far_root > lo && far_root < hi);
+
+}
+
+
+//Box from center - r to center + r, fabs as the radius can be negative (hollow glass)
+bool sphere::bounding_box(aabb& box) const{
+  real r = std::fabs(radius);
+  box = aabb(center - vec3(r, r, r), center + vec3(r, r, r));
+  return true;
+}
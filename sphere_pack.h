@@ -0,0 +1,492 @@
+#include "hitable.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "aligned_allocator.h"
+#include <vector>
+#include <unordered_map>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RT_X86_SIMD 1
+#endif
+#pragma once
+
+//Packed spheres
+
+/*
+ * A hitable_list of spheres costs a pointer chase and a virtual call per sphere, and
+ * each test only uses one float lane of the CPU. sphere_pack stores all spheres as a
+ * structure of arrays (SoA):
+ *
+ *   cx: [x0 x1 x2 x3 ...]    r:   [r0 r1 r2 r3 ...]
+ *   cy: [y0 y1 y2 y3 ...]    mat: [m0 m1 m2 m3 ...]  (index into materials)
+ *   cz: [z0 z1 z2 z3 ...]
+ *
+ * so one ray can be tested against 4 (SSE), 8 (AVX2) or 16 (AVX-512) spheres at once,
+ * each lane doing the same quadratic as sphere::hit. Every lane keeps its own nearest t,
+ * and the lanes are reduced to a single nearest hit once the range is done. Only that
+ * final hit fills in the hit_record.
+ *
+ * The widest kernel the CPU supports is picked at runtime (RT_SIMD=scalar|sse|avx2|avx512
+ * forces one). Arrays are padded with 16 or more NaN radii, which fail every comparison,
+ * so kernels can always load whole vectors past the end of a range.
+ *
+ * Optionally a bvh is built over the pack, its leaves are then short runs of the
+ * arrays tested with the same kernels.
+ *
+ * The arrays and kernels are float whatever real is (vec3.h), so a lane is always 32 bits
+ * wide. In a double build only the nearest t is found in float, the hit_record is filled in
+ * from it in double.
+ */
+
+class sphere_pack;
+
+//Finds the nearest sphere in [begin,end) hit within (tmin,tmax), lowers tmax and sets index if found
+typedef void (*sphere_kernel)(const sphere_pack& s, int begin, int end, const ray& r, float tmin, float& tmax, int& index);
+
+class sphere_pack: public hitable {
+
+  public:
+    sphere_pack() : count(0) { kernel = default_kernel(); }
+    virtual bool nearest(const ray& r, real tmin, real& tmax, hit_id& id) const;
+    virtual void fill_record(const ray& r, real t, const hit_id& id, hit_record& rec) const;
+    virtual bool occluded(const ray& r, real tmin, real tmax) const;
+    virtual bool bounding_box(aabb& box) const;
+
+    void add(const vec3& center, float radius, material* m);
+
+    //Adds a list of spheres, returns false (adding nothing) if anything in the list is not a sphere
+    bool add_list(hitable **l, int n);
+
+    //Builds a pack from a list of spheres, returns NULL if anything in the list is not a sphere
+    static sphere_pack* from_list(hitable **l, int n);
+
+    //Builds a bvh whose leaves hold up to leaf_size consecutive spheres
+    void build_bvh(int leaf_size = 8);
+
+    //Nearest hit without filling a hit_record, index is the sphere that was hit
+    inline bool nearest(const ray& r, real tmin, real& tmax, int& index) const;
+
+    //Fills in the hit record for sphere index at distance t along r
+    inline void fill_record(const ray& r, real t, int index, hit_record& rec) const;
+
+    static sphere_kernel default_kernel();
+    static const char* kernel_name(sphere_kernel k);
+
+    aligned_vector<float> cx, cy, cz, r;
+    std::vector<int> mat;
+    std::vector<material*> materials;
+    int count;
+    std::vector<bvh_node_data> nodes; //empty unless build_bvh was called
+    sphere_kernel kernel;
+
+  private:
+    void pad();
+    std::unordered_map<material*, int> material_index;
+
+};
+
+
+//Plain C++ version, also the reference for the SIMD kernels
+void sphere_kernel_scalar(const sphere_pack& s, int begin, int end, const ray& r, float tmin, float& tmax, int& index){
+  vec3 o = r.origin(), d = r.direction();
+  float a = dot(d, d);
+  for (int k = begin; k < end; k++) {
+    float ocx = o.x() - s.cx[k], ocy = o.y() - s.cy[k], ocz = o.z() - s.cz[k];
+    float half_b = ocx*d.x() + ocy*d.y() + ocz*d.z();
+    float c = ocx*ocx + ocy*ocy + ocz*ocz - s.r[k]*s.r[k];
+    float discriminant = half_b*half_b - a*c;
+    if (discriminant > 0) {
+      float root = sqrtf(discriminant);
+      float t = (-half_b - root)/a;
+      if (!(t < tmax && t > tmin))
+        t = (-half_b + root)/a;
+      if (t < tmax && t > tmin) {
+        tmax = t;
+        index = k;
+      }
+    }
+  }
+}
+
+#ifdef RT_X86_SIMD
+
+//Picks the lane with the smallest t, lower sphere index wins ties
+inline void reduce_lanes(const float* t, const int* idx, int lanes, float& tmax, int& index){
+  for (int l = 0; l < lanes; l++) {
+    if (idx[l] >= 0 && (t[l] < tmax || (t[l] == tmax && idx[l] < index))) {
+      tmax = t[l];
+      index = idx[l];
+    }
+  }
+}
+
+__attribute__((target("sse4.1")))
+void sphere_kernel_sse(const sphere_pack& s, int begin, int end, const ray& r, float tmin, float& tmax, int& index){
+  vec3 o = r.origin(), d = r.direction();
+  __m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+  __m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()), dz = _mm_set1_ps(d.z());
+  __m128 a = _mm_set1_ps(dot(d, d));
+  __m128 vtmin = _mm_set1_ps(tmin);
+  __m128 best_t = _mm_set1_ps(tmax);
+  __m128i best_i = _mm_set1_epi32(-1);
+  __m128i lane = _mm_add_epi32(_mm_set1_epi32(begin), _mm_setr_epi32(0, 1, 2, 3));
+  __m128i vend = _mm_set1_epi32(end);
+  for (int k = begin; k < end; k += 4) {
+    __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&s.cx[k]));
+    __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&s.cy[k]));
+    __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&s.cz[k]));
+    __m128 rad = _mm_loadu_ps(&s.r[k]);
+    __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(rad, rad));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+    __m128 valid = _mm_and_ps(_mm_cmpgt_ps(disc, _mm_setzero_ps()), _mm_castsi128_ps(_mm_cmpgt_epi32(vend, lane)));
+    __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+    __m128 nb = _mm_sub_ps(_mm_setzero_ps(), half_b);
+    __m128 t0 = _mm_div_ps(_mm_sub_ps(nb, root), a);
+    __m128 t1 = _mm_div_ps(_mm_add_ps(nb, root), a);
+    __m128 in0 = _mm_and_ps(_mm_cmpgt_ps(t0, vtmin), _mm_cmplt_ps(t0, best_t));
+    __m128 in1 = _mm_and_ps(_mm_cmpgt_ps(t1, vtmin), _mm_cmplt_ps(t1, best_t));
+    __m128 t = _mm_blendv_ps(t1, t0, in0);
+    __m128 take = _mm_and_ps(valid, _mm_or_ps(in0, in1));
+    best_t = _mm_blendv_ps(best_t, t, take);
+    best_i = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(best_i), _mm_castsi128_ps(lane), take));
+    lane = _mm_add_epi32(lane, _mm_set1_epi32(4));
+  }
+  float t[4];
+  int idx[4];
+  _mm_storeu_ps(t, best_t);
+  _mm_storeu_si128((__m128i*)idx, best_i);
+  reduce_lanes(t, idx, 4, tmax, index);
+}
+
+__attribute__((target("avx2,fma")))
+void sphere_kernel_avx2(const sphere_pack& s, int begin, int end, const ray& r, float tmin, float& tmax, int& index){
+  vec3 o = r.origin(), d = r.direction();
+  __m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+  __m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+  __m256 a = _mm256_set1_ps(dot(d, d));
+  __m256 vtmin = _mm256_set1_ps(tmin);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 best_t = _mm256_set1_ps(tmax);
+  __m256i best_i = _mm256_set1_epi32(-1);
+  __m256i lane = _mm256_add_epi32(_mm256_set1_epi32(begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i vend = _mm256_set1_epi32(end);
+  for (int k = begin; k < end; k += 8) {
+    __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&s.cx[k]));
+    __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&s.cy[k]));
+    __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&s.cz[k]));
+    __m256 rad = _mm256_loadu_ps(&s.r[k]);
+    __m256 half_b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+    __m256 c = _mm256_fnmadd_ps(rad, rad, _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))));
+    __m256 disc = _mm256_fmsub_ps(half_b, half_b, _mm256_mul_ps(a, c));
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GT_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, lane)));
+    __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+    __m256 nb = _mm256_sub_ps(zero, half_b);
+    __m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, root), a);
+    __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, root), a);
+    __m256 in0 = _mm256_and_ps(_mm256_cmp_ps(t0, vtmin, _CMP_GT_OQ), _mm256_cmp_ps(t0, best_t, _CMP_LT_OQ));
+    __m256 in1 = _mm256_and_ps(_mm256_cmp_ps(t1, vtmin, _CMP_GT_OQ), _mm256_cmp_ps(t1, best_t, _CMP_LT_OQ));
+    __m256 t = _mm256_blendv_ps(t1, t0, in0);
+    __m256 take = _mm256_and_ps(valid, _mm256_or_ps(in0, in1));
+    best_t = _mm256_blendv_ps(best_t, t, take);
+    best_i = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_i), _mm256_castsi256_ps(lane), take));
+    lane = _mm256_add_epi32(lane, _mm256_set1_epi32(8));
+  }
+  float t[8];
+  int idx[8];
+  _mm256_storeu_ps(t, best_t);
+  _mm256_storeu_si256((__m256i*)idx, best_i);
+  reduce_lanes(t, idx, 8, tmax, index);
+}
+
+__attribute__((target("avx512f")))
+void sphere_kernel_avx512(const sphere_pack& s, int begin, int end, const ray& r, float tmin, float& tmax, int& index){
+  vec3 o = r.origin(), d = r.direction();
+  __m512 ox = _mm512_set1_ps(o.x()), oy = _mm512_set1_ps(o.y()), oz = _mm512_set1_ps(o.z());
+  __m512 dx = _mm512_set1_ps(d.x()), dy = _mm512_set1_ps(d.y()), dz = _mm512_set1_ps(d.z());
+  __m512 a = _mm512_set1_ps(dot(d, d));
+  __m512 vtmin = _mm512_set1_ps(tmin);
+  __m512 zero = _mm512_setzero_ps();
+  __m512 best_t = _mm512_set1_ps(tmax);
+  __m512i best_i = _mm512_set1_epi32(-1);
+  __m512i lane = _mm512_add_epi32(_mm512_set1_epi32(begin), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  __m512i vend = _mm512_set1_epi32(end);
+  for (int k = begin; k < end; k += 16) {
+    __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&s.cx[k]));
+    __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&s.cy[k]));
+    __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&s.cz[k]));
+    __m512 rad = _mm512_loadu_ps(&s.r[k]);
+    __m512 half_b = _mm512_fmadd_ps(ocz, dz, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocx, dx)));
+    __m512 c = _mm512_fnmadd_ps(rad, rad, _mm512_fmadd_ps(ocz, ocz, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocx, ocx))));
+    __m512 disc = _mm512_fmsub_ps(half_b, half_b, _mm512_mul_ps(a, c));
+    __mmask16 valid = _mm512_cmp_ps_mask(disc, zero, _CMP_GT_OQ) & _mm512_cmpgt_epi32_mask(vend, lane);
+    __m512 root = _mm512_maskz_sqrt_ps(valid, disc);
+    __m512 nb = _mm512_sub_ps(zero, half_b);
+    __m512 t0 = _mm512_div_ps(_mm512_sub_ps(nb, root), a);
+    __m512 t1 = _mm512_div_ps(_mm512_add_ps(nb, root), a);
+    __mmask16 in0 = _mm512_cmp_ps_mask(t0, vtmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t0, best_t, _CMP_LT_OQ);
+    __mmask16 in1 = _mm512_cmp_ps_mask(t1, vtmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t1, best_t, _CMP_LT_OQ);
+    __m512 t = _mm512_mask_blend_ps(in0, t1, t0);
+    __mmask16 take = valid & (in0 | in1);
+    best_t = _mm512_mask_blend_ps(take, best_t, t);
+    best_i = _mm512_mask_blend_epi32(take, best_i, lane);
+    lane = _mm512_add_epi32(lane, _mm512_set1_epi32(16));
+  }
+  float t[16];
+  int idx[16];
+  _mm512_storeu_ps(t, best_t);
+  _mm512_storeu_si512(idx, best_i);
+  reduce_lanes(t, idx, 16, tmax, index);
+}
+
+#endif
+
+
+//Widest kernel this CPU supports, RT_SIMD in the environment overrides the choice
+sphere_kernel sphere_pack::default_kernel(){
+  const char* forced = getenv("RT_SIMD");
+#ifdef RT_X86_SIMD
+  __builtin_cpu_init();
+  bool has_avx512 = __builtin_cpu_supports("avx512f");
+  bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  bool has_sse = __builtin_cpu_supports("sse4.1");
+  if (forced) {
+    if (!strcmp(forced, "avx512") && has_avx512) return sphere_kernel_avx512;
+    if (!strcmp(forced, "avx2") && has_avx2) return sphere_kernel_avx2;
+    if (!strcmp(forced, "sse") && has_sse) return sphere_kernel_sse;
+    if (!strcmp(forced, "scalar")) return sphere_kernel_scalar;
+  }
+  if (has_avx512) return sphere_kernel_avx512;
+  if (has_avx2) return sphere_kernel_avx2;
+  if (has_sse) return sphere_kernel_sse;
+#endif
+  (void)forced;
+  return sphere_kernel_scalar;
+}
+
+const char* sphere_pack::kernel_name(sphere_kernel k){
+#ifdef RT_X86_SIMD
+  if (k == sphere_kernel_avx512) return "avx512";
+  if (k == sphere_kernel_avx2) return "avx2";
+  if (k == sphere_kernel_sse) return "sse";
+#endif
+  (void)k;
+  return "scalar";
+}
+
+
+void sphere_pack::add(const vec3& center, float radius, material* m){
+
+  std::unordered_map<material*, int>::iterator it = material_index.find(m);
+  int mi;
+  if (it == material_index.end()) {
+    mi = int(materials.size());
+    materials.push_back(m);
+    material_index[m] = mi;
+  }
+  else
+    mi = it->second;
+
+  cx.resize(count); cy.resize(count); cz.resize(count); r.resize(count);
+  cx.push_back(center.x());
+  cy.push_back(center.y());
+  cz.push_back(center.z());
+  r.push_back(radius);
+  mat.push_back(mi);
+  count++;
+  pad();
+
+}
+
+//Pads the arrays with spheres that can never be hit, enough for a 16 wide load starting at any sphere
+void sphere_pack::pad(){
+
+  size_t padded = ((size_t(count) + 15) & ~size_t(15)) + 16;
+  cx.resize(padded, 0.0f);
+  cy.resize(padded, 0.0f);
+  cz.resize(padded, 0.0f);
+  r.resize(padded, nanf(""));
+
+}
+
+
+bool sphere_pack::add_list(hitable **l, int n){
+
+  for (int i = 0; i < n; i++)
+    if (!dynamic_cast<sphere*>(l[i]))
+      return false;
+  for (int i = 0; i < n; i++) {
+    sphere* s = static_cast<sphere*>(l[i]);
+    add(s->center, s->radius, s->mat_ptr);
+  }
+  return true;
+
+}
+
+
+sphere_pack* sphere_pack::from_list(hitable **l, int n){
+
+  sphere_pack* pack = new sphere_pack();
+  if (!pack->add_list(l, n)) {
+    delete pack;
+    return NULL;
+  }
+  return pack;
+
+}
+
+
+void sphere_pack::build_bvh(int leaf_size){
+
+  std::vector<aabb> boxes(count);
+  for (int k = 0; k < count; k++) {
+    float rad = fabs(r[k]);
+    boxes[k] = aabb(vec3(cx[k]-rad, cy[k]-rad, cz[k]-rad), vec3(cx[k]+rad, cy[k]+rad, cz[k]+rad));
+  }
+
+  std::vector<int> order;
+  bvh_builder(boxes, leaf_size).build(nodes, order);
+
+  //Reorder the arrays so every leaf is one contiguous run
+  aligned_vector<float> ncx(count), ncy(count), ncz(count), nr(count);
+  std::vector<int> nmat(count);
+  for (int k = 0; k < count; k++) {
+    ncx[k] = cx[order[k]]; ncy[k] = cy[order[k]]; ncz[k] = cz[order[k]];
+    nr[k] = r[order[k]]; nmat[k] = mat[order[k]];
+  }
+  cx.swap(ncx); cy.swap(ncy); cz.swap(ncz); r.swap(nr); mat.swap(nmat);
+  pad();
+
+}
+
+
+inline bool sphere_pack::nearest(const ray& ray_in, real tmin, real& tmax, int& index) const {
+
+  if (count == 0)
+    return false;
+
+  index = -1;
+  float near = float(tmin);
+  if (nodes.empty()) {
+    float far = float(tmax);
+    kernel(*this, 0, count, ray_in, near, far, index);
+    //Only a hit lowers tmax, a miss leaves the caller's (possibly double) value as it was
+    if (index >= 0)
+      tmax = far;
+    RT_STAT(render_counters& stats = render_stats::local();
+            stats.hit_tests += count;
+            stats.hit_successes += index >= 0;)
+    return index >= 0;
+  }
+
+  sphere_kernel k = kernel;
+  const sphere_pack& self = *this;
+  RT_STAT(int tests = 0, successes = 0);
+  auto leaf = [&](int first, int n, real& closest_so_far){
+    int before = index;
+    float far = float(closest_so_far);
+    k(self, first, first + n, ray_in, near, far, index);
+    if (index != before)
+      closest_so_far = far;
+    RT_STAT(tests += n;
+            successes += index != before;)
+    return index != before;
+  };
+  bool hit_anything = bvh_traverse(&nodes[0], ray_in, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += successes;)
+  return hit_anything;
+
+}
+
+
+inline void sphere_pack::fill_record(const ray& ray_in, real t, int index, hit_record& rec) const {
+
+  vec3 center(cx[index], cy[index], cz[index]);
+  rec.t = t;
+  rec.p = ray_in.point_at_parameter(t);
+  rec.normal = (rec.p - center) / r[index];
+  rec.mat_ptr = materials[mat[index]];
+
+}
+
+
+bool sphere_pack::nearest(const ray& ray_in, real tmin, real& tmax, hit_id& id) const {
+
+  int index;
+  if (!nearest(ray_in, tmin, tmax, index))
+    return false;
+  id.prim = this;
+  id.index = index;
+  id.depth = 0;
+  return true;
+
+}
+
+
+void sphere_pack::fill_record(const ray& ray_in, real t, const hit_id& id, hit_record& rec) const {
+
+  fill_record(ray_in, t, id.index, rec);
+
+}
+
+
+//The kernels have no early exit within a range, so the search stops after the first leaf
+//(or the first 16 spheres of a pack without a bvh) that has a sphere in the way
+bool sphere_pack::occluded(const ray& ray_in, real tmin, real tmax) const {
+
+  if (count == 0)
+    return false;
+
+  int index = -1;
+  float near = float(tmin);
+  if (nodes.empty()) {
+    int begin = 0;
+    for (; begin < count && index < 0; begin += 16) {
+      float far = float(tmax);
+      kernel(*this, begin, std::min(begin + 16, count), ray_in, near, far, index);
+    }
+    RT_STAT(render_counters& stats = render_stats::local();
+            stats.hit_tests += std::min(begin, count);
+            stats.hit_successes += index >= 0;)
+    return index >= 0;
+  }
+
+  sphere_kernel k = kernel;
+  const sphere_pack& self = *this;
+  RT_STAT(int tests = 0);
+  auto leaf = [&](int first, int n, real& closest_so_far){
+    float far = float(closest_so_far);
+    k(self, first, first + n, ray_in, near, far, index);
+    RT_STAT(tests += n);
+    return index >= 0;
+  };
+  bool blocked = bvh_traverse<true>(&nodes[0], ray_in, tmin, tmax, leaf);
+  RT_STAT(render_counters& stats = render_stats::local();
+          stats.hit_tests += tests;
+          stats.hit_successes += blocked;)
+  return blocked;
+
+}
+
+
+bool sphere_pack::bounding_box(aabb& box) const {
+
+  if (count == 0)
+    return false;
+  if (!nodes.empty()) {
+    box = nodes[0].box;
+    return true;
+  }
+  box = aabb();
+  for (int k = 0; k < count; k++) {
+    float rad = fabs(r[k]);
+    box.grow(aabb(vec3(cx[k]-rad, cy[k]-rad, cz[k]-rad), vec3(cx[k]+rad, cy[k]+rad, cz[k]+rad)));
+  }
+  return true;
+
+}
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <vector>
+#include <float.h>
+#include "../mesh.h"
+#include "../renderer.h"
+
+//A quad seen from behind (mesh.h): a metal one has to reflect the sky rather than come out
+//black, a dielectric one has to keep its outward normal
+
+//Quad in the z = 0 plane, counter clockwise seen from +z, so its geometric normal is +z
+triangle_mesh make_quad(material* m){
+	std::vector<vec3> vertices = {vec3(-1,-1,0), vec3(1,-1,0), vec3(1,1,0), vec3(-1,1,0)};
+	std::vector<uint32_t> triangles = {0, 1, 2, 0, 2, 3};
+	return triangle_mesh(vertices, triangles, m);
+}
+
+int main(){
+
+	int failures = 0;
+	ray from_behind(vec3(0.1f,0.2f,-2), vec3(0,0,1));
+
+	metal chrome(vec3(0.8f,0.8f,0.8f), 0);
+	triangle_mesh mirror = make_quad(&chrome);
+	hit_record rec;
+	if(!mirror.hit(from_behind, 0.001, FLT_MAX, rec) || dot(rec.normal, from_behind.direction()) >= 0){
+		std::cerr << "back_facing_quad: the normal of a metal quad seen from behind doesn't face the ray\n";
+		failures++;
+	}
+
+	//The camera looks at the back of the quad, which fills the whole view
+	camera cam(vec3(0,0,-2), vec3(0,0,0), vec3(0,1,0), 30, 1, 0, 2);
+	render_options opt;
+	opt.nx = 8;
+	opt.ny = 8;
+	opt.ns = 4;
+	opt.threads = 1;
+	integrator_fns integrator = {color, color_hit};
+	framebuffer fb;
+	render_frame(fb, cam, &mirror, opt, integrator);
+	int black = 0;
+	for(int j = 0; j < opt.ny; j++)
+		for(int i = 0; i < opt.nx; i++)
+			black += !(fb.at(i, j).length() > 0);
+	if(black > 0){
+		std::cerr << "back_facing_quad: " << black << " of " << opt.nx*opt.ny << " pixels of the metal quad seen from behind are black\n";
+		failures++;
+	}
+
+	dielectric clear(1.5f);
+	triangle_mesh glass = make_quad(&clear);
+	if(!glass.hit(from_behind, 0.001, FLT_MAX, rec) || dot(rec.normal, from_behind.direction()) <= 0){
+		std::cerr << "back_facing_quad: the normal of a dielectric quad isn't its outward normal\n";
+		failures++;
+	}
+
+	if(failures == 0)
+		std::cout << "back_facing_quad: ok\n";
+	return failures == 0 ? 0 : 1;
+
+}
@@ -0,0 +1,51 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+//A frame rendered by local workers (distributed.h) is the frame one process renders, to the last
+//bit. Workers are started by running Raytracer again, so the test runs the Raytracer it is given
+//both ways and compares the linear pfm files (the framebuffer's floats as they are)
+
+std::string read_file(const std::string& path){
+	std::ifstream in(path.c_str(), std::ios::binary);
+	std::ostringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+}
+
+int main(int argc, char** argv){
+
+	if (argc != 2) {
+		std::cerr << "usage: distributed_match RAYTRACER\n";
+		return 1;
+	}
+	std::string raytracer = argv[1];
+	std::string frame = " --spp 6 --width 40 --height 30 --tile 8";
+	std::string prefix = "distributed_match-" + std::to_string(getpid());
+	std::string single = prefix + "-single.pfm", workers = prefix + "-workers.pfm";
+
+	int failures = 0;
+	if (system((raytracer + frame + " -o " + single + " 2>/dev/null").c_str()) != 0 ||
+	    system((raytracer + frame + " --local-workers 2 --threads 2 -o " + workers + " 2>/dev/null").c_str()) != 0) {
+		std::cerr << "distributed_match: a render failed\n";
+		failures++;
+	}
+	else {
+		std::string a = read_file(single), b = read_file(workers);
+		if (a.empty() || a != b) {
+			std::cerr << "distributed_match: the frame of the local workers differs from the single process one\n";
+			failures++;
+		}
+	}
+	remove(single.c_str());
+	remove(workers.c_str());
+
+	if (failures == 0)
+		std::cout << "distributed_match: ok\n";
+	return failures == 0 ? 0 : 1;
+
+}
@@ -0,0 +1,50 @@
+#include "../scenes.h"
+#include "../bvh.h"
+#include "../renderer.h"
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#pragma once
+
+//What the tests that render a frame two ways and compare them share
+
+//The cover scene (random_scene()) in a bvh, with its camera for an nx x ny frame
+struct test_frame {
+	test_frame(int nx, int ny) {
+		srand48(0);
+		hitable_list* objects = (hitable_list*)random_scene(arena);
+		world = arena.make<bvh>(objects->list, objects->list_size);
+		cam = random_scene_view().make(float(nx)/float(ny));
+		integrator.radiance = color;
+		integrator.shade = color_hit;
+		opt.nx = nx;
+		opt.ny = ny;
+		opt.ns = 10;
+	}
+
+	scene_arena arena;
+	hitable* world;
+	camera cam;
+	integrator_fns integrator;
+	render_options opt;
+};
+
+//True if a and b hold the very same pixels and sample counts, otherwise says where they differ
+bool same_frame(const char* test, const char* what, const framebuffer& a, const framebuffer& b){
+	if (a.width != b.width || a.height != b.height) {
+		std::cerr << test << ": " << what << ": the frames have different sizes\n";
+		return false;
+	}
+	for (int j = 0; j < a.height; j++)
+		for (int i = 0; i < a.width; i++) {
+			//Component by component, the padding lane of an RT_VEC4 vec3 holds nothing
+			real pa[3] = {a.at(i, j).r(), a.at(i, j).g(), a.at(i, j).b()};
+			real pb[3] = {b.at(i, j).r(), b.at(i, j).g(), b.at(i, j).b()};
+			if (memcmp(pa, pb, sizeof(pa)) != 0 || a.samples[a.index(i, j)] != b.samples[b.index(i, j)]) {
+				std::cerr << test << ": " << what << ": pixel " << i << "," << j << " differs\n";
+				return false;
+			}
+		}
+	return true;
+}
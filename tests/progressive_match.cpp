@@ -0,0 +1,58 @@
+#include "frame_match.h"
+#include "../progressive.h"
+#include <stdio.h>
+#include <unistd.h>
+
+//A frame rendered in passes (progressive.h), and one stopped after a checkpoint and resumed
+//from it, are the frame rendered in one go to the last bit
+
+int main(){
+
+	test_frame frame(40, 30);
+	frame.opt.threads = 2;
+	int failures = 0;
+	const sampler_type samplings[2] = {SAMPLER_RANDOM, SAMPLER_SOBOL};
+	const char* names[2] = {"random sampler", "sobol sampler"};
+	std::string checkpoint = "progressive_match-" + std::to_string(getpid()) + ".acc";
+
+	for (int k = 0; k < 2; k++) {
+		render_options opt = frame.opt;
+		opt.sampling = samplings[k];
+		framebuffer whole;
+		render_frame(whole, frame.cam, frame.world, opt, frame.integrator);
+
+		//Passes of 3 samples, the last one shorter
+		progressive_options po;
+		po.pass_spp = 3;
+		accumulation_buffer accum(opt.nx, opt.ny, 0);
+		framebuffer passes;
+		std::string error;
+		if (!render_progressive(passes, frame.cam, frame.world, opt, frame.integrator, accum, po, error)) {
+			std::cerr << "progressive_match: " << error << "\n";
+			return 1;
+		}
+		failures += !same_frame("progressive_match", (std::string(names[k]) + ", passes").c_str(), whole, passes);
+
+		//Stopped after 4 samples with a checkpoint, then resumed from the file up to ns
+		po.checkpoint = checkpoint;
+		render_options first = opt;
+		first.ns = 4;
+		accumulation_buffer stopped(opt.nx, opt.ny, 0);
+		framebuffer partial, resumed;
+		accumulation_buffer loaded;
+		if (!render_progressive(partial, frame.cam, frame.world, first, frame.integrator, stopped, po, error) ||
+		    !loaded.load(checkpoint, error) ||
+		    !render_progressive(resumed, frame.cam, frame.world, opt, frame.integrator, loaded, po, error)) {
+			std::cerr << "progressive_match: " << error << "\n";
+			remove(checkpoint.c_str());
+			return 1;
+		}
+		failures += !same_frame("progressive_match", (std::string(names[k]) + ", resumed").c_str(), whole, resumed);
+	}
+	remove(checkpoint.c_str());
+
+	if (failures == 0)
+		std::cout << "progressive_match: ok\n";
+	return failures == 0 ? 0 : 1;
+
+}
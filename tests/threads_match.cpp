@@ -0,0 +1,43 @@
+#include "frame_match.h"
+
+//A frame rendered on one thread and on several is the same to the last bit (sampler.h: a
+//pixel's samples don't depend on which thread takes its tile or when), for the random and
+//sobol samplers and for the packet path
+
+int main(){
+
+	test_frame frame(40, 30);
+	int failures = 0;
+	const sampler_type samplings[2] = {SAMPLER_RANDOM, SAMPLER_SOBOL};
+	const char* names[2] = {"random sampler", "sobol sampler"};
+	for (int k = 0; k < 2; k++) {
+		render_options opt = frame.opt;
+		opt.sampling = samplings[k];
+		framebuffer one, many;
+		opt.threads = 1;
+		render_frame(one, frame.cam, frame.world, opt, frame.integrator);
+		opt.threads = 4;
+		render_frame(many, frame.cam, frame.world, opt, frame.integrator);
+		failures += !same_frame("threads_match", names[k], one, many);
+	}
+
+	//Packets only trace the camera rays of a sphere_pack with a bvh
+	srand48(0);
+	hitable_list* objects = (hitable_list*)random_scene(frame.arena);
+	sphere_pack* pack = frame.arena.make<sphere_pack>();
+	pack->add_list(objects->list, objects->list_size);
+	pack->build_bvh();
+	render_options opt = frame.opt;
+	opt.packet_size = 4;
+	framebuffer one, many;
+	opt.threads = 1;
+	render_frame(one, frame.cam, pack, opt, frame.integrator);
+	opt.threads = 4;
+	render_frame(many, frame.cam, pack, opt, frame.integrator);
+	failures += !same_frame("threads_match", "4x4 packets", one, many);
+
+	if (failures == 0)
+		std::cout << "threads_match: ok\n";
+	return failures == 0 ? 0 : 1;
+
+}
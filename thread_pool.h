@@ -0,0 +1,143 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <atomic>
+#pragma once
+
+//Work-stealing thread pool
+
+/*
+ * Every worker owns a deque of tasks. A worker takes work from the back of its own
+ * deque (the most recently added, still warm in cache) and, when that runs dry,
+ * steals from the front of another worker's deque (the oldest, usually the largest
+ * remaining chunk). Tasks submitted from outside are dealt round-robin across the
+ * deques, tasks submitted by a worker go onto that worker's own deque.
+ *
+ * Tiles differ a lot in cost (sky vs. glass), so stealing keeps every core busy
+ * until the very last tile instead of leaving whole static partitions idle.
+ */
+
+class thread_pool {
+
+  public:
+	typedef std::function<void()> task;
+
+	//A thread count of 0 sizes the pool from the hardware
+	explicit thread_pool(int threads = 0) : queues(0), pending(0), queued(0), next_queue(0), stopping(false) {
+		if(threads <= 0)
+			threads = default_thread_count();
+		queues = std::vector<worker_queue>(threads);
+		for(int i = 0; i < threads; i++)
+			workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+	}
+
+	~thread_pool(){
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for(size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	static int default_thread_count(){
+		int n = int(std::thread::hardware_concurrency());
+		return n > 0 ? n : 1;
+	}
+
+	int size() const { return int(queues.size()); }
+
+	//Queue a task, it may run on any worker
+	void submit(task t){
+		int q = (current_worker() >= 0) ? current_worker() : int(next_queue++ % queues.size());
+		pending++;
+		{
+			std::lock_guard<std::mutex> lock(queues[q].m);
+			queues[q].tasks.push_back(t);
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			queued++;
+		}
+		wake.notify_one();
+	}
+
+	//Blocks until every submitted task has finished
+	void wait(){
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		done.wait(lock, [this]{ return pending.load() == 0; });
+	}
+
+  private:
+	struct worker_queue {
+		std::mutex m;
+		std::deque<task> tasks;
+	};
+
+	//Index of the pool worker running on this thread, -1 for outside threads
+	static int& current_worker(){
+		static thread_local int index = -1;
+		return index;
+	}
+
+	//Pops from the back of our own deque, otherwise steals from the front of another
+	bool find_task(int self, task& t){
+		{
+			std::lock_guard<std::mutex> lock(queues[self].m);
+			if(!queues[self].tasks.empty()){
+				t = queues[self].tasks.back();
+				queues[self].tasks.pop_back();
+				queued--;
+				return true;
+			}
+		}
+		int n = int(queues.size());
+		for(int k = 1; k < n; k++){
+			worker_queue& victim = queues[(self + k) % n];
+			std::lock_guard<std::mutex> lock(victim.m);
+			if(!victim.tasks.empty()){
+				t = victim.tasks.front();
+				victim.tasks.pop_front();
+				queued--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void worker_loop(int self){
+		current_worker() = self;
+		for(;;){
+			task t;
+			if(find_task(self, t)){
+				t();
+				if(--pending == 0){
+					std::lock_guard<std::mutex> lock(sleep_mutex);
+					done.notify_all();
+				}
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			if(stopping)
+				return;
+			//Re-check under the lock so a submit between find_task and here is not missed
+			wake.wait(lock, [this]{ return stopping || queued.load() > 0; });
+			if(stopping && queued.load() == 0)
+				return;
+		}
+	}
+
+	std::vector<worker_queue> queues;
+	std::vector<std::thread> workers;
+	std::atomic<int> pending; //submitted but not yet finished
+	std::atomic<int> queued;  //submitted but not yet picked up
+	std::atomic<unsigned int> next_queue;
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool stopping;
+};
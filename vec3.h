@@ -1,116 +1,171 @@
 #include <math.h>
 #include <stdlib.h>
+#include <cmath>
 #include <iostream>
 #pragma once
 
-class vec3  {
-    
+/*
+ * Precision and layout (set by the RT_DOUBLE and RT_VEC4 options of CMakeLists.txt)
+ *
+ * vec3_t<T, Lanes> is a vector of three T, stored in Lanes elements:
+ *
+ *   Lanes = 3   x y z        12 bytes (float), 24 (double), packed like the original float e[3]
+ *   Lanes = 4   x y z 0      16 bytes (float) or 32 (double) aligned to 16, a float vector is one
+ *                            SSE/NEON register, so +, - and * compile to a single instruction
+ *
+ * The renderer uses one of them, vec3, with real as its scalar:
+ *
+ *   RT_DOUBLE=0 (default)    real = float
+ *   RT_DOUBLE=1              real = double, for scenes where float runs out of bits (very large
+ *                            or far from the origin) and as a reference to compare float against
+ *   RT_VEC4=1                vec3 uses the 4 lane layout
+ *
+ * The padding lane is kept at 0 by every operation, so it never turns into a NaN or inf that
+ * could slow down the lanes next to it. Only x, y and z are ever read back.
+ *
+ * The arithmetic is done in T throughout: scalars are converted to T before they are used
+ * (2.0*v is a float multiply in a float build) and the roots go through std::sqrt, which has
+ * a float overload, where the sqrt of <math.h> would round trip through double.
+ */
+
+#ifndef RT_DOUBLE
+#define RT_DOUBLE 0
+#endif
+#ifndef RT_VEC4
+#define RT_VEC4 0
+#endif
+
+#if RT_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
+
+const int RT_VEC_LANES = RT_VEC4 ? 4 : 3;
+
+template <typename T, int Lanes>
+class alignas(Lanes == 4 ? 16 : sizeof(T)) vec3_t {
+
 public:
 
-    //Constructor - vec3 consists of 3 components 
-    vec3() {}
-    vec3(float e0, float e1, float e2) { e[0] = e0; e[1] = e1; e[2] = e2; }
-    
+    typedef T value_type;
+
+    //Constructor - vec3 consists of 3 components
+    vec3_t() { for (int k = 3; k < Lanes; k++) e[k] = 0; }
+    vec3_t(T e0, T e1, T e2) { e[0] = e0; e[1] = e1; e[2] = e2; for (int k = 3; k < Lanes; k++) e[k] = 0; }
+
     //Accessors - may refer to the components as either x,y,z or r,g,b depending on vectors use
     //Note: Member functions make use of an implicit "this" refering to the object
     //they are invoked upon. Const after parameter listing denotes that this implicit this is const
     //meaning that the method cannot modify the object on which it was invoked* (Read-Only)
 
     //*there is an exception for mutable objects however
-    inline float x() const { return e[0]; }
-    inline float y() const { return e[1]; }
-    inline float z() const { return e[2]; }
-    inline float r() const { return e[0]; }
-    inline float g() const { return e[1]; }
-    inline float b() const { return e[2]; }
-        
+    inline T x() const { return e[0]; }
+    inline T y() const { return e[1]; }
+    inline T z() const { return e[2]; }
+    inline T r() const { return e[0]; }
+    inline T g() const { return e[1]; }
+    inline T b() const { return e[2]; }
+
     //Overload operators
-    inline const vec3& operator+() const { return *this; } //Returns address of current vector
-    inline vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); } //Returns a new negative vector
-    
+    inline const vec3_t& operator+() const { return *this; } //Returns address of current vector
+    inline vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); } //Returns a new negative vector
+
     //[ ] is generally overloaded twice a const function for reading and a second for writing
-    inline float operator[](int i) const { return e[i]; } //Index notation for accessing x,y,z / r,g,b (read)
-    inline float& operator[](int i) { return e[i]; }; //Index notation for accessing x,y,z / r,g,b (write)
-    
-    //Declarations for operator overrides 
+    inline T operator[](int i) const { return e[i]; } //Index notation for accessing x,y,z / r,g,b (read)
+    inline T& operator[](int i) { return e[i]; }; //Index notation for accessing x,y,z / r,g,b (write)
+
+    //Operators updating the calling vector
     //remember - const parameters cannot be modified, here they are used to update calling vector
-    inline vec3& operator+=(const vec3 &v2);
-    inline vec3& operator-=(const vec3 &v2);
-    inline vec3& operator*=(const vec3 &v2);
-    inline vec3& operator/=(const vec3 &v2);
-    inline vec3& operator*=(const float t);
-    inline vec3& operator/=(const float t);
-    
+    inline vec3_t& operator+=(const vec3_t &v) { for (int k = 0; k < Lanes; k++) e[k] += v.e[k]; return *this; }
+    inline vec3_t& operator-=(const vec3_t &v) { for (int k = 0; k < Lanes; k++) e[k] -= v.e[k]; return *this; }
+    inline vec3_t& operator*=(const vec3_t &v) { for (int k = 0; k < Lanes; k++) e[k] *= v.e[k]; return *this; }
+    inline vec3_t& operator/=(const vec3_t &v) { for (int k = 0; k < 3; k++) e[k] /= v.e[k]; return *this; }
+    inline vec3_t& operator*=(const T t) { for (int k = 0; k < Lanes; k++) e[k] *= t; return *this; }
+    inline vec3_t& operator/=(const T t) { return *this *= T(1) / t; }
+
     //Functions declarations
-    //Length (magnitude) 
-    inline float length() const { return sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]); }
-    inline float squared_length() const { return e[0]*e[0] + e[1]*e[1] + e[2]*e[2]; }
-    
+    //Length (magnitude)
+    inline T length() const { return std::sqrt(squared_length()); }
+    inline T squared_length() const { return e[0]*e[0] + e[1]*e[1] + e[2]*e[2]; }
+
     //A unit vector is a normalised vector, magnitude of 1
-    inline void make_unit_vector();
-    
-    //Reflection
-    inline vec3 reflect(const vec3& v, const vec3& n);
-        
-    float e[3];
+    inline void make_unit_vector() { *this *= T(1) / length(); }
+
+    T e[Lanes];
 };
 
+typedef vec3_t<real, RT_VEC_LANES> vec3;
+
+//Name of the build's vec3 for reports: float, float4, double or double4
+inline const char* vec3_layout_name() {
+    return RT_DOUBLE ? (RT_VEC4 ? "double4" : "double") : (RT_VEC4 ? "float4" : "float");
+}
+
 
 //Overload input stream - write input to a vector
-inline std::istream& operator>>(std::istream &is, vec3 &t) {
+template <typename T, int L>
+inline std::istream& operator>>(std::istream &is, vec3_t<T, L> &t) {
     is >> t.e[0] >> t.e[1] >> t.e[2];
     return is;
 }
 
 //Overload output stream - print out vector details
-inline std::ostream& operator<<(std::ostream &os, const vec3 &t) {
+template <typename T, int L>
+inline std::ostream& operator<<(std::ostream &os, const vec3_t<T, L> &t) {
     os << t.e[0] << " " << t.e[1] << " " << t.e[2];
     return os;
 }
 
-//Normalises a vector
-inline void vec3::make_unit_vector() {
-    float k = 1.0 / sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
-    e[0] *= k; e[1] *= k; e[2] *= k;
-}
-
 //Add two vectors together (r1 + r2, g1 + g2, b1 + b2) and return new vector
-inline vec3 operator+(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+template <typename T, int L>
+inline vec3_t<T, L> operator+(vec3_t<T, L> v1, const vec3_t<T, L> &v2) {
+    return v1 += v2;
 }
 
 //subtract two vectors together (r1 - r2, g1 - g2, b1 - b2) and return new vector
-inline vec3 operator-(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+template <typename T, int L>
+inline vec3_t<T, L> operator-(vec3_t<T, L> v1, const vec3_t<T, L> &v2) {
+    return v1 -= v2;
 }
 
 //multiply two vectors together (r1 * r2, g1 * g2, b1 * b2) and return new vector
-inline vec3 operator*(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+template <typename T, int L>
+inline vec3_t<T, L> operator*(vec3_t<T, L> v1, const vec3_t<T, L> &v2) {
+    return v1 *= v2;
 }
 
 //divide two vectors  (r1 / r2, g1 / g2, b1 / b2) and return new vector
-inline vec3 operator/(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
+//(the padding lane isn't divided, 0/0 would leave a NaN in it)
+template <typename T, int L>
+inline vec3_t<T, L> operator/(vec3_t<T, L> v1, const vec3_t<T, L> &v2) {
+    return v1 /= v2;
 }
 
+//The scalar of the operators below is a value_type rather than a deduced T, so a literal of
+//another type (2.0, 0.5f, 1) is converted to T instead of failing to match
+
 //multiply vector by a scalar (r1 * s, g1  * s, b1 * s) and return new vector
-inline vec3 operator*(float t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+template <typename T, int L>
+inline vec3_t<T, L> operator*(typename vec3_t<T, L>::value_type t, vec3_t<T, L> v) {
+    return v *= t;
 }
 
 //divide vector by a scalar (r1 / s, g1  / s, b1 / s) and return new vector
-inline vec3 operator/(vec3 v, float t) {
-    return vec3(v.e[0]/t, v.e[1]/t, v.e[2]/t);
+template <typename T, int L>
+inline vec3_t<T, L> operator/(const vec3_t<T, L> &v, typename vec3_t<T, L>::value_type t) {
+    return vec3_t<T, L>(v.e[0]/t, v.e[1]/t, v.e[2]/t);
 }
 
 //multiply vector by a scalar (r1 * s, g1  * s, b1 * s) and return new vector [reversed [parameter ordering]
-inline vec3 operator*(const vec3 &v, float t) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+template <typename T, int L>
+inline vec3_t<T, L> operator*(vec3_t<T, L> v, typename vec3_t<T, L>::value_type t) {
+    return v *= t;
 }
 
 //Calculates the dot product of two vectors (r1 * r2 + g1 * g2 + b1 * b2)
-inline float dot(const vec3 &v1, const vec3 &v2) {
+template <typename T, int L>
+inline T dot(const vec3_t<T, L> &v1, const vec3_t<T, L> &v2) {
     return v1.e[0] *v2.e[0] + v1.e[1] *v2.e[1]  + v1.e[2] *v2.e[2];
 }
 
@@ -118,63 +173,15 @@ inline float dot(const vec3 &v1, const vec3 &v2) {
 //(g1 * b2 - b1 * g1)
 //-(r1 * b2 - b1 * r2)
 //(r1 * b2 - b1 * r2)
-inline vec3 cross(const vec3 &v1, const vec3 &v2) {
-    return vec3( (v1.e[1]*v2.e[2] - v1.e[2]*v2.e[1]),
+template <typename T, int L>
+inline vec3_t<T, L> cross(const vec3_t<T, L> &v1, const vec3_t<T, L> &v2) {
+    return vec3_t<T, L>( (v1.e[1]*v2.e[2] - v1.e[2]*v2.e[1]),
                 (-(v1.e[0]*v2.e[2] - v1.e[2]*v2.e[0])),
                 (v1.e[0]*v2.e[1] - v1.e[1]*v2.e[0]));
 }
 
-//Updates vector values by adding passed vector values
-inline vec3& vec3::operator+=(const vec3 &v){
-    e[0]  += v.e[0];
-    e[1]  += v.e[1];
-    e[2]  += v.e[2];
-    return *this;
-}
-
-//Updates vector values by multiplying passed vector values
-inline vec3& vec3::operator*=(const vec3 &v){
-    e[0]  *= v.e[0];
-    e[1]  *= v.e[1];
-    e[2]  *= v.e[2];
-    return *this;
-}
-
-//Updates vector values by dividing passed vector values
-inline vec3& vec3::operator/=(const vec3 &v){
-    e[0]  /= v.e[0];
-    e[1]  /= v.e[1];
-    e[2]  /= v.e[2];
-    return *this;
-}
-
-//Updates vector values by subtracting passed vector value
-inline vec3& vec3::operator-=(const vec3& v) {
-    e[0]  -= v.e[0];
-    e[1]  -= v.e[1];
-    e[2]  -= v.e[2];
-    return *this;
-}
-
-//Updates vector values by multiplying by scalar value
-inline vec3& vec3::operator*=(const float t) {
-    e[0]  *= t;
-    e[1]  *= t;
-    e[2]  *= t;
-    return *this;
-}
-
-//Updates vector values by dividing by scalar value
-inline vec3& vec3::operator/=(const float t) {
-    float k = 1.0/t;
-    
-    e[0]  *= k;
-    e[1]  *= k;
-    e[2]  *= k;
-    return *this;
-}
-
 //Divides a vector by its length - normalising
-inline vec3 unit_vector(vec3 v) {
+template <typename T, int L>
+inline vec3_t<T, L> unit_vector(const vec3_t<T, L> &v) {
     return v / v.length();
 }
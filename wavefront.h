@@ -0,0 +1,205 @@
+#include "hitable.h"
+#include "material.h"
+#include "camera.h"
+#include "sampler.h"
+#include "integrator.h"
+#include "framebuffer.h"
+#include <vector>
+#include <algorithm>
+#include <float.h>
+#pragma once
+
+//Wavefront (stream) path tracing
+
+/*
+ * color() follows one path at a time: intersect, scatter through whichever material was
+ * hit, recurse. Consecutive bounces jump between lambertian, metal and dielectric code and
+ * between unrelated parts of the scene, so instruction and data caches keep getting flushed.
+ *
+ * The wavefront integrator turns this inside out. It keeps a large pool of paths in flight
+ * and advances all of them one bounce at a time in separate stages:
+ *
+ *   generate  - top the pool up with new camera rays (pixel, sample) until it is full
+ *   intersect - find the hit of every path; paths that miss add throughput * background
+ *               to their pixel and die
+ *   sort      - put the index of every path that hit something into a queue for its material type
+ *   shade     - run each queue in a tight loop calling that material's scatter directly
+ *               (no virtual call), paths that are absorbed or too deep die
+ *   compact   - move the live paths to the front of the pool
+ *
+ *   [gen] -> [intersect] -> [lambertian queue] -> [shade] -\
+ *     ^                  -> [metal queue]      -> [shade] --> [compact] --> (loop)
+ *     |                  -> [dielectric queue] -> [shade] -/
+ *     \------------------------------------------------------------------------/
+ *
+ * Every path carries its own sampler, seeded exactly like the recursive integrator, and
+ * draws its random numbers in the same order, so both integrators trace the same paths and
+ * give the same image, up to the order floating point products and sums are formed in.
+ */
+
+struct wavefront_path {
+	ray r;
+	vec3 throughput; //product of the attenuations so far
+	hit_record rec;
+	sampler rng;
+	int pixel;       //index into the tile's accumulation buffer
+	int depth;       //bounces so far, -1 once the path has finished
+};
+
+//Calls T::scatter without going through the vtable so it can be inlined
+template <typename T>
+inline bool scatter_as(const material* m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng){
+	return static_cast<const T*>(m)->T::scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+//Materials outside the known set still go through the virtual call
+template <>
+inline bool scatter_as<material>(const material* m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler& rng){
+	return m->scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+//Runs one material queue
+template <typename T>
+void shade_queue(std::vector<wavefront_path>& paths, const std::vector<int>& queue, int max_depth){
+	RT_STAT(render_counters& stats = render_stats::local());
+	for(size_t q = 0; q < queue.size(); q++){
+		wavefront_path& p = paths[queue[q]];
+		vec3 attenuation;
+		ray scattered;
+		p.rng.start_bounce(p.depth);
+		if(p.depth < max_depth && scatter_as<T>(p.rec.mat_ptr, p.r, p.rec, attenuation, scattered, p.rng)){
+			p.throughput *= attenuation;
+			p.r = scattered;
+			p.depth++;
+		}
+		else{
+			RT_STAT(if(p.depth < max_depth) stats.absorbed++; else stats.depth_limited++;)
+			p.depth = -1; //absorbed, contributes nothing
+		}
+	}
+}
+
+//Lambertian queue: the directions of all its paths are drawn in one batch (cosine_hemisphere_batch),
+//the same directions lambertian::scatter would draw one at a time
+template <>
+void shade_queue<lambertian>(std::vector<wavefront_path>& paths, const std::vector<int>& queue, int max_depth){
+	RT_STAT(render_counters& stats = render_stats::local());
+	const int batch = 256;
+	float u1[batch], u2[batch], x[batch], y[batch], z[batch];
+	int index[batch];
+	for(size_t q0 = 0; q0 < queue.size(); q0 += batch){
+		size_t q1 = std::min(queue.size(), q0 + batch);
+		int n = 0;
+		for(size_t q = q0; q < q1; q++){
+			wavefront_path& p = paths[queue[q]];
+			p.rng.start_bounce(p.depth);
+			if(p.depth < max_depth){
+				u1[n] = p.rng.next_1d();
+				u2[n] = p.rng.next_1d();
+				index[n++] = queue[q];
+			}
+			else{
+				RT_STAT(stats.depth_limited++);
+				p.depth = -1;
+			}
+		}
+		cosine_hemisphere_batch(u1, u2, x, y, z, n);
+		for(int k = 0; k < n; k++){
+			wavefront_path& p = paths[index[k]];
+			vec3 attenuation;
+			ray scattered;
+			static_cast<const lambertian*>(p.rec.mat_ptr)->scatter_local(p.rec, vec3(x[k], y[k], z[k]), attenuation, scattered);
+			p.throughput *= attenuation;
+			p.r = scattered;
+			p.depth++;
+		}
+	}
+}
+
+//Renders samples [first_sample,ns) of pixels [x0,x1) x [y0,y1) with the wavefront integrator, pool_size paths at a time,
+//adding on to sums if there are any (render_options::sums)
+void render_wavefront(int x0, int y0, int x1, int y1, framebuffer& fb, const camera& cam, hitable *world,
+                      int nx, int ny, int first_sample, int ns, unsigned int frame, unsigned int seed, sampler_type sampling, int pool_size,
+                      std::vector<vec3>* sums = NULL){
+
+	const int max_depth = path_config.max_depth; //same cut off as color()
+	RT_STAT(render_counters& stats = render_stats::local());
+	int w = x1 - x0, h = y1 - y0;
+	std::vector<vec3> acc(size_t(w)*h, vec3(0,0,0));
+	int taken = ns - first_sample; //samples per pixel in this call
+	if(sums)
+		for(int pixel = 0; pixel < w*h; pixel++)
+			acc[pixel] = (*sums)[fb.index(x0 + pixel % w, y0 + pixel / w)];
+	long long total = (long long)w*h*taken, next = 0;
+
+	std::vector<wavefront_path> paths;
+	paths.reserve(pool_size);
+	std::vector<int> queues[MATERIAL_TYPES];
+
+	for(;;){
+		//Generate - one path per (pixel, sample), sample fastest
+		while(int(paths.size()) < pool_size && next < total){
+			int pixel = int(next / taken), s = first_sample + int(next % taken);
+			int i = x0 + pixel % w, j = y0 + pixel / w;
+			wavefront_path p;
+			p.rng = sampler(i, j, frame, seed, sampling);
+			p.rng.start_sample(s);
+			float u = float(i + p.rng.next_1d()) / float(nx);
+			float v = float(j + p.rng.next_1d()) / float(ny);
+			p.r = cam.get_ray(u, v, p.rng);
+			p.throughput = vec3(1,1,1);
+			p.pixel = pixel;
+			p.depth = 0;
+			paths.push_back(p);
+			RT_STAT(stats.paths++);
+			next++;
+		}
+		if(paths.empty())
+			break;
+
+		//Intersect and sort by material
+		for(int t = 0; t < MATERIAL_TYPES; t++)
+			queues[t].clear();
+		for(size_t k = 0; k < paths.size(); k++){
+			wavefront_path& p = paths[k];
+			RT_STAT(stats.count_ray(p.depth));
+			if(world->hit(p.r, 0.001, FLT_MAX, p.rec))
+				queues[p.rec.mat_ptr->type()].push_back(int(k));
+			else{
+				acc[p.pixel] += p.throughput * background(p.r);
+				RT_STAT(stats.escaped++);
+				p.depth = -1;
+			}
+		}
+
+		//Shade
+		shade_queue<lambertian>(paths, queues[MATERIAL_LAMBERTIAN], max_depth);
+		shade_queue<metal>(paths, queues[MATERIAL_METAL], max_depth);
+		shade_queue<dielectric>(paths, queues[MATERIAL_DIELECTRIC], max_depth);
+		shade_queue<material>(paths, queues[MATERIAL_OTHER], max_depth);
+
+		//Compact - keep the live paths, in order, at the front
+		size_t live = 0;
+		for(size_t k = 0; k < paths.size(); k++){
+			if(paths[k].depth >= 0){
+				if(live != k)
+					paths[live] = paths[k];
+				live++;
+			}
+		}
+		paths.resize(live);
+	}
+
+	//Samples finish in whatever order their paths end, so sums carried over from an earlier
+	//pass match a single pass only up to rounding
+	int count = sums ? ns : taken;
+	for(int pixel = 0; pixel < w*h; pixel++){
+		size_t k = fb.index(x0 + pixel % w, y0 + pixel / w);
+		if(sums)
+			(*sums)[k] = acc[pixel];
+		acc[pixel] /= float(count); //as render_tile() divides
+		fb.pixels[k] = acc[pixel];
+		fb.samples[k] = count;
+	}
+
+}